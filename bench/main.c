@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+
+#include <time.h>
+
+#include <crc32.h>
+#include <pool.h>
+#include <protocol.h>
+#include <reader.h>
+#include <sha256.h>
+#include <writer.h>
+
+// Buffer sizes go up by a factor of 4 from the smallest to the largest
+#define MIN_SIZE 64
+#define MAX_SIZE (64 << 20)
+
+// Every size is run untimed for at least this long first, so caches,
+// branch predictors and the CPU's clock have settled
+#define WARMUP_MS 50
+
+#define DEFAULT_REPS 10
+
+// Persistence keeps up to this many packet writes in flight, as the
+// receiver does, with buffers for them adding up to at most MAX_IN_FLIGHT
+#define WRITE_DEPTH   16
+#define MAX_IN_FLIGHT (32 << 20)
+
+// One kind of work done on a buffer of len bytes, iterations times over
+// for each timed repetition. A repetition covers budget bytes, or one
+// buffer for buffers larger than that.
+typedef struct {
+    const char *name;
+    size_t budget;
+    void (*setup)(const uint8_t *data, size_t len);
+    void (*run)(const uint8_t *data, size_t len, size_t iterations);
+    void (*teardown)(void);
+} Benchmark;
+
+typedef struct {
+    double min, median, mean, max, stddev;
+} Stats;
+
+static const char *writeDir = ".";
+
+// Sinks for results that would otherwise be optimised away
+static volatile uint32_t crcSink;
+static volatile uint8_t shaSink;
+
+static void runCrc32(const uint8_t *data, size_t len, size_t iterations)
+{
+    for (size_t i = 0; i < iterations; ++i)
+        crcSink = crc32(data, len);
+}
+
+static void runSha256(const uint8_t *data, size_t len, size_t iterations)
+{
+    SHA256_CTX shaCtx;
+    BYTE shaSum[32];
+
+    for (size_t i = 0; i < iterations; ++i) {
+        sha256_init(&shaCtx);
+        sha256_update(&shaCtx, data, len);
+        sha256_final(&shaCtx, shaSum);
+        shaSink = shaSum[0];
+    }
+}
+
+// Framing sends windowed packets the way send-file does, header and crc32
+// built then written out with the payload in one writev, through a pipe to
+// a thread reading them back the way recv-packets does, buffered and
+// checked whole before being consumed.
+
+typedef struct {
+    SerialReader serial;
+    size_t len;
+    size_t frames;
+    size_t bad;
+} FrameReader;
+
+static int framePipe[2];
+static FrameReader frameReader;
+
+static void setupFraming(const uint8_t *data, size_t len)
+{
+    (void) data;
+
+    if (pipe(framePipe) == -1) {
+        perror("Error creating pipe");
+        exit(-1);
+    }
+
+    // A larger pipe takes more frames per system call, as a serial port's
+    // buffer would. Staying with the default isn't an error.
+    fcntl(framePipe[1], F_SETPIPE_SZ, 1 << 20);
+
+    if (reader_init(&frameReader.serial, framePipe[0], 0x10000) == -1
+        || reader_reserve(&frameReader.serial, len + 13) == -1) {
+        printf("Error allocating the frame reader\n");
+        exit(-1);
+    }
+}
+
+static void* readFrames(void *arg)
+{
+    FrameReader *fr = arg;
+
+    for (size_t i = 0; i < fr->frames; ++i) {
+        uint32_t crcSum, seq, packetLen;
+        CRC32_CTX crcCtx;
+
+        if (reader_need(&fr->serial, 13) == -1) {
+            perror("Error reading frame");
+            exit(-1);
+        }
+
+        const uint8_t *header = reader_data(&fr->serial);
+        memcpy(&crcSum, header + 1, 4);
+        memcpy(&seq, header + 5, 4);
+        memcpy(&packetLen, header + 9, 4);
+
+        if (header[0] != TRANSFER_WINDOW_PACKET || seq != i || packetLen != fr->len) {
+            printf("Frame %zu came out of the pipe mangled\n", i);
+            exit(-1);
+        }
+
+        if (reader_need(&fr->serial, 13 + packetLen) == -1) {
+            perror("Error reading frame");
+            exit(-1);
+        }
+
+        header = reader_data(&fr->serial);
+        crc32_init(&crcCtx);
+        crc32_update(&crcCtx, header + 5, 8 + packetLen);
+        if (crc32_final(&crcCtx) != crcSum)
+            fr->bad += 1;
+
+        reader_consume(&fr->serial, 13 + packetLen);
+    }
+
+    return NULL;
+}
+
+static void runFraming(const uint8_t *data, size_t len, size_t iterations)
+{
+    pthread_t reader;
+
+    frameReader.len = len;
+    frameReader.frames = iterations;
+    frameReader.bad = 0;
+    if (pthread_create(&reader, NULL, readFrames, &frameReader) != 0) {
+        printf("Error starting the frame reader\n");
+        exit(-1);
+    }
+
+    for (size_t i = 0; i < iterations; ++i) {
+        uint8_t header[13];
+        uint32_t seq = i, packetLen = len, crcSum;
+        CRC32_CTX crcCtx;
+
+        header[0] = TRANSFER_WINDOW_PACKET;
+        memcpy(header + 5, &seq, 4);
+        memcpy(header + 9, &packetLen, 4);
+
+        crc32_init(&crcCtx);
+        crc32_update(&crcCtx, header + 5, 8);
+        crc32_update(&crcCtx, data, len);
+        crcSum = crc32_final(&crcCtx);
+        memcpy(header + 1, &crcSum, 4);
+
+        struct iovec iov[2] = { { header, 13 }, { (void *) data, len } };
+        size_t left = 13 + len;
+        int first = 0;
+
+        while (left > 0) {
+            ssize_t result = writev(framePipe[1], iov + first, 2 - first);
+            if (result == -1) {
+                if (errno == EINTR)
+                    continue;
+                perror("Error writing frame");
+                exit(-1);
+            }
+
+            left -= result;
+            while (first < 2 && (size_t) result >= iov[first].iov_len) {
+                result -= iov[first].iov_len;
+                first += 1;
+            }
+            if (first < 2) {
+                iov[first].iov_base = (uint8_t *) iov[first].iov_base + result;
+                iov[first].iov_len -= result;
+            }
+        }
+    }
+
+    pthread_join(reader, NULL);
+
+    if (frameReader.bad > 0) {
+        printf("%zu frames failed their crc32 check\n", frameReader.bad);
+        exit(-1);
+    }
+}
+
+static void teardownFraming(void)
+{
+    reader_destroy(&frameReader.serial);
+    close(framePipe[0]);
+    close(framePipe[1]);
+}
+
+// Persistence writes packets at their place in a file through the same
+// writer recv-packets uses, and waits for the writes but doesn't sync
+// them, as the receiver only does at checkpoints.
+
+static int persistFd;
+static BufferPool persistPool;
+static PacketWriter persistWriter;
+
+static void setupPersistence(const uint8_t *data, size_t len)
+{
+    char path[1024];
+
+    snprintf(path, sizeof(path), "%s/bench-XXXXXX", writeDir);
+    persistFd = mkstemp(path);
+    if (persistFd == -1) {
+        perror("Error creating file to write to");
+        exit(-1);
+    }
+    unlink(path);
+
+    size_t depth = MAX_IN_FLIGHT / len;
+    if (depth < 1)
+        depth = 1;
+    if (depth > WRITE_DEPTH)
+        depth = WRITE_DEPTH;
+
+    // One buffer more than can be in flight, so one is always free
+    if (pool_init(&persistPool, len, depth + 1) == -1
+        || writer_init(&persistWriter, persistFd, -1, &persistPool, depth) == -1) {
+        printf("Error allocating packet buffers\n");
+        exit(-1);
+    }
+
+    for (size_t i = 0; i < persistPool.bufNum; ++i)
+        memcpy(persistPool.arena + i * persistPool.bufSize, data, len);
+}
+
+static void runPersistence(const uint8_t *data, size_t len, size_t iterations)
+{
+    // What the buffers hold was filled in by setupPersistence
+    (void) data;
+
+    for (size_t i = 0; i < iterations; ++i) {
+        uint8_t *buf = pool_get(&persistPool);
+
+        if (writer_submit(&persistWriter, buf, buf, len, (off_t) i * len) == -1) {
+            perror("Error writing packet");
+            exit(-1);
+        }
+    }
+
+    if (writer_drain(&persistWriter) == -1) {
+        perror("Error writing packet");
+        exit(-1);
+    }
+}
+
+static void teardownPersistence(void)
+{
+    writer_destroy(&persistWriter);
+    pool_destroy(&persistPool);
+    close(persistFd);
+}
+
+static const Benchmark benchmarks[] = {
+    { "crc32",       64 << 20, NULL,             runCrc32,       NULL              },
+    { "sha256",      16 << 20, NULL,             runSha256,      NULL              },
+    { "framing",     16 << 20, setupFraming,     runFraming,     teardownFraming   },
+    { "persistence", 16 << 20, setupPersistence, runPersistence, teardownPersistence },
+};
+
+#define BENCHMARK_NUM (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static double elapsedSince(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int openCycleCounter(void)
+{
+    // Counts this thread and any it starts, in the kernel as well unless
+    // only user space may be counted. Returns -1 where there are no
+    // hardware counters, as in most virtual machines.
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.inherit = 1;
+
+    int fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd == -1) {
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    return fd;
+}
+
+static uint64_t readCycles(int fd)
+{
+    uint64_t cycles = 0;
+
+    if (fd != -1 && read(fd, &cycles, sizeof(cycles)) != sizeof(cycles))
+        cycles = 0;
+    return cycles;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static Stats summarise(double *values, size_t n)
+{
+    Stats stats = { 0 };
+    double sum = 0, squares = 0;
+
+    qsort(values, n, sizeof(double), compareDoubles);
+
+    for (size_t i = 0; i < n; ++i)
+        sum += values[i];
+    stats.mean = sum / n;
+
+    for (size_t i = 0; i < n; ++i)
+        squares += (values[i] - stats.mean) * (values[i] - stats.mean);
+    stats.stddev = n > 1 ? sqrt(squares / (n - 1)) : 0;
+
+    stats.min = values[0];
+    stats.max = values[n - 1];
+    stats.median = n % 2 == 1 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+
+    return stats;
+}
+
+static void printJsonString(FILE *fp, const char *str)
+{
+    fputc('"', fp);
+    for (; *str != '\0'; ++str) {
+        if (*str == '"' || *str == '\\')
+            fprintf(fp, "\\%c", *str);
+        else if ((unsigned char) *str < 0x20)
+            fprintf(fp, "\\u%04x", *str);
+        else
+            fputc(*str, fp);
+    }
+    fputc('"', fp);
+}
+
+static void benchmarkSize(const Benchmark *bench, const uint8_t *data, size_t len, size_t reps,
+                          int cyclesfd, FILE *json, bool *firstResult)
+{
+    size_t iterations = bench->budget / len > 0 ? bench->budget / len : 1;
+    double *rates = malloc(reps * sizeof(double));
+    double *cyclesPerByte = malloc(reps * sizeof(double));
+    struct timespec start;
+
+    if (bench->setup != NULL)
+        bench->setup(data, len);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        bench->run(data, len, iterations);
+    } while (elapsedSince(&start) * 1000 < WARMUP_MS);
+
+    for (size_t r = 0; r < reps; ++r) {
+        uint64_t cycles = readCycles(cyclesfd);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        bench->run(data, len, iterations);
+        double seconds = elapsedSince(&start);
+
+        cycles = readCycles(cyclesfd) - cycles;
+        rates[r] = iterations * len / seconds / 1e6;
+        cyclesPerByte[r] = (double) cycles / (iterations * len);
+    }
+
+    if (bench->teardown != NULL)
+        bench->teardown();
+
+    Stats rate = summarise(rates, reps);
+    Stats cycles = summarise(cyclesPerByte, reps);
+
+    // Only the JSON goes to standard output when it is sent there
+    if (json != stdout) {
+        printf("%-12s %9zu B: %9.1f MB/s median, %9.1f min, %9.1f max, %5.1f%% stddev",
+               bench->name, len, rate.median, rate.min, rate.max, rate.stddev / rate.mean * 100);
+        if (cyclesfd != -1)
+            printf(", %.3f cycles/byte", cycles.median);
+        printf("\n");
+    }
+
+    if (json != NULL) {
+        fprintf(json, "%s\n    {\"benchmark\": \"%s\", \"size\": %zu, \"iterations\": %zu, ",
+                *firstResult ? "" : ",", bench->name, len, iterations);
+        fprintf(json, "\"mb_per_s\": {\"min\": %.3f, \"median\": %.3f, \"mean\": %.3f, "
+                "\"max\": %.3f, \"stddev\": %.3f}, ", rate.min, rate.median, rate.mean, rate.max,
+                rate.stddev);
+        if (cyclesfd != -1)
+            fprintf(json, "\"cycles_per_byte\": %.4f}", cycles.median);
+        else
+            fprintf(json, "\"cycles_per_byte\": null}");
+        *firstResult = false;
+    }
+
+    free(rates);
+    free(cyclesPerByte);
+}
+
+int main(int argc, char **argv)
+{
+    const char *jsonPath = NULL;
+    const char *label = NULL;
+    unsigned long reps = DEFAULT_REPS;
+    unsigned long maxSize = MAX_SIZE;
+
+    int c = 0;
+    while (true) {
+        static struct option long_options[] = {
+            {"directory", required_argument, 0, 'd'},
+            {"json",      required_argument, 0, 'j'},
+            {"label",     required_argument, 0, 'l'},
+            {"max-size",  required_argument, 0, 'm'},
+            {"reps",      required_argument, 0, 'r'},
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+        c = getopt_long(argc, argv, "d:j:l:m:r:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'd':
+                // Where persistence writes, the disk being measured
+                writeDir = optarg;
+                break;
+            case 'j':
+                // Results as JSON as well, - for standard output
+                jsonPath = optarg;
+                break;
+            case 'l':
+                // Recorded with the JSON results, such as the commit built
+                label = optarg;
+                break;
+            case 'm':
+                maxSize = strtoul(optarg, NULL, 0);
+                if (maxSize < MIN_SIZE) {
+                    printf("The largest size can't be below %d bytes\n", MIN_SIZE);
+                    exit(-1);
+                }
+                break;
+            case 'r':
+                reps = strtoul(optarg, NULL, 0);
+                if (reps == 0) {
+                    printf("Every size needs at least one repetition\n");
+                    exit(-1);
+                }
+                break;
+            default:
+                exit(-1);
+        }
+    }
+
+    // Any benchmarks named after the options are run, all of them otherwise
+    bool selected[BENCHMARK_NUM];
+    for (size_t b = 0; b < BENCHMARK_NUM; ++b)
+        selected[b] = optind == argc;
+
+    for (int i = optind; i < argc; ++i) {
+        size_t b;
+        for (b = 0; b < BENCHMARK_NUM && strcmp(argv[i], benchmarks[b].name) != 0; ++b)
+            ;
+        if (b == BENCHMARK_NUM) {
+            printf("Unknown benchmark %s, expected crc32, sha256, framing or persistence\n",
+                   argv[i]);
+            exit(-1);
+        }
+        selected[b] = true;
+    }
+
+    // Random data, so no kernel gets to take a shortcut
+    uint8_t *data = malloc(maxSize);
+    if (data == NULL) {
+        printf("Error allocating %lu bytes to benchmark with\n", maxSize);
+        exit(-1);
+    }
+
+    uint64_t x = 0x9E3779B97F4A7C15;
+    for (size_t i = 0; i < maxSize; ++i) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        data[i] = x;
+    }
+
+    FILE *json = NULL;
+    if (jsonPath != NULL) {
+        json = strcmp(jsonPath, "-") == 0 ? stdout : fopen(jsonPath, "w");
+        if (json == NULL) {
+            perror("Error opening JSON output");
+            exit(-1);
+        }
+    }
+
+    int cyclesfd = openCycleCounter();
+
+    // Debug info
+    if (cyclesfd == -1 && json != stdout)
+        printf("No cycle counter available, reporting throughput only\n");
+
+    if (json != NULL) {
+        struct utsname uts;
+
+        uname(&uts);
+        fprintf(json, "{\n  \"machine\": ");
+        printJsonString(json, uts.machine);
+        fprintf(json, ",\n  \"kernel\": ");
+        printJsonString(json, uts.release);
+        fprintf(json, ",\n  \"compiler\": ");
+        printJsonString(json, __VERSION__);
+        if (label != NULL) {
+            fprintf(json, ",\n  \"label\": ");
+            printJsonString(json, label);
+        }
+        fprintf(json, ",\n  \"reps\": %lu,\n  \"warmup_ms\": %d,\n  \"results\": [", reps,
+                WARMUP_MS);
+    }
+
+    bool firstResult = true;
+    for (size_t b = 0; b < BENCHMARK_NUM; ++b) {
+        if (!selected[b])
+            continue;
+
+        for (size_t len = MIN_SIZE; len <= maxSize; len *= 4)
+            benchmarkSize(&benchmarks[b], data, len, reps, cyclesfd, json, &firstResult);
+    }
+
+    if (json != NULL) {
+        fprintf(json, "\n  ]\n}\n");
+        if (json != stdout)
+            fclose(json);
+    }
+
+    if (cyclesfd != -1)
+        close(cyclesfd);
+    free(data);
+
+    return 0;
+}
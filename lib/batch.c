@@ -0,0 +1,385 @@
+#include "batch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sha256.h"
+#include "sha256_utils.h"
+
+void batch_init(Batch *batch)
+{
+    batch->entries = NULL;
+    batch->entryNum = 0;
+    batch->capacity = 0;
+}
+
+void batch_free(Batch *batch)
+{
+    for (size_t i = 0; i < batch->entryNum; ++i) {
+        free(batch->entries[i].name);
+        free(batch->entries[i].path);
+    }
+    free(batch->entries);
+}
+
+static int addFile(Batch *batch, const char *path, const char *name)
+{
+    if (strlen(name) > UINT16_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    if (batch->entryNum == batch->capacity) {
+        size_t capacity = batch->capacity == 0 ? 64 : 2 * batch->capacity;
+        BatchEntry *entries = realloc(batch->entries, capacity * sizeof(BatchEntry));
+        if (entries == NULL)
+            return -1;
+
+        batch->entries = entries;
+        batch->capacity = capacity;
+    }
+
+    BatchEntry *entry = &batch->entries[batch->entryNum];
+    entry->path = strdup(path);
+    entry->name = strdup(name);
+    if (entry->path == NULL || entry->name == NULL) {
+        free(entry->path);
+        free(entry->name);
+        return -1;
+    }
+
+    batch->entryNum += 1;
+    return 0;
+}
+
+static char* joinPath(const char *dir, const char *name)
+{
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+
+    if (path != NULL)
+        snprintf(path, len, "%s%s%s", dir, dir[0] == '\0' ? "" : "/", name);
+    return path;
+}
+
+static int addTree(Batch *batch, const char *path, const char *name)
+{
+    // Symbolic links are skipped so a link to a parent can't recurse
+    // forever. Entries are taken in name order, so the same tree always
+    // packs into the same batch and an interrupted transfer can resume.
+    struct stat st;
+
+    if (lstat(path, &st) == -1)
+        return -1;
+
+    if (S_ISREG(st.st_mode))
+        return addFile(batch, path, name);
+    if (!S_ISDIR(st.st_mode))
+        return 0;
+
+    struct dirent **children;
+    int childNum = scandir(path, &children, NULL, alphasort);
+    if (childNum == -1)
+        return -1;
+
+    int result = 0;
+    for (int i = 0; i < childNum; ++i) {
+        const char *child = children[i]->d_name;
+
+        if (result == 0 && strcmp(child, ".") != 0 && strcmp(child, "..") != 0) {
+            char *childPath = joinPath(path, child);
+            char *childName = joinPath(name, child);
+
+            if (childPath == NULL || childName == NULL)
+                result = -1;
+            else
+                result = addTree(batch, childPath, childName);
+
+            free(childPath);
+            free(childName);
+        }
+
+        free(children[i]);
+    }
+    free(children);
+
+    return result;
+}
+
+int batch_add(Batch *batch, const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == -1)
+        return -1;
+
+    // Named from the last component of path on, which for . or .. is
+    // nothing at all
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        len -= 1;
+
+    size_t start = len;
+    while (start > 0 && path[start - 1] != '/')
+        start -= 1;
+
+    char name[len - start + 1];
+    memcpy(name, path + start, len - start);
+    name[len - start] = '\0';
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        name[0] = '\0';
+
+    if (S_ISREG(st.st_mode))
+        return addFile(batch, path, name);
+
+    if (!S_ISDIR(st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return addTree(batch, path, name);
+}
+
+static int copyFile(BatchEntry *entry, FILE *out)
+{
+    // Copies the file into the batch, hashing it on the way
+    SHA256_CTX shaCtx;
+    uint8_t buf[0x8000];
+    size_t len;
+
+    FILE *in = fopen(entry->path, "r");
+    if (in == NULL)
+        return -1;
+
+    sha256_init(&shaCtx);
+    entry->fileLen = 0;
+
+    while ((len = fread(buf, 1, sizeof(buf), in)) > 0) {
+        sha256_update(&shaCtx, buf, len);
+        if (fwrite(buf, 1, len, out) != len) {
+            fclose(in);
+            return -1;
+        }
+        entry->fileLen += len;
+    }
+
+    sha256_final(&shaCtx, (BYTE *) entry->shaSum);
+
+    int result = ferror(in) ? -1 : 0;
+    fclose(in);
+    return result;
+}
+
+int batch_write(Batch *batch, FILE *fp)
+{
+    uint64_t manifestLen = BATCH_HEADER_SIZE;
+    for (size_t i = 0; i < batch->entryNum; ++i)
+        manifestLen += BATCH_ENTRY_SIZE + strlen(batch->entries[i].name);
+
+    if (batch->entryNum > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    // The data goes first, the manifest can only be filled in after
+    uint64_t offset = manifestLen;
+    if (fseeko(fp, manifestLen, SEEK_SET) == -1)
+        return -1;
+
+    for (size_t i = 0; i < batch->entryNum; ++i) {
+        BatchEntry *entry = &batch->entries[i];
+
+        entry->offset = offset;
+        if (copyFile(entry, fp) == -1)
+            return -1;
+        offset += entry->fileLen;
+    }
+
+    uint8_t *manifest = malloc(manifestLen);
+    if (manifest == NULL)
+        return -1;
+
+    uint32_t entryNum_32 = batch->entryNum;
+    memcpy(manifest, BATCH_MAGIC, 4);
+    memcpy(manifest + 4, &entryNum_32, 4);
+    memcpy(manifest + 8, &manifestLen, 8);
+
+    uint8_t *p = manifest + BATCH_HEADER_SIZE;
+    for (size_t i = 0; i < batch->entryNum; ++i) {
+        const BatchEntry *entry = &batch->entries[i];
+        uint16_t nameLen = strlen(entry->name);
+
+        memcpy(p, &nameLen, 2);
+        memcpy(p + 2, entry->name, nameLen);
+        p += 2 + nameLen;
+        memcpy(p, &entry->offset, 8);
+        memcpy(p + 8, &entry->fileLen, 8);
+        memcpy(p + 16, entry->shaSum, 32);
+        p += 48;
+    }
+
+    int result = 0;
+    if (fseeko(fp, 0, SEEK_SET) == -1 || fwrite(manifest, 1, manifestLen, fp) != manifestLen
+        || fflush(fp) == EOF)
+        result = -1;
+
+    free(manifest);
+    return result;
+}
+
+static bool validName(const char *name, size_t len)
+{
+    // Only relative paths made of real components, nothing that could
+    // write outside the directory being unpacked into
+    size_t start = 0;
+
+    if (len == 0 || memchr(name, '\0', len) != NULL)
+        return false;
+
+    for (size_t i = 0; i <= len; ++i) {
+        if (i < len && name[i] != '/')
+            continue;
+
+        size_t compLen = i - start;
+        if (compLen == 0 || (compLen == 1 && name[start] == '.')
+            || (compLen == 2 && name[start] == '.' && name[start + 1] == '.'))
+            return false;
+
+        start = i + 1;
+    }
+
+    return true;
+}
+
+static int makeParents(int dirfd, char *name)
+{
+    for (char *slash = strchr(name, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int result = mkdirat(dirfd, name, 0755);
+        *slash = '/';
+
+        if (result == -1 && errno != EEXIST)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int writeFile(int dirfd, const char *name, const uint8_t *data, size_t len)
+{
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+
+    size_t written = 0;
+    while (written < len) {
+        ssize_t result = write(fd, data + written, len - written);
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return -1;
+        }
+        written += result;
+    }
+
+    return close(fd);
+}
+
+static long unpackMapped(const uint8_t *data, size_t len, int dirfd, size_t *bad)
+{
+    uint32_t entryNum;
+    uint64_t manifestLen;
+
+    if (len < BATCH_HEADER_SIZE || memcmp(data, BATCH_MAGIC, 4) != 0)
+        goto malformed;
+
+    memcpy(&entryNum, data + 4, 4);
+    memcpy(&manifestLen, data + 8, 8);
+    if (manifestLen > len)
+        goto malformed;
+
+    // The whole manifest is checked before anything is written
+    const uint8_t *p = data + BATCH_HEADER_SIZE;
+    const uint8_t *end = data + manifestLen;
+    for (uint32_t i = 0; i < entryNum; ++i) {
+        uint16_t nameLen;
+        uint64_t offset, fileLen;
+
+        if ((size_t) (end - p) < 2)
+            goto malformed;
+        memcpy(&nameLen, p, 2);
+        if ((size_t) (end - p) < (size_t) BATCH_ENTRY_SIZE + nameLen)
+            goto malformed;
+
+        memcpy(&offset, p + 2 + nameLen, 8);
+        memcpy(&fileLen, p + 10 + nameLen, 8);
+        if (!validName((const char *) p + 2, nameLen) || offset < manifestLen || offset > len
+            || fileLen > len - offset)
+            goto malformed;
+
+        p += BATCH_ENTRY_SIZE + nameLen;
+    }
+
+    *bad = 0;
+    long written = 0;
+
+    p = data + BATCH_HEADER_SIZE;
+    for (uint32_t i = 0; i < entryNum; ++i) {
+        uint16_t nameLen;
+        uint64_t offset, fileLen;
+        uint8_t shaSum[32];
+
+        memcpy(&nameLen, p, 2);
+        char name[nameLen + 1];
+        memcpy(name, p + 2, nameLen);
+        name[nameLen] = '\0';
+        memcpy(&offset, p + 2 + nameLen, 8);
+        memcpy(&fileLen, p + 10 + nameLen, 8);
+        p += BATCH_ENTRY_SIZE + nameLen;
+
+        calculateSHA256(data + offset, fileLen, shaSum);
+        if (memcmp(shaSum, p - 32, 32) != 0) {
+            *bad += 1;
+            continue;
+        }
+
+        if (makeParents(dirfd, name) == -1 || writeFile(dirfd, name, data + offset, fileLen) == -1)
+            return -1;
+        written += 1;
+    }
+
+    return written;
+
+malformed:
+    errno = EBADMSG;
+    return -1;
+}
+
+long batch_unpack(int fd, int dirfd, size_t *bad)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == -1)
+        return -1;
+
+    if (st.st_size == 0)
+        return unpackMapped(NULL, 0, dirfd, bad);
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+
+    long result = unpackMapped(map, st.st_size, dirfd, bad);
+    munmap(map, st.st_size);
+    return result;
+}
@@ -0,0 +1,62 @@
+#ifndef batch_h_INCLUDED
+#define batch_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Many files sent as one transfer. The files are packed back to back behind
+// a manifest, so small files share full sized packets and the whole batch
+// costs a single handshake. It goes across like any other file, with
+// TRANSFER_FLAG_BATCH set, and is unpacked once it has arrived.
+//
+// Batch format:
+//  * 4 bytes for BATCH_MAGIC
+//  * 4 bytes for number of files
+//  * 8 bytes for manifest length in bytes, where the first file starts
+//  * for every file:
+//    * 2 bytes for name length
+//    * name, a relative path with / between components and no NUL
+//    * 8 bytes for offset of the file's data from the start of the batch
+//    * 8 bytes for file size in bytes
+//    * 32 bytes for the file's sha256sum
+//  * every file's data, in manifest order
+
+#define BATCH_MAGIC       "PFTB"
+#define BATCH_HEADER_SIZE 16
+#define BATCH_ENTRY_SIZE  50
+
+typedef struct {
+    char *name;
+    // Where the file is read from when packing
+    char *path;
+    uint64_t offset;
+    uint64_t fileLen;
+    uint8_t shaSum[32];
+} BatchEntry;
+
+typedef struct {
+    BatchEntry *entries;
+    size_t entryNum;
+    size_t capacity;
+} Batch;
+
+void batch_init(Batch *batch);
+void batch_free(Batch *batch);
+
+// Adds a regular file, or every regular file below a directory in name
+// order, named by their path from the directory path is in. Returns -1
+// with errno set on error.
+int batch_add(Batch *batch, const char *path);
+
+// Writes the manifest and every file's data to fp, filling in their
+// offsets, sizes and sums. Returns -1 with errno set on error.
+int batch_write(Batch *batch, FILE *fp);
+
+// Writes every file in the batch in fd out below dirfd, creating any
+// directories their names need. Files that don't match their sha256sum are
+// left out and counted in bad. Returns the number of files written, or -1
+// with errno set on error, EBADMSG for a batch that doesn't parse.
+long batch_unpack(int fd, int dirfd, size_t *bad);
+
+#endif // batch_h_INCLUDED
@@ -0,0 +1,319 @@
+#ifdef COMPRESS_TEST
+#include <stdio.h>
+#endif // COMPRESS_TEST
+
+#include "compress.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_ZSTD
+// Contexts are made once and reused, setting one up costs more than
+// compressing a packet. There is only one of each, so only one thread at a
+// time may compress and only one may decompress.
+static ZSTD_CCtx *zstdCompressCtx;
+static ZSTD_DCtx *zstdDecompressCtx;
+#endif
+
+bool compress_supported(uint8_t codec)
+{
+    switch (codec) {
+        case COMPRESS_NONE:
+            return true;
+#ifdef HAVE_LZ4
+        case COMPRESS_LZ4:
+            return true;
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+static size_t compressData(uint8_t codec, int level, const uint8_t *data, size_t len,
+                           uint8_t *out, size_t outCap)
+{
+    // Returns the compressed length, 0 when it didn't fit in outCap
+
+    // Not all of them are used without both codecs built in
+    (void) level;
+    (void) data;
+    (void) len;
+    (void) out;
+    (void) outCap;
+
+    switch (codec) {
+#ifdef HAVE_LZ4
+        case COMPRESS_LZ4: {
+            int result = LZ4_compress_default((const char *) data, (char *) out, len, outCap);
+            return result > 0 ? (size_t) result : 0;
+        }
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD: {
+            if (zstdCompressCtx == NULL)
+                zstdCompressCtx = ZSTD_createCCtx();
+
+            size_t result = ZSTD_compressCCtx(zstdCompressCtx, out, outCap, data, len, level);
+            return ZSTD_isError(result) ? 0 : result;
+        }
+#endif
+        default:
+            return 0;
+    }
+}
+
+size_t compress_payload(uint8_t codec, int level, const uint8_t *data, size_t len, uint8_t *out)
+{
+    uint32_t len_32 = len;
+    size_t saving = len / 32 > 0 ? len / 32 : 1;
+    size_t compressedLen = 0;
+
+    memcpy(out + 1, &len_32, 4);
+
+    if (len > saving)
+        compressedLen = compressData(codec, level, data, len, out + COMPRESS_HEADER_SIZE,
+                                     len - saving);
+
+    if (compressedLen == 0) {
+        out[0] = COMPRESS_NONE;
+        memcpy(out + COMPRESS_HEADER_SIZE, data, len);
+        return COMPRESS_HEADER_SIZE + len;
+    }
+
+    out[0] = codec;
+    return COMPRESS_HEADER_SIZE + compressedLen;
+}
+
+const uint8_t* compress_encode(Compressor *cmp, const uint8_t *data, size_t len, uint8_t *out,
+                               size_t *outLen)
+{
+    if (cmp->codec == COMPRESS_NONE) {
+        *outLen = len;
+        return data;
+    }
+
+    bool trying = cmp->misses < COMPRESS_GIVE_UP || cmp->skipped == COMPRESS_RETRY;
+
+    *outLen = compress_payload(trying ? cmp->codec : COMPRESS_NONE, cmp->level, data, len, out);
+
+    if (trying) {
+        cmp->misses = out[0] == COMPRESS_NONE ? cmp->misses + 1 : 0;
+        cmp->skipped = 0;
+    } else {
+        cmp->skipped += 1;
+    }
+
+    return out;
+}
+
+long compress_payload_length(const uint8_t *payload, size_t payloadLen)
+{
+    uint32_t len_32;
+
+    if (payloadLen < COMPRESS_HEADER_SIZE)
+        return -1;
+
+    memcpy(&len_32, payload + 1, 4);
+    return len_32;
+}
+
+long decompress_payload(const uint8_t *payload, size_t payloadLen, uint8_t *out, size_t outCap)
+{
+    long len = compress_payload_length(payload, payloadLen);
+    const uint8_t *data = payload + COMPRESS_HEADER_SIZE;
+    size_t dataLen = payloadLen - COMPRESS_HEADER_SIZE;
+
+    if (len == -1 || (size_t) len > outCap)
+        return -1;
+
+    switch (payload[0]) {
+        case COMPRESS_NONE:
+            if (dataLen != (size_t) len)
+                return -1;
+            memcpy(out, data, len);
+            return len;
+#ifdef HAVE_LZ4
+        case COMPRESS_LZ4:
+            if (LZ4_decompress_safe((const char *) data, (char *) out, dataLen, len) != len)
+                return -1;
+            return len;
+#endif
+#ifdef HAVE_ZSTD
+        case COMPRESS_ZSTD: {
+            if (zstdDecompressCtx == NULL)
+                zstdDecompressCtx = ZSTD_createDCtx();
+
+            size_t result = ZSTD_decompressDCtx(zstdDecompressCtx, out, len, data, dataLen);
+            if (ZSTD_isError(result) || result != (size_t) len)
+                return -1;
+            return len;
+        }
+#endif
+        default:
+            return -1;
+    }
+}
+
+#ifdef COMPRESS_TEST
+
+#include <stdlib.h>
+
+static const struct {
+    const char *name;
+    uint8_t codec;
+} codecs[] = {
+    { "none", COMPRESS_NONE },
+    { "lz4",  COMPRESS_LZ4  },
+    { "zstd", COMPRESS_ZSTD },
+};
+
+void fillData(uint8_t *data, size_t len, bool compressible)
+{
+    // Compressible data repeats a few words, the rest is random bytes
+    static const char *words[] = { "packet ", "serial ", "payload ", "crc32 " };
+
+    for (size_t i = 0; i < len;) {
+        if (!compressible) {
+            data[i++] = rand();
+            continue;
+        }
+
+        const char *word = words[rand() % 4];
+        for (size_t n = 0; word[n] != '\0' && i < len; ++n)
+            data[i++] = word[n];
+    }
+}
+
+int checkRoundTrip(void)
+{
+    // Every codec built in has to give back what it was given, whether it
+    // compressed or stored it, and turn down payloads cut short
+
+    uint8_t data[0x8000], payload[0x8000 + COMPRESS_HEADER_SIZE], back[0x8000];
+    int failures = 0;
+
+    for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); ++c) {
+        if (!compress_supported(codecs[c].codec)) {
+            printf("%s: not built in\n", codecs[c].name);
+            continue;
+        }
+
+        int trial;
+        for (trial = 0; trial < 1000; ++trial) {
+            size_t len = rand() % (sizeof(data) + 1);
+            bool compressible = rand() % 2;
+
+            fillData(data, len, compressible);
+            size_t payloadLen = compress_payload(codecs[c].codec, 3, data, len, payload);
+
+            long backLen = decompress_payload(payload, payloadLen, back, sizeof(back));
+            if (backLen != (long) len || memcmp(back, data, len) != 0) {
+                printf("%s: %zu bytes didn't come back\n", codecs[c].name, len);
+                break;
+            }
+
+            // Compressible data has to shrink with a codec to shrink it
+            if (codecs[c].codec != COMPRESS_NONE && compressible && len >= 1024
+                && payload[0] != codecs[c].codec) {
+                printf("%s: %zu compressible bytes were stored\n", codecs[c].name, len);
+                break;
+            }
+
+            if (payloadLen > COMPRESS_HEADER_SIZE
+                && decompress_payload(payload, payloadLen - 1, back, sizeof(back)) != -1) {
+                printf("%s: a payload cut short was accepted\n", codecs[c].name);
+                break;
+            }
+        }
+
+        if (trial < 1000)
+            failures += 1;
+        else
+            printf("%s: ok\n", codecs[c].name);
+    }
+
+    return failures;
+}
+
+int checkGiveUp(void)
+{
+    // After COMPRESS_GIVE_UP packets that didn't shrink the next
+    // COMPRESS_RETRY are stored without trying, then one is tried again
+
+    uint8_t data[4096], payload[4096 + COMPRESS_HEADER_SIZE];
+    Compressor cmp = { COMPRESS_NONE, 3, 0, 0 };
+    size_t payloadLen;
+
+    for (size_t c = 0; c < sizeof(codecs) / sizeof(codecs[0]); ++c)
+        if (codecs[c].codec != COMPRESS_NONE && compress_supported(codecs[c].codec))
+            cmp.codec = codecs[c].codec;
+
+    if (cmp.codec == COMPRESS_NONE) {
+        printf("give up: no codec built in\n");
+        return 0;
+    }
+
+    fillData(data, sizeof(data), false);
+    for (int i = 0; i < COMPRESS_GIVE_UP; ++i)
+        compress_encode(&cmp, data, sizeof(data), payload, &payloadLen);
+
+    // Given up on, even data that would compress is stored
+    fillData(data, sizeof(data), true);
+    for (int i = 0; i < COMPRESS_RETRY; ++i) {
+        compress_encode(&cmp, data, sizeof(data), payload, &payloadLen);
+        if (payload[0] != COMPRESS_NONE) {
+            printf("give up: packet %d after giving up was compressed\n", i);
+            return 1;
+        }
+    }
+
+    // Tried again, and kept on once it paid off
+    for (int i = 0; i < 2; ++i) {
+        compress_encode(&cmp, data, sizeof(data), payload, &payloadLen);
+        if (payload[0] != cmp.codec) {
+            printf("give up: packet %d after the retry wasn't compressed\n", i);
+            return 1;
+        }
+    }
+
+    // Given up on again, a retry that doesn't pay off goes straight back
+    // to storing packets
+    fillData(data, sizeof(data), false);
+    for (int i = 0; i < COMPRESS_GIVE_UP + COMPRESS_RETRY + 1; ++i)
+        compress_encode(&cmp, data, sizeof(data), payload, &payloadLen);
+
+    fillData(data, sizeof(data), true);
+    compress_encode(&cmp, data, sizeof(data), payload, &payloadLen);
+    if (payload[0] != COMPRESS_NONE) {
+        printf("give up: packet after a failed retry was compressed\n");
+        return 1;
+    }
+
+    printf("give up: ok\n");
+    return 0;
+}
+
+int main(void)
+{
+    srand(1);
+
+    if (checkRoundTrip() != 0 || checkGiveUp() != 0)
+        return 1;
+
+    return 0;
+}
+
+#endif // COMPRESS_TEST
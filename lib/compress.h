@@ -0,0 +1,58 @@
+#ifndef compress_h_INCLUDED
+#define compress_h_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Codecs, as carried in the TRANSFER_START header and in front of every
+// compressed payload. LZ4 and zstd are only available when the library
+// was built with them.
+#define COMPRESS_NONE 0
+#define COMPRESS_LZ4  1
+#define COMPRESS_ZSTD 2
+
+// Compressed payload format:
+//  * 1 byte for the codec the data was compressed with, COMPRESS_NONE for
+//    data that didn't compress and is stored as is
+//  * 4 bytes for the uncompressed length
+//  * n bytes of data
+#define COMPRESS_HEADER_SIZE 5
+
+bool compress_supported(uint8_t codec);
+
+// Compresses len bytes of data into out, which has to hold at least
+// len + COMPRESS_HEADER_SIZE bytes, and returns the payload length. Data
+// that doesn't shrink by at least 1/32 is stored instead. The level only
+// matters to zstd.
+size_t compress_payload(uint8_t codec, int level, const uint8_t *data, size_t len, uint8_t *out);
+
+// Returns the uncompressed length of a payload, or -1 if it is malformed
+// or longer than outCap
+long decompress_payload(const uint8_t *payload, size_t payloadLen, uint8_t *out, size_t outCap);
+
+// Returns the uncompressed length a payload claims, or -1 if it is too
+// short to have a header
+long compress_payload_length(const uint8_t *payload, size_t payloadLen);
+
+// Compression stops being tried after this many packets in a row didn't
+// shrink, so an incompressible stretch of the file costs no more than a
+// copy. Every COMPRESS_RETRY packets one is tried again in case the data
+// changed.
+#define COMPRESS_GIVE_UP 8
+#define COMPRESS_RETRY   64
+
+typedef struct {
+    uint8_t codec;
+    int level;
+    size_t misses;
+    size_t skipped;
+} Compressor;
+
+// Returns the payload to send for the data, which is the data itself when
+// the codec is COMPRESS_NONE. out has to hold len + COMPRESS_HEADER_SIZE
+// bytes.
+const uint8_t* compress_encode(Compressor *cmp, const uint8_t *data, size_t len, uint8_t *out,
+                               size_t *outLen);
+
+#endif // compress_h_INCLUDED
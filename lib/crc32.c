@@ -2,9 +2,19 @@
 #include <stdio.h>
 #endif // CRC32_TEST
 
+#include "crc32.h"
+
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
+
 static uint_fast32_t const crctab[256] =
 {
   0x00000000,
@@ -61,28 +71,394 @@ static uint_fast32_t const crctab[256] =
   0xa2f33668, 0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
 };
 
-uint32_t crc32(const uint8_t *data, size_t len)
+// crcslice[k][n] is the crc of byte n followed by k zero bytes, which lets
+// crc32Sliced fold in 8 bytes at a time with independent table lookups
+// instead of one dependent lookup per byte
+static uint32_t crcslice[8][256];
+
+// x^n mod P for the distances the carry-less multiply kernels fold over:
+// 512 and 576 bits to fold 64 bytes forward, 128 and 192 bits for 16
+static uint64_t foldK512, foldK576, foldK128, foldK192;
+
+typedef uint32_t (*Crc32Kernel)(uint32_t crc, const uint8_t *data, size_t len);
+
+static uint32_t crc32Sliced(uint32_t crc, const uint8_t *data, size_t len);
+static bool clmulSupported(void);
+static uint32_t crc32Clmul(uint32_t crc, const uint8_t *data, size_t len);
+
+// Picked once at startup, the fastest kernel this CPU can run
+static Crc32Kernel crc32Kernel = crc32Sliced;
+
+static uint64_t xPowModP(size_t n)
+{
+    uint64_t r = 1;
+
+    for (size_t i = 0; i < n; ++i) {
+        r <<= 1;
+        if (r & 0x100000000)
+            r ^= 0x104C11DB7;
+    }
+
+    return r;
+}
+
+__attribute__((constructor))
+static void initCrc32(void)
 {
-    size_t i;
-    uint_fast32_t crc = 0;
+    for (size_t n = 0; n < 256; ++n) {
+        crcslice[0][n] = crctab[n];
+        for (size_t k = 1; k < 8; ++k)
+            crcslice[k][n] = (crcslice[k - 1][n] << 8) ^ crctab[crcslice[k - 1][n] >> 24];
+    }
+
+    foldK128 = xPowModP(128);
+    foldK192 = xPowModP(192);
+    foldK512 = xPowModP(512);
+    foldK576 = xPowModP(576);
+
+    if (clmulSupported())
+        crc32Kernel = crc32Clmul;
+}
 
-    for (i = 0; i < len; ++i)
+static uint32_t crc32Bytewise(uint32_t crc, const uint8_t *data, size_t len)
+{
+    for (size_t i = 0; i < len; ++i)
         crc = (crc << 8) ^ crctab[((crc >> 24) ^ data[i]) & 0xFF];
 
+    return crc;
+}
+
+static uint32_t crc32Sliced(uint32_t crc, const uint8_t *data, size_t len)
+{
+    while (len >= 8) {
+        uint32_t hi = crc ^ ((uint32_t) data[0] << 24 | (uint32_t) data[1] << 16
+                             | (uint32_t) data[2] << 8 | data[3]);
+
+        crc = crcslice[7][hi >> 24] ^ crcslice[6][(hi >> 16) & 0xFF]
+            ^ crcslice[5][(hi >> 8) & 0xFF] ^ crcslice[4][hi & 0xFF]
+            ^ crcslice[3][data[4]] ^ crcslice[2][data[5]]
+            ^ crcslice[1][data[6]] ^ crcslice[0][data[7]];
+
+        data += 8;
+        len -= 8;
+    }
+
+    return crc32Bytewise(crc, data, len);
+}
+
+// The carry-less multiply kernels treat each 16 byte block as a polynomial
+// with the first bit of the block as its highest coefficient, which is the
+// bit order this (non-reflected) crc uses. A running 128 bit remainder A
+// congruent to everything folded so far mod P is carried forward d bits by
+// splitting it into 64 bit halves, A = Ahi x^64 + Alo, and computing
+//   Ahi * (x^(d+64) mod P) + Alo * (x^d mod P)
+// which is still congruent and fits back in 128 bits. Four remainders are
+// folded 64 bytes at a time to keep the multiplier busy, then merged into
+// one. Since the crc of a message is just it times x^32 mod P, the crc of
+// the final remainder's 16 bytes is the crc of everything it replaced, so
+// the table path finishes it off along with any leftover bytes.
+
+#if defined(__x86_64__)
+
+static bool clmulSupported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i loadBlock(const uint8_t *data)
+{
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) data), reverse);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i foldBlock(__m128i a, __m128i k)
+{
+    return _mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x11), _mm_clmulepi64_si128(a, k, 0x00));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc32Clmul(uint32_t crc, const uint8_t *data, size_t len)
+{
+    const __m128i reverse = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    const __m128i k512 = _mm_set_epi64x(foldK576, foldK512);
+    const __m128i k128 = _mm_set_epi64x(foldK192, foldK128);
+    uint8_t rem[16];
+    __m128i x0, x1, x2, x3;
+
+    if (len < 128)
+        return crc32Sliced(crc, data, len);
+
+    x0 = _mm_xor_si128(loadBlock(data), _mm_set_epi32(crc, 0, 0, 0));
+    x1 = loadBlock(data + 16);
+    x2 = loadBlock(data + 32);
+    x3 = loadBlock(data + 48);
+    data += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x0 = _mm_xor_si128(foldBlock(x0, k512), loadBlock(data));
+        x1 = _mm_xor_si128(foldBlock(x1, k512), loadBlock(data + 16));
+        x2 = _mm_xor_si128(foldBlock(x2, k512), loadBlock(data + 32));
+        x3 = _mm_xor_si128(foldBlock(x3, k512), loadBlock(data + 48));
+        data += 64;
+        len -= 64;
+    }
+
+    x1 = _mm_xor_si128(foldBlock(x0, k128), x1);
+    x2 = _mm_xor_si128(foldBlock(x1, k128), x2);
+    x3 = _mm_xor_si128(foldBlock(x2, k128), x3);
+
+    _mm_storeu_si128((__m128i *) rem, _mm_shuffle_epi8(x3, reverse));
+
+    return crc32Sliced(crc32Sliced(0, rem, 16), data, len);
+}
+
+#elif defined(__aarch64__)
+
+static bool clmulSupported(void)
+{
+    return getauxval(AT_HWCAP) & HWCAP_PMULL;
+}
+
+__attribute__((target("+crypto")))
+static inline uint64x2_t loadBlock(const uint8_t *data)
+{
+    uint8x16_t v = vrev64q_u8(vld1q_u8(data));
+    return vreinterpretq_u64_u8(vextq_u8(v, v, 8));
+}
+
+__attribute__((target("+crypto")))
+static inline uint64x2_t foldBlock(uint64x2_t a, poly64_t khi, poly64_t klo)
+{
+    poly128_t hi = vmull_p64((poly64_t) vgetq_lane_u64(a, 1), khi);
+    poly128_t lo = vmull_p64((poly64_t) vgetq_lane_u64(a, 0), klo);
+    return veorq_u64(vreinterpretq_u64_p128(hi), vreinterpretq_u64_p128(lo));
+}
+
+__attribute__((target("+crypto")))
+static uint32_t crc32Clmul(uint32_t crc, const uint8_t *data, size_t len)
+{
+    uint8_t rem[16];
+    uint64x2_t x0, x1, x2, x3;
+    uint8x16_t v;
+
+    if (len < 128)
+        return crc32Sliced(crc, data, len);
+
+    x0 = veorq_u64(loadBlock(data), vcombine_u64(vcreate_u64(0), vcreate_u64((uint64_t) crc << 32)));
+    x1 = loadBlock(data + 16);
+    x2 = loadBlock(data + 32);
+    x3 = loadBlock(data + 48);
+    data += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x0 = veorq_u64(foldBlock(x0, foldK576, foldK512), loadBlock(data));
+        x1 = veorq_u64(foldBlock(x1, foldK576, foldK512), loadBlock(data + 16));
+        x2 = veorq_u64(foldBlock(x2, foldK576, foldK512), loadBlock(data + 32));
+        x3 = veorq_u64(foldBlock(x3, foldK576, foldK512), loadBlock(data + 48));
+        data += 64;
+        len -= 64;
+    }
+
+    x1 = veorq_u64(foldBlock(x0, foldK192, foldK128), x1);
+    x2 = veorq_u64(foldBlock(x1, foldK192, foldK128), x2);
+    x3 = veorq_u64(foldBlock(x2, foldK192, foldK128), x3);
+
+    v = vrev64q_u8(vreinterpretq_u8_u64(x3));
+    vst1q_u8(rem, vextq_u8(v, v, 8));
+
+    return crc32Sliced(crc32Sliced(0, rem, 16), data, len);
+}
+
+#else
+
+static bool clmulSupported(void)
+{
+    return false;
+}
+
+static uint32_t crc32Clmul(uint32_t crc, const uint8_t *data, size_t len)
+{
+    return crc32Sliced(crc, data, len);
+}
+
+#endif
+
+void crc32_init(CRC32_CTX *ctx)
+{
+    ctx->crc = 0;
+    ctx->len = 0;
+}
+
+void crc32_update(CRC32_CTX *ctx, const uint8_t *data, size_t len)
+{
+    ctx->crc = crc32Kernel(ctx->crc, data, len);
+    ctx->len += len;
+}
+
+static uint32_t finish(uint32_t crc, uint64_t len)
+{
+    // Like cksum, the length of the data is mixed in after it
     for (; len; len >>= 8)
         crc = (crc << 8) ^ crctab[((crc >> 24) ^ len) & 0xFF];
 
     return ~crc & 0xFFFFFFFF;
 }
 
+uint32_t crc32_final(CRC32_CTX *ctx)
+{
+    return finish(ctx->crc, ctx->len);
+}
+
+uint32_t crc32(const uint8_t *data, size_t len)
+{
+    CRC32_CTX ctx;
+
+    crc32_init(&ctx);
+    crc32_update(&ctx, data, len);
+    return crc32_final(&ctx);
+}
+
+// Before the length goes in the crc is linear in the data, and zero bytes
+// in front of a message don't change it. So the crc of a window plus the
+// byte after it, less the crc of its first byte followed by window zero
+// bytes, is the crc of the window moved on a byte.
+
+void crc32_roll_init(CRC32_ROLL *roll, size_t window)
+{
+    uint32_t bits[8];
+
+    for (int k = 0; k < 8; ++k) {
+        uint32_t crc = crctab[1 << k];
+
+        for (size_t i = 0; i < window; ++i)
+            crc = (crc << 8) ^ crctab[crc >> 24];
+        bits[k] = crc;
+    }
+
+    for (size_t n = 0; n < 256; ++n) {
+        roll->out[n] = 0;
+        for (int k = 0; k < 8; ++k)
+            if (n & (1 << k))
+                roll->out[n] ^= bits[k];
+    }
+
+    roll->window = window;
+    roll->crc = 0;
+}
+
+void crc32_roll_start(CRC32_ROLL *roll, const uint8_t *data)
+{
+    roll->crc = crc32Kernel(0, data, roll->window);
+}
+
+void crc32_roll(CRC32_ROLL *roll, uint8_t out, uint8_t in)
+{
+    uint32_t crc = roll->crc;
+
+    roll->crc = (crc << 8) ^ crctab[((crc >> 24) ^ in) & 0xFF] ^ roll->out[out];
+}
+
+uint32_t crc32_roll_sum(const CRC32_ROLL *roll)
+{
+    return finish(roll->crc, roll->window);
+}
+
 #ifdef CRC32_TEST
 
+#include <stdlib.h>
+
+int checkKernels(void)
+{
+    // Every kernel has to match the bytewise table walk on random data of
+    // random lengths and alignments, starting from a random crc
+
+    static const struct {
+        const char *name;
+        Crc32Kernel kernel;
+    } kernels[] = {
+        { "sliced", crc32Sliced },
+        { "clmul",  crc32Clmul  },
+    };
+    uint8_t data[4096 + 16];
+    int failures = 0;
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(data); ++i)
+        data[i] = rand();
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); ++k) {
+        if (kernels[k].kernel == crc32Clmul && !clmulSupported()) {
+            printf("%s: not supported on this CPU\n", kernels[k].name);
+            continue;
+        }
+
+        int trial;
+        for (trial = 0; trial < 10000; ++trial) {
+            size_t offset = rand() % 16;
+            size_t len = rand() % (sizeof(data) - offset);
+            uint32_t crc = rand();
+
+            if (kernels[k].kernel(crc, data + offset, len) != crc32Bytewise(crc, data + offset, len)) {
+                printf("%s: differs from the reference for %zu bytes at offset %zu\n",
+                       kernels[k].name, len, offset);
+                failures += 1;
+                break;
+            }
+        }
+
+        if (trial == 10000)
+            printf("%s: ok\n", kernels[k].name);
+    }
+
+    return failures;
+}
+
+int checkRolling(void)
+{
+    // A window rolled along random data has to match crc32 of it everywhere
+    uint8_t data[4096];
+    static const size_t windows[] = { 1, 7, 64, 700, 2048 };
+    CRC32_ROLL roll;
+
+    for (size_t i = 0; i < sizeof(data); ++i)
+        data[i] = rand();
+
+    for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); ++w) {
+        size_t window = windows[w];
+
+        crc32_roll_init(&roll, window);
+        crc32_roll_start(&roll, data);
+
+        for (size_t i = 0; i + window <= sizeof(data); ++i) {
+            if (crc32_roll_sum(&roll) != crc32(data + i, window)) {
+                printf("rolling: differs from crc32 for %zu bytes at offset %zu\n", window, i);
+                return 1;
+            }
+            if (i + window < sizeof(data))
+                crc32_roll(&roll, data[i], data[i + window]);
+        }
+    }
+
+    printf("rolling: ok\n");
+    return 0;
+}
+
 int main(int argc, char **argv)
 {
-    if (argc < 2) {
-        printf("%s expects a file as an argument.\n", argv[0]);
+    if (checkKernels() != 0)
         return 1;
-    }
+
+    if (checkRolling() != 0)
+        return 1;
+
+    // With a file, print its checksum like cksum would
+    if (argc < 2)
+        return 0;
 
     FILE *fp = fopen(argv[1], "r");
     if (fp == NULL) {
@@ -99,9 +475,9 @@ int main(int argc, char **argv)
     long len = ftell(fp);
     rewind(fp);
 
-    uint8_t data[len];
+    uint8_t *data = malloc(len);
     size_t read = fread(data, 1, len, fp);
-    if (read != len) {
+    if (read != (size_t) len) {
         printf("Error reading file %s.\n", argv[1]);
         return 1;
     }
@@ -109,6 +485,19 @@ int main(int argc, char **argv)
     uint32_t crc = crc32(data, len);
     printf("%u %ld %s\n", crc, len, argv[1]);
 
+    // The incremental path has to match too, however the data is split
+    CRC32_CTX ctx;
+    crc32_init(&ctx);
+    for (long offset = 0, chunk = 1; offset < len; offset += chunk, chunk = chunk * 3 + 1)
+        crc32_update(&ctx, data + offset, chunk < len - offset ? chunk : len - offset);
+
+    if (crc32_final(&ctx) != crc) {
+        printf("Incremental crc32 differs from crc32\n");
+        return 1;
+    }
+
+    free(data);
+
     return 0;
 }
 
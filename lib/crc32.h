@@ -4,7 +4,40 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Matches the POSIX cksum algorithm. The incremental API gives the same
+// result for data that arrives in pieces.
+typedef struct {
+    uint32_t crc;
+    uint64_t len;
+} CRC32_CTX;
+
+void crc32_init(CRC32_CTX *ctx);
+void crc32_update(CRC32_CTX *ctx, const uint8_t *data, size_t len);
+uint32_t crc32_final(CRC32_CTX *ctx);
+
 uint32_t crc32(const uint8_t *data, size_t len);
 
+// The crc32 of a window of bytes sliding along data a byte at a time, for
+// finding blocks of one file in another the way rsync does. Moving the
+// window on costs a couple of table lookups however large it is.
+typedef struct {
+    uint32_t crc;
+    size_t window;
+    // What each byte leaving the window takes out of the crc
+    uint32_t out[256];
+} CRC32_ROLL;
+
+// Sets up for windows of a given length, then crc32_roll_start starts one
+// off at data, which needs to hold at least that many bytes
+void crc32_roll_init(CRC32_ROLL *roll, size_t window);
+void crc32_roll_start(CRC32_ROLL *roll, const uint8_t *data);
+
+// Moves the window on a byte, out being the byte leaving its front and in
+// the one joining its end
+void crc32_roll(CRC32_ROLL *roll, uint8_t out, uint8_t in);
+
+// The same as crc32() of the bytes in the window
+uint32_t crc32_roll_sum(const CRC32_ROLL *roll);
+
 #endif // crc32_h_INCLUDED
 
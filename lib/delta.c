@@ -0,0 +1,408 @@
+#include "delta.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crc32.h"
+#include "sha256.h"
+#include "sha256_utils.h"
+
+_Static_assert(sizeof(DeltaBlock) == 4 + DELTA_STRONG_SIZE, "signatures are sent as they are");
+
+// Signatures by crc32sum, chained in block order from heads[crc & mask]
+typedef struct {
+    const DeltaSignatures *sigs;
+    size_t *heads;
+    size_t *next;
+    size_t mask;
+} BlockIndex;
+
+uint32_t delta_block_size(uint64_t basisLen)
+{
+    // Larger blocks mean fewer signatures to send but less of a changed
+    // file found in the copy, the square root balances the two like rsync
+    uint32_t size = DELTA_MIN_BLOCK;
+
+    while (size < DELTA_MAX_BLOCK && (uint64_t) size * size < basisLen)
+        size += 64;
+
+    return size;
+}
+
+static int mapFile(int fd, const uint8_t **data, uint64_t *len)
+{
+    // Empty files can't be mapped, they come back as NULL
+    struct stat st;
+
+    if (fstat(fd, &st) == -1)
+        return -1;
+
+    *len = st.st_size;
+    *data = NULL;
+    if (*len == 0)
+        return 0;
+
+    void *map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+
+    *data = map;
+    return 0;
+}
+
+static void unmapFile(const uint8_t *data, uint64_t len)
+{
+    if (data != NULL)
+        munmap((void *) data, len);
+}
+
+int delta_sign(int fd, DeltaSignatures *sigs)
+{
+    const uint8_t *data;
+    uint64_t len;
+
+    if (mapFile(fd, &data, &len) == -1)
+        return -1;
+
+    sigs->basisLen = len;
+    sigs->blockSize = delta_block_size(len);
+    sigs->blockNum = len / sigs->blockSize;
+    sigs->blocks = malloc((sigs->blockNum > 0 ? sigs->blockNum : 1) * sizeof(DeltaBlock));
+    if (sigs->blocks == NULL) {
+        unmapFile(data, len);
+        return -1;
+    }
+
+    for (size_t i = 0; i < sigs->blockNum; ++i) {
+        const uint8_t *block = data + i * sigs->blockSize;
+        uint8_t strong[32];
+
+        sigs->blocks[i].crc = crc32(block, sigs->blockSize);
+        calculateSHA256(block, sigs->blockSize, strong);
+        memcpy(sigs->blocks[i].strong, strong, DELTA_STRONG_SIZE);
+    }
+
+    calculateSHA256(data, len, sigs->basisSum);
+    unmapFile(data, len);
+    return 0;
+}
+
+void delta_free(DeltaSignatures *sigs)
+{
+    free(sigs->blocks);
+    sigs->blocks = NULL;
+}
+
+static int indexBlocks(BlockIndex *index, const DeltaSignatures *sigs)
+{
+    size_t buckets = 1;
+    while (buckets < 2 * sigs->blockNum)
+        buckets *= 2;
+
+    index->sigs = sigs;
+    index->mask = buckets - 1;
+    index->heads = malloc(buckets * sizeof(size_t));
+    index->next = malloc((sigs->blockNum > 0 ? sigs->blockNum : 1) * sizeof(size_t));
+    if (index->heads == NULL || index->next == NULL) {
+        free(index->heads);
+        free(index->next);
+        return -1;
+    }
+
+    for (size_t b = 0; b < buckets; ++b)
+        index->heads[b] = SIZE_MAX;
+
+    for (size_t i = sigs->blockNum; i-- > 0;) {
+        size_t b = sigs->blocks[i].crc & index->mask;
+
+        index->next[i] = index->heads[b];
+        index->heads[b] = i;
+    }
+
+    return 0;
+}
+
+static bool blockMatches(const DeltaSignatures *sigs, size_t i, const uint8_t *data,
+                         uint8_t strong[32], bool *hashed)
+{
+    // The window is only hashed once its crc32sum matches a block's
+    if (!*hashed) {
+        calculateSHA256(data, sigs->blockSize, strong);
+        *hashed = true;
+    }
+
+    return memcmp(sigs->blocks[i].strong, strong, DELTA_STRONG_SIZE) == 0;
+}
+
+static size_t findBlock(const BlockIndex *index, uint32_t crc, const uint8_t *data, size_t hint)
+{
+    // Returns the block the window at data matches, or SIZE_MAX. The block
+    // after the last one found is tried first, so a run of blocks that
+    // repeats elsewhere in the copy still comes out as a single run.
+    const DeltaSignatures *sigs = index->sigs;
+    uint8_t strong[32];
+    bool hashed = false;
+
+    if (hint < sigs->blockNum && sigs->blocks[hint].crc == crc
+        && blockMatches(sigs, hint, data, strong, &hashed))
+        return hint;
+
+    for (size_t i = index->heads[crc & index->mask]; i != SIZE_MAX; i = index->next[i])
+        if (sigs->blocks[i].crc == crc && blockMatches(sigs, i, data, strong, &hashed))
+            return i;
+
+    return SIZE_MAX;
+}
+
+static int writeCopy(FILE *out, uint32_t first, uint32_t count)
+{
+    uint8_t buf[9];
+
+    buf[0] = DELTA_COPY;
+    memcpy(buf + 1, &first, 4);
+    memcpy(buf + 5, &count, 4);
+
+    return fwrite(buf, 1, sizeof(buf), out) == sizeof(buf) ? 0 : -1;
+}
+
+static int writeLiteral(FILE *out, const uint8_t *data, uint64_t len)
+{
+    while (len > 0) {
+        uint8_t buf[5];
+        uint32_t chunk = len < UINT32_MAX ? len : UINT32_MAX;
+
+        buf[0] = DELTA_LITERAL;
+        memcpy(buf + 1, &chunk, 4);
+        if (fwrite(buf, 1, sizeof(buf), out) != sizeof(buf)
+            || fwrite(data, 1, chunk, out) != chunk)
+            return -1;
+
+        data += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+int delta_write(const DeltaSignatures *sigs, int fd, const uint8_t shaSum[32], FILE *out,
+                uint64_t *copied)
+{
+    const uint8_t *data;
+    uint64_t len;
+    BlockIndex index;
+
+    if (sigs->blockNum > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+
+    if (mapFile(fd, &data, &len) == -1)
+        return -1;
+
+    if (indexBlocks(&index, sigs) == -1) {
+        unmapFile(data, len);
+        return -1;
+    }
+
+    uint8_t header[DELTA_HEADER_SIZE];
+    memcpy(header, DELTA_MAGIC, 4);
+    memcpy(header + 4, &sigs->blockSize, 4);
+    memcpy(header + 8, &len, 8);
+    memcpy(header + 16, shaSum, 32);
+    memcpy(header + 48, sigs->basisSum, 32);
+
+    int result = fwrite(header, 1, sizeof(header), out) == sizeof(header) ? 0 : -1;
+
+    // Blocks found one after another are held back as a run until one
+    // that doesn't follow on turns up. Bytes from literal up to pos
+    // weren't found in the copy.
+    size_t n = sigs->blockSize;
+    size_t runFirst = 0, runLen = 0;
+    uint64_t literal = 0, pos = 0;
+    CRC32_ROLL roll;
+
+    *copied = 0;
+    if (sigs->blockNum > 0 && len >= n) {
+        crc32_roll_init(&roll, n);
+        crc32_roll_start(&roll, data);
+    }
+
+    while (result == 0 && sigs->blockNum > 0 && len - pos >= n) {
+        size_t found = findBlock(&index, crc32_roll_sum(&roll), data + pos,
+                                 runLen > 0 ? runFirst + runLen : SIZE_MAX);
+
+        if (found == SIZE_MAX) {
+            if (len - pos > n)
+                crc32_roll(&roll, data[pos], data[pos + n]);
+            pos += 1;
+            continue;
+        }
+
+        if (runLen > 0 && found == runFirst + runLen && literal == pos) {
+            runLen += 1;
+        } else {
+            if (runLen > 0)
+                result = writeCopy(out, runFirst, runLen);
+            if (result == 0 && literal < pos)
+                result = writeLiteral(out, data + literal, pos - literal);
+
+            runFirst = found;
+            runLen = 1;
+        }
+
+        *copied += n;
+        pos += n;
+        literal = pos;
+        if (len - pos >= n)
+            crc32_roll_start(&roll, data + pos);
+    }
+
+    if (result == 0 && runLen > 0)
+        result = writeCopy(out, runFirst, runLen);
+    if (result == 0 && literal < len)
+        result = writeLiteral(out, data + literal, len - literal);
+    if (result == 0 && fflush(out) == EOF)
+        result = -1;
+
+    free(index.heads);
+    free(index.next);
+    unmapFile(data, len);
+    return result;
+}
+
+static int parseHeader(const uint8_t *data, uint64_t len, DeltaHeader *header)
+{
+    if (len < DELTA_HEADER_SIZE || memcmp(data, DELTA_MAGIC, 4) != 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    memcpy(&header->blockSize, data + 4, 4);
+    memcpy(&header->fileLen, data + 8, 8);
+    memcpy(header->shaSum, data + 16, 32);
+    memcpy(header->basisSum, data + 48, 32);
+
+    if (header->blockSize == 0) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    return 0;
+}
+
+int delta_read_header(int fd, DeltaHeader *header)
+{
+    uint8_t buf[DELTA_HEADER_SIZE];
+    ssize_t result = pread(fd, buf, sizeof(buf), 0);
+
+    if (result == -1)
+        return -1;
+
+    return parseHeader(buf, result, header);
+}
+
+static int writeAll(int fd, const uint8_t *data, uint64_t len)
+{
+    while (len > 0) {
+        ssize_t result = write(fd, data, len);
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += result;
+        len -= result;
+    }
+
+    return 0;
+}
+
+static int applyMapped(const uint8_t *delta, uint64_t deltaLen, const uint8_t *basis,
+                       uint64_t basisLen, int outfd, uint8_t shaSum[32])
+{
+    DeltaHeader header;
+    SHA256_CTX shaCtx;
+
+    if (parseHeader(delta, deltaLen, &header) == -1)
+        return -1;
+
+    uint64_t blockNum = basisLen / header.blockSize;
+    uint64_t p = DELTA_HEADER_SIZE;
+    uint64_t written = 0;
+
+    sha256_init(&shaCtx);
+
+    while (p < deltaLen) {
+        const uint8_t *from;
+        uint64_t fromLen;
+
+        if (delta[p] == DELTA_COPY && deltaLen - p >= 9) {
+            uint32_t first, count;
+
+            memcpy(&first, delta + p + 1, 4);
+            memcpy(&count, delta + p + 5, 4);
+            if ((uint64_t) first + count > blockNum)
+                goto malformed;
+
+            from = basis + (uint64_t) first * header.blockSize;
+            fromLen = (uint64_t) count * header.blockSize;
+            p += 9;
+        } else if (delta[p] == DELTA_LITERAL && deltaLen - p >= 5) {
+            uint32_t literalLen;
+
+            memcpy(&literalLen, delta + p + 1, 4);
+            if (deltaLen - p - 5 < literalLen)
+                goto malformed;
+
+            from = delta + p + 5;
+            fromLen = literalLen;
+            p += 5 + literalLen;
+        } else {
+            goto malformed;
+        }
+
+        if (fromLen > header.fileLen - written)
+            goto malformed;
+
+        sha256_update(&shaCtx, from, fromLen);
+        if (writeAll(outfd, from, fromLen) == -1)
+            return -1;
+        written += fromLen;
+    }
+
+    if (written != header.fileLen)
+        goto malformed;
+
+    sha256_final(&shaCtx, (BYTE *) shaSum);
+    return 0;
+
+malformed:
+    errno = EBADMSG;
+    return -1;
+}
+
+int delta_apply(int fd, int basisfd, int outfd, uint8_t shaSum[32])
+{
+    const uint8_t *delta, *basis;
+    uint64_t deltaLen, basisLen;
+
+    if (mapFile(fd, &delta, &deltaLen) == -1)
+        return -1;
+
+    if (mapFile(basisfd, &basis, &basisLen) == -1) {
+        unmapFile(delta, deltaLen);
+        return -1;
+    }
+
+    int result = applyMapped(delta, deltaLen, basis, basisLen, outfd, shaSum);
+
+    unmapFile(delta, deltaLen);
+    unmapFile(basis, basisLen);
+    return result;
+}
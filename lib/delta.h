@@ -0,0 +1,91 @@
+#ifndef delta_h_INCLUDED
+#define delta_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// A new version of a file described in terms of an older one the receiver
+// already has, the way rsync does it. The receiver signs every whole block
+// of its copy with a crc32sum and the start of a sha256sum. The sender
+// rolls a crc32sum along the new file looking for blocks with the same
+// sums, so a block is found wherever it moved to, and writes out copies of
+// the blocks it finds and the bytes between them. It goes across like any
+// other file, with TRANSFER_FLAG_DELTA set, and is applied once it has all
+// arrived.
+//
+// Delta format:
+//  * 4 bytes for DELTA_MAGIC
+//  * 4 bytes for block size in bytes
+//  * 8 bytes for the rebuilt file's size in bytes
+//  * 32 bytes for the rebuilt file's sha256sum
+//  * 32 bytes for the sha256sum of the copy it is built on
+// followed by instructions until the rebuilt file is complete, either
+//  * 1 byte for DELTA_COPY
+//  * 4 bytes for the first block of the copy to copy
+//  * 4 bytes for the number of blocks in a row to copy
+// or
+//  * 1 byte for DELTA_LITERAL
+//  * 4 bytes for length in bytes
+//  * n bytes of data
+
+#define DELTA_MAGIC       "PFTD"
+#define DELTA_HEADER_SIZE 80
+
+#define DELTA_COPY    1
+#define DELTA_LITERAL 2
+
+// Bytes of a block's sha256sum in its signature, a false match also has to
+// get past the crc32sum and the rebuilt file's sha256sum
+#define DELTA_STRONG_SIZE 8
+
+// Blocks are about the square root of the copy's size, within these
+#define DELTA_MIN_BLOCK 512
+#define DELTA_MAX_BLOCK 0x10000
+
+typedef struct {
+    uint32_t crc;
+    uint8_t strong[DELTA_STRONG_SIZE];
+} DeltaBlock;
+
+// What the receiver has. A copy shorter than a block, or none at all, has
+// no blocks to build on.
+typedef struct {
+    uint32_t blockSize;
+    uint64_t basisLen;
+    uint8_t basisSum[32];
+    DeltaBlock *blocks;
+    size_t blockNum;
+} DeltaSignatures;
+
+typedef struct {
+    uint32_t blockSize;
+    uint64_t fileLen;
+    uint8_t shaSum[32];
+    uint8_t basisSum[32];
+} DeltaHeader;
+
+uint32_t delta_block_size(uint64_t basisLen);
+
+// Signs every whole block of the file in fd. Returns -1 with errno set on
+// error.
+int delta_sign(int fd, DeltaSignatures *sigs);
+void delta_free(DeltaSignatures *sigs);
+
+// Writes a delta turning the copy sigs describes into the file in fd, whose
+// sha256sum is shaSum, to out. copied is set to the bytes of the file taken
+// from the copy. Returns -1 with errno set on error.
+int delta_write(const DeltaSignatures *sigs, int fd, const uint8_t shaSum[32], FILE *out,
+                uint64_t *copied);
+
+// Returns -1 with errno set on error, EBADMSG for a delta that doesn't
+// parse
+int delta_read_header(int fd, DeltaHeader *header);
+
+// Rebuilds the file the delta in fd describes from the copy in basisfd,
+// writing it to outfd and its sha256sum to shaSum. Returns -1 with errno
+// set on error, EBADMSG for a delta that doesn't parse or copies blocks the
+// copy doesn't have.
+int delta_apply(int fd, int basisfd, int outfd, uint8_t shaSum[32]);
+
+#endif // delta_h_INCLUDED
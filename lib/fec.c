@@ -0,0 +1,471 @@
+#ifdef FEC_TEST
+#include <stdio.h>
+#endif // FEC_TEST
+
+#include "fec.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// GF(2^8) modulo x^8 + x^4 + x^3 + x^2 + 1, where x is a generator
+#define GF_POLY 0x11D
+
+static uint8_t gfExp[510];
+static uint8_t gfLog[256];
+
+// gfMulTable[c][n] is c * n, for the scalar kernel
+static uint8_t gfMulTable[256][256];
+
+// Repair symbols are rows of a Cauchy matrix, coefficient i of repair j
+// being 1 / (x_j + y_i) with x_j = 255 - j and y_i = i. Every square
+// submatrix of a Cauchy matrix is invertible, which is what lets any k
+// symbols rebuild the group.
+static uint8_t gfInv[256];
+
+typedef void (*MulAddKernel)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+static void mulAddScalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+static bool simdSupported(void);
+static void mulAddSimd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+// Picked once at startup, the fastest kernel this CPU can run
+static MulAddKernel mulAddKernel = mulAddScalar;
+
+__attribute__((constructor))
+static void initFec(void)
+{
+    unsigned x = 1;
+
+    for (size_t i = 0; i < 255; ++i) {
+        gfExp[i] = gfExp[i + 255] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= GF_POLY;
+    }
+
+    for (size_t a = 1; a < 256; ++a) {
+        gfInv[a] = gfExp[255 - gfLog[a]];
+        for (size_t b = 1; b < 256; ++b)
+            gfMulTable[a][b] = gfExp[gfLog[a] + gfLog[b]];
+    }
+
+    if (simdSupported())
+        mulAddKernel = mulAddSimd;
+}
+
+static uint8_t gfMul(uint8_t a, uint8_t b)
+{
+    return gfMulTable[a][b];
+}
+
+static uint8_t cauchy(size_t index, size_t i)
+{
+    return gfInv[(255 - index) ^ i];
+}
+
+static void mulAddScalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    const uint8_t *row = gfMulTable[c];
+
+    for (size_t n = 0; n < len; ++n)
+        dst[n] ^= row[src[n]];
+}
+
+// The vector kernels split every byte into nibbles and look both up in 16
+// entry tables of c times each nibble, since c * n = c * hi(n) + c * lo(n)
+
+#if defined(__x86_64__)
+
+static bool simdSupported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+
+__attribute__((target("ssse3")))
+static void mulAddSimd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    uint8_t lo[16], hi[16];
+
+    for (size_t n = 0; n < 16; ++n) {
+        lo[n] = gfMul(c, n);
+        hi[n] = gfMul(c, n << 4);
+    }
+
+    const __m128i loTable = _mm_loadu_si128((const __m128i *) lo);
+    const __m128i hiTable = _mm_loadu_si128((const __m128i *) hi);
+    const __m128i mask = _mm_set1_epi8(0x0F);
+
+    while (len >= 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *) src);
+        __m128i d = _mm_loadu_si128((const __m128i *) dst);
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(loTable, _mm_and_si128(s, mask)),
+                                  _mm_shuffle_epi8(hiTable, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+
+        _mm_storeu_si128((__m128i *) dst, _mm_xor_si128(d, p));
+        src += 16;
+        dst += 16;
+        len -= 16;
+    }
+
+    mulAddScalar(dst, src, c, len);
+}
+
+#elif defined(__aarch64__)
+
+static bool simdSupported(void)
+{
+    return true;
+}
+
+static void mulAddSimd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    uint8_t lo[16], hi[16];
+
+    for (size_t n = 0; n < 16; ++n) {
+        lo[n] = gfMul(c, n);
+        hi[n] = gfMul(c, n << 4);
+    }
+
+    const uint8x16_t loTable = vld1q_u8(lo);
+    const uint8x16_t hiTable = vld1q_u8(hi);
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+
+    while (len >= 16) {
+        uint8x16_t s = vld1q_u8(src);
+        uint8x16_t p = veorq_u8(vqtbl1q_u8(loTable, vandq_u8(s, mask)),
+                                vqtbl1q_u8(hiTable, vshrq_n_u8(s, 4)));
+
+        vst1q_u8(dst, veorq_u8(vld1q_u8(dst), p));
+        src += 16;
+        dst += 16;
+        len -= 16;
+    }
+
+    mulAddScalar(dst, src, c, len);
+}
+
+#else
+
+static bool simdSupported(void)
+{
+    return false;
+}
+
+static void mulAddSimd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    mulAddScalar(dst, src, c, len);
+}
+
+#endif
+
+static void mulAdd(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len)
+{
+    if (c == 1) {
+        for (size_t n = 0; n < len; ++n)
+            dst[n] ^= src[n];
+    } else if (c != 0) {
+        mulAddKernel(dst, src, c, len);
+    }
+}
+
+// Symbols are worked through in strips this long so the output strip
+// stays in L1 while every input is folded into it
+#define STRIP_LEN 4096
+
+void fec_encode(const uint8_t *const *data, size_t k, size_t len, size_t index,
+                uint8_t *repair)
+{
+    memset(repair, 0, len);
+
+    for (size_t off = 0; off < len; off += STRIP_LEN) {
+        size_t strip = len - off < STRIP_LEN ? len - off : STRIP_LEN;
+
+        for (size_t i = 0; i < k; ++i)
+            mulAdd(repair + off, data[i] + off, cauchy(index, i), strip);
+    }
+}
+
+static bool invertMatrix(uint8_t *m, uint8_t *inv, size_t n)
+{
+    // Gauss-Jordan elimination of the n by n matrix m, which is destroyed
+
+    for (size_t r = 0; r < n; ++r)
+        for (size_t c = 0; c < n; ++c)
+            inv[r * n + c] = r == c;
+
+    for (size_t c = 0; c < n; ++c) {
+        size_t pivot = c;
+        while (pivot < n && m[pivot * n + c] == 0)
+            pivot += 1;
+        if (pivot == n)
+            return false;
+
+        for (size_t j = 0; j < n; ++j) {
+            uint8_t t = m[c * n + j];
+            m[c * n + j] = m[pivot * n + j];
+            m[pivot * n + j] = t;
+            t = inv[c * n + j];
+            inv[c * n + j] = inv[pivot * n + j];
+            inv[pivot * n + j] = t;
+        }
+
+        uint8_t scale = gfInv[m[c * n + c]];
+        for (size_t j = 0; j < n; ++j) {
+            m[c * n + j] = gfMul(m[c * n + j], scale);
+            inv[c * n + j] = gfMul(inv[c * n + j], scale);
+        }
+
+        for (size_t r = 0; r < n; ++r) {
+            uint8_t f = m[r * n + c];
+            if (r == c || f == 0)
+                continue;
+            for (size_t j = 0; j < n; ++j) {
+                m[r * n + j] ^= gfMul(f, m[c * n + j]);
+                inv[r * n + j] ^= gfMul(f, inv[c * n + j]);
+            }
+        }
+    }
+
+    return true;
+}
+
+bool fec_decode(uint8_t *const *data, const bool *present, size_t k, size_t len,
+                const uint8_t *const *repair, const size_t *repairIndex, size_t repairNum)
+{
+    // With the missing symbols x_E and the first |E| repair symbols r_R,
+    //   C[R][E] x_E = r_R - C[R][present] x_present
+    // so x_E is the inverse of C[R][E] times those syndromes
+    size_t missing[FEC_MAX_SYMBOLS];
+    size_t e = 0;
+
+    for (size_t i = 0; i < k; ++i)
+        if (!present[i])
+            missing[e++] = i;
+
+    if (e == 0)
+        return true;
+    if (repairNum < e)
+        return false;
+
+    uint8_t *m = malloc(e * e);
+    uint8_t *inv = malloc(e * e);
+
+    for (size_t r = 0; r < e; ++r)
+        for (size_t c = 0; c < e; ++c)
+            m[r * e + c] = cauchy(repairIndex[r], missing[c]);
+
+    if (!invertMatrix(m, inv, e)) {
+        free(m);
+        free(inv);
+        return false;
+    }
+
+    uint8_t *syndromes = malloc(e * STRIP_LEN);
+
+    for (size_t off = 0; off < len; off += STRIP_LEN) {
+        size_t strip = len - off < STRIP_LEN ? len - off : STRIP_LEN;
+
+        for (size_t r = 0; r < e; ++r) {
+            uint8_t *s = syndromes + r * STRIP_LEN;
+
+            memcpy(s, repair[r] + off, strip);
+            for (size_t i = 0; i < k; ++i)
+                if (present[i])
+                    mulAdd(s, data[i] + off, cauchy(repairIndex[r], i), strip);
+        }
+
+        for (size_t c = 0; c < e; ++c) {
+            uint8_t *out = data[missing[c]] + off;
+
+            memset(out, 0, strip);
+            for (size_t r = 0; r < e; ++r)
+                mulAdd(out, syndromes + r * STRIP_LEN, inv[c * e + r], strip);
+        }
+    }
+
+    free(syndromes);
+    free(m);
+    free(inv);
+
+    return true;
+}
+
+#ifdef FEC_TEST
+
+#include <time.h>
+
+int checkKernels(void)
+{
+    // The vector kernel has to match the table walk for every coefficient
+    // on random data of random lengths and alignments
+
+    uint8_t src[4096 + 16], dst[4096 + 16], ref[4096 + 16];
+
+    if (!simdSupported()) {
+        printf("simd: not supported on this CPU\n");
+        return 0;
+    }
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(src); ++i)
+        src[i] = rand();
+
+    for (int trial = 0; trial < 10000; ++trial) {
+        size_t offset = rand() % 16;
+        size_t len = rand() % (sizeof(src) - offset);
+        uint8_t c = rand();
+
+        for (size_t i = 0; i < sizeof(dst); ++i)
+            dst[i] = ref[i] = rand();
+
+        mulAddSimd(dst + offset, src + offset, c, len);
+        mulAddScalar(ref + offset, src + offset, c, len);
+
+        if (memcmp(dst, ref, sizeof(dst)) != 0) {
+            printf("simd: differs from the reference for %zu bytes at offset %zu\n", len, offset);
+            return 1;
+        }
+    }
+
+    printf("simd: ok\n");
+    return 0;
+}
+
+int checkCode(void)
+{
+    // Erase up to m random data symbols of random groups and make sure
+    // a random choice of m repair symbols brings them back
+
+    for (int trial = 0; trial < 1000; ++trial) {
+        size_t k = 1 + rand() % 64;
+        size_t m = 1 + rand() % 16;
+        size_t len = 1 + rand() % 2048;
+        size_t spare = FEC_MAX_SYMBOLS - k - m;
+        size_t first = spare == 0 ? 0 : rand() % spare;
+        uint8_t *data[64], *orig[64], *repair[16];
+        size_t repairIndex[16];
+        bool present[64];
+
+        for (size_t i = 0; i < k; ++i) {
+            data[i] = malloc(len);
+            orig[i] = malloc(len);
+            for (size_t n = 0; n < len; ++n)
+                orig[i][n] = data[i][n] = rand();
+            present[i] = true;
+        }
+
+        for (size_t j = 0; j < m; ++j) {
+            repairIndex[j] = first + j;
+            repair[j] = malloc(len);
+            fec_encode((const uint8_t *const *) data, k, len, repairIndex[j], repair[j]);
+        }
+
+        size_t erased = rand() % (m + 1);
+        for (size_t j = 0; j < erased; ++j) {
+            size_t i = rand() % k;
+            present[i] = false;
+            memset(data[i], 0, len);
+        }
+
+        bool decoded = fec_decode(data, present, k, len, (const uint8_t *const *) repair,
+                                  repairIndex, m);
+
+        bool match = decoded;
+        for (size_t i = 0; i < k; ++i) {
+            match = match && memcmp(data[i], orig[i], len) == 0;
+            free(data[i]);
+            free(orig[i]);
+        }
+        for (size_t j = 0; j < m; ++j)
+            free(repair[j]);
+
+        if (!match) {
+            printf("code: group of %zu with %zu repair symbols didn't decode\n", k, m);
+            return 1;
+        }
+    }
+
+    printf("code: ok\n");
+    return 0;
+}
+
+double elapsedSince(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+void benchmark(size_t k, size_t m, size_t len)
+{
+    // Throughput counts the data symbols, encoding all m repair symbols
+    // and decoding with m of the data symbols lost
+
+    uint8_t *data[FEC_MAX_SYMBOLS], *repair[FEC_MAX_SYMBOLS];
+    size_t repairIndex[FEC_MAX_SYMBOLS];
+    bool present[FEC_MAX_SYMBOLS];
+    struct timespec start;
+    size_t rounds = (256 << 20) / (k * len) + 1;
+    double encodeTime, decodeTime;
+
+    for (size_t i = 0; i < k; ++i) {
+        data[i] = malloc(len);
+        for (size_t n = 0; n < len; ++n)
+            data[i][n] = rand();
+        present[i] = i >= m;
+    }
+    for (size_t j = 0; j < m; ++j) {
+        repair[j] = malloc(len);
+        repairIndex[j] = j;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t r = 0; r < rounds; ++r)
+        for (size_t j = 0; j < m; ++j)
+            fec_encode((const uint8_t *const *) data, k, len, j, repair[j]);
+    encodeTime = elapsedSince(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t r = 0; r < rounds; ++r)
+        fec_decode(data, present, k, len, (const uint8_t *const *) repair, repairIndex, m);
+    decodeTime = elapsedSince(&start);
+
+    printf("k=%zu m=%zu len=%zu: encode %.0f MB/s, decode %.0f MB/s\n", k, m, len,
+           rounds * k * len / encodeTime / 1e6, rounds * k * len / decodeTime / 1e6);
+
+    for (size_t i = 0; i < k; ++i)
+        free(data[i]);
+    for (size_t j = 0; j < m; ++j)
+        free(repair[j]);
+}
+
+int main(int argc, char **argv)
+{
+    if (checkKernels() != 0 || checkCode() != 0)
+        return 1;
+
+    // With -b, also measure how fast groups of typical shapes go through
+    if (argc < 2 || strcmp(argv[1], "-b") != 0)
+        return 0;
+
+    benchmark(16, 2, 0x8000);
+    benchmark(32, 4, 0x8000);
+    benchmark(64, 8, 0x8000);
+    benchmark(32, 4, 0x1000);
+
+    return 0;
+}
+
+#endif // FEC_TEST
@@ -0,0 +1,24 @@
+#ifndef fec_h_INCLUDED
+#define fec_h_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Systematic Reed-Solomon erasure code over GF(2^8). A group of k data
+// symbols of len bytes each is sent as is, followed by any number of
+// repair symbols. Receiving any k of the k + m symbols is enough to
+// rebuild the whole group, as long as k + m <= FEC_MAX_SYMBOLS.
+#define FEC_MAX_SYMBOLS 256
+
+// Computes repair symbol index of the group into repair
+void fec_encode(const uint8_t *const *data, size_t k, size_t len, size_t index,
+                uint8_t *repair);
+
+// Rebuilds the data symbols that aren't present in place from the given
+// repair symbols. Returns false, leaving data untouched, when there are
+// fewer repair symbols than missing data symbols.
+bool fec_decode(uint8_t *const *data, const bool *present, size_t k, size_t len,
+                const uint8_t *const *repair, const size_t *repairIndex, size_t repairNum);
+
+#endif // fec_h_INCLUDED
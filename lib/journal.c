@@ -0,0 +1,225 @@
+#include "journal.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "sha256_utils.h"
+
+void journal_path(char *path, size_t pathLen, const char *dir, const uint8_t shaSum[32])
+{
+    char shaStr[65];
+
+    sha256Str(shaStr, shaSum);
+    snprintf(path, pathLen, "%s/%s.journal", dir, shaStr);
+}
+
+bool bitmap_has(const uint8_t *bitmap, size_t bitmapLen, size_t i)
+{
+    return i / 8 < bitmapLen && (bitmap[i / 8] & (1 << (i % 8)));
+}
+
+static int readAll(int fd, uint8_t *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    ssize_t result;
+
+    while (done < len) {
+        result = pread(fd, buf + done, len - done, offset + done);
+        if (result <= 0)
+            return -1;
+        done += result;
+    }
+
+    return 0;
+}
+
+static int writeAll(int fd, const uint8_t *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    ssize_t result;
+
+    while (done < len) {
+        result = pwrite(fd, buf + done, len - done, offset + done);
+        if (result == -1)
+            return -1;
+        done += result;
+    }
+
+    return 0;
+}
+
+// Loads the journal if it belongs to the same transfer, returns -1 if it
+// doesn't (or can't be read) so a fresh one is started in its place
+static int loadJournal(Journal *journal)
+{
+    uint8_t header[JOURNAL_HEADER_SIZE];
+    uint64_t fileLen, numPackets, targetDev, targetIno;
+    uint32_t packetSize;
+
+    if (readAll(journal->fd, header, JOURNAL_HEADER_SIZE, 0) == -1)
+        return -1;
+
+    memcpy(&fileLen, header + 36, 8);
+    memcpy(&numPackets, header + 44, 8);
+    memcpy(&packetSize, header + 52, 4);
+    memcpy(&targetDev, header + 57, 8);
+    memcpy(&targetIno, header + 65, 8);
+
+    // Packets written somewhere else are of no use here
+    if (memcmp(header, JOURNAL_MAGIC, 4) != 0 || memcmp(header + 4, journal->shaSum, 32) != 0
+        || fileLen != journal->fileLen || numPackets != journal->numPackets
+        || packetSize != journal->packetSize || header[56] != journal->target
+        || targetDev != journal->targetDev || targetIno != journal->targetIno)
+        return -1;
+
+    if (readAll(journal->fd, journal->bitmap, journal->bitmapLen, JOURNAL_HEADER_SIZE) == -1)
+        return -1;
+
+    journal->received = 0;
+    for (size_t i = 0; i < journal->bitmapLen; ++i)
+        journal->received += __builtin_popcount(journal->bitmap[i]);
+
+    return 0;
+}
+
+static int createJournal(Journal *journal)
+{
+    uint8_t header[JOURNAL_HEADER_SIZE];
+
+    memcpy(header, JOURNAL_MAGIC, 4);
+    memcpy(header + 4, journal->shaSum, 32);
+    memcpy(header + 36, &journal->fileLen, 8);
+    memcpy(header + 44, &journal->numPackets, 8);
+    memcpy(header + 52, &journal->packetSize, 4);
+    header[56] = journal->target;
+    memcpy(header + 57, &journal->targetDev, 8);
+    memcpy(header + 65, &journal->targetIno, 8);
+
+    memset(journal->bitmap, 0, journal->bitmapLen);
+    journal->received = 0;
+
+    if (ftruncate(journal->fd, 0) == -1
+        || writeAll(journal->fd, header, JOURNAL_HEADER_SIZE, 0) == -1
+        || writeAll(journal->fd, journal->bitmap, journal->bitmapLen, JOURNAL_HEADER_SIZE) == -1
+        || fsync(journal->fd) == -1)
+        return -1;
+
+    return 0;
+}
+
+int journal_open(Journal *journal, const char *path, const uint8_t shaSum[32],
+                 uint64_t fileLen, uint64_t numPackets, uint32_t packetSize, uint8_t target,
+                 int targetfd)
+{
+    struct stat st;
+
+    if (fstat(targetfd, &st) == -1)
+        return -1;
+
+    journal->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (journal->fd == -1)
+        return -1;
+
+    memcpy(journal->shaSum, shaSum, 32);
+    journal->fileLen = fileLen;
+    journal->numPackets = numPackets;
+    journal->packetSize = packetSize;
+    journal->target = target;
+    journal->targetDev = st.st_dev;
+    journal->targetIno = st.st_ino;
+    journal->bitmapLen = numPackets / 8 + (numPackets % 8 == 0 ? 0 : 1);
+    journal->bitmap = calloc(journal->bitmapLen + 1, 1);
+    journal->dirtyLo = journal->bitmapLen;
+    journal->dirtyHi = 0;
+    journal->pending = 0;
+
+    if (loadJournal(journal) == 0)
+        return 0;
+
+    if (createJournal(journal) == -1) {
+        int err = errno;
+        journal_close(journal);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+bool journal_has(const Journal *journal, size_t i)
+{
+    return bitmap_has(journal->bitmap, journal->bitmapLen, i);
+}
+
+// Only updates the in-memory bitmap. The caller makes the packet data
+// durable before calling journal_sync, so the journal on disk never claims
+// a packet that could be lost in a power cycle.
+void journal_mark(Journal *journal, size_t i)
+{
+    if (journal_has(journal, i))
+        return;
+
+    journal->bitmap[i / 8] |= 1 << (i % 8);
+    journal->received += 1;
+    journal->pending += 1;
+
+    if (i / 8 < journal->dirtyLo)
+        journal->dirtyLo = i / 8;
+    if (i / 8 + 1 > journal->dirtyHi)
+        journal->dirtyHi = i / 8 + 1;
+}
+
+// For packets found to be bad after the fact, so the next attempt asks for
+// them again
+void journal_unmark(Journal *journal, size_t i)
+{
+    if (!journal_has(journal, i))
+        return;
+
+    journal->bitmap[i / 8] &= ~(1 << (i % 8));
+    journal->received -= 1;
+    journal->pending += 1;
+
+    if (i / 8 < journal->dirtyLo)
+        journal->dirtyLo = i / 8;
+    if (i / 8 + 1 > journal->dirtyHi)
+        journal->dirtyHi = i / 8 + 1;
+}
+
+int journal_sync(Journal *journal)
+{
+    if (journal->dirtyLo >= journal->dirtyHi)
+        return 0;
+
+    // While packets arrive bits only go from unset to set, so a torn write
+    // still leaves a bitmap that is valid for data that was synced before
+    // it. Unset bits only ever make the next attempt resend more. Bits are
+    // only cleared by journal_unmark once the whole file failed to verify,
+    // and a torn write of those can leave some of the bad packets marked.
+    // The next attempt verifies the file again and clears them again.
+    if (writeAll(journal->fd, journal->bitmap + journal->dirtyLo,
+                 journal->dirtyHi - journal->dirtyLo,
+                 JOURNAL_HEADER_SIZE + journal->dirtyLo) == -1
+        || fdatasync(journal->fd) == -1)
+        return -1;
+
+    journal->dirtyLo = journal->bitmapLen;
+    journal->dirtyHi = 0;
+    journal->pending = 0;
+
+    return 0;
+}
+
+void journal_close(Journal *journal)
+{
+    close(journal->fd);
+    free(journal->bitmap);
+    journal->fd = -1;
+    journal->bitmap = NULL;
+}
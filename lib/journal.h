@@ -0,0 +1,64 @@
+#ifndef journal_h_INCLUDED
+#define journal_h_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// On-disk record of which packets of a transfer have been received, so an
+// interrupted transfer can pick up where it left off.
+//
+// Journal file format:
+//  * 4 bytes for JOURNAL_MAGIC
+//  * 32 bytes for the transfer's sha256sum
+//  * 8 bytes for file size in bytes
+//  * 8 bytes for number of packets
+//  * 4 bytes for packet size in bytes
+//  * 1 byte for where packets are written, JOURNAL_TARGET_PACKETS or
+//    JOURNAL_TARGET_FILE
+//  * 8 bytes for the device of the directory or file they are written to
+//  * 8 bytes for its inode
+//  * ceil(packets / 8) bytes of bitmap, bit i % 8 of byte i / 8 set once
+//    packet i has been received and written out
+
+#define JOURNAL_MAGIC       "PFTJ"
+#define JOURNAL_HEADER_SIZE 73
+
+// A <dir>/<i>.pkt file per packet, or one output file
+#define JOURNAL_TARGET_PACKETS 0
+#define JOURNAL_TARGET_FILE    1
+
+typedef struct {
+    int fd;
+    uint8_t shaSum[32];
+    uint64_t fileLen;
+    uint64_t numPackets;
+    uint32_t packetSize;
+    uint8_t target;
+    uint64_t targetDev;
+    uint64_t targetIno;
+    uint8_t *bitmap;
+    size_t bitmapLen;
+    size_t received;
+    // Bitmap bytes [dirtyLo, dirtyHi) changed since the last sync
+    size_t dirtyLo, dirtyHi;
+    size_t pending;
+} Journal;
+
+void journal_path(char *path, size_t pathLen, const char *dir, const uint8_t shaSum[32]);
+
+// Picks up the journal at path if it is for the same transfer written to
+// the same place, targetfd being the open directory or file, and starts a
+// fresh one otherwise. Returns -1 with errno set on error.
+int journal_open(Journal *journal, const char *path, const uint8_t shaSum[32],
+                 uint64_t fileLen, uint64_t numPackets, uint32_t packetSize, uint8_t target,
+                 int targetfd);
+bool journal_has(const Journal *journal, size_t i);
+void journal_mark(Journal *journal, size_t i);
+void journal_unmark(Journal *journal, size_t i);
+int journal_sync(Journal *journal);
+void journal_close(Journal *journal);
+
+bool bitmap_has(const uint8_t *bitmap, size_t bitmapLen, size_t i);
+
+#endif // journal_h_INCLUDED
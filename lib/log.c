@@ -0,0 +1,3 @@
+#include "log.h"
+
+int log_level = LOG_LEVEL_INFO;
@@ -0,0 +1,38 @@
+#ifndef log_h_INCLUDED
+#define log_h_INCLUDED
+
+#include <stdio.h>
+
+// Progress messages by how much they say. Errors that end the program are
+// always printed and aren't logged through these.
+//  * LOG_LEVEL_WARN for a transfer recovering from something, a frame sent
+//    again, a checksum that didn't match or a stream resynchronised
+//  * LOG_LEVEL_INFO for the steps of a transfer, the default
+//  * LOG_LEVEL_DEBUG for every packet sent and received
+//
+// Messages above LOG_MAX_LEVEL aren't compiled in at all, so building with
+// a lower one takes the per packet messages off the hot path entirely.
+// Below it log_level decides at run time.
+
+#define LOG_LEVEL_QUIET 0
+#define LOG_LEVEL_WARN  1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_DEBUG 3
+
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+extern int log_level;
+
+#define LOG_AT(level, ...) \
+    do { \
+        if ((level) <= LOG_MAX_LEVEL && (level) <= log_level) \
+            printf(__VA_ARGS__); \
+    } while (0)
+
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...)  LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif // log_h_INCLUDED
@@ -0,0 +1,140 @@
+#include "merkle.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "sha256.h"
+
+void merkle_leaf(const uint8_t *data, size_t len, uint8_t leaf[32])
+{
+    const uint8_t prefix = MERKLE_LEAF_PREFIX;
+    SHA256_CTX shaCtx;
+
+    sha256_init(&shaCtx);
+    sha256_update(&shaCtx, &prefix, 1);
+    sha256_update(&shaCtx, data, len);
+    sha256_final(&shaCtx, (BYTE *) leaf);
+}
+
+static void hashNode(const uint8_t left[32], const uint8_t right[32], uint8_t node[32])
+{
+    const uint8_t prefix = MERKLE_NODE_PREFIX;
+    SHA256_CTX shaCtx;
+
+    sha256_init(&shaCtx);
+    sha256_update(&shaCtx, &prefix, 1);
+    sha256_update(&shaCtx, left, 32);
+    sha256_update(&shaCtx, right, 32);
+    sha256_final(&shaCtx, (BYTE *) node);
+}
+
+void merkle_root(const uint8_t (*leaves)[32], size_t leafNum, uint8_t root[32])
+{
+    // An empty file has the leaf of no data as its root
+    if (leafNum == 0) {
+        merkle_leaf(NULL, 0, root);
+        return;
+    }
+
+    // Each level is built in place over the one below it
+    uint8_t (*level)[32] = malloc(leafNum * 32);
+    size_t levelNum = leafNum;
+
+    memcpy(level, leaves, leafNum * 32);
+
+    while (levelNum > 1) {
+        size_t i;
+
+        for (i = 0; i + 1 < levelNum; i += 2)
+            hashNode(level[i], level[i + 1], level[i / 2]);
+        if (i < levelNum)
+            memcpy(level[i / 2], level[i], 32);
+
+        levelNum = (levelNum + 1) / 2;
+    }
+
+    memcpy(root, level[0], 32);
+    free(level);
+}
+
+// Threads take interleaved packets, thread t hashes packets t, t + n, ...
+typedef struct {
+    int fd;
+    size_t fileLen;
+    size_t packetSize;
+    uint8_t (*leaves)[32];
+    size_t first;
+    size_t step;
+    bool failed;
+} LeafWorker;
+
+static void* hashLeaves(void *arg)
+{
+    LeafWorker *worker = arg;
+    uint8_t *buf = malloc(worker->packetSize);
+    size_t leafNum = worker->fileLen / worker->packetSize
+                     + (worker->fileLen % worker->packetSize == 0 ? 0 : 1);
+
+    for (size_t i = worker->first; i < leafNum; i += worker->step) {
+        off_t offset = (off_t) i * worker->packetSize;
+        size_t len = worker->fileLen - offset > worker->packetSize ? worker->packetSize
+                                                                   : worker->fileLen - offset;
+        size_t done = 0;
+
+        while (done < len) {
+            ssize_t result = pread(worker->fd, buf + done, len - done, offset + done);
+            if (result <= 0) {
+                worker->failed = true;
+                free(buf);
+                return NULL;
+            }
+            done += result;
+        }
+
+        merkle_leaf(buf, len, worker->leaves[i]);
+    }
+
+    free(buf);
+
+    return NULL;
+}
+
+// Hashes every packet of the file into leaves using up to threadNum
+// threads. Returns -1 if the file couldn't be read.
+int merkle_file_leaves(int fd, size_t fileLen, size_t packetSize, uint8_t (*leaves)[32],
+                       int threadNum)
+{
+    if (threadNum < 1)
+        threadNum = 1;
+
+    pthread_t threads[threadNum];
+    LeafWorker workers[threadNum];
+    int started = 0;
+    int result = 0;
+
+    for (int t = 0; t < threadNum; ++t) {
+        workers[t] = (LeafWorker) { fd, fileLen, packetSize, leaves, t, threadNum, false };
+        if (pthread_create(&threads[t], NULL, hashLeaves, &workers[t]) != 0)
+            break;
+        started += 1;
+    }
+
+    // Whatever threads didn't start get their packets hashed here
+    for (int t = started; t < threadNum; ++t) {
+        hashLeaves(&workers[t]);
+        if (workers[t].failed)
+            result = -1;
+    }
+
+    for (int t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+        if (workers[t].failed)
+            result = -1;
+    }
+
+    return result;
+}
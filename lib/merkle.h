@@ -0,0 +1,23 @@
+#ifndef merkle_h_INCLUDED
+#define merkle_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Merkle tree over the packets of a file, so each packet can be checked on
+// its own against a root hash from the transfer header.
+//
+// Leaves are sha256(0x00 || packet data) and inner nodes are
+// sha256(0x01 || left || right). A node without a sibling moves up a level
+// unchanged. The prefixes keep a leaf from ever being mistaken for a node.
+
+#define MERKLE_LEAF_PREFIX 0x00
+#define MERKLE_NODE_PREFIX 0x01
+
+void merkle_leaf(const uint8_t *data, size_t len, uint8_t leaf[32]);
+void merkle_root(const uint8_t (*leaves)[32], size_t leafNum, uint8_t root[32]);
+
+int merkle_file_leaves(int fd, size_t fileLen, size_t packetSize, uint8_t (*leaves)[32],
+                       int threadNum);
+
+#endif // merkle_h_INCLUDED
@@ -0,0 +1,319 @@
+#include "metrics.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+Metrics metrics;
+
+static const char *const counterNames[METRIC_COUNTER_NUM] = {
+    "packets", "payload_bytes", "wire_bytes", "retransmits", "crc_failures", "resyncs"
+};
+
+static const char *const histogramNames[METRIC_HISTOGRAM_NUM] = {
+    "rtt", "disk_write", "read_blocked", "write_blocked"
+};
+
+// The reporting thread and what it needs
+static struct {
+    bool running;
+    FILE *fp;
+    double interval;
+    int listenfd;
+    char *socketPath;
+    // Written to by metrics_stop to wake the thread up
+    int wakefd[2];
+    pthread_t thread;
+    uint64_t startNs;
+    // Counters as of the last line to the file, for its rates
+    uint64_t lastCounters[METRIC_COUNTER_NUM];
+    uint64_t lastNs;
+} reporter;
+
+static unsigned bucketOf(uint64_t ns)
+{
+    if (ns < 8)
+        return ns;
+
+    unsigned msb = 63 - __builtin_clzll(ns);
+    return (msb - 2) * 8 + ((ns >> (msb - 3)) & 7);
+}
+
+static double bucketMiddle(unsigned bucket)
+{
+    if (bucket < 8)
+        return bucket;
+
+    unsigned shift = bucket / 8 - 1;
+    return (double) ((uint64_t) (8 | bucket % 8) << shift) + ((uint64_t) 1 << shift) / 2.0;
+}
+
+void metrics_observe(MetricHistogram histogram, uint64_t ns)
+{
+    Histogram *h = &metrics.histograms[histogram];
+
+    if (!metrics.timing)
+        return;
+
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->buckets[bucketOf(ns)], 1, memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, ns,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed))
+        ;
+}
+
+static uint64_t nowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static double percentile(const uint64_t *buckets, uint64_t count, double p)
+{
+    uint64_t rank = (uint64_t) (p * count);
+    uint64_t seen = 0;
+
+    for (unsigned b = 0; b < METRIC_BUCKETS; ++b) {
+        seen += buckets[b];
+        if (seen > rank)
+            return bucketMiddle(b);
+    }
+
+    return 0;
+}
+
+static void writeHistogram(FILE *out, const Histogram *h)
+{
+    // Counted from a copy of the buckets so the percentiles agree with the
+    // count even while more are being added
+    uint64_t buckets[METRIC_BUCKETS];
+    uint64_t count = 0;
+
+    for (unsigned b = 0; b < METRIC_BUCKETS; ++b) {
+        buckets[b] = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        count += buckets[b];
+    }
+
+    uint64_t sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+    double max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    double p50 = percentile(buckets, count, 0.5);
+    double p90 = percentile(buckets, count, 0.9);
+    double p99 = percentile(buckets, count, 0.99);
+
+    fprintf(out, "{\"count\": %llu, \"sum_ms\": %.3f, \"mean_us\": %.1f, \"p50_us\": %.1f, "
+            "\"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}", (unsigned long long) count,
+            sum / 1e6, count > 0 ? sum / 1e3 / count : 0, (p50 < max ? p50 : max) / 1e3,
+            (p90 < max ? p90 : max) / 1e3, (p99 < max ? p99 : max) / 1e3, max / 1e3);
+}
+
+static char* formatLine(uint64_t *sinceCounters, uint64_t *sinceNs, bool final, size_t *len)
+{
+    // One line of everything, with rates since the counters and time
+    // given, which are moved on to now
+    char *line = NULL;
+    FILE *out = open_memstream(&line, len);
+    if (out == NULL)
+        return NULL;
+
+    uint64_t now = nowNs();
+    uint64_t counters[METRIC_COUNTER_NUM];
+    double seconds = (now - *sinceNs) / 1e9;
+
+    for (int c = 0; c < METRIC_COUNTER_NUM; ++c)
+        counters[c] = atomic_load_explicit(&metrics.counters[c], memory_order_relaxed);
+
+    fprintf(out, "{\"elapsed_s\": %.3f", (now - reporter.startNs) / 1e9);
+    for (int c = 0; c < METRIC_COUNTER_NUM; ++c)
+        fprintf(out, ", \"%s\": %llu", counterNames[c], (unsigned long long) counters[c]);
+
+    fprintf(out, ", \"packets_per_s\": %.1f, \"goodput_bytes_per_s\": %.1f",
+            seconds > 0 ? (counters[METRIC_PACKETS] - sinceCounters[METRIC_PACKETS]) / seconds
+                        : 0,
+            seconds > 0 ? (counters[METRIC_PAYLOAD_BYTES]
+                           - sinceCounters[METRIC_PAYLOAD_BYTES]) / seconds
+                        : 0);
+
+    for (int h = 0; h < METRIC_HISTOGRAM_NUM; ++h) {
+        fprintf(out, ", \"%s\": ", histogramNames[h]);
+        writeHistogram(out, &metrics.histograms[h]);
+    }
+
+    fprintf(out, ", \"final\": %s}\n", final ? "true" : "false");
+    fclose(out);
+
+    memcpy(sinceCounters, counters, sizeof(counters));
+    *sinceNs = now;
+    return line;
+}
+
+static void writeFileLine(bool final)
+{
+    size_t len;
+    char *line = formatLine(reporter.lastCounters, &reporter.lastNs, final, &len);
+
+    if (line != NULL) {
+        fwrite(line, 1, len, reporter.fp);
+        fflush(reporter.fp);
+    }
+    free(line);
+}
+
+static void answerConnection(void)
+{
+    // Connections get rates over the whole transfer so far
+    uint64_t sinceCounters[METRIC_COUNTER_NUM] = { 0 };
+    uint64_t sinceNs = reporter.startNs;
+    size_t len;
+
+    int fd = accept(reporter.listenfd, NULL, NULL);
+    if (fd == -1)
+        return;
+
+    char *line = formatLine(sinceCounters, &sinceNs, false, &len);
+    if (line != NULL)
+        send(fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    free(line);
+    close(fd);
+}
+
+static void* report(void *arg)
+{
+    (void) arg;
+    uint64_t nextNs = reporter.startNs + (uint64_t) (reporter.interval * 1e9);
+
+    while (true) {
+        struct pollfd pfds[2] = { { reporter.wakefd[0], POLLIN, 0 },
+                                  { reporter.listenfd, POLLIN, 0 } };
+        int waitMs = -1;
+
+        if (reporter.fp != NULL) {
+            uint64_t now = nowNs();
+            waitMs = nextNs > now ? (int) ((nextNs - now + 999999) / 1000000) : 0;
+        }
+
+        if (poll(pfds, reporter.listenfd != -1 ? 2 : 1, waitMs) == -1 && errno != EINTR)
+            break;
+
+        if (pfds[0].revents & POLLIN)
+            break;
+        if (pfds[1].revents & POLLIN)
+            answerConnection();
+
+        if (reporter.fp != NULL && nowNs() >= nextNs) {
+            writeFileLine(false);
+            nextNs += (uint64_t) (reporter.interval * 1e9);
+        }
+    }
+
+    return NULL;
+}
+
+static int listenOn(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    // One left behind by an earlier run that didn't get to remove it
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 4) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int metrics_start(FILE *fp, double interval, const char *socketPath)
+{
+    if (reporter.running) {
+        errno = EALREADY;
+        return -1;
+    }
+
+    reporter.fp = fp;
+    reporter.interval = interval > 0 ? interval : 1;
+    reporter.listenfd = -1;
+    reporter.socketPath = NULL;
+    reporter.startNs = nowNs();
+    reporter.lastNs = reporter.startNs;
+    memset(reporter.lastCounters, 0, sizeof(reporter.lastCounters));
+
+    if (socketPath != NULL) {
+        reporter.listenfd = listenOn(socketPath);
+        reporter.socketPath = strdup(socketPath);
+        if (reporter.listenfd == -1 || reporter.socketPath == NULL)
+            goto fail;
+    }
+
+    if (pipe(reporter.wakefd) == -1)
+        goto fail;
+
+    metrics.timing = true;
+
+    int result = pthread_create(&reporter.thread, NULL, report, NULL);
+    if (result != 0) {
+        metrics.timing = false;
+        close(reporter.wakefd[0]);
+        close(reporter.wakefd[1]);
+        errno = result;
+        goto fail;
+    }
+
+    reporter.running = true;
+    return 0;
+
+fail:
+    if (reporter.listenfd != -1) {
+        close(reporter.listenfd);
+        unlink(socketPath);
+    }
+    free(reporter.socketPath);
+    return -1;
+}
+
+void metrics_stop(void)
+{
+    if (!reporter.running)
+        return;
+
+    uint8_t wake = 0;
+    if (write(reporter.wakefd[1], &wake, 1) == 1)
+        pthread_join(reporter.thread, NULL);
+
+    if (reporter.fp != NULL)
+        writeFileLine(true);
+
+    close(reporter.wakefd[0]);
+    close(reporter.wakefd[1]);
+    if (reporter.listenfd != -1) {
+        close(reporter.listenfd);
+        unlink(reporter.socketPath);
+    }
+    free(reporter.socketPath);
+
+    metrics.timing = false;
+    reporter.running = false;
+}
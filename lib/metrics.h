@@ -0,0 +1,109 @@
+#ifndef metrics_h_INCLUDED
+#define metrics_h_INCLUDED
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <time.h>
+
+// Counters and latency histograms for a running transfer, kept in one
+// global so any part of a tool can add to them. Counting is a relaxed
+// atomic add, cheap enough for every packet, and can happen from any
+// thread. Latencies are only timed once metrics_start has been called, so
+// a tool that isn't reporting them doesn't read the clock for them either.
+//
+// Histograms are log-linear over nanoseconds: a bucket for every eighth of
+// every power of two, so a percentile read off them is within 12.5%.
+//
+// metrics_start reports them as one JSON object per line, every so often
+// to a file and to every connection made to a Unix socket:
+//  * elapsed_s, seconds since metrics_start
+//  * every counter, under its name
+//  * packets_per_s and goodput_bytes_per_s, over the time since the last
+//    line to the file, or since the start for a socket
+//  * every histogram under its name, as count, sum_ms, mean_us, p50_us,
+//    p90_us, p99_us and max_us
+//  * final, true on the line written by metrics_stop
+
+typedef enum {
+    // Data frames sent, or packets stored
+    METRIC_PACKETS,
+    // File bytes the receiver has acknowledged, or stored
+    METRIC_PAYLOAD_BYTES,
+    // Every byte written to the serial port
+    METRIC_WIRE_BYTES,
+    METRIC_RETRANSMITS,
+    METRIC_CRC_FAILURES,
+    METRIC_RESYNCS,
+    METRIC_COUNTER_NUM
+} MetricCounter;
+
+typedef enum {
+    // From sending a frame to its answer
+    METRIC_RTT,
+    // Waiting on writes to the output file, the whole write when it is
+    // synchronous and waits for completions when it isn't
+    METRIC_DISK_WRITE,
+    // Waiting in poll and read on the serial port
+    METRIC_READ_BLOCKED,
+    // Waiting in write on the serial port
+    METRIC_WRITE_BLOCKED,
+    METRIC_HISTOGRAM_NUM
+} MetricHistogram;
+
+#define METRIC_BUCKETS 496
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[METRIC_BUCKETS];
+} Histogram;
+
+typedef struct {
+    // Whether latencies are being timed
+    bool timing;
+    _Atomic uint64_t counters[METRIC_COUNTER_NUM];
+    Histogram histograms[METRIC_HISTOGRAM_NUM];
+} Metrics;
+
+extern Metrics metrics;
+
+static inline void metrics_count(MetricCounter counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(&metrics.counters[counter], n, memory_order_relaxed);
+}
+
+void metrics_observe(MetricHistogram histogram, uint64_t ns);
+
+// Where a latency starts, 0 when nothing is being timed
+static inline uint64_t metrics_timer(void)
+{
+    struct timespec now;
+
+    if (!metrics.timing)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Records the time since start, from metrics_timer, in histogram
+static inline void metrics_elapsed(MetricHistogram histogram, uint64_t start)
+{
+    if (start != 0)
+        metrics_observe(histogram, metrics_timer() - start);
+}
+
+// Starts timing latencies and reporting everything, a line to fp every
+// interval seconds if fp isn't NULL, and a line to every connection to a
+// Unix socket at socketPath if that isn't NULL. Returns -1 with errno set
+// if the socket or the thread reporting can't be set up.
+int metrics_start(FILE *fp, double interval, const char *socketPath);
+
+// Writes a last line to the file, stops reporting and removes the socket
+void metrics_stop(void);
+
+#endif // metrics_h_INCLUDED
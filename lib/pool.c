@@ -0,0 +1,66 @@
+#include "pool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Buffers start on cache lines so neighbours being filled by different
+// threads don't share one
+#define POOL_ALIGN 64
+
+int pool_init(BufferPool *pool, size_t bufSize, size_t bufNum)
+{
+    return pool_init_aligned(pool, bufSize, bufNum, POOL_ALIGN);
+}
+
+int pool_init_aligned(BufferPool *pool, size_t bufSize, size_t bufNum, size_t align)
+{
+    pool->bufSize = (bufSize + align - 1) / align * align;
+    pool->bufNum = bufNum;
+    pool->freeNum = bufNum;
+    pool->align = align;
+
+    if (posix_memalign((void **) &pool->arena, align, pool->bufSize * bufNum) != 0)
+        return -1;
+
+    pool->freeList = malloc(bufNum * sizeof(uint8_t *));
+    if (pool->freeList == NULL && bufNum > 0) {
+        free(pool->arena);
+        return -1;
+    }
+
+    // Handed out from the start of the arena first
+    for (size_t i = 0; i < bufNum; ++i)
+        pool->freeList[i] = pool->arena + (bufNum - 1 - i) * pool->bufSize;
+
+    return 0;
+}
+
+void pool_destroy(BufferPool *pool)
+{
+    free(pool->arena);
+    free(pool->freeList);
+}
+
+uint8_t* pool_get(BufferPool *pool)
+{
+    uint8_t *buf;
+
+    if (pool->freeNum > 0)
+        return pool->freeList[--pool->freeNum];
+
+    if (posix_memalign((void **) &buf, pool->align, pool->bufSize) != 0)
+        return NULL;
+
+    return buf;
+}
+
+void pool_put(BufferPool *pool, uint8_t *buf)
+{
+    uintptr_t offset = (uintptr_t) buf - (uintptr_t) pool->arena;
+
+    if (offset < pool->bufSize * pool->bufNum)
+        pool->freeList[pool->freeNum++] = buf;
+    else
+        free(buf);
+}
@@ -0,0 +1,32 @@
+#ifndef pool_h_INCLUDED
+#define pool_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fixed set of equally sized buffers carved out of one allocation, handed
+// out and taken back through a free list so packets can be read and framed
+// without touching the heap. When every buffer is in use pool_get falls
+// back to malloc, and pool_put frees those again, so a pool that turns out
+// too small only costs speed. Not thread safe.
+typedef struct {
+    uint8_t *arena;
+    size_t bufSize;
+    size_t bufNum;
+    size_t align;
+    uint8_t **freeList;
+    size_t freeNum;
+} BufferPool;
+
+// Returns -1 if the arena can't be allocated
+int pool_init(BufferPool *pool, size_t bufSize, size_t bufNum);
+// The same, with every buffer starting on a multiple of align, a power of
+// two, as O_DIRECT needs
+int pool_init_aligned(BufferPool *pool, size_t bufSize, size_t bufNum, size_t align);
+void pool_destroy(BufferPool *pool);
+
+// Returns a buffer of at least bufSize bytes
+uint8_t* pool_get(BufferPool *pool);
+void pool_put(BufferPool *pool, uint8_t *buf);
+
+#endif // pool_h_INCLUDED
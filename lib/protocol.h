@@ -1,8 +1,12 @@
 #ifndef protocol_h_INCLUDED
 #define protocol_h_INCLUDED
 
-// 2^15 bytes, 32 kb
-#define PACKET_SIZE 0x8000
+// The packet size is chosen by the sender and carried in the header, this
+// is what it uses unless told otherwise. 2^15 bytes, 32 kb
+#define DEFAULT_PACKET_SIZE 0x8000
+
+// Receivers reject packets, and adaptive frames, any larger than this, 1 mb
+#define MAX_PACKET_SIZE 0x100000
 
 #define TRANSFER_START  1
 #define TRANSFER_PACKET 2
@@ -11,5 +15,94 @@
 #define TRANSFER_END    5
 #define TRANSFER_ERROR  6
 
-#endif // protocol_h_INCLUDED
+// The receiver gives up on a transfer with TRANSFER_ERROR followed by the
+// crc32sum of that one byte. Any other answer corrupted into TRANSFER_ERROR,
+// or into TRANSFER_END, is handled like the corrupted answer it is. Streamed
+// transfers end the same way: the receiver accepts the trailer, and the
+// sender has the last word after it, with TRANSFER_END and its crc32sum.
+#define TRANSFER_SEALED_SIZE 5
+
+// Windowed (selective repeat) transfers. Every packet carries its sequence
+// number and is acknowledged individually, so several packets can be in
+// flight at once.
+#define TRANSFER_WINDOW_PACKET 7
+#define TRANSFER_ACK           8
+#define TRANSFER_NAK           9
+
+// Per-packet hashes for transfers with TRANSFER_FLAG_MERKLE, sent after the
+// header reply in chunks of at most MAX_LEAVES. The receiver answers each
+// with a TRANSFER_LEAVES of its own saying how many it has so far, and the
+// sender carries on from there.
+#define TRANSFER_LEAVES 10
+#define MAX_LEAVES      256
+
+// Adaptive transfers send frames of a varying number of consecutive
+// packets, placed by their file offset and answered like stop-and-wait
+// packets with TRANSFER_NEXT or TRANSFER_AGAIN
+#define TRANSFER_OFFSET_PACKET 11
+
+// Forward error corrected transfers send groups of windowed packets without
+// waiting for answers, followed by Reed-Solomon repair packets and a group
+// end. The receiver rebuilds lost packets from the repair packets and
+// answers the group end with TRANSFER_GROUP_STATUS, naming only the packets
+// it couldn't rebuild.
+#define TRANSFER_REPAIR_PACKET 12
+#define TRANSFER_GROUP_END     13
+#define TRANSFER_GROUP_STATUS  14
+
+// Sent when the answer to a packet hasn't arrived within the retransmission
+// timeout, listing the packets still waiting on one. The receiver answers
+// with a TRANSFER_QUERY of its own saying which of them it has, so a lost
+// answer isn't mistaken for a lost packet and only what didn't arrive is
+// sent again. Answers echo the query's id, stale ones are ignored.
+//
+// Transfers of known length end with a bare TRANSFER_END from the sender
+// once everything is answered. Until then the receiver keeps answering,
+// even after it has every packet.
+#define TRANSFER_QUERY 15
 
+// Asked for by a sender with a new version of a file before its header,
+// answered by the receiver with signatures of the copy it already has so
+// only what changed has to be sent, see delta.h. Each answer carries the
+// signatures of at most MAX_SIGNATURES blocks from the one asked for, so a
+// damaged answer only costs that many again. Requests are made again until
+// an undamaged answer comes back.
+#define TRANSFER_SIGNATURES 16
+#define MAX_SIGNATURES      1024
+
+// Transfer modes, proposed by the sender in the TRANSFER_START header and
+// confirmed (or downgraded) by the receiver's reply
+#define TRANSFER_MODE_STOP_WAIT 0
+#define TRANSFER_MODE_WINDOW    1
+#define TRANSFER_MODE_ADAPTIVE  2
+#define TRANSFER_MODE_FEC       3
+
+// Header flags
+//  * TRANSFER_FLAG_TRAILER: the file was streamed from a source of unknown
+//    length, its size, packet count and sha256sum follow the last packet in
+//    a checksummed TRANSFER_END trailer instead of being in the header
+//  * TRANSFER_FLAG_MERKLE: the header carries the root of a merkle tree over
+//    the packets and TRANSFER_LEAVES follows the header reply, so every
+//    packet can be verified on its own as it arrives
+//  * TRANSFER_FLAG_BATCH: the file is a batch of files as laid out in
+//    batch.h, which the receiver unpacks once it has all arrived
+//  * TRANSFER_FLAG_DELTA: the file is a delta as laid out in delta.h,
+//    against the copy the receiver sent signatures of, which the receiver
+//    applies once it has all arrived
+#define TRANSFER_FLAG_TRAILER 0x01
+#define TRANSFER_FLAG_MERKLE  0x02
+#define TRANSFER_FLAG_BATCH   0x04
+#define TRANSFER_FLAG_DELTA   0x08
+
+// The header also proposes one of the COMPRESS_* codecs from compress.h,
+// which the receiver accepts or turns down to COMPRESS_NONE. Once accepted,
+// the data of every packet and adaptive frame is a compressed payload
+// carrying its uncompressed length. Packets are checked and stored
+// uncompressed, so the journal, merkle leaves and repair symbols don't
+// change.
+
+// Upper bound on the number of unacknowledged packets in windowed mode, and
+// on the number of packets in a forward error corrected group
+#define MAX_WINDOW_SIZE 256
+
+#endif // protocol_h_INCLUDED
@@ -0,0 +1,206 @@
+#include "reader.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+static int64_t nowMs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int reader_init(SerialReader *rd, int fd, size_t capacity)
+{
+    rd->fd = fd;
+    rd->capacity = capacity;
+    rd->start = 0;
+    rd->end = 0;
+    rd->deadlineMs = 0;
+
+    rd->buf = malloc(capacity);
+    return rd->buf == NULL ? -1 : 0;
+}
+
+void reader_destroy(SerialReader *rd)
+{
+    free(rd->buf);
+}
+
+int reader_reserve(SerialReader *rd, size_t capacity)
+{
+    if (capacity <= rd->capacity)
+        return 0;
+
+    uint8_t *buf = realloc(rd->buf, capacity);
+    if (buf == NULL)
+        return -1;
+
+    rd->buf = buf;
+    rd->capacity = capacity;
+    return 0;
+}
+
+void reader_set_deadline(SerialReader *rd, double seconds)
+{
+    rd->deadlineMs = seconds > 0 ? nowMs() + (int64_t) (seconds * 1000) : 0;
+}
+
+size_t reader_available(const SerialReader *rd)
+{
+    return rd->end - rd->start;
+}
+
+const uint8_t* reader_data(const SerialReader *rd)
+{
+    return rd->buf + rd->start;
+}
+
+static void compact(SerialReader *rd)
+{
+    memmove(rd->buf, rd->buf + rd->start, rd->end - rd->start);
+    rd->end -= rd->start;
+    rd->start = 0;
+}
+
+static ssize_t readSome(const SerialReader *rd, uint8_t *buf, size_t len, int timeoutMs)
+{
+    struct pollfd pfd = { rd->fd, POLLIN, 0 };
+    ssize_t result;
+    bool capped;
+
+    do {
+        // Waits never run past the deadline
+        int waitMs = timeoutMs;
+        capped = false;
+
+        if (rd->deadlineMs != 0) {
+            int64_t left = rd->deadlineMs - nowMs();
+            if (left <= 0) {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+            if (waitMs < 0 || left < waitMs) {
+                waitMs = left > INT_MAX ? INT_MAX : (int) left;
+                capped = true;
+            }
+        }
+
+        result = poll(&pfd, 1, waitMs);
+
+        // Only a timeout of the caller's own is returned as one
+        if (result == 0 && capped) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    } while (result == -1 && errno == EINTR);
+
+    if (result <= 0)
+        return result;
+
+    do {
+        result = read(rd->fd, buf, len);
+    } while (result == -1 && errno == EINTR);
+
+    // Nothing to read after poll said there was means the other end is gone
+    if (result == 0) {
+        errno = EIO;
+        return -1;
+    }
+
+    return result;
+}
+
+ssize_t reader_fill(SerialReader *rd, int timeoutMs)
+{
+    if (rd->end == rd->capacity)
+        compact(rd);
+
+    // Nothing can be added to a full buffer, that counts as a timeout
+    if (rd->end == rd->capacity)
+        return 0;
+
+    uint64_t start = metrics_timer();
+    ssize_t result = readSome(rd, rd->buf + rd->end, rd->capacity - rd->end, timeoutMs);
+    metrics_elapsed(METRIC_READ_BLOCKED, start);
+
+    if (result > 0)
+        rd->end += result;
+
+    return result;
+}
+
+int reader_need(SerialReader *rd, size_t len)
+{
+    return reader_need_within(rd, len, -1) == 1 ? 0 : -1;
+}
+
+int reader_need_within(SerialReader *rd, size_t len, int quietMs)
+{
+    // More than fits could never arrive, the buffer would fill up first
+    if (len > rd->capacity) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    if (rd->start + len > rd->capacity)
+        compact(rd);
+
+    while (reader_available(rd) < len) {
+        ssize_t result = reader_fill(rd, quietMs);
+        if (result <= 0)
+            return result;
+    }
+
+    return 1;
+}
+
+void reader_consume(SerialReader *rd, size_t len)
+{
+    rd->start += len;
+
+    if (rd->start == rd->end) {
+        rd->start = 0;
+        rd->end = 0;
+    }
+}
+
+int reader_read(SerialReader *rd, uint8_t *out, size_t len)
+{
+    size_t buffered = reader_available(rd) < len ? reader_available(rd) : len;
+
+    memcpy(out, reader_data(rd), buffered);
+    reader_consume(rd, buffered);
+    out += buffered;
+    len -= buffered;
+
+    // Whatever doesn't fit in the buffer goes straight to out
+    while (len >= rd->capacity) {
+        ssize_t result = readSome(rd, out, len, -1);
+        if (result == -1)
+            return -1;
+
+        out += result;
+        len -= result;
+    }
+
+    if (len > 0) {
+        if (reader_need(rd, len) == -1)
+            return -1;
+
+        memcpy(out, reader_data(rd), len);
+        reader_consume(rd, len);
+    }
+
+    return 0;
+}
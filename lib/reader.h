@@ -0,0 +1,60 @@
+#ifndef reader_h_INCLUDED
+#define reader_h_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+// Buffered reads from a serial port. Every read() takes as much as the
+// port has available, so a run of small frames or responses costs one
+// system call instead of several each, and a frame can be looked at whole
+// before any of it is consumed. Bytes are consumed from the front and the
+// rest moved back down once the end of the buffer is reached.
+//
+// A deadline, once set, bounds every wait: reads past it fail with
+// ETIMEDOUT instead of blocking on a link that has gone silent.
+typedef struct {
+    int fd;
+    uint8_t *buf;
+    size_t capacity;
+    size_t start;
+    size_t end;
+    int64_t deadlineMs;
+} SerialReader;
+
+// Returns -1 if the buffer can't be allocated
+int reader_init(SerialReader *rd, int fd, size_t capacity);
+void reader_destroy(SerialReader *rd);
+
+// Grows the buffer to hold at least capacity bytes, returns -1 if it can't
+int reader_reserve(SerialReader *rd, size_t capacity);
+
+// Makes reads fail with ETIMEDOUT from seconds from now on, 0 to wait
+// forever again
+void reader_set_deadline(SerialReader *rd, double seconds);
+
+// The bytes buffered but not consumed yet
+size_t reader_available(const SerialReader *rd);
+const uint8_t* reader_data(const SerialReader *rd);
+
+// Reads whatever is available, waiting up to timeoutMs (forever when
+// negative) for something to arrive. Returns the number of bytes added, 0
+// on timeout and -1 on error, end of file or once the deadline has passed.
+ssize_t reader_fill(SerialReader *rd, int timeoutMs);
+
+// Waits until at least len bytes are buffered. Returns -1 on error or end
+// of file, with errno ERANGE if len is more than the capacity.
+int reader_need(SerialReader *rd, size_t len);
+
+// The same, but gives up once nothing has arrived for quietMs. Returns 1
+// when the bytes are buffered, 0 if the line went quiet first.
+int reader_need_within(SerialReader *rd, size_t len, int quietMs);
+
+void reader_consume(SerialReader *rd, size_t len);
+
+// Copies the next len bytes, any number of them, to out. Returns -1 on
+// error or end of file.
+int reader_read(SerialReader *rd, uint8_t *out, size_t len);
+
+#endif // reader_h_INCLUDED
@@ -0,0 +1,114 @@
+#include "ring.h"
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define cpuRelax() _mm_pause()
+#elif defined(__aarch64__)
+#define cpuRelax() __asm__ __volatile__("yield")
+#else
+#define cpuRelax() ((void) 0)
+#endif
+
+// How many times a side checks again before going to sleep. Packets move
+// through in microseconds, so a short spin usually beats a system call.
+#define SPIN_LIMIT 256
+
+static void futexWait(_Atomic uint32_t *addr, uint32_t value)
+{
+    syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futexWake(_Atomic uint32_t *addr)
+{
+    syscall(SYS_futex, (uint32_t *) addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+int ring_init(SpscRing *ring, uint32_t capacity)
+{
+    uint32_t size = 1;
+
+    while (size < capacity)
+        size <<= 1;
+
+    ring->slots = malloc(size * sizeof(void *));
+    if (ring->slots == NULL)
+        return -1;
+
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->producerWaiting, 0);
+    atomic_init(&ring->consumerWaiting, 0);
+
+    return 0;
+}
+
+void ring_destroy(SpscRing *ring)
+{
+    free(ring->slots);
+}
+
+// Waits until *counter isn't value any more. The waiting flag is raised
+// before the last look so the other side, which moves the counter and then
+// checks the flag, can't slip in between without waking us.
+static void waitForChange(_Atomic uint32_t *counter, uint32_t value, _Atomic uint32_t *waiting)
+{
+    for (int spin = 0; spin < SPIN_LIMIT; ++spin) {
+        if (atomic_load_explicit(counter, memory_order_acquire) != value)
+            return;
+        cpuRelax();
+    }
+
+    while (atomic_load(counter) == value) {
+        atomic_store(waiting, 1);
+        if (atomic_load(counter) != value)
+            break;
+        futexWait(counter, value);
+    }
+
+    atomic_store(waiting, 0);
+}
+
+void ring_push(SpscRing *ring, void *item)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail;
+
+    while (head - (tail = atomic_load_explicit(&ring->tail, memory_order_acquire)) > ring->mask)
+        waitForChange(&ring->tail, tail, &ring->producerWaiting);
+
+    ring->slots[head & ring->mask] = item;
+    atomic_store(&ring->head, head + 1);
+
+    if (atomic_load(&ring->consumerWaiting))
+        futexWake(&ring->head);
+}
+
+void* ring_pop(SpscRing *ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head;
+    void *item;
+
+    while ((head = atomic_load_explicit(&ring->head, memory_order_acquire)) == tail)
+        waitForChange(&ring->head, head, &ring->consumerWaiting);
+
+    item = ring->slots[tail & ring->mask];
+    atomic_store(&ring->tail, tail + 1);
+
+    if (atomic_load(&ring->producerWaiting))
+        futexWake(&ring->tail);
+
+    return item;
+}
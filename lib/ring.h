@@ -0,0 +1,35 @@
+#ifndef ring_h_INCLUDED
+#define ring_h_INCLUDED
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Bounded single producer, single consumer queue of pointers. Pushing and
+// popping are lock free, a side only sleeps (on a futex) when the ring is
+// full or empty, and the other side only makes a system call to wake it
+// when it actually is asleep.
+typedef struct {
+    void **slots;
+    uint32_t mask;
+
+    // Free running counts of pushes and pops, each written by one side only
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+
+    _Atomic uint32_t producerWaiting;
+    _Atomic uint32_t consumerWaiting;
+} SpscRing;
+
+// The capacity is rounded up to a power of two. Returns -1 if the slots
+// can't be allocated.
+int ring_init(SpscRing *ring, uint32_t capacity);
+void ring_destroy(SpscRing *ring);
+
+// Blocks while the ring is full
+void ring_push(SpscRing *ring, void *item);
+
+// Blocks while the ring is empty
+void* ring_pop(SpscRing *ring);
+
+#endif // ring_h_INCLUDED
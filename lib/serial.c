@@ -0,0 +1,37 @@
+#include "serial.h"
+
+// The termios2 interface takes the baud rate as a number, glibc's termios
+// only knows the Bxxx constants. The two can't be included together.
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+
+int serial_configure(int fd, const SerialConfig *config)
+{
+    struct termios2 tio;
+
+    if (ioctl(fd, TCGETS2, &tio) == -1)
+        return -1;
+
+    // The same as cfmakeraw
+    tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF
+                     | IXANY);
+    tio.c_oflag &= ~OPOST;
+    tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+    tio.c_cflag |= CS8 | CREAD | CLOCAL;
+
+    if (config->rtscts)
+        tio.c_cflag |= CRTSCTS;
+
+    if (config->baud != 0) {
+        tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+        tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+        tio.c_ispeed = config->baud;
+        tio.c_ospeed = config->baud;
+    }
+
+    tio.c_cc[VMIN] = config->vmin;
+    tio.c_cc[VTIME] = config->vtime;
+
+    return ioctl(fd, TCSETS2, &tio);
+}
@@ -0,0 +1,28 @@
+#ifndef serial_h_INCLUDED
+#define serial_h_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// How a serial port is set up. Frames are binary, so the port always goes
+// into raw 8N1 mode with no echo, line editing, signals or character
+// translation.
+//
+//  * baud is the line rate in bits per second, any rate the driver can do
+//    and not only the standard ones. 0 keeps the current rate.
+//  * rtscts turns on RTS/CTS hardware flow control.
+//  * vmin and vtime are the termios read settings: a read returns once vmin
+//    bytes have arrived or the line has been idle for vtime tenths of a
+//    second after the first one. Raising vmin on the receiving end of a
+//    fast link gets more of a frame per read.
+typedef struct {
+    unsigned long baud;
+    bool rtscts;
+    uint8_t vmin;
+    uint8_t vtime;
+} SerialConfig;
+
+// Returns -1 with errno set if the port can't be configured
+int serial_configure(int fd, const SerialConfig *config);
+
+#endif // serial_h_INCLUDED
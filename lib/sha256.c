@@ -13,10 +13,22 @@
 *********************************************************************/
 
 /*************************** HEADER FILES ***************************/
+#ifdef SHA256_TEST
+#include <stdio.h>
+#endif
+#include <stdbool.h>
 #include <stdlib.h>
 #include <memory.h>
 #include "sha256.h"
 
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
+
 /****************************** MACROS ******************************/
 #define ROTLEFT(a,b) (((a) << (b)) | ((a) >> (32-(b))))
 #define ROTRIGHT(a,b) (((a) >> (b)) | ((a) << (32-(b))))
@@ -40,6 +52,13 @@ static const WORD k[64] = {
 	0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
 };
 
+// Backends hash a run of whole 64 byte blocks into the state. The fastest
+// one this CPU supports is picked once at startup.
+typedef void (*Sha256Blocks)(WORD state[8], const BYTE data[], size_t blocks);
+
+static void sha256BlocksScalar(WORD state[8], const BYTE data[], size_t blocks);
+static Sha256Blocks sha256Blocks = sha256BlocksScalar;
+
 /*********************** FUNCTION DEFINITIONS ***********************/
 void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 {
@@ -82,6 +101,138 @@ void sha256_transform(SHA256_CTX *ctx, const BYTE data[])
 	ctx->state[7] += h;
 }
 
+static void sha256BlocksScalar(WORD state[8], const BYTE data[], size_t blocks)
+{
+	SHA256_CTX ctx;
+
+	memcpy(ctx.state, state, sizeof(ctx.state));
+	for (; blocks > 0; --blocks, data += 64)
+		sha256_transform(&ctx, data);
+	memcpy(state, ctx.state, sizeof(ctx.state));
+}
+
+#if defined(__x86_64__)
+
+// SHA extensions keep the state as ABEF/CDGH halves and run four rounds per
+// pair of sha256rnds2, with sha256msg1/sha256msg2 extending the schedule
+static bool shaExtSupported(void)
+{
+	unsigned int a, b, c, d;
+
+	if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1) || !(c & bit_SSSE3))
+		return false;
+	if (!__get_cpuid_count(7, 0, &a, &b, &c, &d))
+		return false;
+	return b & bit_SHA;
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256BlocksShaExt(WORD state[8], const BYTE data[], size_t blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i state0, state1, tmp, msg, w[4], abefSave, cdghSave;
+	int g;
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);
+	state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B);
+	state0 = _mm_alignr_epi8(tmp, state1, 8);
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+	for (; blocks > 0; --blocks, data += 64) {
+		abefSave = state0;
+		cdghSave = state1;
+
+		for (g = 0; g < 16; ++g) {
+			if (g < 4) {
+				w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16 * g)), mask);
+			} else {
+				tmp = _mm_sha256msg1_epu32(w[g % 4], w[(g + 1) % 4]);
+				tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(w[(g + 3) % 4], w[(g + 2) % 4], 4));
+				w[g % 4] = _mm_sha256msg2_epu32(tmp, w[(g + 3) % 4]);
+			}
+
+			msg = _mm_add_epi32(w[g % 4], _mm_loadu_si128((const __m128i *) &k[4 * g]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+		}
+
+		state0 = _mm_add_epi32(state0, abefSave);
+		state1 = _mm_add_epi32(state1, cdghSave);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);
+	state1 = _mm_shuffle_epi32(state1, 0xB1);
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+	state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+	_mm_storeu_si128((__m128i *) &state[0], state0);
+	_mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+#elif defined(__aarch64__)
+
+// The ARMv8 SHA2 instructions work on the ABCD/EFGH halves of the state
+// directly, four rounds per sha256h/sha256h2 pair
+static bool shaExtSupported(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_SHA2;
+}
+
+__attribute__((target("+crypto")))
+static void sha256BlocksShaExt(WORD state[8], const BYTE data[], size_t blocks)
+{
+	uint32x4_t state0, state1, abcdSave, efghSave, msg, tmp, w[4];
+	int g;
+
+	state0 = vld1q_u32(&state[0]);
+	state1 = vld1q_u32(&state[4]);
+
+	for (; blocks > 0; --blocks, data += 64) {
+		abcdSave = state0;
+		efghSave = state1;
+
+		for (g = 0; g < 16; ++g) {
+			if (g < 4)
+				w[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * g)));
+			else
+				w[g % 4] = vsha256su1q_u32(vsha256su0q_u32(w[g % 4], w[(g + 1) % 4]),
+				                           w[(g + 2) % 4], w[(g + 3) % 4]);
+
+			msg = vaddq_u32(w[g % 4], vld1q_u32(&k[4 * g]));
+			tmp = state0;
+			state0 = vsha256hq_u32(state0, state1, msg);
+			state1 = vsha256h2q_u32(state1, tmp, msg);
+		}
+
+		state0 = vaddq_u32(state0, abcdSave);
+		state1 = vaddq_u32(state1, efghSave);
+	}
+
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+}
+
+#else
+
+static bool shaExtSupported(void)
+{
+	return false;
+}
+
+static void sha256BlocksShaExt(WORD state[8], const BYTE data[], size_t blocks)
+{
+	sha256BlocksScalar(state, data, blocks);
+}
+
+#endif
+
+__attribute__((constructor))
+static void sha256SelectBackend(void)
+{
+	if (shaExtSupported())
+		sha256Blocks = sha256BlocksShaExt;
+}
+
 void sha256_init(SHA256_CTX *ctx)
 {
 	ctx->datalen = 0;
@@ -98,17 +249,29 @@ void sha256_init(SHA256_CTX *ctx)
 
 void sha256_update(SHA256_CTX *ctx, const BYTE data[], size_t len)
 {
-	WORD i;
+	size_t i = 0, blocks;
 
-	for (i = 0; i < len; ++i) {
-		ctx->data[ctx->datalen] = data[i];
-		ctx->datalen++;
-		if (ctx->datalen == 64) {
-			sha256_transform(ctx, ctx->data);
-			ctx->bitlen += 512;
-			ctx->datalen = 0;
-		}
+	// Top up a partially filled block first
+	if (ctx->datalen > 0) {
+		while (i < len && ctx->datalen < 64)
+			ctx->data[ctx->datalen++] = data[i++];
+		if (ctx->datalen < 64)
+			return;
+		sha256Blocks(ctx->state, ctx->data, 1);
+		ctx->bitlen += 512;
+		ctx->datalen = 0;
+	}
+
+	// Whole blocks are hashed straight from the input
+	blocks = (len - i) / 64;
+	if (blocks > 0) {
+		sha256Blocks(ctx->state, data + i, blocks);
+		ctx->bitlen += (unsigned long long) blocks * 512;
+		i += blocks * 64;
 	}
+
+	memcpy(ctx->data, data + i, len - i);
+	ctx->datalen = len - i;
 }
 
 void sha256_final(SHA256_CTX *ctx, BYTE hash[])
@@ -127,7 +290,7 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 		ctx->data[i++] = 0x80;
 		while (i < 64)
 			ctx->data[i++] = 0x00;
-		sha256_transform(ctx, ctx->data);
+		sha256Blocks(ctx->state, ctx->data, 1);
 		memset(ctx->data, 0, 56);
 	}
 
@@ -141,7 +304,7 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 	ctx->data[58] = ctx->bitlen >> 40;
 	ctx->data[57] = ctx->bitlen >> 48;
 	ctx->data[56] = ctx->bitlen >> 56;
-	sha256_transform(ctx, ctx->data);
+	sha256Blocks(ctx->state, ctx->data, 1);
 
 	// Since this implementation uses little endian byte ordering and SHA uses big endian,
 	// reverse all the bytes when copying the final state to the output hash.
@@ -156,3 +319,58 @@ void sha256_final(SHA256_CTX *ctx, BYTE hash[])
 		hash[i + 28] = (ctx->state[7] >> (24 - i * 8)) & 0x000000ff;
 	}
 }
+
+#ifdef SHA256_TEST
+
+// Hashes random runs of blocks with every backend this CPU supports and
+// checks the state against the scalar code. Returns the number of
+// backends that disagreed.
+int sha256_check_backends(void)
+{
+	static const struct {
+		const char *name;
+		Sha256Blocks blocks;
+		bool (*supported)(void);
+	} backends[] = {
+		{ "sha-ext", sha256BlocksShaExt, shaExtSupported },
+	};
+	BYTE data[64 * 64];
+	WORD expected[8], state[8];
+	int failures = 0;
+	size_t i, b;
+	int trial;
+
+	srand(1);
+	for (i = 0; i < sizeof(data); ++i)
+		data[i] = rand();
+
+	for (b = 0; b < sizeof(backends) / sizeof(backends[0]); ++b) {
+		if (!backends[b].supported()) {
+			printf("%s: not supported on this CPU\n", backends[b].name);
+			continue;
+		}
+
+		for (trial = 0; trial < 1000; ++trial) {
+			size_t n = rand() % 64 + 1;
+
+			for (i = 0; i < 8; ++i)
+				expected[i] = state[i] = rand();
+
+			sha256BlocksScalar(expected, data, n);
+			backends[b].blocks(state, data, n);
+
+			if (memcmp(expected, state, sizeof(state)) != 0) {
+				printf("%s: differs from the scalar code for %zu blocks\n", backends[b].name, n);
+				failures += 1;
+				break;
+			}
+		}
+
+		if (trial == 1000)
+			printf("%s: ok\n", backends[b].name);
+	}
+
+	return failures;
+}
+
+#endif // SHA256_TEST
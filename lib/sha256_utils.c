@@ -14,6 +14,22 @@ void calculateSHA256(const void *data, size_t len, uint8_t shaSum[32])
     sha256_final(&shaCtx, (BYTE *) shaSum);
 }
 
+// Hashes the rest of the stream in fixed size chunks so files of any size can
+// be hashed in bounded memory. Returns -1 if reading the stream failed.
+int calculateFileSHA256(FILE *fp, uint8_t shaSum[32])
+{
+    SHA256_CTX shaCtx;
+    uint8_t buf[0x8000];
+    size_t len;
+
+    sha256_init(&shaCtx);
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+        sha256_update(&shaCtx, buf, len);
+    sha256_final(&shaCtx, (BYTE *) shaSum);
+
+    return ferror(fp) ? -1 : 0;
+}
+
 void sha256Str(char shaStr[65], const uint8_t shaSum[32])
 {
     for (size_t i = 0; i < 32; ++i)
@@ -24,62 +40,47 @@ void sha256Str(char shaStr[65], const uint8_t shaSum[32])
 #ifdef SHA256_TEST
 
 #include <stdlib.h>
+#include <string.h>
 
-long fileLength(FILE *fp)
+int sha256_check_backends(void);
+
+int main(int argc, char **argv)
 {
-    if (fseek(fp, 0, SEEK_END) == -1) {
-        perror("Error seeking file end");
+    FILE *fp;
+    uint8_t shaSum[32];
+    char shaStr[65];
+
+    // Every backend has to agree with the scalar code, and the API as a
+    // whole with a known digest
+    if (sha256_check_backends() != 0)
         exit(-1);
-    }
 
-    long len = ftell(fp);
-    rewind(fp);
+    calculateSHA256("abc", 3, shaSum);
+    sha256Str(shaStr, shaSum);
+    if (strcmp(shaStr, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad") != 0) {
+        printf("sha256 of \"abc\" is wrong: %s\n", shaStr);
+        exit(-1);
+    }
 
-    return len;
-}
+    // With a file, print its sha256sum
+    if (argc < 2)
+        return 0;
 
-uint8_t* readFile(char *filePath, size_t *size)
-{
-    FILE *fp = fopen(filePath, "r");
+    fp = fopen(argv[1], "r");
     if (fp == NULL) {
         perror("Error opening file");
         exit(-1);
     }
 
-    long len = fileLength(fp);
-
-    uint8_t *data = malloc(len);
-    size_t read = fread(data, 1, len, fp);
-    if (read != len) {
-        printf("Error reading file %s.\n", filePath);
+    if (calculateFileSHA256(fp, shaSum) == -1) {
+        printf("Error reading file %s.\n", argv[1]);
         exit(-1);
     }
     fclose(fp);
 
-    *size = len;
-    return data;
-}
-
-int main(int argc, char **argv)
-{
-    size_t len;
-    uint8_t *data;
-    uint8_t shaSum[32];
-    char shaStr[65];
-
-    if (argc < 2) {
-        printf("%s expects a file to check the sha256 sum of.\n", argv[0]);
-        exit(-1);
-    }
-
-    data = readFile(argv[1], &len);
-
-    calculateSHA256(data, len, shaSum);
     sha256Str(shaStr, shaSum);
 
     printf("%s\n", shaStr);
-
-    free(data);
 }
 
 #endif // SHA256_TEST
@@ -3,8 +3,10 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 void calculateSHA256(const void *data, size_t len, uint8_t shaSum[32]);
+int calculateFileSHA256(FILE *fp, uint8_t shaSum[32]);
 void sha256Str(char shaStr[65], const uint8_t shaSum[32]);
 
 #endif // sha256_utils_h_INCLUDED
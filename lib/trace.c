@@ -0,0 +1,219 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+#include <unistd.h>
+
+// Events the ring holds, a little over a second of a fast transfer
+#define TRACE_RING_EVENTS 0x10000
+
+_Static_assert(sizeof(TraceEvent) == 24, "trace events are written out as they are");
+
+bool trace_on;
+
+// The ring and the thread emptying it. Only the recording thread moves
+// head and only the writing thread moves tail, both are free running.
+static struct {
+    TraceEvent *events;
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t overflow;
+    FILE *fp;
+    // Written to by trace_stop to wake the thread up
+    int wakefd[2];
+    pthread_t thread;
+} ring;
+
+static uint64_t clockNs(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void trace_push(TraceKind kind, uint64_t seq, uint32_t len, uint8_t code)
+{
+    uint64_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&ring.tail, memory_order_acquire) == TRACE_RING_EVENTS) {
+        atomic_fetch_add_explicit(&ring.overflow, 1, memory_order_relaxed);
+        return;
+    }
+
+    ring.events[head % TRACE_RING_EVENTS] = (TraceEvent) {
+        clockNs(CLOCK_MONOTONIC), seq, len, kind, code, 0
+    };
+    atomic_store_explicit(&ring.head, head + 1, memory_order_release);
+}
+
+static void flush(void)
+{
+    // Everything recorded so far, in at most two pieces where it wraps
+    uint64_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring.head, memory_order_acquire);
+
+    while (tail < head) {
+        size_t from = tail % TRACE_RING_EVENTS;
+        size_t num = head - tail < TRACE_RING_EVENTS - from ? head - tail
+                                                            : TRACE_RING_EVENTS - from;
+
+        fwrite(ring.events + from, sizeof(TraceEvent), num, ring.fp);
+        tail += num;
+        atomic_store_explicit(&ring.tail, tail, memory_order_release);
+    }
+}
+
+static void* writeEvents(void *arg)
+{
+    (void) arg;
+
+    while (true) {
+        struct pollfd pfd = { ring.wakefd[0], POLLIN, 0 };
+
+        if (poll(&pfd, 1, TRACE_FLUSH_MS) == -1 && errno != EINTR)
+            break;
+
+        flush();
+        if (pfd.revents & POLLIN)
+            break;
+    }
+
+    return NULL;
+}
+
+int trace_start(const char *path, uint8_t side)
+{
+    // Trace header, see trace.h
+    uint8_t header[24] = { 0 };
+    uint16_t version = TRACE_VERSION;
+    uint64_t monotonicNs = clockNs(CLOCK_MONOTONIC);
+    uint64_t realtimeNs = clockNs(CLOCK_REALTIME);
+
+    memcpy(header, TRACE_MAGIC, 4);
+    memcpy(header + 4, &version, 2);
+    header[6] = side;
+    memcpy(header + 8, &monotonicNs, 8);
+    memcpy(header + 16, &realtimeNs, 8);
+
+    ring.events = malloc(TRACE_RING_EVENTS * sizeof(TraceEvent));
+    if (ring.events == NULL)
+        return -1;
+
+    ring.fp = fopen(path, "w");
+    if (ring.fp == NULL || fwrite(header, 1, sizeof(header), ring.fp) != sizeof(header))
+        goto fail;
+
+    if (pipe(ring.wakefd) == -1)
+        goto fail;
+
+    atomic_store(&ring.head, 0);
+    atomic_store(&ring.tail, 0);
+    atomic_store(&ring.overflow, 0);
+
+    int result = pthread_create(&ring.thread, NULL, writeEvents, NULL);
+    if (result != 0) {
+        close(ring.wakefd[0]);
+        close(ring.wakefd[1]);
+        errno = result;
+        goto fail;
+    }
+
+    trace_on = true;
+    return 0;
+
+fail:
+    if (ring.fp != NULL)
+        fclose(ring.fp);
+    free(ring.events);
+    ring.fp = NULL;
+    ring.events = NULL;
+    return -1;
+}
+
+void trace_stop(void)
+{
+    if (!trace_on)
+        return;
+
+    trace_on = false;
+
+    uint8_t wake = 0;
+    if (write(ring.wakefd[1], &wake, 1) == 1)
+        pthread_join(ring.thread, NULL);
+
+    flush();
+
+    uint64_t overflow = atomic_load(&ring.overflow);
+    if (overflow > 0) {
+        TraceEvent last = { clockNs(CLOCK_MONOTONIC), overflow, 0, TRACE_OVERFLOW, 0, 0 };
+        fwrite(&last, sizeof(last), 1, ring.fp);
+    }
+
+    close(ring.wakefd[0]);
+    close(ring.wakefd[1]);
+    fclose(ring.fp);
+    free(ring.events);
+    ring.fp = NULL;
+    ring.events = NULL;
+}
+
+int trace_load(const char *path, TraceHeader *header, TraceEvent **events, size_t *eventNum)
+{
+    uint8_t buf[24];
+    uint16_t version;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+        return -1;
+
+    if (fread(buf, 1, sizeof(buf), fp) != sizeof(buf) || memcmp(buf, TRACE_MAGIC, 4) != 0)
+        goto invalid;
+
+    memcpy(&version, buf + 4, 2);
+    if (version != TRACE_VERSION)
+        goto invalid;
+
+    header->side = buf[6];
+    memcpy(&header->monotonicNs, buf + 8, 8);
+    memcpy(&header->realtimeNs, buf + 16, 8);
+
+    // Read in doubling chunks, a trace cut short by a crash keeps whatever
+    // whole events made it out
+    size_t capacity = 4096, num = 0;
+    TraceEvent *all = malloc(capacity * sizeof(TraceEvent));
+
+    while (all != NULL) {
+        num += fread(all + num, sizeof(TraceEvent), capacity - num, fp);
+        if (num < capacity)
+            break;
+
+        TraceEvent *grown = realloc(all, 2 * capacity * sizeof(TraceEvent));
+        if (grown == NULL) {
+            free(all);
+            all = NULL;
+            break;
+        }
+        all = grown;
+        capacity *= 2;
+    }
+
+    fclose(fp);
+    if (all == NULL)
+        return -1;
+
+    *events = all;
+    *eventNum = num;
+    return 0;
+
+invalid:
+    fclose(fp);
+    errno = EINVAL;
+    return -1;
+}
@@ -0,0 +1,100 @@
+#ifndef trace_h_INCLUDED
+#define trace_h_INCLUDED
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A binary record of what went over the link, for working out afterwards
+// why a transfer was slow. Events go into a ring in memory and a thread
+// writes them out every TRACE_FLUSH_MS, so recording one is a clock read
+// and a store. A full ring doesn't hold the transfer up, the events that
+// don't fit are counted and the count is written at the end instead.
+// Events have to be recorded from one thread.
+//
+// Trace file format:
+//  * 4 bytes for TRACE_MAGIC
+//  * 2 bytes for TRACE_VERSION
+//  * 1 byte for the side, TRACE_SENDER or TRACE_RECEIVER
+//  * 1 byte reserved
+//  * 8 bytes for CLOCK_MONOTONIC when the trace started, in ns
+//  * 8 bytes for CLOCK_REALTIME at the same time, in ns
+// followed by one 24 byte event after another:
+//  * 8 bytes for CLOCK_MONOTONIC when it happened, in ns
+//  * 8 bytes for the sequence number, see TraceKind
+//  * 4 bytes for the length in bytes on the wire
+//  * 1 byte for the kind
+//  * 1 byte for the code, see TraceKind
+//  * 2 bytes reserved
+
+#define TRACE_MAGIC    "PFTR"
+#define TRACE_VERSION  1
+#define TRACE_FLUSH_MS 50
+
+// Sequence number of an answer that doesn't carry one
+#define TRACE_NO_SEQ UINT64_MAX
+
+#define TRACE_SENDER   1
+#define TRACE_RECEIVER 2
+
+typedef enum {
+    // A data frame, by sequence number or file offset for adaptive frames.
+    // The receiver's code is 1 if its crc32sum matched and 0 if not.
+    TRACE_FRAME = 1,
+    // A repair packet, seq is its group << 16 | its index
+    TRACE_REPAIR,
+    // seq is the group
+    TRACE_GROUP_END,
+    // A response, the code is its command and seq the sequence number,
+    // group or query id it's for, or TRACE_NO_SEQ
+    TRACE_ANSWER,
+    // seq is the query id
+    TRACE_QUERY,
+    // An answer the sender stopped waiting for
+    TRACE_TIMEOUT,
+    // len is how many bytes the receiver dropped to find a frame again, the
+    // code 1 if the line went quiet first
+    TRACE_RESYNC,
+    // The last event, seq is how many didn't fit in the ring
+    TRACE_OVERFLOW
+} TraceKind;
+
+typedef struct {
+    uint64_t ns;
+    uint64_t seq;
+    uint32_t len;
+    uint8_t kind;
+    uint8_t code;
+    uint16_t reserved;
+} TraceEvent;
+
+typedef struct {
+    uint8_t side;
+    uint64_t monotonicNs;
+    uint64_t realtimeNs;
+} TraceHeader;
+
+// Whether events are being recorded
+extern bool trace_on;
+
+void trace_push(TraceKind kind, uint64_t seq, uint32_t len, uint8_t code);
+
+static inline void trace_event(TraceKind kind, uint64_t seq, uint32_t len, uint8_t code)
+{
+    if (trace_on)
+        trace_push(kind, seq, len, code);
+}
+
+// Starts recording events to a new file at path. Returns -1 with errno set
+// if it can't be created or the thread writing it can't be started.
+int trace_start(const char *path, uint8_t side);
+
+// Writes out whatever is left and closes the file
+void trace_stop(void);
+
+// Reads a whole trace into a malloc'd array of events. Returns -1 with
+// errno set if it can't be read, EINVAL if it isn't a trace.
+int trace_load(const char *path, TraceHeader *header, TraceEvent **events, size_t *eventNum);
+
+#endif // trace_h_INCLUDED
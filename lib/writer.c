@@ -0,0 +1,320 @@
+#include "writer.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// liburing isn't needed for the little used here, the kernel interface is
+// three system calls and a few shared ring buffers
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+// Queued writes go to the kernel once this many have built up, or when a
+// free slot or the caller has to wait anyway
+#define WRITER_BATCH 4
+
+static int uringSetup(unsigned entries, struct io_uring_params *params)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int ringfd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, ringfd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static int uringRegister(int ringfd, unsigned opcode, const void *arg, unsigned argNum)
+{
+    return (int) syscall(__NR_io_uring_register, ringfd, opcode, arg, argNum);
+}
+
+static unsigned loadAcquire(const unsigned *p)
+{
+    return atomic_load_explicit((const _Atomic unsigned *) p, memory_order_acquire);
+}
+
+static void storeRelease(unsigned *p, unsigned value)
+{
+    atomic_store_explicit((_Atomic unsigned *) p, value, memory_order_release);
+}
+
+static int pwriteAll(int fd, const uint8_t *data, size_t len, off_t offset)
+{
+    size_t written = 0;
+    ssize_t result;
+
+    while (written < len) {
+        result = pwrite(fd, data + written, len - written, offset + written);
+        if (result == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += result;
+    }
+
+    return 0;
+}
+
+static bool directAligned(const PacketWriter *w, const uint8_t *data, size_t len, off_t offset)
+{
+    return w->directfd != -1 && (uintptr_t) data % WRITER_DIRECT_ALIGN == 0
+           && len % WRITER_DIRECT_ALIGN == 0 && offset % WRITER_DIRECT_ALIGN == 0;
+}
+
+static bool inArena(const BufferPool *pool, const uint8_t *data, size_t len)
+{
+    uintptr_t offset = (uintptr_t) data - (uintptr_t) pool->arena;
+    return offset < pool->bufSize * pool->bufNum && len <= pool->bufSize * pool->bufNum - offset;
+}
+
+static int mapRings(PacketWriter *w, const struct io_uring_params *params)
+{
+    w->sqMapLen = params->sq_off.array + params->sq_entries * sizeof(unsigned);
+    w->cqMapLen = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+    // Newer kernels put both rings in one mapping
+    if (params->features & IORING_FEAT_SINGLE_MMAP) {
+        if (w->cqMapLen > w->sqMapLen)
+            w->sqMapLen = w->cqMapLen;
+        w->cqMapLen = 0;
+    }
+
+    w->sqMap = mmap(NULL, w->sqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    w->ringfd, IORING_OFF_SQ_RING);
+    if (w->sqMap == MAP_FAILED)
+        return -1;
+
+    w->cqMap = w->sqMap;
+    if (w->cqMapLen > 0) {
+        w->cqMap = mmap(NULL, w->cqMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        w->ringfd, IORING_OFF_CQ_RING);
+        if (w->cqMap == MAP_FAILED) {
+            munmap(w->sqMap, w->sqMapLen);
+            return -1;
+        }
+    }
+
+    w->sqesLen = params->sq_entries * sizeof(struct io_uring_sqe);
+    w->sqes = mmap(NULL, w->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   w->ringfd, IORING_OFF_SQES);
+    if (w->sqes == MAP_FAILED) {
+        if (w->cqMapLen > 0)
+            munmap(w->cqMap, w->cqMapLen);
+        munmap(w->sqMap, w->sqMapLen);
+        return -1;
+    }
+
+    uint8_t *sq = w->sqMap, *cq = w->cqMap;
+    w->sqHead = (unsigned *) (sq + params->sq_off.head);
+    w->sqTail = (unsigned *) (sq + params->sq_off.tail);
+    w->sqMask = (unsigned *) (sq + params->sq_off.ring_mask);
+    w->sqArray = (unsigned *) (sq + params->sq_off.array);
+    w->cqHead = (unsigned *) (cq + params->cq_off.head);
+    w->cqTail = (unsigned *) (cq + params->cq_off.tail);
+    w->cqMask = (unsigned *) (cq + params->cq_off.ring_mask);
+    w->cqes = (struct io_uring_cqe *) (cq + params->cq_off.cqes);
+
+    return 0;
+}
+
+static void setupRing(PacketWriter *w)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    w->ringfd = uringSetup(w->depth, &params);
+    if (w->ringfd == -1)
+        return;
+
+    // IORING_OP_WRITE came in the same kernel as this feature flag
+    if (!(params.features & IORING_FEAT_RW_CUR_POS) || mapRings(w, &params) == -1) {
+        close(w->ringfd);
+        w->ringfd = -1;
+        return;
+    }
+
+    struct iovec arena = { w->pool->arena, w->pool->bufSize * w->pool->bufNum };
+    w->fixed = arena.iov_len > 0
+               && uringRegister(w->ringfd, IORING_REGISTER_BUFFERS, &arena, 1) == 0;
+}
+
+int writer_init(PacketWriter *w, int fd, int directfd, BufferPool *pool, unsigned depth)
+{
+    w->fd = fd;
+    w->directfd = directfd;
+    w->pool = pool;
+    w->ringfd = -1;
+    w->fixed = false;
+    w->depth = depth;
+    w->freeNum = depth;
+    w->queued = 0;
+
+    w->writes = calloc(depth, sizeof(PendingWrite));
+    w->freeSlots = malloc(depth * sizeof(unsigned));
+    if (w->writes == NULL || w->freeSlots == NULL) {
+        free(w->writes);
+        free(w->freeSlots);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < depth; ++i)
+        w->freeSlots[i] = depth - 1 - i;
+
+    setupRing(w);
+    return 0;
+}
+
+void writer_destroy(PacketWriter *w)
+{
+    if (w->ringfd != -1) {
+        munmap(w->sqes, w->sqesLen);
+        if (w->cqMapLen > 0)
+            munmap(w->cqMap, w->cqMapLen);
+        munmap(w->sqMap, w->sqMapLen);
+        close(w->ringfd);
+    }
+
+    free(w->writes);
+    free(w->freeSlots);
+}
+
+bool writer_async(const PacketWriter *w)
+{
+    return w->ringfd != -1;
+}
+
+static void queueWrite(PacketWriter *w, unsigned slot)
+{
+    // Only called with a free slot, and there are as many submission
+    // entries as slots, so the ring always has room
+    const PendingWrite *pw = &w->writes[slot];
+    unsigned tail = *w->sqTail;
+    unsigned index = tail & *w->sqMask;
+    struct io_uring_sqe *sqe = &w->sqes[index];
+    bool direct = directAligned(w, pw->data, pw->len, pw->offset);
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = direct ? w->directfd : w->fd;
+    sqe->off = pw->offset;
+    sqe->addr = (uintptr_t) pw->data;
+    sqe->len = pw->len;
+    sqe->user_data = slot;
+
+    if (w->fixed && inArena(w->pool, pw->data, pw->len)) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = 0;
+    }
+
+    w->sqArray[index] = index;
+    storeRelease(w->sqTail, tail + 1);
+    w->queued += 1;
+}
+
+static int enter(PacketWriter *w, unsigned minComplete)
+{
+    // Only waiting for completions holds the caller up on the disk
+    uint64_t start = minComplete > 0 ? metrics_timer() : 0;
+    int result;
+
+    do {
+        result = uringEnter(w->ringfd, w->queued, minComplete,
+                            minComplete > 0 ? IORING_ENTER_GETEVENTS : 0);
+    } while (result == -1 && errno == EINTR);
+
+    metrics_elapsed(METRIC_DISK_WRITE, start);
+
+    if (result == -1)
+        return -1;
+
+    w->queued -= result;
+    return 0;
+}
+
+static int reap(PacketWriter *w)
+{
+    // Collects every completion already posted, without a system call
+    unsigned head = *w->cqHead;
+    unsigned tail = loadAcquire(w->cqTail);
+    int error = 0;
+
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe *cqe = &w->cqes[head & *w->cqMask];
+        unsigned slot = cqe->user_data;
+        PendingWrite *pw = &w->writes[slot];
+
+        if (cqe->res < 0) {
+            error = -cqe->res;
+        } else if ((size_t) cqe->res < pw->len) {
+            // Short writes go again for whatever is left
+            pw->data += cqe->res;
+            pw->len -= cqe->res;
+            pw->offset += cqe->res;
+            queueWrite(w, slot);
+            continue;
+        }
+
+        pool_put(w->pool, pw->buf);
+        pw->buf = NULL;
+        w->freeSlots[w->freeNum++] = slot;
+    }
+
+    storeRelease(w->cqHead, head);
+
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+
+    return 0;
+}
+
+int writer_submit(PacketWriter *w, uint8_t *buf, const uint8_t *data, size_t len, off_t offset)
+{
+    if (w->ringfd == -1) {
+        uint64_t start = metrics_timer();
+        int result = pwriteAll(directAligned(w, data, len, offset) ? w->directfd : w->fd, data,
+                               len, offset);
+        metrics_elapsed(METRIC_DISK_WRITE, start);
+        pool_put(w->pool, buf);
+        return result;
+    }
+
+    if (reap(w) == -1)
+        return -1;
+
+    while (w->freeNum == 0) {
+        if (enter(w, 1) == -1 || reap(w) == -1)
+            return -1;
+    }
+
+    unsigned slot = w->freeSlots[--w->freeNum];
+    w->writes[slot] = (PendingWrite) { buf, data, len, offset };
+    queueWrite(w, slot);
+
+    if (w->queued >= WRITER_BATCH)
+        return enter(w, 0);
+
+    return 0;
+}
+
+int writer_drain(PacketWriter *w)
+{
+    if (w->ringfd == -1)
+        return 0;
+
+    while (w->freeNum < w->depth) {
+        if (enter(w, 1) == -1 || reap(w) == -1)
+            return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+#ifndef writer_h_INCLUDED
+#define writer_h_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "pool.h"
+
+// Writes packets out in the background through io_uring, so storing a
+// packet doesn't hold up reading the next one. Buffers handed to the
+// writer go back to their pool once the kernel is done with them, and
+// completions are collected in batches from the shared ring without a
+// system call each. The pool's arena is registered with the kernel when
+// the memlock limit allows, which saves mapping its pages on every write.
+//
+// Writes whose buffer, length and offset are all aligned to
+// WRITER_DIRECT_ALIGN go through directfd when it is open, that being the
+// same file opened with O_DIRECT, everything else through fd. Kernels
+// without io_uring, or that don't let this process use it, get the same
+// writes done synchronously with pwrite.
+//
+// Nothing is synced here, writer_drain only waits for the writes so the
+// caller can sync at its own checkpoints. Not thread safe.
+
+#define WRITER_DIRECT_ALIGN 4096
+
+typedef struct {
+    // Released to the pool once written, NULL while the slot is free
+    uint8_t *buf;
+    const uint8_t *data;
+    size_t len;
+    off_t offset;
+} PendingWrite;
+
+typedef struct {
+    int fd;
+    int directfd;
+    BufferPool *pool;
+    // -1 when writing synchronously
+    int ringfd;
+    bool fixed;
+    // Rings shared with the kernel
+    void *sqMap, *cqMap;
+    size_t sqMapLen, cqMapLen;
+    struct io_uring_sqe *sqes;
+    size_t sqesLen;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    // One slot per write in flight, the slot index is the request's tag
+    PendingWrite *writes;
+    unsigned *freeSlots;
+    unsigned depth, freeNum;
+    // Prepared but not yet passed to the kernel
+    unsigned queued;
+} PacketWriter;
+
+// Keeps up to depth writes in flight. directfd is -1 without O_DIRECT.
+// Returns -1 if memory can't be allocated, a missing io_uring isn't an
+// error.
+int writer_init(PacketWriter *w, int fd, int directfd, BufferPool *pool, unsigned depth);
+void writer_destroy(PacketWriter *w);
+
+// Whether writes really happen in the background
+bool writer_async(const PacketWriter *w);
+
+// Writes len bytes of data at offset and then puts buf, which data points
+// into, back in the pool. Returns -1 with errno set if this or an earlier
+// write failed.
+int writer_submit(PacketWriter *w, uint8_t *buf, const uint8_t *data, size_t len, off_t offset);
+
+// Waits for every write submitted so far, returns -1 with errno set if
+// any of them failed
+int writer_drain(PacketWriter *w);
+
+#endif // writer_h_INCLUDED
@@ -0,0 +1,822 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <time.h>
+
+#include <serial.h>
+
+// Runs send-file and recv-packets against each other on one machine, over
+// a pair of pseudo-terminals joined by a link emulator, for a matrix of
+// file sizes. The emulator gives each direction of the link the same
+// impairments:
+//  * a line rate, at 10 bits a byte as on an 8N1 serial line. Only a UART
+//    FIFO's worth of bytes is taken from the sender ahead of the line, so
+//    it is held back as by a real port rather than queueing without end.
+//  * one-way latency, and jitter on top of it that never reorders bytes
+//  * independent bit errors at a given bit error rate
+//  * bursts of garbled bytes, a mean number of bytes apart
+//  * bytes dropped outright, as on a UART overrun
+// Every run goes in a directory of its own, so no journal is picked up
+// from an earlier one, and the output is compared with the input.
+
+#define DEFAULT_SIZES "4k,64k,1M"
+#define DEFAULT_RUNS  3
+
+// How many bytes the emulated UART buffers ahead of the line, and the most
+// taken from a tool in one read. On a capped line reads are cut down to a
+// millisecond of line time, so bytes trickle out the far end as they would
+// on a real line instead of turning up in bursts with silences between.
+#define FIFO_BYTES 4096
+#define CHUNK_SIZE 4096
+#define CHUNK_MS   1
+
+// Without a line rate bytes are still only taken this far ahead of being
+// delivered
+#define UNLIMITED_QUEUE (1 << 20)
+
+// A tool still running this long after the other has exited is stuck
+#define STRAGGLER_MS 5000
+
+typedef struct {
+    double baud;
+    double latencyMs;
+    double jitterMs;
+    double ber;
+    double drop;
+    double burstEvery;
+    unsigned long burstLen;
+} LinkConfig;
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t sent;
+    int64_t deliverNs;
+} Chunk;
+
+// One direction of the link, bytes read from the from master are held as
+// chunks until their delivery time and then written to the to master
+typedef struct {
+    int from, to;
+    Chunk *chunks;
+    size_t head, num, capacity;
+    size_t queued;
+    int64_t lineFreeNs;
+    int64_t lastDeliverNs;
+    // Distances to the next impairment of each kind, counted down
+    double untilFlip;
+    double untilDrop;
+    double untilBurst;
+    unsigned long burstLeft;
+    // Totals
+    uint64_t bytes, flipped, dropped, garbled;
+} Direction;
+
+typedef struct {
+    bool ok;
+    bool timedOut;
+    double seconds;
+    unsigned long retransmits;
+    uint64_t forwardBytes, reverseBytes;
+    uint64_t flipped, dropped, garbled;
+} RunResult;
+
+static LinkConfig line = { 0, 0, 0, 0, 0, 0, 16 };
+static uint64_t rngState = 0x9E3779B97F4A7C15;
+
+static uint64_t nextRandom(void)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState;
+}
+
+static double uniform(void)
+{
+    // In (0, 1]
+    return ((nextRandom() >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+static double untilNext(double p)
+{
+    // Trials up to the next success of probability p, drawn all at once
+    // instead of flipping a coin on every bit or byte
+    if (p <= 0)
+        return INFINITY;
+    if (p >= 1)
+        return 0;
+    return floor(log(uniform()) / log1p(-p));
+}
+
+static int64_t nowNs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void initDirection(Direction *dir, int from, int to)
+{
+    memset(dir, 0, sizeof(*dir));
+    dir->from = from;
+    dir->to = to;
+    dir->untilFlip = untilNext(line.ber);
+    dir->untilDrop = untilNext(line.drop);
+    dir->untilBurst = line.burstEvery > 0 ? untilNext(1 / line.burstEvery) : INFINITY;
+}
+
+static void freeDirection(Direction *dir)
+{
+    for (size_t i = 0; i < dir->num; ++i)
+        free(dir->chunks[(dir->head + i) % dir->capacity].data);
+    free(dir->chunks);
+}
+
+static size_t impair(Direction *dir, uint8_t *data, size_t len)
+{
+    // Applies every impairment to the bytes as they go onto the line,
+    // returns how many are left once dropped ones are taken out
+    size_t kept = 0;
+
+    for (size_t i = 0; i < len; ++i) {
+        uint8_t byte = data[i];
+
+        if (dir->untilDrop-- <= 0) {
+            dir->untilDrop = untilNext(line.drop);
+            dir->dropped += 1;
+            continue;
+        }
+
+        if (dir->untilBurst-- <= 0) {
+            dir->untilBurst = untilNext(1 / line.burstEvery);
+            dir->burstLeft = line.burstLen;
+        }
+        if (dir->burstLeft > 0) {
+            byte = nextRandom();
+            dir->burstLeft -= 1;
+            dir->garbled += 1;
+        }
+
+        dir->untilFlip -= 8;
+        while (dir->untilFlip < 0) {
+            byte ^= 1 << (int) (dir->untilFlip + 8);
+            dir->flipped += 1;
+            dir->untilFlip += untilNext(line.ber) + 1;
+        }
+
+        data[kept++] = byte;
+    }
+
+    return kept;
+}
+
+static bool wantsInput(const Direction *dir, int64_t now)
+{
+    if (line.baud <= 0)
+        return dir->queued < UNLIMITED_QUEUE;
+
+    // Only as far ahead of the line as the UART's FIFO reaches
+    return dir->lineFreeNs - now < FIFO_BYTES * 10 * 1e9 / line.baud;
+}
+
+static size_t chunkSize(void)
+{
+    double bytes = line.baud / 10 * CHUNK_MS / 1000;
+
+    if (line.baud <= 0 || bytes >= CHUNK_SIZE)
+        return CHUNK_SIZE;
+    return bytes < 1 ? 1 : bytes;
+}
+
+static void takeInput(Direction *dir)
+{
+    size_t size = chunkSize();
+    uint8_t *data = malloc(size);
+    ssize_t len = read(dir->from, data, size);
+
+    if (len <= 0) {
+        free(data);
+        return;
+    }
+
+    int64_t now = nowNs();
+    dir->bytes += len;
+
+    // The line sends bytes one after the other, however late they arrive
+    int64_t start = dir->lineFreeNs > now ? dir->lineFreeNs : now;
+    dir->lineFreeNs = start + (line.baud > 0 ? (int64_t) (len * 10 * 1e9 / line.baud) : 0);
+
+    int64_t deliver = dir->lineFreeNs + (int64_t) (line.latencyMs * 1e6)
+                      + (int64_t) (uniform() * line.jitterMs * 1e6);
+    if (deliver < dir->lastDeliverNs)
+        deliver = dir->lastDeliverNs;
+    dir->lastDeliverNs = deliver;
+
+    size_t kept = impair(dir, data, len);
+    if (kept == 0) {
+        free(data);
+        return;
+    }
+
+    if (dir->num == dir->capacity) {
+        size_t capacity = dir->capacity == 0 ? 64 : 2 * dir->capacity;
+        Chunk *chunks = malloc(capacity * sizeof(Chunk));
+
+        for (size_t i = 0; i < dir->num; ++i)
+            chunks[i] = dir->chunks[(dir->head + i) % dir->capacity];
+        free(dir->chunks);
+
+        dir->chunks = chunks;
+        dir->capacity = capacity;
+        dir->head = 0;
+    }
+
+    dir->chunks[(dir->head + dir->num) % dir->capacity] = (Chunk) { data, kept, 0, deliver };
+    dir->num += 1;
+    dir->queued += kept;
+}
+
+static Chunk* dueChunk(Direction *dir, int64_t now)
+{
+    if (dir->num == 0 || dir->chunks[dir->head].deliverNs > now)
+        return NULL;
+    return &dir->chunks[dir->head];
+}
+
+static void deliver(Direction *dir)
+{
+    Chunk *chunk;
+
+    while ((chunk = dueChunk(dir, nowNs())) != NULL) {
+        ssize_t result = write(dir->to, chunk->data + chunk->sent, chunk->len - chunk->sent);
+        if (result <= 0)
+            return;
+
+        chunk->sent += result;
+        dir->queued -= result;
+        if (chunk->sent < chunk->len)
+            return;
+
+        free(chunk->data);
+        dir->head = (dir->head + 1) % dir->capacity;
+        dir->num -= 1;
+    }
+}
+
+static int openPty(int *master, char *slavePath, size_t pathLen)
+{
+    // Returns the slave, held open and in raw mode for the whole run so
+    // nothing written before a tool opens it goes through a cooked line
+    SerialConfig config = { 0, false, 1, 0 };
+
+    *master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (*master == -1 || grantpt(*master) == -1 || unlockpt(*master) == -1
+        || ptsname_r(*master, slavePath, pathLen) != 0)
+        return -1;
+
+    int slave = open(slavePath, O_RDWR | O_NOCTTY);
+    if (slave == -1 || serial_configure(slave, &config) == -1)
+        return -1;
+
+    return slave;
+}
+
+static char** splitArgs(const char *args, size_t lead, char **copy, size_t *argNum)
+{
+    // Whitespace separated words after lead free slots, with room for two
+    // more arguments and a terminating NULL. The words point into copy.
+    char **argv = malloc((lead + strlen(args) / 2 + 4) * sizeof(char *));
+    size_t n = lead;
+
+    *copy = strdup(args);
+    for (char *word = strtok(*copy, " \t"); word != NULL; word = strtok(NULL, " \t"))
+        argv[n++] = word;
+
+    *argNum = n;
+    return argv;
+}
+
+static pid_t spawn(const char *dir, const char *logPath, char **argv)
+{
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Error starting process");
+        exit(-1);
+    }
+    if (pid > 0)
+        return pid;
+
+    // Both tools write their metadata file where they run
+    int log = open(logPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log == -1 || chdir(dir) == -1) {
+        perror("Error setting up process");
+        _exit(127);
+    }
+
+    dup2(log, STDOUT_FILENO);
+    dup2(log, STDERR_FILENO);
+    close(log);
+
+    execv(argv[0], argv);
+    perror("Error starting process");
+    _exit(127);
+}
+
+static unsigned long readCounter(const char *metricsPath, const char *name)
+{
+    // The counter as of the last line a tool's metrics file has
+    FILE *fp = fopen(metricsPath, "r");
+    char line[4096], key[64];
+    unsigned long count = 0;
+
+    if (fp == NULL)
+        return 0;
+
+    snprintf(key, sizeof(key), "\"%s\": ", name);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *at = strstr(line, key);
+        if (at != NULL)
+            count = strtoul(at + strlen(key), NULL, 10);
+    }
+
+    fclose(fp);
+    return count;
+}
+
+static bool sameContents(const char *a, const char *b)
+{
+    FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+    uint8_t bufA[0x8000], bufB[0x8000];
+    bool same = fa != NULL && fb != NULL;
+
+    while (same) {
+        size_t lenA = fread(bufA, 1, sizeof(bufA), fa);
+        size_t lenB = fread(bufB, 1, sizeof(bufB), fb);
+
+        same = lenA == lenB && memcmp(bufA, bufB, lenA) == 0;
+        if (lenA == 0)
+            break;
+    }
+
+    if (fa != NULL)
+        fclose(fa);
+    if (fb != NULL)
+        fclose(fb);
+    return same;
+}
+
+static void writeInput(const char *path, size_t len)
+{
+    FILE *fp = fopen(path, "w");
+    uint8_t buf[0x8000];
+
+    if (fp == NULL) {
+        perror("Error creating input file");
+        exit(-1);
+    }
+
+    for (size_t done = 0; done < len; done += sizeof(buf)) {
+        size_t n = len - done < sizeof(buf) ? len - done : sizeof(buf);
+        for (size_t i = 0; i < n; ++i)
+            buf[i] = nextRandom();
+        fwrite(buf, 1, n, fp);
+    }
+
+    fclose(fp);
+}
+
+static RunResult runOnce(const char *tools, const char *runDir, const char *input,
+                         const char *sendArgs, const char *recvArgs, double timeout)
+{
+    RunResult result = { 0 };
+    int sendMaster, recvMaster;
+    char sendPath[64], recvPath[64];
+    char path[1024], output[1024], sendLog[1024], recvLog[1024], sendMetrics[1024];
+    size_t n;
+
+    int sendSlave = openPty(&sendMaster, sendPath, sizeof(sendPath));
+    int recvSlave = openPty(&recvMaster, recvPath, sizeof(recvPath));
+    if (sendSlave == -1 || recvSlave == -1) {
+        perror("Error opening pseudo-terminals");
+        exit(-1);
+    }
+
+    snprintf(output, sizeof(output), "%s/out.bin", runDir);
+    snprintf(sendLog, sizeof(sendLog), "%s/send.log", runDir);
+    snprintf(recvLog, sizeof(recvLog), "%s/recv.log", runDir);
+    snprintf(sendMetrics, sizeof(sendMetrics), "%s/send-metrics.jsonl", runDir);
+
+    char *recvCopy, *sendCopy;
+    char **recvArgv = splitArgs(recvArgs, 5, &recvCopy, &n);
+    snprintf(path, sizeof(path), "%s/recv-packets", tools);
+    recvArgv[0] = path;
+    recvArgv[1] = "-d";
+    recvArgv[2] = (char *) runDir;
+    recvArgv[3] = "-o";
+    recvArgv[4] = output;
+    recvArgv[n] = recvPath;
+    recvArgv[n + 1] = NULL;
+
+    pid_t recvPid = spawn(runDir, recvLog, recvArgv);
+
+    char sendTool[1024];
+    char **sendArgv = splitArgs(sendArgs, 5, &sendCopy, &n);
+    snprintf(sendTool, sizeof(sendTool), "%s/send-file", tools);
+    sendArgv[0] = sendTool;
+    sendArgv[1] = "-f";
+    sendArgv[2] = (char *) input;
+    sendArgv[3] = "-M";
+    sendArgv[4] = sendMetrics;
+    sendArgv[n] = sendPath;
+    sendArgv[n + 1] = NULL;
+
+    int64_t start = nowNs();
+    pid_t sendPid = spawn(runDir, sendLog, sendArgv);
+
+    Direction forward, reverse;
+    initDirection(&forward, sendMaster, recvMaster);
+    initDirection(&reverse, recvMaster, sendMaster);
+
+    int sendStatus = -1, recvStatus = -1;
+    int64_t firstExitNs = 0;
+
+    while (sendPid != 0 || recvPid != 0) {
+        int64_t now = nowNs();
+
+        if (now - start > timeout * 1e9
+            || (firstExitNs != 0 && now - firstExitNs > STRAGGLER_MS * 1000000LL)) {
+            result.timedOut = now - start > timeout * 1e9;
+            if (sendPid != 0)
+                kill(sendPid, SIGKILL);
+            if (recvPid != 0)
+                kill(recvPid, SIGKILL);
+        }
+
+        if (sendPid != 0 && waitpid(sendPid, &sendStatus, WNOHANG) == sendPid) {
+            // Done once the sender has every answer, the receiver may
+            // still be waiting out a lost goodbye
+            result.seconds = (nowNs() - start) / 1e9;
+            sendPid = 0;
+            firstExitNs = firstExitNs != 0 ? firstExitNs : nowNs();
+        }
+        if (recvPid != 0 && waitpid(recvPid, &recvStatus, WNOHANG) == recvPid) {
+            recvPid = 0;
+            firstExitNs = firstExitNs != 0 ? firstExitNs : nowNs();
+        }
+
+        // Wait for input the link has room for, for a tool to take what
+        // is due, or until the next chunk is due, checking on the tools
+        // every 10 ms
+        struct pollfd pfds[2] = { { sendMaster, 0, 0 }, { recvMaster, 0, 0 } };
+        int64_t waitNs = 10000000;
+        Direction *dirs[2] = { &forward, &reverse };
+
+        now = nowNs();
+        for (int d = 0; d < 2; ++d) {
+            Direction *dir = dirs[d];
+
+            if (wantsInput(dir, now))
+                pfds[d].events |= POLLIN;
+
+            if (dueChunk(dir, now) != NULL)
+                pfds[1 - d].events |= POLLOUT;
+            else if (dir->num > 0 && dir->chunks[dir->head].deliverNs - now < waitNs)
+                waitNs = dir->chunks[dir->head].deliverNs - now;
+        }
+
+        poll(pfds, 2, (int) ((waitNs + 999999) / 1000000));
+
+        for (int d = 0; d < 2; ++d) {
+            if (pfds[d].revents & POLLIN)
+                takeInput(dirs[d]);
+            deliver(dirs[d]);
+        }
+    }
+
+    result.ok = WIFEXITED(sendStatus) && WEXITSTATUS(sendStatus) == 0 && WIFEXITED(recvStatus)
+                && WEXITSTATUS(recvStatus) == 0 && sameContents(input, output);
+    result.retransmits = readCounter(sendMetrics, "retransmits");
+    result.forwardBytes = forward.bytes;
+    result.reverseBytes = reverse.bytes;
+    result.flipped = forward.flipped + reverse.flipped;
+    result.dropped = forward.dropped + reverse.dropped;
+    result.garbled = forward.garbled + reverse.garbled;
+
+    freeDirection(&forward);
+    freeDirection(&reverse);
+    free(recvCopy);
+    free(recvArgv);
+    free(sendCopy);
+    free(sendArgv);
+    close(sendSlave);
+    close(recvSlave);
+    close(sendMaster);
+    close(recvMaster);
+
+    return result;
+}
+
+static size_t parseSize(const char *str, char **end)
+{
+    double value = strtod(str, end);
+
+    switch (**end) {
+        case 'k': case 'K': value *= 1 << 10; *end += 1; break;
+        case 'm': case 'M': value *= 1 << 20; *end += 1; break;
+        case 'g': case 'G': value *= 1 << 30; *end += 1; break;
+    }
+
+    return value;
+}
+
+static void removeRun(const char *runDir)
+{
+    // Everything in it was put there by the tools or by this harness
+    DIR *dir = opendir(runDir);
+    struct dirent *entry;
+
+    if (dir == NULL)
+        return;
+
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_type == DT_REG)
+            unlinkat(dirfd(dir), entry->d_name, 0);
+    }
+
+    closedir(dir);
+    rmdir(runDir);
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    const char *tools = ".";
+    const char *sizes = DEFAULT_SIZES;
+    const char *sendArgs = "";
+    const char *recvArgs = "";
+    const char *jsonPath = NULL;
+    const char *keepDir = NULL;
+    unsigned long runs = DEFAULT_RUNS;
+    double timeout = 600;
+
+    int c = 0;
+    while (true) {
+        static struct option long_options[] = {
+            {"baud",        required_argument, 0, 'b'},
+            {"ber",         required_argument, 0, 'e'},
+            {"burst-every", required_argument, 0, 'B'},
+            {"burst-len",   required_argument, 0, 'L'},
+            {"drop",        required_argument, 0, 'x'},
+            {"jitter",      required_argument, 0, 'J'},
+            {"json",        required_argument, 0, 'j'},
+            {"keep",        required_argument, 0, 'k'},
+            {"latency",     required_argument, 0, 'l'},
+            {"recv-args",   required_argument, 0, 'R'},
+            {"runs",        required_argument, 0, 'n'},
+            {"seed",        required_argument, 0, 'r'},
+            {"send-args",   required_argument, 0, 'S'},
+            {"sizes",       required_argument, 0, 's'},
+            {"timeout",     required_argument, 0, 'T'},
+            {"tools",       required_argument, 0, 't'},
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+        c = getopt_long(argc, argv, "B:b:e:J:j:k:L:l:n:R:r:S:s:T:t:x:", long_options,
+                        &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'B':
+                // Mean number of bytes between error bursts, 0 for none
+                line.burstEvery = strtod(optarg, NULL);
+                break;
+            case 'b':
+                // Line rate in bits per second, 0 for as fast as it goes
+                line.baud = strtod(optarg, NULL);
+                break;
+            case 'e':
+                line.ber = strtod(optarg, NULL);
+                break;
+            case 'J':
+                line.jitterMs = strtod(optarg, NULL);
+                break;
+            case 'j':
+                // Results as JSON as well, - for standard output
+                jsonPath = optarg;
+                break;
+            case 'k':
+                // Keep every run's files, logs included, below this
+                // directory instead of a temporary one
+                keepDir = optarg;
+                break;
+            case 'L':
+                line.burstLen = strtoul(optarg, NULL, 0);
+                break;
+            case 'l':
+                line.latencyMs = strtod(optarg, NULL);
+                break;
+            case 'n':
+                runs = strtoul(optarg, NULL, 0);
+                break;
+            case 'R':
+                recvArgs = optarg;
+                break;
+            case 'r':
+                rngState = strtoull(optarg, NULL, 0) | 1;
+                break;
+            case 'S':
+                sendArgs = optarg;
+                break;
+            case 's':
+                sizes = optarg;
+                break;
+            case 'T':
+                // Seconds a run may take before both tools are killed
+                timeout = strtod(optarg, NULL);
+                break;
+            case 't':
+                // Where send-file and recv-packets are
+                tools = optarg;
+                break;
+            case 'x':
+                line.drop = strtod(optarg, NULL);
+                break;
+            default:
+                exit(-1);
+        }
+    }
+
+    if (line.ber < 0 || line.ber > 1 || line.drop < 0 || line.drop > 1) {
+        printf("Bit error and drop rates are probabilities, between 0 and 1\n");
+        exit(-1);
+    }
+
+    // The tools run in the run directories, so every path has to be
+    // absolute
+    char *toolsDir = realpath(tools, NULL);
+    if (toolsDir == NULL) {
+        perror("Error finding the tools");
+        exit(-1);
+    }
+
+    char workDir[512];
+    if (keepDir != NULL) {
+        if (mkdir(keepDir, 0755) == -1 && errno != EEXIST) {
+            perror("Error creating directory to keep runs in");
+            exit(-1);
+        }
+        char *abs = realpath(keepDir, NULL);
+        snprintf(workDir, sizeof(workDir), "%s", abs);
+        free(abs);
+    } else {
+        const char *tmp = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+        snprintf(workDir, sizeof(workDir), "%s/loopback-XXXXXX", tmp);
+        if (mkdtemp(workDir) == NULL) {
+            perror("Error creating temporary directory");
+            exit(-1);
+        }
+    }
+
+    FILE *json = NULL;
+    if (jsonPath != NULL) {
+        json = strcmp(jsonPath, "-") == 0 ? stdout : fopen(jsonPath, "w");
+        if (json == NULL) {
+            perror("Error opening JSON output");
+            exit(-1);
+        }
+
+        fprintf(json, "{\n  \"link\": {\"baud\": %.0f, \"latency_ms\": %g, \"jitter_ms\": %g, "
+                "\"ber\": %g, \"drop\": %g, \"burst_every\": %g, \"burst_len\": %lu},\n",
+                line.baud, line.latencyMs, line.jitterMs, line.ber, line.drop, line.burstEvery,
+                line.burstLen);
+        fprintf(json, "  \"send_args\": \"%s\",\n  \"recv_args\": \"%s\",\n  \"results\": [",
+                sendArgs, recvArgs);
+    }
+
+    // The summary only goes to standard output when the JSON doesn't
+    FILE *report = json == stdout ? stderr : stdout;
+    bool allOk = true;
+    bool firstResult = true;
+
+    for (const char *p = sizes; *p != '\0';) {
+        char *end;
+        size_t size = parseSize(p, &end);
+        if (end == p || (*end != ',' && *end != '\0')) {
+            printf("Can't make sense of the sizes %s\n", sizes);
+            exit(-1);
+        }
+        p = *end == ',' ? end + 1 : end;
+
+        char input[640];
+        snprintf(input, sizeof(input), "%s/in-%zu.bin", workDir, size);
+        writeInput(input, size);
+
+        double *seconds = malloc(runs * sizeof(double));
+        size_t okRuns = 0;
+        unsigned long retransmits = 0;
+
+        for (unsigned long r = 0; r < runs; ++r) {
+            char runDir[640];
+
+            snprintf(runDir, sizeof(runDir), "%s/run-%zu-%lu", workDir, size, r);
+            if (mkdir(runDir, 0755) == -1) {
+                perror("Error creating run directory");
+                exit(-1);
+            }
+
+            RunResult res = runOnce(toolsDir, runDir, input, sendArgs, recvArgs, timeout);
+
+            fprintf(report, "%10zu B run %lu: %s, %.2f s, %.1f B/s, %lu retransmits, "
+                    "%llu B forward, %llu B back, %llu bits flipped, %llu B dropped, "
+                    "%llu B garbled\n", size, r,
+                    res.ok ? "ok" : res.timedOut ? "TIMED OUT" : "FAILED", res.seconds,
+                    res.seconds > 0 ? size / res.seconds : 0, res.retransmits,
+                    (unsigned long long) res.forwardBytes, (unsigned long long) res.reverseBytes,
+                    (unsigned long long) res.flipped, (unsigned long long) res.dropped,
+                    (unsigned long long) res.garbled);
+
+            if (json != NULL) {
+                fprintf(json, "%s\n    {\"size\": %zu, \"run\": %lu, \"ok\": %s, "
+                        "\"timed_out\": %s, \"seconds\": %.4f, \"goodput_bytes_per_s\": %.1f, "
+                        "\"retransmits\": %lu, \"forward_bytes\": %llu, \"reverse_bytes\": %llu, "
+                        "\"flipped_bits\": %llu, \"dropped_bytes\": %llu, "
+                        "\"garbled_bytes\": %llu}", firstResult ? "" : ",", size, r,
+                        res.ok ? "true" : "false", res.timedOut ? "true" : "false", res.seconds,
+                        res.ok && res.seconds > 0 ? size / res.seconds : 0, res.retransmits,
+                        (unsigned long long) res.forwardBytes,
+                        (unsigned long long) res.reverseBytes,
+                        (unsigned long long) res.flipped, (unsigned long long) res.dropped,
+                        (unsigned long long) res.garbled);
+                firstResult = false;
+            }
+
+            if (res.ok) {
+                seconds[okRuns++] = res.seconds;
+                retransmits += res.retransmits;
+            }
+            allOk = allOk && res.ok;
+
+            if (keepDir == NULL && res.ok)
+                removeRun(runDir);
+        }
+
+        if (okRuns > 0) {
+            qsort(seconds, okRuns, sizeof(double), compareDoubles);
+            double median = okRuns % 2 == 1 ? seconds[okRuns / 2]
+                                            : (seconds[okRuns / 2 - 1] + seconds[okRuns / 2]) / 2;
+
+            fprintf(report, "%10zu B: %zu of %lu ok, median %.2f s, %.1f B/s goodput", size,
+                    okRuns, runs, median, size / median);
+            if (line.baud > 0)
+                fprintf(report, " (%.1f%% of the line)", size / median / (line.baud / 10) * 100);
+            fprintf(report, ", %.1f retransmits a run\n", (double) retransmits / okRuns);
+        } else {
+            fprintf(report, "%10zu B: no run succeeded\n", size);
+        }
+
+        free(seconds);
+        if (keepDir == NULL)
+            unlink(input);
+    }
+
+    if (json != NULL) {
+        fprintf(json, "\n  ]\n}\n");
+        if (json != stdout)
+            fclose(json);
+    }
+
+    // Failed runs are left behind to be looked at
+    if (keepDir == NULL && rmdir(workDir) == -1)
+        fprintf(report, "Failed runs are kept in %s\n", workDir);
+
+    free(toolsDir);
+
+    return allOk ? 0 : 1;
+}
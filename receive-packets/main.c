@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -11,226 +14,2452 @@
 #include <sys/stat.h>
 
 #include <fcntl.h>
+#include <linux/limits.h>
 
+#include <batch.h>
+#include <compress.h>
 #include <crc32.h>
+#include <delta.h>
+#include <fec.h>
+#include <journal.h>
+#include <log.h>
+#include <merkle.h>
+#include <metrics.h>
+#include <pool.h>
 #include <protocol.h>
+#include <reader.h>
+#include <serial.h>
+#include <sha256.h>
 #include <sha256_utils.h>
+#include <trace.h>
+#include <writer.h>
 
 
 
 #define RECEIVING_FILE "receiving.meta"
 //#define RECEIVED_PACKETS_DIR "received-packets"
 
-void readAllOrDie(int fd, uint8_t *buf, size_t len)
+// The serial device is read this much at a time, on top of room for the
+// largest frame of the transfer
+#define READER_SIZE 0x10000
+
+// Packet writes to the output file that can be in flight at once
+#define WRITE_DEPTH 16
+
+// A frame with a corrupted command byte or length is skipped by looking
+// for the next intact frame. Once the line has been quiet this long
+// without one turning up, the lost frame was the last one sent and the
+// sender is waiting for an answer to it.
+#define RESYNC_QUIET_MS 100
+
+// Returned by readPacketCommand in place of a command when a frame was lost
+#define FRAME_LOST      0
+#define FRAME_LOST_LAST 0xff
+
+#define COMMAND_BIT(command) ((command) < 32 ? 1u << (command) : 0)
+
+// Once every packet is in, the sender may still ask about answers it lost
+// before it ends the transfer. Without anything arriving for this long it
+// has either finished or isn't going to.
+#define LINGER_MS 3000
+
+void readAllOrDie(SerialReader *serial, uint8_t *buf, size_t len)
+{
+    if (reader_read(serial, buf, len) == -1) {
+        perror("Error reading serial device");
+        exit(-1);
+    }
+}
+
+const uint8_t* peekOrDie(SerialReader *serial, size_t len)
+{
+    if (reader_need(serial, len) == -1) {
+        perror("Error reading serial device");
+        exit(-1);
+    }
+
+    return reader_data(serial);
+}
+
+void writeAllOrDie(int fd, const uint8_t *data, size_t dataLen)
 {
-    size_t offset = 0;
+    size_t written = 0;
     ssize_t result;
-    while (offset < len) {
-        result = read(fd, buf + offset, len - offset);
+
+    while (written < dataLen) {
+        uint64_t start = metrics_timer();
+        result = write(fd, data + written, dataLen - written);
+        metrics_elapsed(METRIC_WRITE_BLOCKED, start);
+
         if (result == -1) {
-            perror("Error reading file descriptor");
+            perror("Error writing data to file descriptor");
             exit(-1);
         }
-        offset += result;
+        written += result;
     }
+
+    metrics_count(METRIC_WIRE_BYTES, dataLen);
 }
 
-void readHeader(int serialfd, uint8_t shaSum[32], size_t *fileSize, size_t *numPackets)
+bool readHeader(SerialReader *serial, uint8_t shaSum[32], size_t *fileSize, size_t *numPackets,
+                uint8_t *mode, uint16_t *window, uint8_t *flags, uint8_t merkleRoot[32],
+                size_t *packetSize, uint8_t *codec)
 {
-    uint8_t command;
-    uint8_t inBuf[48];
-    ssize_t result;
+    const uint8_t *inBuf;
+    uint32_t packetSize_32, crcSum;
 
     // Header format:
     //  * 1 byte for TRANSFER_START
+    //  * 4 bytes for crc32sum of everything after it
     //  * 8 bytes for file size in bytes
     //  * 8 bytes for number of packets
     //  * 32 bytes for sha256sum
+    //  * 1 byte for the proposed transfer mode
+    //  * 2 bytes for the proposed window size
+    //  * 1 byte for header flags
+    //  * 32 bytes for the merkle root, zero without TRANSFER_FLAG_MERKLE
+    //  * 4 bytes for the size of every packet but the last in bytes
+    //  * 1 byte for the proposed compression codec
+    //
+    // With TRANSFER_FLAG_TRAILER set the file size, number of packets and
+    // sha256sum are unknown until the TRANSFER_END trailer.
+    //
+    // Returns false, having dropped the first byte, unless an intact header
+    // starts the buffer. The sender sends the header again until it gets a
+    // reply, so skipping what comes ahead of it finds the next one.
 
-    result = read(serialfd, &command, 1);
-    if (result == -1) {
-        perror("Error reading header command");
+    inBuf = peekOrDie(serial, 1);
+    if (inBuf[0] != TRANSFER_START) {
+        reader_consume(serial, 1);
+        return false;
+    }
+
+    inBuf = peekOrDie(serial, 94);
+    memcpy(&crcSum, inBuf + 1, 4);
+    if (crcSum != crc32(inBuf + 5, 89)) {
+        LOG_WARN("Error receiving header: calculated checksum differs from given.\n");
+        metrics_count(METRIC_CRC_FAILURES, 1);
+        reader_consume(serial, 1);
+        return false;
+    }
+
+    memcpy(fileSize, inBuf + 5, 8);
+    memcpy(numPackets, inBuf + 13, 8);
+    memcpy(shaSum, inBuf + 21, 32);
+    *mode = inBuf[53];
+    memcpy(window, inBuf + 54, 2);
+    *flags = inBuf[56];
+    memcpy(merkleRoot, inBuf + 57, 32);
+    memcpy(&packetSize_32, inBuf + 89, 4);
+    *codec = inBuf[93];
+
+    *packetSize = packetSize_32;
+    reader_consume(serial, 94);
+
+    return true;
+}
+
+bool trailerIntact(SerialReader *serial)
+{
+    // Called with the rest of a trailer buffered, its command already
+    // consumed by the packet loop. One that doesn't check out is left where
+    // it is for the packet loop to resynchronise past.
+
+    const uint8_t *inBuf = reader_data(serial);
+    uint32_t crcSum;
+
+    memcpy(&crcSum, inBuf, 4);
+    if (crcSum == crc32(inBuf + 4, 48))
+        return true;
+
+    LOG_WARN("Error receiving trailer: calculated checksum differs from given.\n");
+    metrics_count(METRIC_CRC_FAILURES, 1);
+    return false;
+}
+
+void readTrailer(SerialReader *serial, uint8_t shaSum[32], size_t *fileSize, size_t *numPackets)
+{
+    uint8_t inBuf[52];
+
+    // Trailer format:
+    //  * 1 byte for TRANSFER_END, already consumed by the packet loop
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 8 bytes for file size in bytes
+    //  * 8 bytes for number of packets
+    //  * 32 bytes for sha256sum
+
+    readAllOrDie(serial, inBuf, 52);
+
+    memcpy(fileSize, inBuf + 4, 8);
+    memcpy(numPackets, inBuf + 12, 8);
+    memcpy(shaSum, inBuf + 20, 32);
+}
+
+uint8_t* frameHeaderReply(uint8_t mode, uint16_t window, uint8_t codec, const uint8_t *bitmap,
+                          size_t bitmapLen, size_t *replyLen)
+{
+    uint8_t *outBuf;
+    uint64_t bitmapLen_64;
+    uint32_t crcSum;
+
+    // Header reply format:
+    //  * 1 byte for TRANSFER_START
+    //  * 4 bytes for crc32sum of everything after it, bitmap included
+    //  * 1 byte for the accepted transfer mode
+    //  * 2 bytes for the accepted window size
+    //  * 1 byte for the accepted compression codec
+    //  * 8 bytes for the length of the received packet bitmap
+    //  * n bytes of bitmap, bit i % 8 of byte i / 8 set for every packet
+    //    already received in an earlier attempt at this transfer
+    //
+    // Returns the reply, which is kept to be sent again if the header comes
+    // again
+
+    *replyLen = 17 + bitmapLen;
+    outBuf = malloc(*replyLen);
+    if (outBuf == NULL) {
+        printf("Error allocating the header reply\n");
         exit(-1);
     }
 
-    if (command != TRANSFER_START) {
-        printf("Recieved erroneous command instead of TRANSFER_START\n");
+    bitmapLen_64 = bitmapLen;
+
+    outBuf[0] = TRANSFER_START;
+    outBuf[5] = mode;
+    memcpy(outBuf + 6, &window, 2);
+    outBuf[8] = codec;
+    memcpy(outBuf + 9, &bitmapLen_64, 8);
+    if (bitmapLen > 0)
+        memcpy(outBuf + 17, bitmap, bitmapLen);
+
+    crcSum = crc32(outBuf + 5, *replyLen - 5);
+    memcpy(outBuf + 1, &crcSum, 4);
+
+    return outBuf;
+}
+
+void signBasis(const char *path, DeltaSignatures *sigs)
+{
+    // A copy that isn't there yet leaves nothing to build a delta on, the
+    // whole file is sent instead
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 && errno == ENOENT) {
+        LOG_INFO("No copy at %s yet, a delta can't be built on it\n", path);
+        return;
+    }
+
+    if (fd == -1 || delta_sign(fd, sigs) == -1) {
+        perror("Error signing basis");
         exit(-1);
     }
+    close(fd);
+
+    LOG_INFO("Signed %zu blocks of %u bytes of %s\n", sigs->blockNum, sigs->blockSize, path);
+}
+
+void writeSignatures(int serialfd, const DeltaSignatures *sigs, uint32_t first)
+{
+    uint8_t header[55];
+    uint32_t crcSum;
+    uint16_t count;
+
+    // Signatures format:
+    //  * 1 byte for TRANSFER_SIGNATURES
+    //  * 4 bytes for block size in bytes
+    //  * 8 bytes for the size of the copy in bytes, 0 without one
+    //  * 32 bytes for its sha256sum
+    //  * 4 bytes for the first block answered for
+    //  * 2 bytes for the number of blocks answered for, n
+    //  * 4 bytes for crc32sum of the above, less the command
+    //  * 4 bytes for crc32sum and DELTA_STRONG_SIZE bytes for the start of
+    //    the sha256sum of each of the n blocks, in order
+    //  * 4 bytes for crc32sum of the blocks
+
+    count = first >= sigs->blockNum ? 0
+            : sigs->blockNum - first < MAX_SIGNATURES ? sigs->blockNum - first
+            : MAX_SIGNATURES;
 
-    readAllOrDie(serialfd, inBuf, 48);
+    header[0] = TRANSFER_SIGNATURES;
+    memcpy(header + 1, &sigs->blockSize, 4);
+    memcpy(header + 5, &sigs->basisLen, 8);
+    memcpy(header + 13, sigs->basisSum, 32);
+    memcpy(header + 45, &first, 4);
+    memcpy(header + 49, &count, 2);
+    crcSum = crc32(header + 1, 50);
+    memcpy(header + 51, &crcSum, 4);
 
-    //*fileSize = *((uint64_t*) (inBuf + 0));
-    //*numPackets = *((uint64_t*) (inBuf + 8));
-    memcpy(fileSize, inBuf + 0, 8);
-    memcpy(numPackets, inBuf + 8, 8);
-    memcpy(shaSum, inBuf + 16, 32);
+    const uint8_t *blocks = (const uint8_t *) (sigs->blocks + (count > 0 ? first : 0));
+    size_t blocksLen = count * sizeof(DeltaBlock);
+
+    writeAllOrDie(serialfd, header, sizeof(header));
+    if (count > 0)
+        writeAllOrDie(serialfd, blocks, blocksLen);
+
+    crcSum = crc32(blocks, blocksLen);
+    writeAllOrDie(serialfd, (const uint8_t *) &crcSum, 4);
 }
 
-void createMetadataFile(uint8_t shaSum[32], size_t fileLen, size_t packetNum)
+void createMetadataFile(const char *dir, uint8_t shaSum[32], size_t fileLen, size_t packetNum,
+                        size_t packetSize)
 {
+    // Goes in the packet directory, where stitch looks for it
     char shaStr[65];
+    char metaPath[PATH_MAX];
     FILE *metafp;
 
     sha256Str(shaStr, shaSum);
+    if ((size_t) snprintf(metaPath, sizeof(metaPath), "%s/%s", dir, RECEIVING_FILE)
+        >= sizeof(metaPath)) {
+        printf("Directory path %s is too long\n", dir);
+        exit(-1);
+    }
 
-    // TODO: check if the file exists already to handle resuming transfers
-    //       otherwise this file would be pointless
-    metafp = fopen(RECEIVING_FILE, "w");
+    metafp = fopen(metaPath, "w");
     if (metafp == NULL) {
         perror("Error creating recieving metadata file");
         exit(-1);
     }
 
-    fprintf(metafp, "%s\n%zu\n%zu\n", shaStr, fileLen, packetNum);
+    fprintf(metafp, "%s\n%zu\n%zu\n%zu\n", shaStr, fileLen, packetNum, packetSize);
     fclose(metafp);
 }
 
-void readPacketHeader(int serialfd, uint16_t *packetLen, uint32_t *crcSum)
+size_t frameHeaderLength(uint8_t command)
 {
-    uint8_t pktCommand = 0;
-    ssize_t pktRes = read(serialfd, &pktCommand, 1);
-    if (pktRes == -1) {
-        perror("Error reading packet command");
-        exit(-1);
+    // Everything in front of the payload, 0 for commands that aren't frames
+
+    switch (command) {
+        case TRANSFER_START:
+            return 94;
+        case TRANSFER_END:
+            return 53;
+        case TRANSFER_PACKET:
+            return 9;
+        case TRANSFER_WINDOW_PACKET:
+            return 13;
+        case TRANSFER_OFFSET_PACKET:
+        case TRANSFER_LEAVES:
+            return 17;
+        case TRANSFER_REPAIR_PACKET:
+            return 15;
+        case TRANSFER_GROUP_END:
+        case TRANSFER_QUERY:
+            return 11;
+        default:
+            return 0;
     }
+}
 
-    if (pktCommand == TRANSFER_END) {
-        printf("Recieved a premature transfer_end command.\n");
-        exit(-1);
-    } else if (pktCommand != TRANSFER_PACKET) {
-        printf("Recieved erroneous command instead of transfer_packet.\n");
-        exit(-1);
+size_t framePayloadLength(const uint8_t *header)
+{
+    uint32_t len_32;
+    uint16_t count;
+
+    switch (header[0]) {
+        case TRANSFER_START:
+        case TRANSFER_END:
+            return 0;
+        case TRANSFER_PACKET:
+            memcpy(&len_32, header + 1, 4);
+            return len_32;
+        case TRANSFER_GROUP_END:
+            memcpy(&count, header + 9, 2);
+            return 4 * (size_t) count;
+        case TRANSFER_QUERY:
+            memcpy(&count, header + 9, 2);
+            return 8 * (size_t) count;
+        default:
+            // The rest end their header with the payload length
+            memcpy(&len_32, header + frameHeaderLength(header[0]) - 4, 4);
+            return len_32;
+    }
+}
+
+bool frameFits(const uint8_t *header, size_t maxLen)
+{
+    size_t limit = header[0] == TRANSFER_GROUP_END ? 4 * MAX_WINDOW_SIZE
+                   : header[0] == TRANSFER_QUERY ? 8 * MAX_WINDOW_SIZE : maxLen;
+    return framePayloadLength(header) <= limit;
+}
+
+bool frameIntact(const uint8_t *frame, size_t frameLen)
+{
+    uint32_t crcSum;
+
+    // Plain packets only checksum their data, the other frames everything
+    // after the crc32sum
+    if (frame[0] == TRANSFER_PACKET) {
+        memcpy(&crcSum, frame + 5, 4);
+        return crcSum == crc32(frame + 9, frameLen - 9);
+    }
+
+    memcpy(&crcSum, frame + 1, 4);
+    return crcSum == crc32(frame + 5, frameLen - 5);
+}
+
+bool resyncStream(SerialReader *serial, uint32_t expected, size_t maxLen)
+{
+    // Drops the corrupted frame at the front of the buffer along with
+    // everything up to the next intact frame of an expected kind, or all of
+    // it once the line has gone quiet without one turning up. Returns
+    // whether it went quiet.
+
+    size_t from = 1;
+    size_t dropped = 0;
+
+    metrics_count(METRIC_RESYNCS, 1);
+
+    while (true) {
+        const uint8_t *buf = reader_data(serial);
+        size_t avail = reader_available(serial);
+        size_t partial = avail;
+
+        for (size_t o = from; o < avail; ++o) {
+            size_t headerLen = frameHeaderLength(buf[o]);
+
+            if (!(expected & COMMAND_BIT(buf[o])) || headerLen == 0)
+                continue;
+
+            // Frames that could still be arriving are looked at again once
+            // more of them has
+            if (avail - o < headerLen) {
+                partial = partial < o ? partial : o;
+                continue;
+            }
+
+            if (!frameFits(buf + o, maxLen))
+                continue;
+
+            size_t frameLen = headerLen + framePayloadLength(buf + o);
+            if (avail - o < frameLen) {
+                partial = partial < o ? partial : o;
+                continue;
+            }
+
+            if (frameIntact(buf + o, frameLen)) {
+                LOG_WARN("Resynchronised after dropping %zu bytes\n", dropped + o);
+                trace_event(TRACE_RESYNC, 0, dropped + o, 0);
+
+                reader_consume(serial, o);
+                return false;
+            }
+        }
+
+        reader_consume(serial, partial);
+        dropped += partial;
+        from = 0;
+
+        ssize_t result = reader_fill(serial, RESYNC_QUIET_MS);
+        if (result == -1) {
+            perror("Error reading serial device");
+            exit(-1);
+        }
+
+        if (result == 0) {
+            LOG_WARN("Line went quiet after dropping %zu bytes\n",
+                     dropped + reader_available(serial));
+            trace_event(TRACE_RESYNC, 0, dropped + reader_available(serial), 1);
+
+            reader_consume(serial, reader_available(serial));
+            return true;
+        }
+    }
+}
+
+uint8_t readPacketCommand(SerialReader *serial, uint32_t expected, size_t maxLen, bool ending)
+{
+    // Returns the command of the next frame, one of the expected ones or,
+    // when the sender may be ending the transfer, TRANSFER_END, and leaves
+    // the rest of the frame to be read. Anything else, or a payload longer
+    // than maxLen, means the command or length got corrupted and there's no
+    // telling where the frame ends. The stream is resynchronised then and
+    // FRAME_LOST or FRAME_LOST_LAST returned instead.
+
+    uint8_t command = peekOrDie(serial, 1)[0];
+    size_t headerLen = frameHeaderLength(command);
+
+    if (command == TRANSFER_END && ending) {
+        reader_consume(serial, 1);
+        return command;
+    }
+
+    if ((expected & COMMAND_BIT(command)) && headerLen > 0
+        && frameFits(peekOrDie(serial, headerLen), maxLen)) {
+        // The whole frame is waited for here, so one that lost bytes on
+        // the way is dropped once the line goes quiet instead of swallowing
+        // whatever the sender sends next
+        int result = reader_need_within(serial,
+                                        headerLen + framePayloadLength(reader_data(serial)),
+                                        RESYNC_QUIET_MS);
+        if (result == -1) {
+            perror("Error reading serial device");
+            exit(-1);
+        }
+
+        if (result == 1) {
+            reader_consume(serial, 1);
+            return command;
+        }
+
+        LOG_WARN("Recieved a frame cut short, resynchronising.\n");
+    } else {
+        LOG_WARN("Recieved erroneous command instead of a packet, resynchronising.\n");
     }
 
+    return resyncStream(serial, expected, maxLen) ? FRAME_LOST_LAST : FRAME_LOST;
+}
+
+void readPacketHeader(SerialReader *serial, uint32_t *packetLen, uint32_t *crcSum)
+{
     // read packet header
-    uint8_t pktHeader[6];
-    readAllOrDie(serialfd, pktHeader, 6);
+    uint8_t pktHeader[8];
+    readAllOrDie(serial, pktHeader, 8);
 
-    //*packetLen = *((uint16_t *) (pktHeader + 0));
-    //*crcSum    = *((uint32_t *) (pktHeader + 2));
-    memcpy(packetLen, pktHeader + 0, 2);
-    memcpy(crcSum, pktHeader + 2, 4);
+    //*packetLen = *((uint32_t *) (pktHeader + 0));
+    //*crcSum    = *((uint32_t *) (pktHeader + 4));
+    memcpy(packetLen, pktHeader + 0, 4);
+    memcpy(crcSum, pktHeader + 4, 4);
 }
 
-uint8_t* readPacket(int serialfd, size_t packetLen)
+uint8_t* readPacket(SerialReader *serial, BufferPool *pool, size_t packetLen)
 {
-    uint8_t *data = malloc(packetLen);
-    readAllOrDie(serialfd, data, packetLen);
+    // The pool's buffers hold the largest payload the transfer allows, and
+    // readPacketCommand doesn't let through frames claiming more
+    if (packetLen > pool->bufSize) {
+        printf("Recieved a packet longer than the packet size, lost track of the stream\n");
+        exit(-1);
+    }
+
+    uint8_t *data = pool_get(pool);
+    readAllOrDie(serial, data, packetLen);
 
     return data;
 }
 
+bool readWindowPacket(SerialReader *serial, BufferPool *pool, size_t packetSize, uint32_t *seq,
+                      uint32_t *packetLen, uint8_t **data)
+{
+    // Windowed packet format:
+    //  * 1 byte for TRANSFER_WINDOW_PACKET
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 4 bytes for sequence number
+    //  * 4 bytes for packet size in bytes
+    //  * n bytes for packet data
+    //
+    // The command has already been consumed by readPacketCommand. Returns
+    // whether the crc32sum matched, the sequence number and packet data are
+    // only meaningful when it did.
+
+    uint8_t pktHeader[12];
+    uint32_t crcSum;
+    readAllOrDie(serial, pktHeader, 12);
+
+    memcpy(&crcSum, pktHeader + 0, 4);
+    memcpy(seq, pktHeader + 4, 4);
+    memcpy(packetLen, pktHeader + 8, 4);
+
+    // The crc covers the sequence number and length as well as the data
+    CRC32_CTX crcCtx;
+    crc32_init(&crcCtx);
+    crc32_update(&crcCtx, pktHeader + 4, 8);
+
+    *data = readPacket(serial, pool, *packetLen);
+    crc32_update(&crcCtx, *data, *packetLen);
+
+    bool intact = crcSum == crc32_final(&crcCtx) && *packetLen <= packetSize;
+    trace_event(TRACE_FRAME, *seq, 13 + *packetLen, intact);
+    return intact;
+}
+
+bool readOffsetPacket(SerialReader *serial, BufferPool *pool, size_t frameSize, uint64_t *offset,
+                      uint32_t *packetLen, uint8_t **data)
+{
+    // Offset packet format:
+    //  * 1 byte for TRANSFER_OFFSET_PACKET
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 8 bytes for the file offset of the first byte
+    //  * 4 bytes for frame size in bytes
+    //  * n bytes for the data of one or more consecutive packets
+    //
+    // The command has already been consumed by readPacketCommand. Returns
+    // whether the crc32sum matched.
+
+    uint8_t pktHeader[16];
+    uint32_t crcSum;
+    readAllOrDie(serial, pktHeader, 16);
+
+    memcpy(&crcSum, pktHeader + 0, 4);
+    memcpy(offset, pktHeader + 4, 8);
+    memcpy(packetLen, pktHeader + 12, 4);
+
+    CRC32_CTX crcCtx;
+    crc32_init(&crcCtx);
+    crc32_update(&crcCtx, pktHeader + 4, 12);
+
+    *data = readPacket(serial, pool, *packetLen);
+    crc32_update(&crcCtx, *data, *packetLen);
+
+    bool intact = crcSum == crc32_final(&crcCtx) && *packetLen <= frameSize;
+    trace_event(TRACE_FRAME, *offset, 17 + *packetLen, intact);
+    return intact;
+}
+
+bool readRepairPacket(SerialReader *serial, BufferPool *pool, size_t symbolSize, uint32_t *group,
+                      uint16_t *index, uint32_t *repairLen, uint8_t **data)
+{
+    // Repair packet format:
+    //  * 1 byte for TRANSFER_REPAIR_PACKET
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 4 bytes for group number
+    //  * 2 bytes for repair symbol index
+    //  * 4 bytes for repair symbol size in bytes
+    //  * n bytes for the repair symbol
+    //
+    // The command has already been consumed. Returns whether the crc32sum
+    // matched.
+
+    uint8_t pktHeader[14];
+    uint32_t crcSum;
+    readAllOrDie(serial, pktHeader, 14);
+
+    memcpy(&crcSum, pktHeader + 0, 4);
+    memcpy(group, pktHeader + 4, 4);
+    memcpy(index, pktHeader + 8, 2);
+    memcpy(repairLen, pktHeader + 10, 4);
+
+    CRC32_CTX crcCtx;
+    crc32_init(&crcCtx);
+    crc32_update(&crcCtx, pktHeader + 4, 10);
+
+    *data = readPacket(serial, pool, *repairLen);
+    crc32_update(&crcCtx, *data, *repairLen);
+
+    bool intact = crcSum == crc32_final(&crcCtx) && *repairLen <= symbolSize;
+    trace_event(TRACE_REPAIR, (uint64_t) *group << 16 | *index, 15 + *repairLen, intact);
+    return intact;
+}
+
+bool readGroupEnd(SerialReader *serial, uint32_t *group, uint16_t *count, uint32_t *seqs)
+{
+    // Group end format:
+    //  * 1 byte for TRANSFER_GROUP_END
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 4 bytes for group number
+    //  * 2 bytes for the number of packets in the group
+    //  * 4 bytes for the sequence number of each packet, in symbol order
+    //
+    // The command has already been consumed. Returns whether the crc32sum
+    // matched.
+
+    uint8_t inBuf[10 + 4 * MAX_WINDOW_SIZE];
+    uint32_t crcSum;
+    readAllOrDie(serial, inBuf, 10);
+
+    memcpy(&crcSum, inBuf + 0, 4);
+    memcpy(group, inBuf + 4, 4);
+    memcpy(count, inBuf + 8, 2);
+
+    if (*count > MAX_WINDOW_SIZE) {
+        printf("Error receiving group end: %u packets is too many\n", *count);
+        exit(-1);
+    }
+
+    readAllOrDie(serial, inBuf + 10, 4 * (size_t) *count);
+    memcpy(seqs, inBuf + 10, 4 * (size_t) *count);
+
+    bool intact = crcSum == crc32(inBuf + 4, 6 + 4 * (size_t) *count);
+    trace_event(TRACE_GROUP_END, *group, 11 + 4 * (size_t) *count, intact);
+    return intact;
+}
+
 void replyCommand(int serialfd, uint8_t command)
 {
+    uint64_t start = metrics_timer();
     ssize_t result = write(serialfd, &command, 1);
+    metrics_elapsed(METRIC_WRITE_BLOCKED, start);
+
     if (result == -1) {
         perror("Error writing reply command");
         exit(-1);
     }
+
+    metrics_count(METRIC_WIRE_BYTES, 1);
+    trace_event(TRACE_ANSWER, TRACE_NO_SEQ, 1, command);
 }
 
-int main(int argc, char **argv)
+void replySealed(int serialfd, uint8_t command)
 {
-    char dir[1024] = "";
-    size_t start = 0;
+    // Sealed answer format:
+    //  * 1 byte for the command
+    //  * 4 bytes for crc32sum of the command
+    //
+    // For the answers that end a transfer, which the sender can't tell
+    // from a corrupted one without the checksum
 
-    int c = 0;
-    while (true) {
-        static struct option long_options[] = {
-            {"directory", required_argument, 0, 'd'},
-            {"start",     required_argument, 0, 's'},
-            {0, 0, 0, 0}
-        };
+    uint8_t outBuf[TRANSFER_SEALED_SIZE] = { command };
+    uint32_t crcSum = crc32(outBuf, 1);
+    memcpy(outBuf + 1, &crcSum, 4);
 
-        int option_index = 0;
-        c = getopt_long(argc, argv, "d:s:", long_options, &option_index);
-        if (c == -1)
-            break;
+    writeAllOrDie(serialfd, outBuf, TRANSFER_SEALED_SIZE);
+    trace_event(TRACE_ANSWER, TRACE_NO_SEQ, TRANSFER_SEALED_SIZE, command);
+}
 
-        switch (c) {
-            case 'd':
-                strncpy(dir, optarg, sizeof(dir));
-                break;
-            case 's':
-                start = strtoul(optarg, NULL, 0);
-                break;
-        }
+bool isSealed(const uint8_t *inBuf, uint8_t command)
+{
+    uint32_t crcSum;
+
+    memcpy(&crcSum, inBuf + 1, 4);
+    return inBuf[0] == command && crcSum == crc32(&command, 1);
+}
+
+void replyAbort(int serialfd)
+{
+    replySealed(serialfd, TRANSFER_ERROR);
+}
+
+void replyWindowCommand(int serialfd, uint8_t command, uint32_t seq)
+{
+    // Windowed response format:
+    //  * 1 byte for TRANSFER_ACK or TRANSFER_NAK
+    //  * 4 bytes for the sequence number it refers to
+
+    uint8_t outBuf[5];
+    outBuf[0] = command;
+    memcpy(outBuf + 1, &seq, 4);
+
+    writeAllOrDie(serialfd, outBuf, 5);
+    trace_event(TRACE_ANSWER, seq, 5, command);
+}
+
+void writeGroupStatus(int serialfd, uint32_t group, uint16_t count, const uint8_t *missing)
+{
+    // Group status format:
+    //  * 1 byte for TRANSFER_GROUP_STATUS
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 4 bytes for group number
+    //  * 2 bytes for the number of packets in the group
+    //  * (count + 7) / 8 bytes for a bitmap of the packets still missing
+
+    uint8_t outBuf[11 + MAX_WINDOW_SIZE / 8];
+    size_t bitmapLen = (count + 7) / 8;
+    uint32_t crcSum;
+
+    outBuf[0] = TRANSFER_GROUP_STATUS;
+    memcpy(outBuf + 5, &group, 4);
+    memcpy(outBuf + 9, &count, 2);
+    memcpy(outBuf + 11, missing, bitmapLen);
+
+    crcSum = crc32(outBuf + 5, 6 + bitmapLen);
+    memcpy(outBuf + 1, &crcSum, 4);
+
+    writeAllOrDie(serialfd, outBuf, 11 + bitmapLen);
+    trace_event(TRACE_ANSWER, group, 11 + bitmapLen, TRANSFER_GROUP_STATUS);
+}
+
+void answerQuery(SerialReader *serial, const uint8_t *received, size_t bitmapLen, size_t below)
+{
+    // Query format:
+    //  * 1 byte for TRANSFER_QUERY
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 4 bytes for the query id
+    //  * 2 bytes for the number of packets asked about
+    //  * 8 bytes for the number of each packet
+    //
+    // Answer format:
+    //  * 1 byte for TRANSFER_QUERY
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 4 bytes for the query id
+    //  * 2 bytes for the number of packets asked about
+    //  * (count + 7) / 8 bytes for a bitmap of the ones received
+    //
+    // Packets count as received if they're in the bitmap or numbered below
+    // below. The command has already been consumed, readPacketCommand only
+    // lets through queries of at most MAX_WINDOW_SIZE packets. A damaged
+    // query goes unanswered, the sender asks again.
+
+    uint8_t inBuf[10 + 8 * MAX_WINDOW_SIZE];
+    uint8_t outBuf[11 + MAX_WINDOW_SIZE / 8] = { 0 };
+    uint32_t crcSum;
+    uint16_t count;
+
+    readAllOrDie(serial, inBuf, 10);
+    memcpy(&count, inBuf + 8, 2);
+    readAllOrDie(serial, inBuf + 10, 8 * (size_t) count);
+
+    uint32_t id;
+    memcpy(&id, inBuf + 4, 4);
+    memcpy(&crcSum, inBuf, 4);
+    trace_event(TRACE_QUERY, id, 11 + 8 * (size_t) count, 0);
+    if (crcSum != crc32(inBuf + 4, 6 + 8 * (size_t) count)) {
+        LOG_WARN("Error receiving query: calculated checksum differs from given.\n");
+        metrics_count(METRIC_CRC_FAILURES, 1);
+        return;
     }
 
-    if (optind == argc) {
-        printf("%s expects a serial device to communicate across\n", argv[0]);
-        exit(-1);
+    size_t answerLen = (count + 7) / 8;
+    for (size_t p = 0; p < count; ++p) {
+        uint64_t i;
+
+        memcpy(&i, inBuf + 10 + 8 * p, 8);
+        if (i < below || (received != NULL && bitmap_has(received, bitmapLen, i)))
+            outBuf[11 + p / 8] |= 1 << (p % 8);
     }
 
-    size_t fileLen, packetNum;
-    uint8_t shaSum[32];
-    int serialfd;
+    LOG_DEBUG("\tAnswering a query about %u packets\n", count);
 
-    serialfd = open(argv[1], O_RDWR);
-    if (serialfd == -1) {
-        perror("Error opening serial device");
+    outBuf[0] = TRANSFER_QUERY;
+    memcpy(outBuf + 5, inBuf + 4, 6);
+
+    crcSum = crc32(outBuf + 5, 6 + answerLen);
+    memcpy(outBuf + 1, &crcSum, 4);
+
+    writeAllOrDie(serial->fd, outBuf, 11 + answerLen);
+    trace_event(TRACE_ANSWER, id, 11 + answerLen, TRANSFER_QUERY);
+}
+
+bool senderLingers(SerialReader *serial)
+{
+    // Called once every packet is in. Returns whether anything, a query or
+    // the sender's TRANSFER_END, arrived within LINGER_MS.
+
+    if (reader_available(serial) > 0)
+        return true;
+
+    ssize_t result = reader_fill(serial, LINGER_MS);
+    if (result == -1) {
+        perror("Error reading serial device");
         exit(-1);
     }
 
-    readHeader(serialfd, shaSum, &fileLen, &packetNum);
-    createMetadataFile(shaSum, fileLen, packetNum);
+    return result > 0;
+}
 
-    // Debug info
-    printf("Received header, listening for packets...\n\n");
+void answerHeaderAgain(SerialReader *serial, const uint8_t *reply, size_t replyLen)
+{
+    // The header only comes again when the sender didn't get our reply to
+    // it. Its command has already been consumed. A damaged one is dropped,
+    // it comes again too.
 
-    // Read the packets
-    for (size_t i = start; i < packetNum;) {
-        uint16_t packetLen;
-        uint32_t crcSum;
-        uint8_t *data;
+    const uint8_t *inBuf = peekOrDie(serial, 93);
+    uint32_t crcSum;
 
-        // Debug info
-        printf("Listening for packet%zu...\n", i);
+    memcpy(&crcSum, inBuf, 4);
+    bool intact = crcSum == crc32(inBuf + 4, 89);
+    reader_consume(serial, 93);
 
-        readPacketHeader(serialfd, &packetLen, &crcSum);
+    if (intact) {
+        LOG_WARN("Received the header again, answering it again\n");
+        writeAllOrDie(serial->fd, reply, replyLen);
+    }
+}
 
-        // Debug info
-        printf("\tReceived header: %u, %u\n", packetLen, crcSum);
+void replyLeaves(int serialfd, size_t filled)
+{
+    uint8_t outBuf[13] = { TRANSFER_LEAVES };
+    uint64_t filled_64 = filled;
+    uint32_t crcSum;
 
-        data = readPacket(serialfd, packetLen);
+    // Leaves answer format:
+    //  * 1 byte for TRANSFER_LEAVES
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 8 bytes for the number of leaves received so far
 
-        // Debug info
-        printf("\tReceived packet data, sending reply...\n");
+    memcpy(outBuf + 5, &filled_64, 8);
+    crcSum = crc32(outBuf + 5, 8);
+    memcpy(outBuf + 1, &crcSum, 4);
 
-        // calculate the crc32sum on this end to verify packet integrity
-        if (crcSum != crc32(data, packetLen)) {
-            // If the calculated crc32sum differs from given,
-            // request that the packet is sent again
-            printf("Error receiving packet: calculated crc32sum differs from given.\n");
-            replyCommand(serialfd, TRANSFER_AGAIN);
-            free(data);
+    writeAllOrDie(serialfd, outBuf, sizeof(outBuf));
+}
+
+uint8_t (*readLeaves(SerialReader *serial, const uint8_t merkleRoot[32], size_t leafNum,
+                     const uint8_t *reply, size_t replyLen))[32]
+{
+    // Leaves format:
+    //  * 1 byte for TRANSFER_LEAVES
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 8 bytes for the number of the first leaf
+    //  * 4 bytes for the length of the leaves in bytes
+    //  * 32 bytes per packet for its merkle leaf, in packet order, for at
+    //    most MAX_LEAVES packets
+    //
+    // Every chunk is answered with the number of leaves we have, a damaged
+    // or out of order one just doesn't add to it. Leaves that don't hash to
+    // the root from the header are asked for again from the start. Returns
+    // them once they do and something other than the leaves follows, the
+    // sender sends the last chunk again when our answer got lost.
+
+    if (leafNum > SIZE_MAX / 32) {
+        printf("Transfer has too many packets for merkle leaves\n");
+        replyAbort(serial->fd);
+        exit(-1);
+    }
+
+    uint8_t (*leaves)[32] = malloc(leafNum * 32);
+    if (leaves == NULL && leafNum > 0) {
+        printf("Error allocating the merkle leaves\n");
+        replyAbort(serial->fd);
+        exit(-1);
+    }
+
+    size_t filled = 0;
+    uint8_t root[32];
+
+    while (filled < leafNum || peekOrDie(serial, 1)[0] == TRANSFER_LEAVES
+           || reader_data(serial)[0] == TRANSFER_START) {
+        uint8_t command = readPacketCommand(serial, COMMAND_BIT(TRANSFER_LEAVES)
+                                                    | COMMAND_BIT(TRANSFER_START),
+                                            MAX_LEAVES * 32, false);
+
+        // The sender didn't get our reply to the header
+        if (command == TRANSFER_START) {
+            answerHeaderAgain(serial, reply, replyLen);
             continue;
         }
 
-        replyCommand(serialfd, TRANSFER_NEXT);
+        // The next intact chunk is already here and gets answered instead
+        if (command == FRAME_LOST)
+            continue;
 
-        // Debug info
-        printf("Packet intact, writing out to file\n");
+        if (command == FRAME_LOST_LAST) {
+            replyLeaves(serial->fd, filled);
+            continue;
+        }
 
-        char packetPath[1024];
-        strncpy(packetPath, dir, sizeof(packetPath));
-        strncat(packetPath, "/", sizeof(packetPath) - strlen(packetPath) - 1);
-        snprintf(packetPath + strlen(packetPath), sizeof(packetPath) - strlen(packetPath),
-                 "%zu.pkt", i);
+        // readPacketCommand waited for all of it
+        const uint8_t *inBuf = reader_data(serial);
+        uint32_t crcSum, len_32;
+        uint64_t first_64;
 
-        FILE *packetfp = fopen(packetPath, "w");
-        if (packetfp == NULL) {
-            perror("Error opening packet file for write");
-            exit(-1);
-        }
+        memcpy(&crcSum, inBuf, 4);
+        memcpy(&first_64, inBuf + 4, 8);
+        memcpy(&len_32, inBuf + 12, 4);
 
-        fwrite(data, 1, packetLen, packetfp);
-        fclose(packetfp);
-        free(data);
+        if (crcSum != crc32(inBuf + 4, 12 + len_32) || len_32 % 32 != 0 || first_64 > leafNum
+            || len_32 / 32 > leafNum - first_64) {
+            LOG_WARN("Error receiving merkle leaves: calculated checksum differs from given.\n");
+            metrics_count(METRIC_CRC_FAILURES, 1);
+        } else if (first_64 == filled) {
+            memcpy(leaves + filled, inBuf + 16, len_32);
+            filled += len_32 / 32;
 
-        i += 1;
+            if (filled == leafNum) {
+                merkle_root((const uint8_t (*)[32]) leaves, leafNum, root);
+                if (memcmp(root, merkleRoot, 32) != 0) {
+                    LOG_WARN("Error receiving merkle leaves: they don't match the root\n");
+                    filled = 0;
+                }
+            }
+        }
+
+        reader_consume(serial, 16 + len_32);
+        replyLeaves(serial->fd, filled);
     }
 
-    close(serialfd);
+    return leaves;
+}
+
+// Verified packets either go into one <dir>/<i>.pkt file each, to be
+// assembled later by stitch, or straight into their final place in a single
+// output file when outfd is open, written in the background by writer.
+// Known-length transfers record every stored packet in the journal, synced
+// every syncInterval packets. With merkle leaves every packet is checked
+// against its leaf before it is accepted. The reply to the header is kept
+// for a sender that didn't get it and sends the header again.
+typedef struct {
+    int dirfd;
+    int outfd;
+    Journal *journal;
+    size_t syncInterval;
+    const uint8_t (*leaves)[32];
+    size_t packetSize;
+    uint8_t codec;
+    BufferPool *pool;
+    PacketWriter *writer;
+    const uint8_t *reply;
+    size_t replyLen;
+} PacketSink;
+
+void pwriteAllOrDie(int fd, const uint8_t *data, size_t dataLen, off_t offset)
+{
+    size_t written = 0;
+    ssize_t result;
+
+    while (written < dataLen) {
+        uint64_t start = metrics_timer();
+        result = pwrite(fd, data + written, dataLen - written, offset + written);
+        metrics_elapsed(METRIC_DISK_WRITE, start);
+
+        if (result == -1) {
+            perror("Error writing packet to output file");
+            exit(-1);
+        }
+        written += result;
+    }
+}
+
+int openOutputFile(const char *path, size_t fileLen, bool trailer)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror("Error opening output file");
+        exit(-1);
+    }
+
+    // Reserve all the space up front so packets landing out of order don't
+    // fragment the file. Streamed transfers don't know their size yet and
+    // just grow the file as packets are written.
+    if (!trailer && fileLen > 0 && fallocate(fd, 0, 0, fileLen) == -1) {
+        if (errno != EOPNOTSUPP) {
+            perror("Error allocating output file");
+            exit(-1);
+        }
+        if (ftruncate(fd, fileLen) == -1) {
+            perror("Error resizing output file");
+            exit(-1);
+        }
+    }
+
+    return fd;
+}
+
+void closeOutputFile(int fd, size_t fileLen)
+{
+    // Drop anything left over from a larger file that was already there
+    if (ftruncate(fd, fileLen) == -1) {
+        perror("Error resizing output file");
+        exit(-1);
+    }
+
+    if (fsync(fd) == -1) {
+        perror("Error syncing output file");
+        exit(-1);
+    }
+
+    close(fd);
+}
+
+void writePacketFile(int dirfd, size_t i, const uint8_t *data, size_t packetLen)
+{
+    char packetName[32];
+    snprintf(packetName, sizeof(packetName), "%zu.pkt", i);
+
+    // Relative to the already open directory, without stdio buffering
+    // that would only be copied once more on the way out
+    int fd = openat(dirfd, packetName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Error opening packet file for write");
+        exit(-1);
+    }
+
+    pwriteAllOrDie(fd, data, packetLen, 0);
+    close(fd);
+}
+
+void drainWrites(const PacketSink *sink)
+{
+    if (sink->writer != NULL && writer_drain(sink->writer) == -1) {
+        perror("Error writing packet to output file");
+        exit(-1);
+    }
+}
+
+void checkpoint(const PacketSink *sink)
+{
+    // Packet data has to be on disk before the journal can claim it is,
+    // and that starts with every write having been done
+    drainWrites(sink);
+
+    int result = sink->outfd != -1 ? fdatasync(sink->outfd) : syncfs(sink->dirfd);
+    if (result == -1) {
+        perror("Error syncing received packets");
+        exit(-1);
+    }
+
+    if (journal_sync(sink->journal) == -1) {
+        perror("Error syncing journal");
+        exit(-1);
+    }
+}
+
+void recordPacket(const PacketSink *sink, size_t i, size_t packetLen)
+{
+    metrics_count(METRIC_PACKETS, 1);
+    metrics_count(METRIC_PAYLOAD_BYTES, packetLen);
+
+    if (sink->journal != NULL) {
+        journal_mark(sink->journal, i);
+        if (sink->journal->pending >= sink->syncInterval)
+            checkpoint(sink);
+    }
+}
+
+void storePacket(const PacketSink *sink, size_t i, const uint8_t *data, size_t packetLen)
+{
+    // Written before returning, the caller keeps data
+
+    if (sink->outfd != -1)
+        pwriteAllOrDie(sink->outfd, data, packetLen, (off_t) i * sink->packetSize);
+    else
+        writePacketFile(sink->dirfd, i, data, packetLen);
+
+    recordPacket(sink, i, packetLen);
+}
+
+void submitWriteOrDie(const PacketSink *sink, uint8_t *buf, size_t len, off_t offset)
+{
+    if (writer_submit(sink->writer, buf, buf, len, offset) == -1) {
+        perror("Error writing packet to output file");
+        exit(-1);
+    }
+}
+
+void handOffPacket(const PacketSink *sink, size_t i, uint8_t *data, size_t packetLen)
+{
+    // Takes data, a pool buffer, and puts it back once the packet is
+    // written. The output file is written in the background, so the
+    // journal only syncs it after waiting for the writes.
+
+    if (sink->writer == NULL) {
+        storePacket(sink, i, data, packetLen);
+        pool_put(sink->pool, data);
+        return;
+    }
+
+    submitWriteOrDie(sink, data, packetLen, (off_t) i * sink->packetSize);
+    recordPacket(sink, i, packetLen);
+}
+
+bool leafMatches(const PacketSink *sink, size_t i, const uint8_t *data, size_t packetLen)
+{
+    uint8_t leaf[32];
+
+    if (sink->leaves == NULL)
+        return true;
+
+    merkle_leaf(data, packetLen, leaf);
+    return memcmp(leaf, sink->leaves[i], 32) == 0;
+}
+
+size_t payloadSize(const PacketSink *sink, size_t len)
+{
+    // Compressed payloads that didn't shrink carry a header on top
+    return sink->codec == COMPRESS_NONE ? len : len + COMPRESS_HEADER_SIZE;
+}
+
+bool decodePayload(const PacketSink *sink, uint8_t **data, uint32_t *packetLen, size_t maxLen)
+{
+    // Replaces a compressed payload with the data it holds. A payload that
+    // won't decompress is as bad as a corrupted packet.
+
+    if (sink->codec == COMPRESS_NONE)
+        return true;
+
+    long len = compress_payload_length(*data, *packetLen);
+    if (len == -1 || (size_t) len > maxLen)
+        return false;
+
+    uint8_t *out = pool_get(sink->pool);
+    if (decompress_payload(*data, *packetLen, out, len) != len) {
+        pool_put(sink->pool, out);
+        return false;
+    }
+
+    pool_put(sink->pool, *data);
+    *data = out;
+    *packetLen = len;
+
+    return true;
+}
+
+size_t packetLength(size_t fileLen, size_t packetSize, size_t i)
+{
+    size_t offset = i * packetSize;
+    return fileLen - offset > packetSize ? packetSize : fileLen - offset;
+}
+
+size_t receiveStopAndWait(SerialReader *serial, const PacketSink *sink, size_t packetNum,
+                          bool trailer)
+{
+    // Returns the number of packets in the transfer, which for transfers
+    // ending in a trailer is only known once TRANSFER_END arrives
+    size_t i = 0;
+
+    while (true) {
+        uint32_t packetLen;
+        uint32_t crcSum;
+        uint8_t *data;
+
+        // The sender skips everything the journal says we have, in order
+        if (i < packetNum && sink->journal != NULL && journal_has(sink->journal, i)) {
+            i += 1;
+            continue;
+        }
+
+        bool done = i >= packetNum;
+        if (done && !senderLingers(serial))
+            break;
+
+        if (!done)
+            LOG_DEBUG("Listening for packet%zu...\n", i);
+
+        uint8_t command = readPacketCommand(serial, COMMAND_BIT(TRANSFER_PACKET)
+                                                    | COMMAND_BIT(TRANSFER_QUERY)
+                                                    | COMMAND_BIT(TRANSFER_START)
+                                                    | (trailer ? COMMAND_BIT(TRANSFER_END) : 0),
+                                            sink->pool->bufSize, done);
+        if (command == TRANSFER_END) {
+            // A damaged trailer is answered once the stream resynchronises
+            if (trailer && !trailerIntact(serial))
+                continue;
+            break;
+        }
+
+        // The sender didn't get our reply to the header
+        if (command == TRANSFER_START) {
+            answerHeaderAgain(serial, sink->reply, sink->replyLen);
+            continue;
+        }
+
+        // Every packet before i has been received or skipped
+        if (command == TRANSFER_QUERY) {
+            answerQuery(serial, NULL, 0, i);
+            continue;
+        }
+
+        // A lost packet is sent again like a damaged one
+        if (command != TRANSFER_PACKET) {
+            replyCommand(serial->fd, TRANSFER_AGAIN);
+            continue;
+        }
+
+        readPacketHeader(serial, &packetLen, &crcSum);
+
+        LOG_DEBUG("\tReceived header: %u, %u\n", packetLen, crcSum);
+
+        data = readPacket(serial, sink->pool, packetLen);
+
+        bool intact = crcSum == crc32(data, packetLen);
+        trace_event(TRACE_FRAME, i, 9 + packetLen, intact);
+
+        LOG_DEBUG("\tReceived packet data, sending reply...\n");
+
+        // calculate the crc32sum on this end to verify packet integrity
+        if (!intact || packetLen > payloadSize(sink, sink->packetSize)
+            || !decodePayload(sink, &data, &packetLen, sink->packetSize)
+            || !leafMatches(sink, i, data, packetLen)) {
+            // If the calculated crc32sum differs from given,
+            // request that the packet is sent again
+            LOG_WARN("Error receiving packet: calculated checksum differs from given.\n");
+            metrics_count(METRIC_CRC_FAILURES, 1);
+            replyCommand(serial->fd, TRANSFER_AGAIN);
+            pool_put(sink->pool, data);
+            continue;
+        }
+
+        replyCommand(serial->fd, TRANSFER_NEXT);
+
+        // Only a repeat of the last packet, sent after its answer got lost
+        if (done) {
+            pool_put(sink->pool, data);
+            continue;
+        }
+
+        LOG_DEBUG("Packet intact, writing out to file\n");
+
+        handOffPacket(sink, i, data, packetLen);
+
+        i += 1;
+    }
+
+    return i;
+}
+
+bool markReceived(uint8_t **bitmap, size_t *bitmapLen, size_t i)
+{
+    // Returns whether packet i is new, growing the bitmap as needed
+
+    if (i / 8 >= *bitmapLen) {
+        size_t newLen = i / 8 + 1 > 2 * *bitmapLen ? i / 8 + 1 : 2 * *bitmapLen;
+        *bitmap = realloc(*bitmap, newLen);
+        memset(*bitmap + *bitmapLen, 0, newLen - *bitmapLen);
+        *bitmapLen = newLen;
+    }
+
+    if ((*bitmap)[i / 8] & (1 << (i % 8)))
+        return false;
+
+    (*bitmap)[i / 8] |= 1 << (i % 8);
+    return true;
+}
+
+size_t receiveWindowed(SerialReader *serial, const PacketSink *sink, size_t fileLen,
+                       size_t packetNum, bool trailer)
+{
+    // Packets can arrive in any order, so keep a bitmap of the ones written
+    // out to avoid rewriting retransmitted duplicates, starting from what
+    // the journal already has. Without a known packet count it grows as
+    // higher sequence numbers show up.
+    size_t bitmapLen = (trailer ? 0 : packetNum) / 8 + 1;
+    uint8_t *received = calloc(bitmapLen, 1);
+    size_t count = 0;
+
+    if (sink->journal != NULL) {
+        memcpy(received, sink->journal->bitmap, sink->journal->bitmapLen);
+        count = sink->journal->received;
+    }
+
+    // The sender only ends the transfer once every packet is acked, until
+    // then it may send packets again whose ACK it didn't get
+    while (true) {
+        uint32_t seq;
+        uint32_t packetLen;
+        uint8_t *data;
+
+        bool done = !trailer && count >= packetNum;
+        if (done && !senderLingers(serial))
+            break;
+
+        uint8_t command = readPacketCommand(serial, COMMAND_BIT(TRANSFER_WINDOW_PACKET)
+                                                    | COMMAND_BIT(TRANSFER_QUERY)
+                                                    | COMMAND_BIT(TRANSFER_START)
+                                                    | (trailer ? COMMAND_BIT(TRANSFER_END) : 0),
+                                            sink->pool->bufSize, done);
+        if (command == TRANSFER_END) {
+            // A damaged trailer is answered once the stream resynchronises
+            if (trailer && !trailerIntact(serial))
+                continue;
+            break;
+        }
+
+        // The sender didn't get our reply to the header
+        if (command == TRANSFER_START) {
+            answerHeaderAgain(serial, sink->reply, sink->replyLen);
+            continue;
+        }
+
+        if (command == TRANSFER_QUERY) {
+            answerQuery(serial, received, bitmapLen, 0);
+            continue;
+        }
+
+        // The sender matches responses to packets by their order, so a
+        // lost packet still gets its NAK
+        if (command != TRANSFER_WINDOW_PACKET) {
+            replyWindowCommand(serial->fd, TRANSFER_NAK, 0);
+            continue;
+        }
+
+        bool intact = readWindowPacket(serial, sink->pool, payloadSize(sink, sink->packetSize),
+                                       &seq, &packetLen, &data)
+                      && decodePayload(sink, &data, &packetLen, sink->packetSize);
+
+        LOG_DEBUG("\tReceived packet %u: %u\n", seq, packetLen);
+
+        bool validLen = trailer ? packetLen > 0
+                                : seq < packetNum
+                                  && packetLen == packetLength(fileLen, sink->packetSize, seq);
+
+        if (!intact || !validLen || !leafMatches(sink, seq, data, packetLen)) {
+            LOG_WARN("Error receiving packet: calculated checksum differs from given.\n");
+            metrics_count(METRIC_CRC_FAILURES, 1);
+
+            // A sequence number that fails the check can't be trusted, but
+            // the sender matches responses to packets by their order anyway
+            replyWindowCommand(serial->fd, TRANSFER_NAK, seq);
+            pool_put(sink->pool, data);
+            continue;
+        }
+
+        replyWindowCommand(serial->fd, TRANSFER_ACK, seq);
+
+        if (markReceived(&received, &bitmapLen, seq)) {
+            handOffPacket(sink, seq, data, packetLen);
+            count += 1;
+        } else {
+            pool_put(sink->pool, data);
+        }
+    }
+
+    free(received);
+
+    return count;
+}
+
+size_t receiveAdaptive(SerialReader *serial, const PacketSink *sink, size_t fileLen,
+                       size_t packetNum, bool trailer)
+{
+    // Frames hold any number of consecutive packets starting at a packet
+    // boundary, every packet in them is checked and stored on its own. As
+    // with windowed transfers a bitmap keeps retransmitted packets from
+    // being counted twice.
+    size_t bitmapLen = (trailer ? 0 : packetNum) / 8 + 1;
+    uint8_t *received = calloc(bitmapLen, 1);
+    size_t packetSize = sink->packetSize;
+    size_t count = 0;
+
+    if (sink->journal != NULL) {
+        memcpy(received, sink->journal->bitmap, sink->journal->bitmapLen);
+        count = sink->journal->received;
+    }
+
+    while (true) {
+        uint64_t offset;
+        uint32_t frameLen;
+        uint8_t *data;
+
+        bool done = !trailer && count >= packetNum;
+        if (done && !senderLingers(serial))
+            break;
+
+        uint8_t command = readPacketCommand(serial, COMMAND_BIT(TRANSFER_OFFSET_PACKET)
+                                                    | COMMAND_BIT(TRANSFER_QUERY)
+                                                    | COMMAND_BIT(TRANSFER_START)
+                                                    | (trailer ? COMMAND_BIT(TRANSFER_END) : 0),
+                                            sink->pool->bufSize, done);
+        if (command == TRANSFER_END) {
+            // A damaged trailer is answered once the stream resynchronises
+            if (trailer && !trailerIntact(serial))
+                continue;
+            break;
+        }
+
+        // The sender didn't get our reply to the header
+        if (command == TRANSFER_START) {
+            answerHeaderAgain(serial, sink->reply, sink->replyLen);
+            continue;
+        }
+
+        // Frames are stored whole, so the sender asks about their first
+        // packet
+        if (command == TRANSFER_QUERY) {
+            answerQuery(serial, received, bitmapLen, 0);
+            continue;
+        }
+
+        if (command != TRANSFER_OFFSET_PACKET) {
+            replyCommand(serial->fd, TRANSFER_AGAIN);
+            continue;
+        }
+
+        bool intact = readOffsetPacket(serial, sink->pool, payloadSize(sink, MAX_PACKET_SIZE),
+                                       &offset, &frameLen, &data)
+                      && decodePayload(sink, &data, &frameLen, MAX_PACKET_SIZE);
+
+        LOG_DEBUG("\tReceived frame at %llu: %u\n", (unsigned long long) offset, frameLen);
+
+        // Frames have to start on a packet and only the file's last packet
+        // may be short
+        size_t first = offset / packetSize;
+        size_t units = frameLen / packetSize + (frameLen % packetSize == 0 ? 0 : 1);
+        bool valid = intact && frameLen > 0 && offset % packetSize == 0;
+        if (valid && !trailer)
+            valid = first < packetNum && offset + frameLen <= fileLen
+                    && (frameLen % packetSize == 0 || offset + frameLen == fileLen);
+
+        for (size_t k = 0; valid && k < units; ++k) {
+            size_t len = frameLen - k * packetSize > packetSize ? packetSize
+                                                                : frameLen - k * packetSize;
+            valid = leafMatches(sink, first + k, data + k * packetSize, len);
+        }
+
+        if (!valid) {
+            LOG_WARN("Error receiving frame: calculated checksum differs from given.\n");
+            metrics_count(METRIC_CRC_FAILURES, 1);
+            replyCommand(serial->fd, TRANSFER_AGAIN);
+            pool_put(sink->pool, data);
+            continue;
+        }
+
+        replyCommand(serial->fd, TRANSFER_NEXT);
+
+        // Into the output file a frame with anything new in it is written
+        // whole, packets that were already had only get the same data again
+        bool handedOff = false;
+        for (size_t k = 0; sink->writer != NULL && !handedOff && k < units; ++k) {
+            if (!bitmap_has(received, bitmapLen, first + k)) {
+                submitWriteOrDie(sink, data, frameLen, offset);
+                handedOff = true;
+            }
+        }
+
+        for (size_t k = 0; k < units; ++k) {
+            size_t len = frameLen - k * packetSize > packetSize ? packetSize
+                                                                : frameLen - k * packetSize;
+            if (markReceived(&received, &bitmapLen, first + k)) {
+                if (handedOff)
+                    recordPacket(sink, first + k, len);
+                else
+                    storePacket(sink, first + k, data + k * packetSize, len);
+                count += 1;
+            }
+        }
+
+        if (!handedOff)
+            pool_put(sink->pool, data);
+    }
+
+    free(received);
+
+    return count;
+}
+
+// The intact packets and repair symbols received for the forward error
+// corrected group in progress, kept until its group end says which
+// packets it was made of
+typedef struct {
+    uint32_t number;
+    uint32_t seq[MAX_WINDOW_SIZE];
+    uint32_t len[MAX_WINDOW_SIZE];
+    uint8_t *data[MAX_WINDOW_SIZE];
+    size_t dataNum;
+    uint8_t *repair[FEC_MAX_SYMBOLS];
+    size_t repairIndex[FEC_MAX_SYMBOLS];
+    uint32_t repairLen;
+    size_t repairNum;
+} RepairGroup;
+
+void clearGroup(BufferPool *pool, RepairGroup *grp)
+{
+    for (size_t i = 0; i < grp->dataNum; ++i)
+        pool_put(pool, grp->data[i]);
+    for (size_t j = 0; j < grp->repairNum; ++j)
+        pool_put(pool, grp->repair[j]);
+
+    grp->dataNum = 0;
+    grp->repairNum = 0;
+}
+
+bool validPacket(const PacketSink *sink, size_t fileLen, size_t packetNum, bool trailer,
+                 size_t seq, size_t packetLen)
+{
+    if (trailer)
+        return packetLen > 0 && packetLen <= sink->packetSize;
+
+    return seq < packetNum && packetLen == packetLength(fileLen, sink->packetSize, seq);
+}
+
+size_t rebuildGroup(const PacketSink *sink, const RepairGroup *grp, const uint32_t *seqs,
+                    size_t count, size_t fileLen, size_t packetNum, bool trailer,
+                    uint8_t **received, size_t *bitmapLen)
+{
+    // Stores whichever missing packets of the group the repair symbols can
+    // rebuild, returning how many. Symbols are a 4 byte length followed by
+    // the packet, zero padded to the size of the repair symbols.
+    size_t symbolLen = grp->repairLen;
+    uint8_t *symbols[MAX_WINDOW_SIZE];
+    bool present[MAX_WINDOW_SIZE];
+    size_t missing = 0, rebuilt = 0;
+
+    for (size_t p = 0; p < count; ++p) {
+        present[p] = false;
+        for (size_t i = 0; i < grp->dataNum && !present[p]; ++i)
+            present[p] = grp->seq[i] == seqs[p];
+        if (!present[p])
+            missing += 1;
+    }
+
+    if (missing == 0 || missing > grp->repairNum || symbolLen < 4)
+        return 0;
+
+    for (size_t p = 0; p < count; ++p) {
+        symbols[p] = calloc(symbolLen, 1);
+
+        for (size_t i = 0; i < grp->dataNum && present[p]; ++i) {
+            if (grp->seq[i] != seqs[p])
+                continue;
+
+            // A packet longer than the repair symbols can't be part of them
+            if (4 + (size_t) grp->len[i] > symbolLen) {
+                for (size_t q = 0; q <= p; ++q)
+                    free(symbols[q]);
+                return 0;
+            }
+
+            memcpy(symbols[p], &grp->len[i], 4);
+            memcpy(symbols[p] + 4, grp->data[i], grp->len[i]);
+            break;
+        }
+    }
+
+    if (fec_decode(symbols, present, count, symbolLen, (const uint8_t *const *) grp->repair,
+                   grp->repairIndex, grp->repairNum)) {
+        for (size_t p = 0; p < count; ++p) {
+            uint32_t packetLen;
+
+            if (present[p])
+                continue;
+
+            memcpy(&packetLen, symbols[p], 4);
+            if (4 + (size_t) packetLen > symbolLen
+                || !validPacket(sink, fileLen, packetNum, trailer, seqs[p], packetLen)
+                || !leafMatches(sink, seqs[p], symbols[p] + 4, packetLen))
+                continue;
+
+            LOG_DEBUG("\tRebuilt packet %u from repair packets\n", seqs[p]);
+
+            if (markReceived(received, bitmapLen, seqs[p])) {
+                storePacket(sink, seqs[p], symbols[p] + 4, packetLen);
+                rebuilt += 1;
+            }
+        }
+    }
+
+    for (size_t p = 0; p < count; ++p)
+        free(symbols[p]);
+
+    return rebuilt;
+}
+
+size_t receiveCorrected(SerialReader *serial, const PacketSink *sink, size_t fileLen,
+                        size_t packetNum, bool trailer)
+{
+    // Intact packets are stored as they arrive, like windowed transfers,
+    // and also kept with the group's repair symbols. Nothing is answered
+    // until the group end, which lists the group's packets so the lost ones
+    // can be rebuilt before saying which are still missing. The last status
+    // is kept in case the sender didn't get it and asks again.
+    size_t bitmapLen = (trailer ? 0 : packetNum) / 8 + 1;
+    uint8_t *received = calloc(bitmapLen, 1);
+    RepairGroup grp = { .number = 0, .dataNum = 0, .repairNum = 0 };
+    uint8_t lastStatus[MAX_WINDOW_SIZE / 8];
+    uint16_t lastCount = 0;
+    size_t count = 0;
+
+    if (sink->journal != NULL) {
+        memcpy(received, sink->journal->bitmap, sink->journal->bitmapLen);
+        count = sink->journal->received;
+    }
+
+    // The sender waits on the status of a group even once its packets are
+    // all in, so a started group has to be seen through to its end. Group
+    // ends are sent again when their status is late, and answered again.
+    while (true) {
+        bool done = !trailer && count >= packetNum && grp.dataNum == 0;
+        if (done && !senderLingers(serial))
+            break;
+
+        uint8_t command = readPacketCommand(serial,
+                                            COMMAND_BIT(TRANSFER_WINDOW_PACKET)
+                                            | COMMAND_BIT(TRANSFER_REPAIR_PACKET)
+                                            | COMMAND_BIT(TRANSFER_GROUP_END)
+                                            | COMMAND_BIT(TRANSFER_START)
+                                            | (trailer ? COMMAND_BIT(TRANSFER_END) : 0),
+                                            sink->pool->bufSize, done);
+
+        if (command == TRANSFER_END) {
+            // A damaged trailer is answered once the stream resynchronises
+            if (trailer && !trailerIntact(serial))
+                continue;
+            break;
+        } else if (command == TRANSFER_START) {
+            // The sender didn't get our reply to the header
+            answerHeaderAgain(serial, sink->reply, sink->replyLen);
+        } else if (command == FRAME_LOST) {
+            // A lost packet is just missing from its group
+            continue;
+        } else if (command == FRAME_LOST_LAST) {
+            // Only the group end is followed by the sender waiting
+            replyCommand(serial->fd, TRANSFER_AGAIN);
+            continue;
+        } else if (command == TRANSFER_WINDOW_PACKET) {
+            uint32_t seq, packetLen;
+            uint8_t *data;
+
+            bool intact = readWindowPacket(serial, sink->pool,
+                                           payloadSize(sink, sink->packetSize), &seq, &packetLen,
+                                           &data)
+                          && decodePayload(sink, &data, &packetLen, sink->packetSize);
+
+            LOG_DEBUG("\tReceived packet %u: %u\n", seq, packetLen);
+
+            if (!intact || !validPacket(sink, fileLen, packetNum, trailer, seq, packetLen)
+                || !leafMatches(sink, seq, data, packetLen) || grp.dataNum == MAX_WINDOW_SIZE) {
+                LOG_WARN("Error receiving packet: calculated checksum differs from given.\n");
+                metrics_count(METRIC_CRC_FAILURES, 1);
+                pool_put(sink->pool, data);
+                continue;
+            }
+
+            if (markReceived(&received, &bitmapLen, seq)) {
+                storePacket(sink, seq, data, packetLen);
+                count += 1;
+            }
+
+            grp.seq[grp.dataNum] = seq;
+            grp.len[grp.dataNum] = packetLen;
+            grp.data[grp.dataNum++] = data;
+        } else if (command == TRANSFER_REPAIR_PACKET) {
+            uint32_t group, repairLen;
+            uint16_t index;
+            uint8_t *data;
+
+            bool intact = readRepairPacket(serial, sink->pool, 4 + sink->packetSize, &group,
+                                           &index, &repairLen, &data);
+
+            if (!intact || group != grp.number || index >= FEC_MAX_SYMBOLS
+                || (grp.repairNum > 0 && repairLen != grp.repairLen)
+                || grp.repairNum == FEC_MAX_SYMBOLS) {
+                LOG_WARN("Error receiving repair packet: calculated checksum differs "
+                         "from given.\n");
+                metrics_count(METRIC_CRC_FAILURES, 1);
+                pool_put(sink->pool, data);
+                continue;
+            }
+
+            grp.repairLen = repairLen;
+            grp.repairIndex[grp.repairNum] = index;
+            grp.repair[grp.repairNum++] = data;
+        } else if (command == TRANSFER_GROUP_END) {
+            uint32_t group;
+            uint16_t groupCount;
+            uint32_t seqs[MAX_WINDOW_SIZE];
+
+            if (!readGroupEnd(serial, &group, &groupCount, seqs)) {
+                LOG_WARN("Error receiving group end: calculated checksum differs from given.\n");
+                metrics_count(METRIC_CRC_FAILURES, 1);
+                replyCommand(serial->fd, TRANSFER_AGAIN);
+                continue;
+            }
+
+            if (group + 1 == grp.number && groupCount == lastCount) {
+                writeGroupStatus(serial->fd, group, lastCount, lastStatus);
+                continue;
+            } else if (group != grp.number) {
+                printf("Received the end of group %u while receiving group %u\n", group,
+                       grp.number);
+                replyAbort(serial->fd);
+                exit(-1);
+            }
+
+            count += rebuildGroup(sink, &grp, seqs, groupCount, fileLen, packetNum, trailer,
+                                  &received, &bitmapLen);
+
+            memset(lastStatus, 0, sizeof(lastStatus));
+            for (size_t p = 0; p < groupCount; ++p)
+                if (!bitmap_has(received, bitmapLen, seqs[p]))
+                    lastStatus[p / 8] |= 1 << (p % 8);
+            lastCount = groupCount;
+
+            writeGroupStatus(serial->fd, group, lastCount, lastStatus);
+
+            clearGroup(sink->pool, &grp);
+            grp.number += 1;
+        }
+    }
+
+    clearGroup(sink->pool, &grp);
+    free(received);
+
+    return count;
+}
+
+size_t verifyOutputFile(const PacketSink *sink, const uint8_t shaSum[32], size_t fileLen,
+                        size_t packetNum)
+{
+    // Reads the finished file back, checking it against the sha256sum from
+    // the header and, with leaves, each packet against its leaf. Packets
+    // that don't match are dropped from the journal so the next attempt
+    // asks for just them. Without a bad packet to blame a file that doesn't
+    // match its hash has every packet dropped. Returns the number of bad
+    // packets.
+
+    uint8_t *buf = malloc(sink->packetSize);
+    uint8_t fileSum[32];
+    SHA256_CTX shaCtx;
+    size_t bad = 0;
+
+    sha256_init(&shaCtx);
+
+    for (size_t i = 0; i < packetNum; ++i) {
+        size_t packetLen = packetLength(fileLen, sink->packetSize, i);
+        size_t done = 0;
+
+        while (done < packetLen) {
+            ssize_t result = pread(sink->outfd, buf + done, packetLen - done,
+                                   (off_t) i * sink->packetSize + done);
+            if (result <= 0) {
+                perror("Error reading back output file");
+                exit(-1);
+            }
+            done += result;
+        }
+
+        sha256_update(&shaCtx, buf, packetLen);
+
+        if (!leafMatches(sink, i, buf, packetLen)) {
+            printf("Packet %zu doesn't match its merkle leaf\n", i);
+            if (sink->journal != NULL)
+                journal_unmark(sink->journal, i);
+            bad += 1;
+        }
+    }
+
+    sha256_final(&shaCtx, (BYTE *) fileSum);
+    free(buf);
+
+    if (bad == 0 && memcmp(fileSum, shaSum, 32) != 0) {
+        printf("Output file doesn't match its sha256sum\n");
+        for (size_t i = 0; i < packetNum && sink->journal != NULL; ++i)
+            journal_unmark(sink->journal, i);
+        bad = packetNum;
+    }
+
+    if (bad == 0)
+        LOG_INFO("Output file verified\n");
+
+    return bad;
+}
+
+void unpackBatch(const char *path, const char *dir, const uint8_t shaSum[32], bool remove)
+{
+    uint8_t fileSum[32];
+    size_t bad;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror("Error opening batch");
+        exit(-1);
+    }
+
+    // Nothing is unpacked from a batch that isn't the one that was sent
+    if (calculateFileSHA256(fp, fileSum) == -1) {
+        printf("Error reading batch\n");
+        exit(-1);
+    }
+    if (memcmp(fileSum, shaSum, 32) != 0) {
+        printf("Batch doesn't match its sha256sum\n");
+        exit(-1);
+    }
+
+    int dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1) {
+        perror("Error opening packet directory");
+        exit(-1);
+    }
+
+    long files = batch_unpack(fileno(fp), dirfd, &bad);
+    if (files == -1) {
+        perror("Error unpacking batch");
+        exit(-1);
+    }
+
+    close(dirfd);
+    fclose(fp);
+
+    LOG_INFO("Unpacked %ld files into %s\n", files, dir);
+
+    if (bad > 0) {
+        printf("%zu files in the batch don't match their sha256sum\n", bad);
+        exit(-1);
+    }
+
+    if (remove && unlink(path) == -1) {
+        perror("Error removing batch");
+        exit(-1);
+    }
+}
+
+void rebuildPath(char *path, size_t pathLen, const char *output)
+{
+    // Where a file replacing output is put together before it is verified
+    if ((size_t) snprintf(path, pathLen, "%s.rebuild", output) >= pathLen) {
+        printf("Output path %s is too long\n", output);
+        exit(-1);
+    }
+}
+
+void applyDelta(const char *path, const char *basisPath, const char *output,
+                const uint8_t shaSum[32], const DeltaSignatures *sigs)
+{
+    // Rebuilds the file next to where it is going and only moves it into
+    // place once it matches, so the copy it was built on survives a delta
+    // that goes wrong even when the file replaces it
+    uint8_t fileSum[32];
+    char rebuilt[PATH_MAX];
+    DeltaHeader header;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror("Error opening delta");
+        exit(-1);
+    }
+
+    if (calculateFileSHA256(fp, fileSum) == -1) {
+        printf("Error reading delta\n");
+        exit(-1);
+    }
+    if (memcmp(fileSum, shaSum, 32) != 0) {
+        printf("Delta doesn't match its sha256sum\n");
+        exit(-1);
+    }
+
+    if (delta_read_header(fileno(fp), &header) == -1) {
+        perror("Error reading delta");
+        exit(-1);
+    }
+    if (memcmp(header.basisSum, sigs->basisSum, 32) != 0) {
+        printf("Delta was made against a different copy than %s\n", basisPath);
+        exit(-1);
+    }
+
+    int basisfd = open(basisPath, O_RDONLY);
+    if (basisfd == -1) {
+        perror("Error opening basis");
+        exit(-1);
+    }
+
+    rebuildPath(rebuilt, sizeof(rebuilt), output);
+    int outfd = open(rebuilt, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outfd == -1) {
+        perror("Error opening rebuilt file");
+        exit(-1);
+    }
+
+    if (delta_apply(fileno(fp), basisfd, outfd, fileSum) == -1) {
+        perror("Error applying delta");
+        unlink(rebuilt);
+        exit(-1);
+    }
+
+    close(basisfd);
+    fclose(fp);
+
+    if (memcmp(fileSum, header.shaSum, 32) != 0) {
+        printf("File rebuilt from the delta doesn't match its sha256sum\n");
+        unlink(rebuilt);
+        exit(-1);
+    }
+
+    if (fsync(outfd) == -1 || close(outfd) == -1 || rename(rebuilt, output) == -1) {
+        perror("Error writing rebuilt file");
+        exit(-1);
+    }
+
+    LOG_INFO("Rebuilt %s from the delta and verified it\n", output);
+
+    if (unlink(path) == -1) {
+        perror("Error removing delta");
+        exit(-1);
+    }
+}
+
+FILE* startMetrics(const char *path, double interval, const char *socketPath)
+{
+    // Returns the file metrics go to, if any
+    FILE *fp = NULL;
+
+    if (path == NULL && socketPath == NULL)
+        return NULL;
+
+    if (path != NULL) {
+        fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+        if (fp == NULL) {
+            perror("Error opening metrics file");
+            exit(-1);
+        }
+    }
+
+    if (metrics_start(fp, interval, socketPath) == -1) {
+        perror("Error starting metrics");
+        exit(-1);
+    }
+
+    return fp;
+}
+
+void stopMetrics(FILE *fp)
+{
+    metrics_stop();
+    if (fp != NULL && fp != stdout)
+        fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+    char dir[1024] = ".";
+    char *output = NULL;
+    char *basisPath = NULL;
+    unsigned long syncInterval = 32;
+    unsigned long maxWindow = MAX_WINDOW_SIZE;
+    double deadline = 0;
+    bool direct = false;
+    SerialConfig serialConfig = { 0, false, 1, 0 };
+    const char *metricsPath = NULL;
+    const char *metricsSocket = NULL;
+    double metricsInterval = 1;
+    const char *tracePath = NULL;
+
+    int c = 0;
+    while (true) {
+        static struct option long_options[] = {
+            {"baud",             required_argument, 0, 'b'},
+            {"basis",            required_argument, 0, 'B'},
+            {"deadline",         required_argument, 0, 'D'},
+            {"directory",        required_argument, 0, 'd'},
+            {"direct",           no_argument,       0, 'I'},
+            {"metrics",          required_argument, 0, 'M'},
+            {"metrics-interval", required_argument, 0, 'i'},
+            {"metrics-socket",   required_argument, 0, 'U'},
+            {"output",           required_argument, 0, 'o'},
+            {"quiet",            no_argument,       0, 'q'},
+            {"rtscts",           no_argument,       0, 'R'},
+            {"start",            required_argument, 0, 's'},
+            {"sync",             required_argument, 0, 'S'},
+            {"trace",            required_argument, 0, 't'},
+            {"verbose",          no_argument,       0, 'v'},
+            {"vmin",             required_argument, 0, 'V'},
+            {"vtime",            required_argument, 0, 'T'},
+            {"window",           required_argument, 0, 'w'},
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+        c = getopt_long(argc, argv, "B:b:D:d:i:IM:o:qRs:S:t:T:U:V:vw:", long_options,
+                        &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'B':
+                // The copy of the file already here, which a sender with
+                // --delta only sends the differences from. The new version
+                // replaces it unless --output says where else it goes.
+                basisPath = optarg;
+                break;
+            case 'b':
+                serialConfig.baud = strtoul(optarg, NULL, 0);
+                break;
+            case 'D':
+                // Seconds the whole transfer may take, the journal keeps
+                // what arrived for the next attempt
+                deadline = strtod(optarg, NULL);
+                break;
+            case 'd':
+                strncpy(dir, optarg, sizeof(dir));
+                break;
+            case 'I':
+                // Write the output file with O_DIRECT, which only pays off
+                // for packet sizes that are a multiple of 4096 bytes
+                direct = true;
+                break;
+            case 'i':
+                // Seconds between lines of metrics
+                metricsInterval = strtod(optarg, NULL);
+                break;
+            case 'M':
+                // JSON lines of metrics, - for standard output
+                metricsPath = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'q':
+                log_level -= 1;
+                break;
+            case 'R':
+                serialConfig.rtscts = true;
+                break;
+            case 's':
+                // Transfers pick up where they left off from the journal
+                printf("--start is no longer supported, interrupted transfers resume on their "
+                       "own\n");
+                exit(-1);
+            case 'S':
+                syncInterval = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                // A binary trace of every frame, see trace.h
+                tracePath = optarg;
+                break;
+            case 'U':
+                // A Unix socket answering every connection with metrics
+                metricsSocket = optarg;
+                break;
+            case 'v':
+                log_level += 1;
+                break;
+            case 'T':
+            case 'V': {
+                // Both are counts the tty keeps in a single byte
+                unsigned long value = strtoul(optarg, NULL, 0);
+                if (value > 255) {
+                    printf("--%s can be at most 255\n", c == 'V' ? "vmin" : "vtime");
+                    exit(-1);
+                }
+                if (c == 'V')
+                    serialConfig.vmin = value;
+                else
+                    serialConfig.vtime = value;
+                break;
+            }
+            case 'w':
+                maxWindow = strtoul(optarg, NULL, 0);
+                if (maxWindow > MAX_WINDOW_SIZE)
+                    maxWindow = MAX_WINDOW_SIZE;
+                break;
+        }
+    }
+
+    if (optind == argc) {
+        printf("%s expects a serial device to communicate across\n", argv[0]);
+        exit(-1);
+    }
+
+    size_t fileLen, packetNum, packetSize;
+    uint8_t shaSum[32], merkleRoot[32];
+    uint8_t mode, flags, codec;
+    uint16_t window;
+    int serialfd;
+    SerialReader serial;
+
+    serialfd = open(argv[optind], O_RDWR);
+    if (serialfd == -1) {
+        perror("Error opening serial device");
+        exit(-1);
+    }
+
+    // Anything that isn't a tty, like a pipe to test with, is used as is
+    if (isatty(serialfd) && serial_configure(serialfd, &serialConfig) == -1) {
+        perror("Error configuring serial device");
+        exit(-1);
+    }
+
+    if (reader_init(&serial, serialfd, READER_SIZE) == -1) {
+        printf("Error allocating the serial buffer\n");
+        exit(-1);
+    }
+    reader_set_deadline(&serial, deadline);
+
+    FILE *metricsfp = startMetrics(metricsPath, metricsInterval, metricsSocket);
+    if (tracePath != NULL && trace_start(tracePath, TRACE_RECEIVER) == -1) {
+        perror("Error starting trace");
+        exit(-1);
+    }
+
+    // A sender with --delta asks for signatures of the copy first, and asks
+    // again if the answer doesn't get through
+    DeltaSignatures sigs = { 0 };
+    if (basisPath != NULL)
+        signBasis(basisPath, &sigs);
+
+    while (true) {
+        uint32_t first;
+
+        if (peekOrDie(&serial, 1)[0] != TRANSFER_SIGNATURES) {
+            if (readHeader(&serial, shaSum, &fileLen, &packetNum, &mode, &window, &flags,
+                           merkleRoot, &packetSize, &codec))
+                break;
+            continue;
+        }
+
+        // Signatures request format:
+        //  * 1 byte for TRANSFER_SIGNATURES
+        //  * 4 bytes for the first block wanted
+        memcpy(&first, peekOrDie(&serial, 5) + 1, 4);
+        reader_consume(&serial, 5);
+        writeSignatures(serialfd, &sigs, first);
+    }
+
+    if (packetSize == 0 || packetSize > MAX_PACKET_SIZE) {
+        printf("Transfer has an unsupported packet size of %zu bytes\n", packetSize);
+        replyAbort(serialfd);
+        exit(-1);
+    }
+
+    bool trailer = flags & TRANSFER_FLAG_TRAILER;
+    bool merkle = flags & TRANSFER_FLAG_MERKLE;
+    bool batch = flags & TRANSFER_FLAG_BATCH;
+    bool delta = flags & TRANSFER_FLAG_DELTA;
+    if (trailer)
+        packetNum = SIZE_MAX;
+    else
+        createMetadataFile(dir, shaSum, fileLen, packetNum, packetSize);
+
+    // Fall back to stop-and-wait for anything we don't understand
+    if (window > maxWindow)
+        window = maxWindow;
+    // In forward error corrected transfers the window is the group size
+    bool windowed = (mode == TRANSFER_MODE_WINDOW && window > 1)
+                    || (mode == TRANSFER_MODE_FEC && window > 0);
+    if (mode == TRANSFER_MODE_ADAPTIVE) {
+        window = 0;
+    } else if (!windowed) {
+        mode = TRANSFER_MODE_STOP_WAIT;
+        window = 0;
+    }
+
+    if (merkle && (trailer || packetNum != fileLen / packetSize + (fileLen % packetSize == 0 ? 0 : 1))) {
+        printf("Merkle tree doesn't match the packets in the transfer\n");
+        replyAbort(serialfd);
+        exit(-1);
+    }
+
+    if (delta && sigs.blockNum == 0) {
+        printf("Received a delta without a copy to apply it to\n");
+        replyAbort(serialfd);
+        exit(-1);
+    }
+
+    if ((mode == TRANSFER_MODE_WINDOW || mode == TRANSFER_MODE_FEC) && !trailer
+        && packetNum > UINT32_MAX) {
+        printf("Transfer has too many packets to be sequenced\n");
+        replyAbort(serialfd);
+        exit(-1);
+    }
+
+    // Packets go uncompressed if this build can't decompress them
+    if (!compress_supported(codec))
+        codec = COMPRESS_NONE;
+
+    PacketSink sink = { -1, -1, NULL, syncInterval, NULL, packetSize, codec, NULL, NULL, NULL,
+                        0 };
+    Journal journal;
+    BufferPool pool;
+    PacketWriter writer;
+    int directfd = -1;
+
+    // Every packet is read into one of these and handed back once stored.
+    // Adaptive frames can be as large as the protocol allows, repair
+    // symbols carry a length on top of a packet, and FEC keeps a whole
+    // group around until it is complete.
+    size_t maxPacket = mode == TRANSFER_MODE_ADAPTIVE ? MAX_PACKET_SIZE : packetSize;
+    size_t bufNum = mode == TRANSFER_MODE_FEC ? window + 16 : 4;
+
+    // Packets being written out to the output file hold on to their buffer
+    // until they are. Adaptive frames are large enough that a few of them
+    // keep the disk busy, the pool mallocs any more than that.
+    if (output != NULL)
+        bufNum += mode == TRANSFER_MODE_ADAPTIVE ? 4 : WRITE_DEPTH;
+
+    // Resynchronising needs the largest frame to fit in the serial buffer
+    if (pool_init_aligned(&pool, payloadSize(&sink, maxPacket) + 4, bufNum,
+                          direct ? WRITER_DIRECT_ALIGN : 64) == -1
+        || reader_reserve(&serial, READER_SIZE + pool.bufSize) == -1) {
+        printf("Error allocating packet buffers\n");
+        replyAbort(serialfd);
+        exit(-1);
+    }
+    sink.pool = &pool;
+
+    sink.dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (sink.dirfd == -1) {
+        perror("Error opening packet directory");
+        replyAbort(serialfd);
+        exit(-1);
+    }
+
+    // A batch has to be in one piece to be unpacked, without an output
+    // file it goes into one of its own that is removed once unpacked
+    char batchFile[PATH_MAX];
+    bool ownBatchFile = batch && output == NULL;
+    if (ownBatchFile) {
+        char shaStr[65];
+
+        sha256Str(shaStr, shaSum);
+        if ((size_t) snprintf(batchFile, sizeof(batchFile), "%s/%s.batch", dir, shaStr)
+            >= sizeof(batchFile)) {
+            printf("Directory path %s is too long\n", dir);
+            replyAbort(serialfd);
+            exit(-1);
+        }
+        output = batchFile;
+    }
+
+    // So does a delta, always into one of its own since the output is where
+    // the file rebuilt from it goes, the copy itself by default. A whole
+    // file sent in place of a delta is received next to where it goes too,
+    // and only moved there once verified, so the copy survives a transfer
+    // that goes wrong.
+    char deltaFile[PATH_MAX];
+    char replacement[PATH_MAX];
+    char *rebuilt = output != NULL ? output : basisPath;
+    bool replacing = !delta && !batch && basisPath != NULL;
+    if (delta) {
+        char shaStr[65];
+
+        sha256Str(shaStr, shaSum);
+        if ((size_t) snprintf(deltaFile, sizeof(deltaFile), "%s/%s.delta", dir, shaStr)
+            >= sizeof(deltaFile)) {
+            printf("Directory path %s is too long\n", dir);
+            replyAbort(serialfd);
+            exit(-1);
+        }
+        output = deltaFile;
+    } else if (replacing) {
+        rebuildPath(replacement, sizeof(replacement), rebuilt);
+        output = replacement;
+    } else if (!batch) {
+        output = rebuilt;
+    }
+
+    if (output != NULL) {
+        sink.outfd = openOutputFile(output, fileLen, trailer);
+
+        if (direct) {
+            directfd = open(output, O_WRONLY | O_DIRECT);
+            if (directfd == -1) {
+                perror("Error opening output file for direct I/O");
+                replyAbort(serialfd);
+                exit(-1);
+            }
+        }
+
+        if (writer_init(&writer, sink.outfd, directfd, &pool, WRITE_DEPTH) == -1) {
+            printf("Error allocating the packet writer\n");
+            replyAbort(serialfd);
+            exit(-1);
+        }
+        sink.writer = &writer;
+
+        if (!writer_async(&writer))
+            LOG_INFO("io_uring is unavailable, writing packets synchronously\n");
+    }
+
+    // Only transfers whose hash is known up front can be resumed, the
+    // journal picks up any packets received by an earlier attempt into the
+    // same place
+    char journalFile[1024];
+    if (!trailer) {
+        uint8_t target = sink.outfd != -1 ? JOURNAL_TARGET_FILE : JOURNAL_TARGET_PACKETS;
+
+        journal_path(journalFile, sizeof(journalFile), dir, shaSum);
+        if (journal_open(&journal, journalFile, shaSum, fileLen, packetNum, packetSize, target,
+                         sink.outfd != -1 ? sink.outfd : sink.dirfd) == -1) {
+            perror("Error opening journal");
+            replyAbort(serialfd);
+            exit(-1);
+        }
+        sink.journal = &journal;
+
+        if (journal.received > 0)
+            LOG_INFO("Resuming transfer, %zu of %zu packets already received\n",
+                     journal.received, packetNum);
+    }
+
+    if (sink.journal != NULL && journal.received > 0)
+        sink.reply = frameHeaderReply(mode, window, codec, journal.bitmap, journal.bitmapLen,
+                                      &sink.replyLen);
+    else
+        sink.reply = frameHeaderReply(mode, window, codec, NULL, 0, &sink.replyLen);
+
+    writeAllOrDie(serialfd, sink.reply, sink.replyLen);
+
+    if (merkle)
+        sink.leaves = readLeaves(&serial, merkleRoot, packetNum, sink.reply, sink.replyLen);
+
+    LOG_INFO("Received header, listening for packets...\n\n");
+
+    // Read the packets
+    size_t received;
+    if (mode == TRANSFER_MODE_WINDOW)
+        received = receiveWindowed(&serial, &sink, fileLen, packetNum, trailer);
+    else if (mode == TRANSFER_MODE_FEC)
+        received = receiveCorrected(&serial, &sink, fileLen, packetNum, trailer);
+    else if (mode == TRANSFER_MODE_ADAPTIVE)
+        received = receiveAdaptive(&serial, &sink, fileLen, packetNum, trailer);
+    else
+        received = receiveStopAndWait(&serial, &sink, packetNum, trailer);
+
+    // Streamed transfers only describe the file once it has all been sent
+    if (trailer) {
+        readTrailer(&serial, shaSum, &fileLen, &packetNum);
+
+        if (received != packetNum) {
+            printf("Received %zu packets but the trailer announced %zu\n", received, packetNum);
+            replyAbort(serialfd);
+            exit(-1);
+        }
+
+        createMetadataFile(dir, shaSum, fileLen, packetNum, packetSize);
+        replySealed(serialfd, TRANSFER_END);
+
+        // If the answer got lost the trailer comes again, until the sender
+        // ends with a sealed TRANSFER_END of its own. Anything else is
+        // damaged and skipped, the sender sends it again.
+        while (senderLingers(&serial)) {
+            if (reader_data(&serial)[0] != TRANSFER_END) {
+                reader_consume(&serial, 1);
+                continue;
+            }
+
+            // Only a trailer is followed by more
+            int result = reader_need_within(&serial, 53, RESYNC_QUIET_MS);
+            if (result == -1) {
+                perror("Error reading serial device");
+                exit(-1);
+            }
+
+            if (result == 1 && frameIntact(reader_data(&serial), 53)) {
+                reader_consume(&serial, 53);
+                replySealed(serialfd, TRANSFER_END);
+                continue;
+            }
+
+            if (reader_available(&serial) >= TRANSFER_SEALED_SIZE
+                && isSealed(reader_data(&serial), TRANSFER_END))
+                break;
+
+            reader_consume(&serial, 1);
+        }
+
+        LOG_INFO("Received trailer, transfer complete\n");
+    }
+
+    drainWrites(&sink);
+    if (sink.journal != NULL)
+        checkpoint(&sink);
+
+    // Packets go straight into the output file with nothing after to check
+    // it, so it is checked here. With leaves to go on, a file that doesn't
+    // match its hash only needs its bad packets sent again.
+    size_t bad = 0;
+    if (sink.outfd != -1) {
+        bad = verifyOutputFile(&sink, shaSum, fileLen, packetNum);
+        if (bad > 0 && sink.journal != NULL)
+            checkpoint(&sink);
+    }
+
+    if (sink.journal != NULL)
+        journal_close(&journal);
+
+    // A verified output file has nothing left to resume, the same file sent
+    // again is received again
+    if (sink.journal != NULL && sink.outfd != -1 && bad == 0 && unlink(journalFile) == -1) {
+        perror("Error removing journal");
+        exit(-1);
+    }
+
+    if (sink.writer != NULL)
+        writer_destroy(&writer);
+    if (directfd != -1)
+        close(directfd);
+    if (sink.outfd != -1)
+        closeOutputFile(sink.outfd, fileLen);
+
+    stopMetrics(metricsfp);
+    trace_stop();
+
+    free((void *) sink.leaves);
+    free((void *) sink.reply);
+    pool_destroy(&pool);
+    reader_destroy(&serial);
+    close(sink.dirfd);
+    close(serialfd);
+
+    if (bad > 0) {
+        printf("%zu packets failed verification, run again to receive them\n", bad);
+        exit(-1);
+    }
+
+    if (replacing && rename(output, rebuilt) == -1) {
+        perror("Error moving received file into place");
+        exit(-1);
+    }
+
+    if (batch)
+        unpackBatch(output, dir, shaSum, ownBatchFile);
+    if (delta)
+        applyDelta(output, basisPath, rebuilt, shaSum, &sigs);
+
+    delta_free(&sigs);
 }
@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -8,42 +10,180 @@
 #include <getopt.h>
 #include <unistd.h>
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+#include <time.h>
+
+#include <batch.h>
+#include <compress.h>
 #include <crc32.h>
+#include <delta.h>
+#include <fec.h>
+#include <journal.h>
+#include <log.h>
+#include <merkle.h>
+#include <metrics.h>
+#include <pool.h>
 #include <protocol.h>
+#include <reader.h>
+#include <ring.h>
+#include <serial.h>
+#include <sha256.h>
 #include <sha256_utils.h>
+#include <trace.h>
+
 
 
+// Packets are read from the file on demand so memory use stays bounded no
+// matter how large it is. Sources that can't be seeked (stdin, pipes) have
+// an unknown length and are hashed as their packets are produced instead.
+// Regular files are mapped when possible so packets can be sent straight
+// out of the page cache without being copied into a buffer first.
+typedef struct {
+    FILE *fp;
+    const uint8_t *map;
+    bool seekable;
+    bool hashing;
+    SHA256_CTX shaCtx;
+    size_t fileLen;
+    size_t packetSize;
+    size_t packets;
+} PacketSource;
 
-long fileLength(FILE *fp)
+void openSource(PacketSource *src, FILE *fp, size_t packetSize)
 {
-    if (fseek(fp, 0, SEEK_END) == -1) {
-        perror("Error seeking file end");
+    struct stat st;
+
+    if (fstat(fileno(fp), &st) == -1) {
+        perror("Error reading file status");
         exit(-1);
     }
 
-    long len = ftell(fp);
-    rewind(fp);
+    src->fp = fp;
+    src->seekable = S_ISREG(st.st_mode);
+    src->hashing = !src->seekable;
+    src->fileLen = src->seekable ? st.st_size : 0;
+    src->packetSize = packetSize;
+    src->packets = 0;
+    src->map = NULL;
 
-    return len;
+    if (src->hashing)
+        sha256_init(&src->shaCtx);
+
+    // Falls back to reading the file if it can't be mapped
+    if (src->seekable && src->fileLen > 0) {
+        void *map = mmap(NULL, src->fileLen, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (map != MAP_FAILED) {
+            madvise(map, src->fileLen, MADV_SEQUENTIAL);
+            src->map = map;
+        }
+    }
+}
+
+void closeSource(PacketSource *src)
+{
+    if (src->map != NULL)
+        munmap((void *) src->map, src->fileLen);
+}
+
+const uint8_t* mappedPacket(PacketSource *src, size_t *len)
+{
+    size_t offset = src->packets * src->packetSize;
+
+    if (offset >= src->fileLen) {
+        *len = 0;
+        return NULL;
+    }
+
+    *len = src->fileLen - offset > src->packetSize ? src->packetSize : src->fileLen - offset;
+    src->packets += 1;
+
+    return src->map + offset;
 }
 
-uint8_t* readFile(FILE *fp, size_t *size)
+size_t readPacketData(PacketSource *src, uint8_t *buf)
 {
-    long len = fileLength(fp);
+    // Returns the length of the next packet, 0 once the file is exhausted
+
+    if (src->map != NULL) {
+        size_t len;
+        const uint8_t *data = mappedPacket(src, &len);
+
+        if (len > 0)
+            memcpy(buf, data, len);
+        return len;
+    }
 
-    uint8_t *data = malloc(len);
-    size_t read = fread(data, 1, len, fp);
-    if (read != len) {
+    size_t len = fread(buf, 1, src->packetSize, src->fp);
+    if (len < src->packetSize && ferror(src->fp)) {
         printf("Error reading file\n");
         exit(-1);
     }
-    fclose(fp);
 
-    *size = len;
-    return data;
+    // A file of known length has to produce exactly the packets promised
+    // in the header
+    if (src->seekable) {
+        size_t offset = src->packets * src->packetSize;
+        size_t expected = src->fileLen - offset > src->packetSize ? src->packetSize
+                                                                  : src->fileLen - offset;
+        if (offset > src->fileLen || len != expected) {
+            printf("File changed while it was being sent\n");
+            exit(-1);
+        }
+    }
+
+    if (len > 0) {
+        if (src->hashing)
+            sha256_update(&src->shaCtx, buf, len);
+        if (!src->seekable)
+            src->fileLen += len;
+        src->packets += 1;
+    }
+
+    return len;
+}
+
+const uint8_t* packetData(PacketSource *src, uint8_t *buf, size_t *len)
+{
+    // Returns the next packet and its length in len, 0 once the file is
+    // exhausted. The packet is read into buf unless the file is mapped.
+
+    if (src->map != NULL)
+        return mappedPacket(src, len);
+
+    *len = readPacketData(src, buf);
+    return buf;
+}
+
+void seekPacket(PacketSource *src, size_t i, uint8_t *buf)
+{
+    if (src->packets == i)
+        return;
+
+    if (src->map != NULL) {
+        src->packets = i;
+        return;
+    }
+
+    if (!src->hashing) {
+        if (fseeko(src->fp, (off_t) i * src->packetSize, SEEK_SET) == -1) {
+            perror("Error seeking file");
+            exit(-1);
+        }
+        src->packets = i;
+        return;
+    }
+
+    // Skipped data still has to go into the hash
+    while (src->packets < i) {
+        if (readPacketData(src, buf) == 0) {
+            printf("Packet %zu is past the end of the file\n", i);
+            exit(-1);
+        }
+    }
 }
 
 /*void writeMetadataFile(char shaStr[65], const char *filename)
@@ -68,193 +208,2184 @@ void deleteMetadataFile()
     }
 }*/
 
+// Responses are small, this holds a good number of them at once
+#define READER_SIZE 0x1000
+
+// A response too damaged to tell how long it was is dropped along with
+// everything after it until the line has been quiet this long
+#define RESYNC_QUIET_MS 100
+
+void readAllOrDie(SerialReader *serial, uint8_t *buf, size_t len)
+{
+    if (reader_read(serial, buf, len) == -1) {
+        perror("Error reading serial port");
+        exit(-1);
+    }
+}
+
+const uint8_t* peekOrDie(SerialReader *serial, size_t len)
+{
+    if (reader_need(serial, len) == -1) {
+        perror("Error reading serial port");
+        exit(-1);
+    }
+
+    return reader_data(serial);
+}
+
+void drainOrDie(SerialReader *serial)
+{
+    ssize_t result;
+
+    while ((result = reader_fill(serial, RESYNC_QUIET_MS)) > 0)
+        ;
+
+    if (result == -1) {
+        perror("Error reading serial port");
+        exit(-1);
+    }
+
+    reader_consume(serial, reader_available(serial));
+}
+
+bool isSealed(SerialReader *serial, uint8_t command)
+{
+    // Whether command is at the front of the buffer followed by its
+    // crc32sum, waiting for the rest of it until the line goes quiet
+
+    uint32_t crcSum;
+
+    int result = reader_need_within(serial, TRANSFER_SEALED_SIZE, RESYNC_QUIET_MS);
+    if (result == -1) {
+        perror("Error reading serial port");
+        exit(-1);
+    }
+    if (result == 0)
+        return false;
+
+    memcpy(&crcSum, reader_data(serial) + 1, 4);
+    return reader_data(serial)[0] == command && crcSum == crc32(&command, 1);
+}
+
+void exitIfAborted(SerialReader *serial, const char *message)
+{
+    // Called with TRANSFER_ERROR at the front of the buffer. Exits with
+    // message if the receiver gave up on the transfer, otherwise it is a
+    // corrupted answer and left for the caller.
+
+    if (!isSealed(serial, TRANSFER_ERROR))
+        return;
+
+    printf("%s\n", message);
+    exit(-1);
+}
+
+// Retransmission timeout from smoothed round trip times, the way TCP works
+// it out (RFC 6298): SRTT and RTTVAR follow every sample with gains of 1/8
+// and 1/4 and RTO = SRTT + 4 * RTTVAR. Answers to packets sent more than
+// once aren't sampled since there's no telling which copy they answer
+// (Karn's algorithm), and every timeout doubles the RTO until a fresh
+// sample comes in.
+#define RTO_INITIAL_MS 1000
+#define RTO_MIN_MS     200
+#define RTO_MAX_MS     60000
+
+typedef struct {
+    double srtt;
+    double rttvar;
+    double rto;
+    bool sampled;
+} RttEstimator;
+
+void initRtt(RttEstimator *rtt)
+{
+    rtt->srtt = 0;
+    rtt->rttvar = 0;
+    rtt->rto = RTO_INITIAL_MS;
+    rtt->sampled = false;
+}
+
+void sampleRtt(RttEstimator *rtt, double ms)
+{
+    metrics_observe(METRIC_RTT, (uint64_t) (ms * 1e6));
+
+    if (!rtt->sampled) {
+        rtt->srtt = ms;
+        rtt->rttvar = ms / 2;
+        rtt->sampled = true;
+    } else {
+        double err = ms > rtt->srtt ? ms - rtt->srtt : rtt->srtt - ms;
+
+        rtt->rttvar = 0.75 * rtt->rttvar + 0.25 * err;
+        rtt->srtt = 0.875 * rtt->srtt + 0.125 * ms;
+    }
+
+    rtt->rto = rtt->srtt + 4 * rtt->rttvar;
+    if (rtt->rto < RTO_MIN_MS)
+        rtt->rto = RTO_MIN_MS;
+    else if (rtt->rto > RTO_MAX_MS)
+        rtt->rto = RTO_MAX_MS;
+}
+
+void backoffRtt(RttEstimator *rtt)
+{
+    rtt->rto = 2 * rtt->rto < RTO_MAX_MS ? 2 * rtt->rto : RTO_MAX_MS;
+}
+
+double msSince(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+bool awaitResponse(SerialReader *serial, size_t len, const struct timespec *sentAt,
+                   double timeoutMs)
+{
+    // Waits for len bytes of response to be buffered. Returns false if they
+    // still aren't timeoutMs after sentAt.
+
+    while (reader_available(serial) < len) {
+        double left = timeoutMs - msSince(sentAt);
+        if (left <= 0) {
+            trace_event(TRACE_TIMEOUT, TRACE_NO_SEQ, 0, 0);
+            return false;
+        }
+
+        if (reader_fill(serial, (int) left + 1) == -1) {
+            perror("Error reading serial port");
+            exit(-1);
+        }
+    }
+
+    return true;
+}
+
 void writeAllOrDie(int fd, const uint8_t *data, size_t dataLen)
 {
     size_t written = 0;
     ssize_t result;
 
     while (written < dataLen) {
+        uint64_t start = metrics_timer();
         result = write(fd, data + written, dataLen - written);
+        metrics_elapsed(METRIC_WRITE_BLOCKED, start);
+
         if (result == -1) {
             perror("Error writing data to file descriptor");
             exit(-1);
         }
         written += result;
     }
+
+    metrics_count(METRIC_WIRE_BYTES, dataLen);
+}
+
+void writevAllOrDie(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t result;
+
+    // Partial writes leave the iovecs pointing at what's still unwritten
+    while (iovcnt > 0) {
+        uint64_t start = metrics_timer();
+        result = writev(fd, iov, iovcnt);
+        metrics_elapsed(METRIC_WRITE_BLOCKED, start);
+
+        if (result == -1) {
+            perror("Error writing data to file descriptor");
+            exit(-1);
+        }
+        metrics_count(METRIC_WIRE_BYTES, result);
+
+        while (iovcnt > 0 && (size_t) result >= iov->iov_len) {
+            result -= iov->iov_len;
+            iov += 1;
+            iovcnt -= 1;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + result;
+            iov->iov_len -= result;
+        }
+    }
+}
+
+void writeFrame(int serialfd, const uint8_t *header, size_t headerLen, const uint8_t *payload,
+                size_t payloadLen)
+{
+    // Frames go out as their header followed by the payload wherever it
+    // already is, so it never has to be copied next to the header
+    struct iovec iov[2] = {
+        { (void *) header, headerLen },
+        { (void *) payload, payloadLen }
+    };
+
+    writevAllOrDie(serialfd, iov, 2);
 }
 
-void writeHeader(int serialfd, const uint8_t shaSum[32], size_t fileLen, size_t numPackets)
+void writeHeader(int serialfd, const uint8_t shaSum[32], size_t fileLen, size_t numPackets,
+                 uint8_t mode, uint16_t window, uint8_t flags, const uint8_t merkleRoot[32],
+                 size_t packetSize, uint8_t codec)
 {
     uint64_t fileLen_64, numPackets_64;
-    uint8_t outBuf[49];
+    uint32_t packetSize_32, crcSum;
+    uint8_t outBuf[94];
 
     // Header format:
     //  * 1 byte for TRANSFER_START
+    //  * 4 bytes for crc32sum of everything after it
     //  * 8 bytes for file size in bytes
     //  * 8 bytes for number of packets
     //  * 32 bytes for sha256sum
+    //  * 1 byte for the proposed transfer mode
+    //  * 2 bytes for the proposed window size
+    //  * 1 byte for header flags
+    //  * 32 bytes for the merkle root, zero without TRANSFER_FLAG_MERKLE
+    //  * 4 bytes for the size of every packet but the last in bytes
+    //  * 1 byte for the proposed compression codec
 
     fileLen_64 = fileLen;
     numPackets_64 = numPackets;
+    packetSize_32 = packetSize;
 
     outBuf[0] = TRANSFER_START;
-    memcpy(outBuf + 1, &fileLen_64, 8);
-    memcpy(outBuf + 9, &numPackets_64, 8);
-    memcpy(outBuf + 17, shaSum, 32);
+    memcpy(outBuf + 5, &fileLen_64, 8);
+    memcpy(outBuf + 13, &numPackets_64, 8);
+    memcpy(outBuf + 21, shaSum, 32);
+    outBuf[53] = mode;
+    memcpy(outBuf + 54, &window, 2);
+    outBuf[56] = flags;
+    memcpy(outBuf + 57, merkleRoot, 32);
+    memcpy(outBuf + 89, &packetSize_32, 4);
+    outBuf[93] = codec;
+
+    crcSum = crc32(outBuf + 5, 89);
+    memcpy(outBuf + 1, &crcSum, 4);
 
-    writeAllOrDie(serialfd, outBuf, 49);
+    writeAllOrDie(serialfd, outBuf, 94);
 }
 
-void writePacket(int serialfd, const uint8_t *packetData, size_t packetLen)
+void writeTrailer(int serialfd, const uint8_t shaSum[32], size_t fileLen, size_t numPackets)
 {
-    uint16_t packetLen_16;
+    uint64_t fileLen_64, numPackets_64;
     uint32_t crcSum;
-    uint8_t *outBuf;
+    uint8_t outBuf[53];
 
-    // Packet format:
-    //  * 1 byte for TRANSFER_PACKET
-    //  * 2 bytes for packet size in bytes
-    //  * 4 bytes for crc32sum
-    //  * n bytes for packet data
+    // Trailer format, sent after the last packet when the header was
+    // written with TRANSFER_FLAG_TRAILER:
+    //  * 1 byte for TRANSFER_END
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 8 bytes for file size in bytes
+    //  * 8 bytes for number of packets
+    //  * 32 bytes for sha256sum
 
-    packetLen_16 = packetLen;
-    crcSum = crc32(packetData, packetLen);
+    fileLen_64 = fileLen;
+    numPackets_64 = numPackets;
+
+    outBuf[0] = TRANSFER_END;
+    memcpy(outBuf + 5, &fileLen_64, 8);
+    memcpy(outBuf + 13, &numPackets_64, 8);
+    memcpy(outBuf + 21, shaSum, 32);
+    crcSum = crc32(outBuf + 5, 48);
+    memcpy(outBuf + 1, &crcSum, 4);
+
+    writeAllOrDie(serialfd, outBuf, 53);
+}
+
+// Signatures start with a crc32sum of their own, so a damaged length is
+// caught before the blocks are read by it
+#define SIGNATURES_HEADER_SIZE 55
+
+bool readSignatures(SerialReader *serial, DeltaSignatures *sigs, size_t *have, int quietMs)
+{
+    // Signatures format:
+    //  * 1 byte for TRANSFER_SIGNATURES
+    //  * 4 bytes for block size in bytes
+    //  * 8 bytes for the size of the receiver's copy in bytes, 0 without one
+    //  * 32 bytes for its sha256sum
+    //  * 4 bytes for the first block answered for
+    //  * 2 bytes for the number of blocks answered for, n
+    //  * 4 bytes for crc32sum of the above, less the command
+    //  * 4 bytes for crc32sum and DELTA_STRONG_SIZE bytes for the start of
+    //    the sha256sum of each of the n blocks, in order
+    //  * 4 bytes for crc32sum of the blocks
+    //
+    // The first answer fills in sigs, later ones add to the have blocks
+    // it holds so far if they follow on, anything else is a stale copy of
+    // an earlier answer. The header has to be buffered already. Returns
+    // false if anything was damaged, or the blocks stopped coming for
+    // quietMs.
+
+    const uint8_t *header = reader_data(serial);
+    uint32_t crcSum, first;
+    uint16_t count;
+    uint64_t basisLen;
+    uint32_t blockSize;
+
+    memcpy(&crcSum, header + 51, 4);
+    if (header[0] != TRANSFER_SIGNATURES || crcSum != crc32(header + 1, 50))
+        return false;
+
+    memcpy(&blockSize, header + 1, 4);
+    memcpy(&basisLen, header + 5, 8);
+    memcpy(&first, header + 45, 4);
+    memcpy(&count, header + 49, 2);
 
-    outBuf = malloc(7 + packetLen);
+    size_t blockNum = blockSize > 0 ? basisLen / blockSize : 0;
+    if (count > MAX_SIGNATURES || (size_t) first + count > blockNum)
+        return false;
 
-    outBuf[0] = TRANSFER_PACKET;
-    memcpy(outBuf + 1, &packetLen_16, 2);
-    memcpy(outBuf + 3, &crcSum, 4);
-    memcpy(outBuf + 7, packetData, packetLen);
+    if (sigs->blocks == NULL) {
+        sigs->blockSize = blockSize;
+        sigs->basisLen = basisLen;
+        sigs->blockNum = blockNum;
+        memcpy(sigs->basisSum, header + 13, 32);
+        sigs->blocks = malloc(blockNum > 0 ? blockNum * sizeof(DeltaBlock) : 1);
+    }
+    reader_consume(serial, SIGNATURES_HEADER_SIZE);
+
+    size_t blocksLen = count * sizeof(DeltaBlock);
+    int result = reader_need_within(serial, blocksLen + 4, quietMs);
+    if (result == -1) {
+        perror("Error reading serial port");
+        exit(-1);
+    } else if (result == 0) {
+        return false;
+    }
 
-    // Debug info
-    printf("\tSending packet: %u, %u\n", packetLen_16, crcSum);
+    const uint8_t *blocks = reader_data(serial);
+    memcpy(&crcSum, blocks + blocksLen, 4);
+    if (crcSum != crc32(blocks, blocksLen))
+        return false;
 
-    writeAllOrDie(serialfd, outBuf, 7 + packetLen);
+    if (first == *have && (size_t) first + count <= sigs->blockNum) {
+        memcpy(sigs->blocks + first, blocks, blocksLen);
+        *have += count;
+    }
+    reader_consume(serial, blocksLen + 4);
 
-    free(outBuf);
+    return true;
 }
 
-bool readResponse(int serialfd)
+void requestSignatures(SerialReader *serial, DeltaSignatures *sigs)
 {
-    // if response is TRANSFER_NEXT return true
-    // if response is TRANSFER_AGAIN return false
-    // if response is an error, exit?
+    // Signatures request format:
+    //  * 1 byte for TRANSFER_SIGNATURES
+    //  * 4 bytes for the first block wanted
+    //
+    // Asks for the blocks it doesn't have until an undamaged answer has
+    // brought all of them. An answer that was only late comes again for
+    // the second request, and is skipped here or by readHeaderReply.
 
-    uint8_t response;
-    ssize_t result;
+    uint8_t request[5] = { TRANSFER_SIGNATURES };
+    size_t have = 0;
+    RttEstimator rtt;
 
-    result = read(serialfd, &response, 1);
-    if (result == -1) {
-        perror("Error reading packet response");
+    sigs->blocks = NULL;
+    initRtt(&rtt);
+
+    if (reader_reserve(serial, SIGNATURES_HEADER_SIZE + MAX_SIGNATURES * sizeof(DeltaBlock)
+                               + 4) == -1) {
+        printf("Error allocating the serial buffer\n");
         exit(-1);
     }
 
-    switch (response) {
-        case TRANSFER_NEXT:
-            return true;
-            break;
-        case TRANSFER_AGAIN:
-            return false;
-            break;
-        case TRANSFER_END:
-            printf("Received premature TRANSFER_END response\n");
-            exit(-1);
-        case TRANSFER_ERROR:
-            printf("Received TRANSFER_ERROR response\n");
-            exit(-1);
-        default:
-            printf("Received erroneous transfer response\n");
-            exit(-1);
+    while (sigs->blocks == NULL || have < sigs->blockNum) {
+        struct timespec sentAt;
+        uint32_t first = have;
+
+        memcpy(request + 1, &first, 4);
+        writeAllOrDie(serial->fd, request, sizeof(request));
+        clock_gettime(CLOCK_MONOTONIC, &sentAt);
+
+        if (!awaitResponse(serial, SIGNATURES_HEADER_SIZE, &sentAt, rtt.rto)) {
+            LOG_WARN("No answer to the signature request, asking again\n");
+            metrics_count(METRIC_RETRANSMITS, 1);
+            backoffRtt(&rtt);
+        } else if (!readSignatures(serial, sigs, &have, rtt.rto)) {
+            LOG_WARN("Signatures arrived damaged, asking again\n");
+            metrics_count(METRIC_RETRANSMITS, 1);
+            drainOrDie(serial);
+        }
     }
 }
 
-int main(int argc, char **argv)
+bool readHeaderReply(SerialReader *serial, size_t packetNum, uint8_t *mode, uint16_t *window,
+                     uint8_t *codec, uint8_t **bitmap, size_t *bitmapLen)
 {
-    FILE *file = stdin;
-    size_t start = 0;
+    const uint8_t *inBuf;
+    uint64_t bitmapLen_64;
+    uint32_t crcSum;
 
-    int c = 0;
+    // Header reply format:
+    //  * 1 byte for TRANSFER_START
+    //  * 4 bytes for crc32sum of everything after it, bitmap included
+    //  * 1 byte for the accepted transfer mode
+    //  * 2 bytes for the accepted window size
+    //  * 1 byte for the accepted compression codec
+    //  * 8 bytes for the length of the received packet bitmap
+    //  * n bytes of bitmap, bit i % 8 of byte i / 8 set for every packet
+    //    the receiver already has from an earlier attempt at this transfer
+    //
+    // Fills in bitmap, which is NULL when there is nothing to skip. Returns
+    // false if the reply got corrupted, after dropping it, the receiver
+    // answers the header again when it comes again.
+
+    // Signatures asked for more than once can be answered more than once,
+    // the spare answers come first
     while (true) {
-        static struct option long_options[] = {
-            {"file",  required_argument, 0, 'f'},
-            {"start", required_argument, 0, 's'},
-            {0, 0, 0, 0}
-        };
+        DeltaSignatures spare = { .blocks = NULL };
+        size_t none = 0;
+        int result = reader_need_within(serial, 1, RESYNC_QUIET_MS);
 
-        int option_index = 0;
-        c = getopt_long(argc, argv, "f:s:", long_options, &option_index);
-        if (c == -1)
+        if (result == -1) {
+            perror("Error reading serial port");
+            exit(-1);
+        }
+        if (result == 0) {
+            LOG_WARN("No reply to the transfer header, sending it again\n");
+            return false;
+        }
+        if (reader_data(serial)[0] != TRANSFER_SIGNATURES)
             break;
 
-        switch (c) {
-            case 'f':
-                file = fopen(optarg, "r");
-                if (file == NULL) {
-                    perror("Error opening file");
-                    exit(-1);
-                }
-                break;
-            case 's':
-                start = strtoul(optarg, NULL, 0);
-                break;
-        }
+        peekOrDie(serial, SIGNATURES_HEADER_SIZE);
+        if (!readSignatures(serial, &spare, &none, RTO_INITIAL_MS))
+            drainOrDie(serial);
+        delta_free(&spare);
     }
 
-    if (optind == argc) {
-        printf("%s expects a serial port to communicate across\n", argv[0]);
-        return -1;
+    if (reader_data(serial)[0] == TRANSFER_ERROR)
+        exitIfAborted(serial, "Receiver rejected the transfer header");
+
+    if (reader_data(serial)[0] != TRANSFER_START) {
+        LOG_WARN("Received erroneous reply to the transfer header, sending it again\n");
+        drainOrDie(serial);
+        return false;
     }
 
-    size_t fileLen, packetNum;
-    uint8_t *fileData;
-    int serialfd;
+    if (reader_need_within(serial, 17, RESYNC_QUIET_MS) != 1) {
+        LOG_WARN("Reply to the transfer header was cut short, sending the header again\n");
+        drainOrDie(serial);
+        return false;
+    }
 
-    fileData = readFile(file, &fileLen);
-    packetNum = fileLen / PACKET_SIZE + (fileLen % PACKET_SIZE == 0 ? 0 : 1);
+    // A bitmap can't name more packets than there are, so a damaged length
+    // is caught before anything is allocated for it
+    memcpy(&bitmapLen_64, reader_data(serial) + 9, 8);
+    if (bitmapLen_64 > packetNum / 8 + (packetNum % 8 == 0 ? 0 : 1)) {
+        LOG_WARN("Received erroneous reply to the transfer header, sending it again\n");
+        drainOrDie(serial);
+        return false;
+    }
 
-    if (start >= packetNum) {
-        printf("Given a start packet that is greater than the total number of packets for that file\n");
+    if (reader_reserve(serial, 17 + bitmapLen_64) == -1) {
+        printf("Error allocating the serial buffer\n");
         exit(-1);
     }
+    if (reader_need_within(serial, 17 + bitmapLen_64, RESYNC_QUIET_MS) != 1) {
+        LOG_WARN("Reply to the transfer header was cut short, sending the header again\n");
+        drainOrDie(serial);
+        return false;
+    }
 
-    serialfd = open(argv[optind], O_RDWR);
-    if (serialfd == -1) {
-        perror("Error opening serial port");
-        exit(-1);
+    inBuf = reader_data(serial);
+    memcpy(&crcSum, inBuf + 1, 4);
+    if (crcSum != crc32(inBuf + 5, 12 + bitmapLen_64)) {
+        LOG_WARN("Error receiving the header reply: calculated checksum differs from given, "
+                 "sending the header again\n");
+        metrics_count(METRIC_CRC_FAILURES, 1);
+        drainOrDie(serial);
+        return false;
     }
 
-    // If this is the start of the transfer, write out the header
-    if (start == 0) {
-        uint8_t shaSum[32];
-        char shaStr[65];
+    *mode = inBuf[5];
+    memcpy(window, inBuf + 6, 2);
+    *codec = inBuf[8];
 
-        calculateSHA256(fileData, fileLen, shaSum);
-        sha256Str(shaStr, shaSum);
+    *bitmapLen = bitmapLen_64;
+    *bitmap = NULL;
+    if (*bitmapLen > 0) {
+        *bitmap = malloc(*bitmapLen);
+        if (*bitmap == NULL) {
+            printf("Error allocating the received packet bitmap\n");
+            exit(-1);
+        }
+        memcpy(*bitmap, inBuf + 17, *bitmapLen);
+    }
+    reader_consume(serial, 17 + *bitmapLen);
 
-        // I don't think the sending metadata file is necessary?
-        //writeMetadataFile(shaStr, argv[2]);
-        writeHeader(serialfd, shaSum, fileLen, packetNum);
+    return true;
+}
 
-        // Debug info
-        printf("Header written, sending packets...\n");
-    } else {
-        // Debug info
-        printf("Resuming transfer at packet %zu\n", start);
-    }
+size_t framePacket(uint8_t *header, const uint8_t *packetData, size_t packetLen)
+{
+    uint32_t packetLen_32;
+    uint32_t crcSum;
 
-    for (size_t i = start; i < packetNum;) {
-        size_t offset = i * PACKET_SIZE;
-        size_t packetLen = fileLen - offset > PACKET_SIZE ? PACKET_SIZE : fileLen - offset;
+    // Packet format:
+    //  * 1 byte for TRANSFER_PACKET
+    //  * 4 bytes for packet size in bytes
+    //  * 4 bytes for crc32sum
+    //  * n bytes for packet data
+    //
+    // Only the header is built, into header. Returns its length.
 
-        // Debug info
-        printf("Sending packet %zu\n", i);
+    packetLen_32 = packetLen;
+    crcSum = crc32(packetData, packetLen);
 
-        writePacket(serialfd, fileData + offset, packetLen);
-        if (readResponse(serialfd))
-            i += 1;
-    }
+    header[0] = TRANSFER_PACKET;
+    memcpy(header + 1, &packetLen_32, 4);
+    memcpy(header + 5, &crcSum, 4);
+
+    return 9;
+}
+
+size_t frameWindowPacket(uint8_t *header, uint32_t seq, const uint8_t *packetData,
+                         size_t packetLen)
+{
+    uint32_t packetLen_32;
+    uint32_t crcSum;
+    CRC32_CTX crcCtx;
+
+    // Windowed packet format:
+    //  * 1 byte for TRANSFER_WINDOW_PACKET
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 4 bytes for sequence number
+    //  * 4 bytes for packet size in bytes
+    //  * n bytes for packet data
+    //
+    // The sequence number is covered by the crc so a corrupted one can't
+    // land a good packet in the wrong place. Only the header is built, into
+    // header. Returns its length.
+
+    packetLen_32 = packetLen;
+
+    header[0] = TRANSFER_WINDOW_PACKET;
+    memcpy(header + 5, &seq, 4);
+    memcpy(header + 9, &packetLen_32, 4);
+
+    crc32_init(&crcCtx);
+    crc32_update(&crcCtx, header + 5, 8);
+    crc32_update(&crcCtx, packetData, packetLen);
+    crcSum = crc32_final(&crcCtx);
+    memcpy(header + 1, &crcSum, 4);
+
+    return 13;
+}
+
+void writeWindowPacket(int serialfd, uint32_t seq, const uint8_t *packetData, size_t packetLen)
+{
+    uint8_t header[13];
+    size_t headerLen = frameWindowPacket(header, seq, packetData, packetLen);
+
+    LOG_DEBUG("\tSending packet %u: %zu\n", seq, packetLen);
+
+    metrics_count(METRIC_PACKETS, 1);
+    writeFrame(serialfd, header, headerLen, packetData, packetLen);
+    trace_event(TRACE_FRAME, seq, headerLen + packetLen, 0);
+}
+
+void writeOffsetPacket(int serialfd, uint64_t offset, const uint8_t *packetData, size_t packetLen)
+{
+    uint32_t packetLen_32;
+    uint32_t crcSum;
+    uint8_t header[17];
+    CRC32_CTX crcCtx;
+
+    // Offset packet format:
+    //  * 1 byte for TRANSFER_OFFSET_PACKET
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 8 bytes for the file offset of the first byte
+    //  * 4 bytes for frame size in bytes
+    //  * n bytes for the data of one or more consecutive packets
+
+    packetLen_32 = packetLen;
+
+    header[0] = TRANSFER_OFFSET_PACKET;
+    memcpy(header + 5, &offset, 8);
+    memcpy(header + 13, &packetLen_32, 4);
+
+    crc32_init(&crcCtx);
+    crc32_update(&crcCtx, header + 5, 12);
+    crc32_update(&crcCtx, packetData, packetLen);
+    crcSum = crc32_final(&crcCtx);
+    memcpy(header + 1, &crcSum, 4);
+
+    LOG_DEBUG("\tSending frame at %llu: %u, %u\n", (unsigned long long) offset, packetLen_32,
+              crcSum);
+
+    metrics_count(METRIC_PACKETS, 1);
+    writeFrame(serialfd, header, 17, packetData, packetLen);
+    trace_event(TRACE_FRAME, offset, 17 + packetLen, 0);
+}
+
+void writeRepairPacket(int serialfd, uint32_t group, uint16_t index, const uint8_t *repairData,
+                       size_t repairLen)
+{
+    uint32_t repairLen_32;
+    uint32_t crcSum;
+    uint8_t header[15];
+    CRC32_CTX crcCtx;
+
+    // Repair packet format:
+    //  * 1 byte for TRANSFER_REPAIR_PACKET
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 4 bytes for group number
+    //  * 2 bytes for repair symbol index
+    //  * 4 bytes for repair symbol size in bytes
+    //  * n bytes for the repair symbol
+
+    repairLen_32 = repairLen;
+
+    header[0] = TRANSFER_REPAIR_PACKET;
+    memcpy(header + 5, &group, 4);
+    memcpy(header + 9, &index, 2);
+    memcpy(header + 11, &repairLen_32, 4);
+
+    crc32_init(&crcCtx);
+    crc32_update(&crcCtx, header + 5, 10);
+    crc32_update(&crcCtx, repairData, repairLen);
+    crcSum = crc32_final(&crcCtx);
+    memcpy(header + 1, &crcSum, 4);
+
+    LOG_DEBUG("\tSending repair packet %u of group %u: %u, %u\n", index, group, repairLen_32,
+              crcSum);
+
+    metrics_count(METRIC_PACKETS, 1);
+    writeFrame(serialfd, header, 15, repairData, repairLen);
+    trace_event(TRACE_REPAIR, (uint64_t) group << 16 | index, 15 + repairLen, 0);
+}
+
+void writeGroupEnd(int serialfd, uint32_t group, const uint32_t *seqs, uint16_t count)
+{
+    uint32_t crcSum;
+    uint8_t outBuf[11 + 4 * MAX_WINDOW_SIZE];
+
+    // Group end format:
+    //  * 1 byte for TRANSFER_GROUP_END
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 4 bytes for group number
+    //  * 2 bytes for the number of packets in the group
+    //  * 4 bytes for the sequence number of each packet, in symbol order
+
+    outBuf[0] = TRANSFER_GROUP_END;
+    memcpy(outBuf + 5, &group, 4);
+    memcpy(outBuf + 9, &count, 2);
+    memcpy(outBuf + 11, seqs, 4 * (size_t) count);
+
+    crcSum = crc32(outBuf + 5, 6 + 4 * (size_t) count);
+    memcpy(outBuf + 1, &crcSum, 4);
+
+    writeAllOrDie(serialfd, outBuf, 11 + 4 * (size_t) count);
+    trace_event(TRACE_GROUP_END, group, 11 + 4 * (size_t) count, 0);
+}
+
+int readGroupStatus(SerialReader *serial, uint32_t group, uint16_t count, uint8_t *missing,
+                    const struct timespec *sentAt, double timeoutMs)
+{
+    // Group status format:
+    //  * 1 byte for TRANSFER_GROUP_STATUS
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 4 bytes for group number
+    //  * 2 bytes for the number of packets in the group
+    //  * (count + 7) / 8 bytes for a bitmap of the packets still missing
+    //
+    // Returns 1 with the status of the group, 0 when the status is for some
+    // other group or damaged, or the receiver asked for the group end again
+    // with TRANSFER_AGAIN, and -1 if it didn't arrive within timeoutMs of
+    // sentAt. Statuses of earlier groups, answering group ends that were
+    // sent again while their status was on its way, are skipped.
+
+    uint8_t response;
+    uint8_t inBuf[10 + MAX_WINDOW_SIZE / 8];
+    size_t bitmapLen;
+    uint32_t crcSum, statusGroup;
+    uint16_t statusCount;
+
+    while (true) {
+        if (!awaitResponse(serial, 1, sentAt, timeoutMs))
+            return -1;
+
+        if (reader_data(serial)[0] == TRANSFER_ERROR)
+            exitIfAborted(serial, "Received TRANSFER_ERROR response");
+
+        readAllOrDie(serial, &response, 1);
+
+        switch (response) {
+            case TRANSFER_GROUP_STATUS:
+                break;
+            case TRANSFER_AGAIN:
+                trace_event(TRACE_ANSWER, TRACE_NO_SEQ, 1, response);
+                return 0;
+            default:
+                // Whatever it was, the group end goes again and the receiver
+                // answers with the same status
+                LOG_WARN("Received erroneous transfer response, asking again\n");
+                drainOrDie(serial);
+                return 0;
+        }
+
+        if (!awaitResponse(serial, 10, sentAt, timeoutMs))
+            return -1;
+
+        readAllOrDie(serial, inBuf, 10);
+        memcpy(&crcSum, inBuf, 4);
+        memcpy(&statusGroup, inBuf + 4, 4);
+        memcpy(&statusCount, inBuf + 8, 2);
+
+        if (statusCount > MAX_WINDOW_SIZE)
+            return 0;
+
+        bitmapLen = (statusCount + 7) / 8;
+        if (!awaitResponse(serial, bitmapLen, sentAt, timeoutMs))
+            return -1;
+
+        readAllOrDie(serial, inBuf + 10, bitmapLen);
+
+        if (crcSum != crc32(inBuf + 4, 6 + bitmapLen))
+            return 0;
+        if (statusGroup < group)
+            continue;
+        if (statusGroup != group || statusCount != count)
+            return 0;
+
+        trace_event(TRACE_ANSWER, group, 11 + bitmapLen, TRANSFER_GROUP_STATUS);
+        memcpy(missing, inBuf + 10, bitmapLen);
+        return 1;
+    }
+}
+
+uint8_t readWindowResponse(SerialReader *serial, uint32_t *seq)
+{
+    // Windowed response format:
+    //  * 1 byte for TRANSFER_ACK or TRANSFER_NAK
+    //  * 4 bytes for the sequence number it refers to
+    //
+    // Returns TRANSFER_ACK or TRANSFER_NAK or, for a corrupted response,
+    // whatever was read instead
+
+    uint8_t response;
+    uint8_t seqBuf[4];
+
+    if (peekOrDie(serial, 1)[0] == TRANSFER_ERROR)
+        exitIfAborted(serial, "Received TRANSFER_ERROR response");
+
+    readAllOrDie(serial, &response, 1);
+
+    switch (response) {
+        case TRANSFER_ACK:
+        case TRANSFER_NAK:
+            readAllOrDie(serial, seqBuf, 4);
+            memcpy(seq, seqBuf, 4);
+            trace_event(TRACE_ANSWER, *seq, 5, response);
+            return response;
+        default:
+            // A response that lost a byte on the way puts every one after it
+            // out of step, so skipping a fixed length could go wrong forever.
+            // The caller asks about the window instead, which skips whatever
+            // arrives ahead of the answer.
+            trace_event(TRACE_ANSWER, TRACE_NO_SEQ, 1, response);
+            LOG_WARN("Received erroneous transfer response\n");
+            return response;
+    }
+}
+
+uint8_t readResponse(SerialReader *serial)
+{
+    // Returns TRANSFER_NEXT, TRANSFER_AGAIN or, for a corrupted response,
+    // whatever was read instead. Without sequence numbers any guess at what
+    // a corrupted one was would store a packet twice or skip one if wrong,
+    // so it is left to the caller to find out.
+
+    uint8_t response;
+
+    if (peekOrDie(serial, 1)[0] == TRANSFER_ERROR)
+        exitIfAborted(serial, "Received TRANSFER_ERROR response");
+
+    readAllOrDie(serial, &response, 1);
+    trace_event(TRACE_ANSWER, TRACE_NO_SEQ, 1, response);
+
+    switch (response) {
+        case TRANSFER_NEXT:
+        case TRANSFER_AGAIN:
+            return response;
+        default:
+            LOG_WARN("Received erroneous transfer response\n");
+            return response;
+    }
+}
+
+void queryPackets(SerialReader *serial, RttEstimator *rtt, const uint64_t *indexes,
+                  uint16_t count, uint8_t *has)
+{
+    // Query format:
+    //  * 1 byte for TRANSFER_QUERY
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 4 bytes for the query id
+    //  * 2 bytes for the number of packets asked about
+    //  * 8 bytes for the number of each packet
+    //
+    // Answer format:
+    //  * 1 byte for TRANSFER_QUERY
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 4 bytes for the query id
+    //  * 2 bytes for the number of packets asked about
+    //  * (count + 7) / 8 bytes for a bitmap of the ones received
+    //
+    // Fills has with the answer. The link doesn't reorder anything, so
+    // whatever arrives ahead of the answer responds to packets sent before
+    // the query, which the answer covers as well, and is dropped. A late
+    // answer is asked for again under a new id.
+
+    static uint32_t lastId = 0;
+    uint8_t outBuf[11 + 8 * MAX_WINDOW_SIZE];
+    size_t answerLen = (count + 7) / 8;
+
+    outBuf[0] = TRANSFER_QUERY;
+    memcpy(outBuf + 9, &count, 2);
+    memcpy(outBuf + 11, indexes, 8 * (size_t) count);
+
+    while (true) {
+        uint32_t id = ++lastId;
+        uint32_t crcSum, answerId;
+        uint16_t answerCount;
+        struct timespec sentAt;
+
+        memcpy(outBuf + 5, &id, 4);
+        crcSum = crc32(outBuf + 5, 6 + 8 * (size_t) count);
+        memcpy(outBuf + 1, &crcSum, 4);
+
+        writeAllOrDie(serial->fd, outBuf, 11 + 8 * (size_t) count);
+        clock_gettime(CLOCK_MONOTONIC, &sentAt);
+        trace_event(TRACE_QUERY, id, 11 + 8 * (size_t) count, 0);
+
+        while (awaitResponse(serial, 1, &sentAt, rtt->rto)) {
+            if (reader_data(serial)[0] != TRANSFER_QUERY) {
+                reader_consume(serial, 1);
+                continue;
+            }
+
+            if (!awaitResponse(serial, 11 + answerLen, &sentAt, rtt->rto))
+                break;
+
+            const uint8_t *answer = reader_data(serial);
+            memcpy(&crcSum, answer + 1, 4);
+            memcpy(&answerId, answer + 5, 4);
+            memcpy(&answerCount, answer + 9, 2);
+
+            // Stale or damaged answers are skipped a byte at a time, like
+            // anything else that isn't the answer
+            if (crcSum != crc32(answer + 5, 6 + answerLen) || answerId != id
+                || answerCount != count) {
+                reader_consume(serial, 1);
+                continue;
+            }
+
+            memcpy(has, answer + 11, answerLen);
+            reader_consume(serial, 11 + answerLen);
+            trace_event(TRACE_ANSWER, id, 11 + answerLen, TRANSFER_QUERY);
+
+            // Ids tell answers apart, so every one is a clean sample
+            sampleRtt(rtt, msSince(&sentAt));
+            return;
+        }
+
+        LOG_WARN("No answer to query %u, asking again\n", id);
+
+        metrics_count(METRIC_RETRANSMITS, 1);
+        backoffRtt(rtt);
+    }
+}
+
+bool readTimedResponse(SerialReader *serial, RttEstimator *rtt, const struct timespec *sentAt,
+                       bool resent, size_t first)
+{
+    // Whether the packet, or adaptive frame starting at packet first,
+    // written at sentAt was received. An overdue answer is as good as lost,
+    // and so is a corrupted one, the receiver is asked whether the packet
+    // arrived instead.
+
+    uint8_t response = 0;
+
+    if (awaitResponse(serial, 1, sentAt, rtt->rto)) {
+        response = readResponse(serial);
+        if (response == TRANSFER_NEXT || response == TRANSFER_AGAIN) {
+            if (!resent)
+                sampleRtt(rtt, msSince(sentAt));
+            return response == TRANSFER_NEXT;
+        }
+    } else {
+        backoffRtt(rtt);
+    }
+
+    uint64_t index = first;
+    uint8_t has;
+
+    LOG_WARN("No answer to packet %zu, asking whether it arrived\n", first);
+
+    queryPackets(serial, rtt, &index, 1, &has);
+    return has & 1;
+}
+
+bool readLeavesAnswer(SerialReader *serial, size_t leafNum, size_t *have)
+{
+    const uint8_t *inBuf;
+    uint64_t have_64;
+    uint32_t crcSum;
+
+    // Leaves answer format:
+    //  * 1 byte for TRANSFER_LEAVES
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 8 bytes for the number of leaves received so far
+    //
+    // Returns false for a corrupted answer, after dropping it. A late answer
+    // to a chunk sent twice only costs sending what it says again, the
+    // receiver answers that with how many it really has.
+
+    if (reader_data(serial)[0] == TRANSFER_ERROR)
+        exitIfAborted(serial, "Receiver rejected the merkle leaves");
+
+    if (reader_data(serial)[0] != TRANSFER_LEAVES
+        || reader_need_within(serial, 13, RESYNC_QUIET_MS) != 1) {
+        drainOrDie(serial);
+        return false;
+    }
+
+    inBuf = reader_data(serial);
+    memcpy(&crcSum, inBuf + 1, 4);
+    memcpy(&have_64, inBuf + 5, 8);
+    if (crcSum != crc32(inBuf + 5, 8) || have_64 > leafNum) {
+        drainOrDie(serial);
+        return false;
+    }
+    reader_consume(serial, 13);
+
+    *have = have_64;
+    return true;
+}
+
+void writeLeaves(SerialReader *serial, const uint8_t (*leaves)[32], size_t leafNum)
+{
+    // Leaves format:
+    //  * 1 byte for TRANSFER_LEAVES
+    //  * 4 bytes for crc32sum of everything after it
+    //  * 8 bytes for the number of the first leaf
+    //  * 4 bytes for the length of the leaves in bytes
+    //  * 32 bytes per packet for its merkle leaf, in packet order, for at
+    //    most MAX_LEAVES packets
+    //
+    // Chunks are sent one at a time from wherever the receiver says it has
+    // got to, so only a damaged chunk is sent again. The receiver checks
+    // them against the root from the header once it has all of them and
+    // starts over from none if they don't match.
+
+    uint8_t header[17] = { TRANSFER_LEAVES };
+    size_t have = 0;
+    RttEstimator rtt;
+
+    initRtt(&rtt);
+
+    while (have < leafNum) {
+        struct timespec sentAt;
+        CRC32_CTX ctx;
+        uint64_t first_64 = have;
+        size_t count = leafNum - have < MAX_LEAVES ? leafNum - have : MAX_LEAVES;
+        uint32_t len_32 = count * 32;
+        uint32_t crcSum;
+
+        memcpy(header + 5, &first_64, 8);
+        memcpy(header + 13, &len_32, 4);
+        crc32_init(&ctx);
+        crc32_update(&ctx, header + 5, 12);
+        crc32_update(&ctx, leaves[have], len_32);
+        crcSum = crc32_final(&ctx);
+        memcpy(header + 1, &crcSum, 4);
+
+        writeAllOrDie(serial->fd, header, sizeof(header));
+        writeAllOrDie(serial->fd, leaves[have], len_32);
+        clock_gettime(CLOCK_MONOTONIC, &sentAt);
+
+        if (!awaitResponse(serial, 1, &sentAt, rtt.rto)) {
+            LOG_WARN("No answer to the merkle leaves, sending them again\n");
+            metrics_count(METRIC_RETRANSMITS, 1);
+            backoffRtt(&rtt);
+        } else if (!readLeavesAnswer(serial, leafNum, &have)) {
+            LOG_WARN("Received erroneous answer to the merkle leaves, sending them again\n");
+            metrics_count(METRIC_RETRANSMITS, 1);
+        }
+    }
+}
+
+// Picks how many packets go in each adaptive frame. Every ADAPT_EPOCH
+// attempts it compares the goodput (bytes acked per second) with the
+// previous epoch and keeps doubling or halving the frame in whichever
+// direction improved it, turning around when it got worse. That settles
+// around the size with the best goodput for the current error rate and
+// keeps following it as the link changes. An epoch where most attempts
+// failed always halves, since long frames are the likely cause.
+#define ADAPT_EPOCH 8
+
+typedef struct {
+    size_t units;
+    size_t maxUnits;
+    int direction;
+    double lastGoodput;
+    size_t attempts;
+    size_t failures;
+    size_t ackedBytes;
+    struct timespec epochStart;
+} FrameSizer;
+
+void initFrameSizer(FrameSizer *sizer, size_t units, size_t maxUnits)
+{
+    sizer->units = units;
+    sizer->maxUnits = maxUnits;
+    sizer->direction = 1;
+    sizer->lastGoodput = 0;
+    sizer->attempts = 0;
+    sizer->failures = 0;
+    sizer->ackedBytes = 0;
+    clock_gettime(CLOCK_MONOTONIC, &sizer->epochStart);
+}
+
+void recordFrame(FrameSizer *sizer, bool acked, size_t frameLen)
+{
+    struct timespec now;
+    double elapsed, goodput;
+
+    sizer->attempts += 1;
+    if (acked)
+        sizer->ackedBytes += frameLen;
+    else
+        sizer->failures += 1;
+
+    if (sizer->attempts < ADAPT_EPOCH)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - sizer->epochStart.tv_sec)
+              + (now.tv_nsec - sizer->epochStart.tv_nsec) / 1e9;
+    goodput = elapsed > 0 ? sizer->ackedBytes / elapsed : 0;
+
+    if (2 * sizer->failures > sizer->attempts)
+        sizer->direction = -1;
+    else if (goodput < sizer->lastGoodput)
+        sizer->direction = -sizer->direction;
+
+    if (sizer->direction > 0 && sizer->units < sizer->maxUnits)
+        sizer->units = 2 * sizer->units < sizer->maxUnits ? 2 * sizer->units : sizer->maxUnits;
+    else if (sizer->direction < 0 && sizer->units > 1)
+        sizer->units /= 2;
+
+    LOG_INFO("Goodput %.0f B/s with %zu of %zu attempts failed, frames are now %zu packets\n",
+             goodput, sizer->failures, sizer->attempts, sizer->units);
+
+    sizer->lastGoodput = goodput;
+    sizer->attempts = 0;
+    sizer->failures = 0;
+    sizer->ackedBytes = 0;
+    sizer->epochStart = now;
+}
+
+// Stop-and-wait and windowed transfers send the packets the receiver is
+// missing in order, so they're read and framed ahead of the serial link. A
+// reader thread reads (and for streamed sources hashes) packets, a framing
+// thread compresses them and builds the frame headers with their crc32sum,
+// and the sending thread only writes frames out and deals with responses.
+// The stages pass packets along single producer, single consumer rings, and
+// acked packets go back to the reader through the free ring. Their buffers
+// all come out of one pool set up front, and uncompressed payloads are sent
+// from wherever they were read to (or from the file mapping), so nothing is
+// allocated or copied per packet and the work on the next few packets
+// overlaps the wire time of the current one. The source and compressor
+// belong to the pipeline threads until it's finished.
+#define PIPELINE_DEPTH 8
+
+typedef struct {
+    size_t seq;
+    size_t len;
+    const uint8_t *data;
+    size_t payloadLen;
+    const uint8_t *payload;
+    size_t headerLen;
+    uint8_t header[13];
+
+    // Owned buffers the packet is read and compressed into
+    uint8_t *readBuf;
+    uint8_t *encodeBuf;
+} PipelinePacket;
+
+typedef struct {
+    PacketSource *src;
+    Compressor *cmp;
+    size_t packetNum;
+    const uint8_t *have;
+    size_t haveLen;
+    uint8_t command;
+
+    PipelinePacket *packets;
+    size_t packetCount;
+    BufferPool pool;
+    SpscRing free;
+    SpscRing read;
+    SpscRing framed;
+    pthread_t reader;
+    pthread_t framer;
+} SendPipeline;
+
+void* pipelineReader(void *arg)
+{
+    SendPipeline *pl = arg;
+    size_t seq = 0;
+
+    // A packet with no data marks the end of the file
+    while (true) {
+        PipelinePacket *pkt = ring_pop(&pl->free);
+
+        while (seq < pl->packetNum && bitmap_has(pl->have, pl->haveLen, seq))
+            seq += 1;
+
+        pkt->len = 0;
+        if (seq < pl->packetNum) {
+            seekPacket(pl->src, seq, pkt->readBuf);
+            pkt->data = packetData(pl->src, pkt->readBuf, &pkt->len);
+        }
+        pkt->seq = seq++;
+
+        ring_push(&pl->read, pkt);
+        if (pkt->len == 0)
+            return NULL;
+    }
+}
+
+void* pipelineFramer(void *arg)
+{
+    SendPipeline *pl = arg;
+
+    while (true) {
+        PipelinePacket *pkt = ring_pop(&pl->read);
+
+        if (pkt->len == 0) {
+            ring_push(&pl->framed, pkt);
+            return NULL;
+        }
+
+        pkt->payload = compress_encode(pl->cmp, pkt->data, pkt->len, pkt->encodeBuf,
+                                       &pkt->payloadLen);
+
+        if (pl->command == TRANSFER_PACKET)
+            pkt->headerLen = framePacket(pkt->header, pkt->payload, pkt->payloadLen);
+        else
+            pkt->headerLen = frameWindowPacket(pkt->header, pkt->seq, pkt->payload,
+                                               pkt->payloadLen);
+
+        ring_push(&pl->framed, pkt);
+    }
+}
+
+void startPipeline(SendPipeline *pl, PacketSource *src, Compressor *cmp, size_t packetNum,
+                   const uint8_t *have, size_t haveLen, uint8_t command, size_t inFlight)
+{
+    // inFlight is how many packets the sender holds on to until they're
+    // acked, the pipeline keeps PIPELINE_DEPTH more on their way. Mapped
+    // files need no read buffers and uncompressed transfers no buffers to
+    // compress into.
+    bool reading = src->map == NULL;
+    bool encoding = cmp->codec != COMPRESS_NONE;
+
+    pl->src = src;
+    pl->cmp = cmp;
+    pl->packetNum = packetNum;
+    pl->have = have;
+    pl->haveLen = haveLen;
+    pl->command = command;
+    pl->packetCount = inFlight + PIPELINE_DEPTH;
+    pl->packets = malloc(pl->packetCount * sizeof(PipelinePacket));
+
+    if (pool_init(&pl->pool, src->packetSize + COMPRESS_HEADER_SIZE,
+                  pl->packetCount * (reading + encoding)) == -1
+        || ring_init(&pl->free, pl->packetCount) == -1
+        || ring_init(&pl->read, pl->packetCount) == -1
+        || ring_init(&pl->framed, pl->packetCount) == -1) {
+        printf("Error allocating the send pipeline\n");
+        exit(-1);
+    }
+
+    for (size_t i = 0; i < pl->packetCount; ++i) {
+        PipelinePacket *pkt = &pl->packets[i];
+
+        pkt->readBuf = reading ? pool_get(&pl->pool) : NULL;
+        pkt->encodeBuf = encoding ? pool_get(&pl->pool) : NULL;
+        ring_push(&pl->free, pkt);
+    }
+
+    if (pthread_create(&pl->reader, NULL, pipelineReader, pl) != 0
+        || pthread_create(&pl->framer, NULL, pipelineFramer, pl) != 0) {
+        printf("Error starting the send pipeline\n");
+        exit(-1);
+    }
+}
+
+PipelinePacket* nextPacket(SendPipeline *pl)
+{
+    // Returns the next framed packet, NULL once the file is exhausted
+
+    PipelinePacket *pkt = ring_pop(&pl->framed);
+    return pkt->len == 0 ? NULL : pkt;
+}
+
+void writePipelinePacket(int serialfd, const PipelinePacket *pkt)
+{
+    metrics_count(METRIC_PACKETS, 1);
+    writeFrame(serialfd, pkt->header, pkt->headerLen, pkt->payload, pkt->payloadLen);
+    trace_event(TRACE_FRAME, pkt->seq, pkt->headerLen + pkt->payloadLen, 0);
+}
+
+void releasePacket(SendPipeline *pl, PipelinePacket *pkt)
+{
+    ring_push(&pl->free, pkt);
+}
+
+void finishPipeline(SendPipeline *pl)
+{
+    // Only once nextPacket has returned NULL
+
+    pthread_join(pl->reader, NULL);
+    pthread_join(pl->framer, NULL);
+
+    free(pl->packets);
+    pool_destroy(&pl->pool);
+    ring_destroy(&pl->free);
+    ring_destroy(&pl->read);
+    ring_destroy(&pl->framed);
+}
+
+void sendStopAndWait(SerialReader *serial, PacketSource *src, Compressor *cmp, size_t packetNum,
+                     const uint8_t *have, size_t haveLen)
+{
+    SendPipeline pl;
+    PipelinePacket *pkt;
+    RttEstimator rtt;
+
+    // The receiver skips the packets it already has in the same order, so
+    // the packets still line up without sequence numbers
+    startPipeline(&pl, src, cmp, packetNum, have, haveLen, TRANSFER_PACKET, 1);
+    initRtt(&rtt);
+
+    while ((pkt = nextPacket(&pl)) != NULL) {
+        bool acked, resent = false;
+
+        do {
+            struct timespec sentAt;
+
+            LOG_DEBUG("Sending packet %zu: %zu\n", pkt->seq, pkt->headerLen + pkt->payloadLen);
+
+            if (resent)
+                metrics_count(METRIC_RETRANSMITS, 1);
+
+            writePipelinePacket(serial->fd, pkt);
+            clock_gettime(CLOCK_MONOTONIC, &sentAt);
+
+            acked = readTimedResponse(serial, &rtt, &sentAt, resent, pkt->seq);
+            resent = true;
+        } while (!acked);
+
+        metrics_count(METRIC_PAYLOAD_BYTES, pkt->len);
+        releasePacket(&pl, pkt);
+    }
+
+    finishPipeline(&pl);
+}
+
+void sendAdaptive(SerialReader *serial, PacketSource *src, Compressor *cmp, size_t packetNum,
+                  const uint8_t *have, size_t haveLen)
+{
+    // Each frame covers a run of consecutive packets the receiver doesn't
+    // have yet, as many as the frame sizer currently allows. Frames start
+    // out around DEFAULT_PACKET_SIZE bytes.
+    size_t maxUnits = MAX_PACKET_SIZE / src->packetSize;
+    size_t units = DEFAULT_PACKET_SIZE / src->packetSize;
+    uint8_t *frame = malloc(maxUnits * src->packetSize);
+    uint8_t *payloadBuf = malloc(maxUnits * src->packetSize + COMPRESS_HEADER_SIZE);
+    FrameSizer sizer;
+    RttEstimator rtt;
+    size_t i = 0;
+    bool eof = false;
+
+    initFrameSizer(&sizer, units < 1 ? 1 : units > maxUnits ? maxUnits : units, maxUnits);
+    initRtt(&rtt);
+
+    while (!eof) {
+        size_t first, frameLen = 0;
+        bool acked;
+
+        while (i < packetNum && bitmap_has(have, haveLen, i))
+            i += 1;
+        if (i >= packetNum)
+            break;
+
+        first = i;
+        seekPacket(src, first, frame);
+
+        // Mapped files already hold the frame's packets back to back
+        const uint8_t *frameData = src->map != NULL ? src->map + first * src->packetSize : frame;
+
+        for (units = 0; units < sizer.units && i < packetNum && !bitmap_has(have, haveLen, i);) {
+            size_t packetLen;
+
+            packetData(src, frame + frameLen, &packetLen);
+            if (packetLen == 0) {
+                eof = true;
+                break;
+            }
+
+            frameLen += packetLen;
+            units += 1;
+            i += 1;
+
+            // Only the last packet of the file is short
+            if (packetLen < src->packetSize) {
+                eof = true;
+                break;
+            }
+        }
+
+        if (units == 0)
+            break;
+
+        bool resent = false;
+
+        do {
+            struct timespec sentAt;
+            size_t payloadLen;
+            const uint8_t *payload = compress_encode(cmp, frameData, frameLen, payloadBuf,
+                                                     &payloadLen);
+
+            LOG_DEBUG("Sending packets %zu to %zu\n", first, first + units - 1);
+
+            if (resent)
+                metrics_count(METRIC_RETRANSMITS, 1);
+
+            writeOffsetPacket(serial->fd, (uint64_t) first * src->packetSize, payload, payloadLen);
+            clock_gettime(CLOCK_MONOTONIC, &sentAt);
+
+            acked = readTimedResponse(serial, &rtt, &sentAt, resent, first);
+            recordFrame(&sizer, acked, frameLen);
+            resent = true;
+
+            // Retry a failed frame at the new size when it shrank, the rest
+            // goes in the next one. Streamed sources can't be rewound for
+            // that so they resend the whole frame.
+            if (!acked && sizer.units < units && src->seekable) {
+                units = sizer.units;
+                frameLen = units * src->packetSize;
+                i = first + units;
+                eof = false;
+            }
+        } while (!acked);
+
+        metrics_count(METRIC_PAYLOAD_BYTES, frameLen);
+    }
+
+    free(frame);
+    free(payloadBuf);
+}
+
+void sendWindowed(SerialReader *serial, PacketSource *src, Compressor *cmp, size_t packetNum,
+                  const uint8_t *have, size_t haveLen, uint16_t window)
+{
+    // Transmissions are numbered in the order packets are first sent, which
+    // skips any the receiver already has. Transmissions [base, next) are in
+    // flight and slot n % window holds the sequence number and data of
+    // transmission n, plus whether the receiver has acked it yet.
+    //
+    // The serial link doesn't reorder anything and the receiver answers
+    // every packet it sees, so responses arrive in the order the packets
+    // were sent. sent[] is that queue of transmissions, which lets a NAK be
+    // matched to its packet even when the sequence number in the packet got
+    // corrupted.
+    // Slots hold the framed packets from the pipeline until they're acked.
+    //
+    // Each transmission is timed from when it was written. When the answer
+    // at the front of the queue is overdue it was lost, or the packet was,
+    // and the responses behind it can't be matched by order any more. The
+    // receiver is asked which packets in flight it has instead, and the
+    // rest go again.
+    SendPipeline pl;
+    PipelinePacket *slots[MAX_WINDOW_SIZE];
+    bool acked[MAX_WINDOW_SIZE] = { false };
+    bool resent[MAX_WINDOW_SIZE] = { false };
+    size_t sent[MAX_WINDOW_SIZE];
+    struct timespec sentAt[MAX_WINDOW_SIZE];
+    size_t sentHead = 0, sentCount = 0;
+    size_t base = 0, next = 0;
+    bool eof = false;
+    RttEstimator rtt;
+
+    startPipeline(&pl, src, cmp, packetNum, have, haveLen, TRANSFER_WINDOW_PACKET, window);
+    initRtt(&rtt);
+
+    while (base < next || !eof) {
+        while (!eof && next < base + window) {
+            PipelinePacket *pkt = nextPacket(&pl);
+            if (pkt == NULL) {
+                eof = true;
+                break;
+            }
+
+            LOG_DEBUG("\tSending packet %zu: %zu\n", pkt->seq, pkt->headerLen + pkt->payloadLen);
+
+            slots[next % window] = pkt;
+            resent[next % window] = false;
+            writePipelinePacket(serial->fd, pkt);
+            clock_gettime(CLOCK_MONOTONIC, &sentAt[(sentHead + sentCount) % MAX_WINDOW_SIZE]);
+            sent[(sentHead + sentCount++) % MAX_WINDOW_SIZE] = next;
+            next += 1;
+        }
+
+        if (sentCount == 0)
+            break;
+
+        uint32_t respSeq = 0;
+        uint8_t response = TRANSFER_NAK;
+        bool answered = awaitResponse(serial, 5, &sentAt[sentHead], rtt.rto);
+
+        if (answered) {
+            // An ACK for a packet further back in the queue means answers in
+            // front of it never came, the receiver dropped their packets
+            // while resynchronising. Matching by order would stay out of
+            // step from then on, so it's handled like a missing answer, as
+            // is a corrupted one.
+            uint32_t expected = slots[sent[sentHead] % window]->seq;
+
+            response = readWindowResponse(serial, &respSeq);
+            answered = response == TRANSFER_ACK || response == TRANSFER_NAK;
+            for (size_t k = 1; k < sentCount && response == TRANSFER_ACK && respSeq != expected
+                               && answered; ++k)
+                answered = respSeq != slots[sent[(sentHead + k) % MAX_WINDOW_SIZE] % window]->seq;
+
+            if (!answered && response == TRANSFER_ACK)
+                LOG_WARN("\tAnswer for packet %u came out of turn\n", respSeq);
+        }
+
+        if (!answered) {
+            uint64_t seqs[MAX_WINDOW_SIZE];
+            size_t queued[MAX_WINDOW_SIZE];
+            uint8_t has[MAX_WINDOW_SIZE / 8];
+            bool requeued[MAX_WINDOW_SIZE] = { false };
+            size_t queuedNum = sentCount;
+
+            for (size_t k = 0; k < queuedNum; ++k) {
+                queued[k] = sent[(sentHead + k) % MAX_WINDOW_SIZE];
+                seqs[k] = slots[queued[k] % window]->seq;
+            }
+
+            LOG_WARN("\tNo answer to packet %zu, asking about the %zu packets in flight\n",
+                     slots[queued[0] % window]->seq, queuedNum);
+
+            backoffRtt(&rtt);
+            queryPackets(serial, &rtt, seqs, queuedNum, has);
+            sentCount = 0;
+
+            for (size_t k = 0; k < queuedNum; ++k)
+                if (bitmap_has(has, (queuedNum + 7) / 8, k))
+                    acked[queued[k] % window] = true;
+
+            // A packet can be queued more than once, it only goes again once
+            for (size_t k = 0; k < queuedNum; ++k) {
+                size_t n = queued[k];
+                if (acked[n % window] || requeued[n % window])
+                    continue;
+
+                LOG_WARN("\tSending packet %zu again\n", slots[n % window]->seq);
+
+                metrics_count(METRIC_RETRANSMITS, 1);
+                requeued[n % window] = true;
+                resent[n % window] = true;
+                writePipelinePacket(serial->fd, slots[n % window]);
+                clock_gettime(CLOCK_MONOTONIC, &sentAt[(sentHead + sentCount) % MAX_WINDOW_SIZE]);
+                sent[(sentHead + sentCount++) % MAX_WINDOW_SIZE] = n;
+            }
+        } else {
+            size_t n = sent[sentHead];
+            const struct timespec *packetSentAt = &sentAt[sentHead];
+            sentHead = (sentHead + 1) % MAX_WINDOW_SIZE;
+            sentCount -= 1;
+
+            // An ACK for anything other than the packet we expect means the
+            // response itself was mangled, so play it safe and resend
+            PipelinePacket *pkt = slots[n % window];
+            if (response == TRANSFER_NAK || respSeq != (uint32_t) pkt->seq) {
+                if (!acked[n % window]) {
+                    LOG_WARN("\tSending packet %zu again\n", pkt->seq);
+
+                    metrics_count(METRIC_RETRANSMITS, 1);
+                    resent[n % window] = true;
+                    writePipelinePacket(serial->fd, pkt);
+                    clock_gettime(CLOCK_MONOTONIC,
+                                  &sentAt[(sentHead + sentCount) % MAX_WINDOW_SIZE]);
+                    sent[(sentHead + sentCount++) % MAX_WINDOW_SIZE] = n;
+                }
+                continue;
+            }
+
+            if (!resent[n % window])
+                sampleRtt(&rtt, msSince(packetSentAt));
+
+            acked[n % window] = true;
+        }
+
+        while (base < next && acked[base % window]) {
+            metrics_count(METRIC_PAYLOAD_BYTES, slots[base % window]->len);
+            acked[base % window] = false;
+            releasePacket(&pl, slots[base % window]);
+            base += 1;
+        }
+    }
+
+    finishPipeline(&pl);
+}
+
+void sendCorrected(SerialReader *serial, PacketSource *src, Compressor *cmp, size_t packetNum,
+                   const uint8_t *have, size_t haveLen, uint16_t groupSize, uint16_t repairNum)
+{
+    // Packets go out in groups of up to groupSize windowed packets, followed
+    // by repairNum repair packets and a group end listing the sequence
+    // numbers of the group. Nothing is answered until the group end, the
+    // receiver rebuilds whatever it lost from the repair packets and only
+    // the packets it couldn't are sent again, at the front of the next
+    // group.
+    //
+    // Slots hold the packets as repair symbols are made of them: a 4 byte
+    // length followed by the data, zero padded to the longest in the group,
+    // so rebuilt packets come back with their length. Only the packets
+    // themselves are compressed, the repair symbols are made of the
+    // uncompressed data the receiver ends up with.
+    size_t slotSize = 4 + src->packetSize;
+    uint8_t *slots = malloc((size_t) groupSize * slotSize);
+    uint8_t *repair = malloc(slotSize);
+    uint8_t *payloadBuf = malloc(src->packetSize + COMPRESS_HEADER_SIZE);
+    const uint8_t *symbols[MAX_WINDOW_SIZE];
+    uint32_t seqs[MAX_WINDOW_SIZE];
+    uint8_t missing[MAX_WINDOW_SIZE / 8];
+    uint32_t group = 0;
+    size_t count = 0, seq = 0;
+    bool eof = false;
+    RttEstimator rtt;
+
+    initRtt(&rtt);
+
+    while (true) {
+        while (!eof && count < groupSize) {
+            uint8_t *slot = slots + count * slotSize;
+            uint32_t packetLen = 0;
+
+            while (seq < packetNum && bitmap_has(have, haveLen, seq))
+                seq += 1;
+
+            if (seq < packetNum) {
+                seekPacket(src, seq, slot + 4);
+                packetLen = readPacketData(src, slot + 4);
+            }
+            if (packetLen == 0) {
+                eof = true;
+                break;
+            }
+
+            memcpy(slot, &packetLen, 4);
+            seqs[count++] = seq++;
+        }
+
+        if (count == 0)
+            break;
+
+        size_t symbolLen = 0;
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t packetLen;
+
+            memcpy(&packetLen, slots + i * slotSize, 4);
+            if (4 + packetLen > symbolLen)
+                symbolLen = 4 + packetLen;
+
+            size_t payloadLen;
+            const uint8_t *payload = compress_encode(cmp, slots + i * slotSize + 4, packetLen,
+                                                     payloadBuf, &payloadLen);
+
+            symbols[i] = slots + i * slotSize;
+            writeWindowPacket(serial->fd, seqs[i], payload, payloadLen);
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t packetLen;
+
+            memcpy(&packetLen, slots + i * slotSize, 4);
+            memset(slots + i * slotSize + 4 + packetLen, 0, symbolLen - 4 - packetLen);
+        }
+
+        for (uint16_t j = 0; j < repairNum; ++j) {
+            fec_encode(symbols, count, symbolLen, j, repair);
+            writeRepairPacket(serial->fd, group, j, repair, symbolLen);
+        }
+
+        // The group end goes again if its status is late, the receiver
+        // answers a repeat with the same status
+        bool resent = false;
+        int status;
+
+        do {
+            struct timespec sentAt;
+
+            if (resent)
+                metrics_count(METRIC_RETRANSMITS, 1);
+
+            writeGroupEnd(serial->fd, group, seqs, count);
+            clock_gettime(CLOCK_MONOTONIC, &sentAt);
+
+            status = readGroupStatus(serial, group, count, missing, &sentAt, rtt.rto);
+            if (status == 1 && !resent)
+                sampleRtt(&rtt, msSince(&sentAt));
+
+            if (status == -1) {
+                LOG_WARN("No status for group %u, sending its end again\n", group);
+
+                backoffRtt(&rtt);
+            }
+
+            resent = true;
+        } while (status != 1);
+
+        // Whatever is still missing moves to the front for the next group
+        size_t kept = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (!bitmap_has(missing, (count + 7) / 8, i)) {
+                uint32_t packetLen;
+
+                memcpy(&packetLen, slots + i * slotSize, 4);
+                metrics_count(METRIC_PAYLOAD_BYTES, packetLen);
+                continue;
+            }
+
+            LOG_WARN("Packet %u wasn't rebuilt, sending it again\n", seqs[i]);
+
+            metrics_count(METRIC_RETRANSMITS, 1);
+            if (kept != i)
+                memcpy(slots + kept * slotSize, slots + i * slotSize, slotSize);
+            seqs[kept++] = seqs[i];
+        }
+
+        count = kept;
+        group += 1;
+    }
+
+    free(slots);
+    free(repair);
+    free(payloadBuf);
+}
+
+FILE* startMetrics(const char *path, double interval, const char *socketPath)
+{
+    // Returns the file metrics go to, if any
+    FILE *fp = NULL;
+
+    if (path == NULL && socketPath == NULL)
+        return NULL;
+
+    if (path != NULL) {
+        fp = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+        if (fp == NULL) {
+            perror("Error opening metrics file");
+            exit(-1);
+        }
+    }
+
+    if (metrics_start(fp, interval, socketPath) == -1) {
+        perror("Error starting metrics");
+        exit(-1);
+    }
+
+    return fp;
+}
+
+void stopMetrics(FILE *fp)
+{
+    metrics_stop();
+    if (fp != NULL && fp != stdout)
+        fclose(fp);
+}
+
+bool makeDelta(SerialReader *serial, PacketSource *src, FILE **file)
+{
+    // Swaps the file for a delta against the receiver's copy of it, made
+    // into a temporary file. Returns false, leaving the file as it was,
+    // when the receiver has nothing to build on or the delta isn't smaller.
+
+    DeltaSignatures sigs;
+    uint8_t shaSum[32];
+    uint64_t copied;
+
+    requestSignatures(serial, &sigs);
+    if (sigs.blockNum == 0) {
+        LOG_INFO("Receiver has no copy to build a delta on, sending the whole file\n");
+        delta_free(&sigs);
+        return false;
+    }
+
+    FILE *fp = tmpfile();
+    if (fp == NULL || calculateFileSHA256(*file, shaSum) == -1
+        || delta_write(&sigs, fileno(*file), shaSum, fp, &copied) == -1) {
+        perror("Error making delta");
+        exit(-1);
+    }
+    delta_free(&sigs);
+
+    off_t deltaLen = ftello(fp);
+    if ((uint64_t) deltaLen >= src->fileLen) {
+        LOG_INFO("Delta is no smaller than the file, sending the whole file\n");
+        fclose(fp);
+        rewind(*file);
+        return false;
+    }
+
+    LOG_INFO("Sending a delta of %lld bytes, %llu of the file's %zu bytes are in the "
+             "receiver's copy\n", (long long) deltaLen, (unsigned long long) copied,
+             src->fileLen);
+
+    closeSource(src);
+    fclose(*file);
+    *file = fp;
+    rewind(fp);
+    openSource(src, fp, src->packetSize);
+
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *file = stdin;
+    unsigned long window = 0;
+    unsigned long packetSize = DEFAULT_PACKET_SIZE;
+    bool merkle = false;
+    bool adaptive = false;
+    bool delta = false;
+    unsigned long repairNum = 0;
+    double deadline = 0;
+    Compressor cmp = { COMPRESS_NONE, 3, 0, 0 };
+    SerialConfig serialConfig = { 0, false, 1, 0 };
+    Batch batch;
+    const char *metricsPath = NULL;
+    const char *metricsSocket = NULL;
+    double metricsInterval = 1;
+    const char *tracePath = NULL;
+
+    batch_init(&batch);
+
+    int c = 0;
+    while (true) {
+        static struct option long_options[] = {
+            {"adaptive",         no_argument,       0, 'a'},
+            {"baud",             required_argument, 0, 'b'},
+            {"batch",            required_argument, 0, 'B'},
+            {"compress",         required_argument, 0, 'c'},
+            {"deadline",         required_argument, 0, 'D'},
+            {"delta",            no_argument,       0, 'd'},
+            {"file",             required_argument, 0, 'f'},
+            {"list",             required_argument, 0, 'L'},
+            {"merkle",           no_argument,       0, 'm'},
+            {"metrics",          required_argument, 0, 'M'},
+            {"metrics-interval", required_argument, 0, 'i'},
+            {"metrics-socket",   required_argument, 0, 'U'},
+            {"packet-size",      required_argument, 0, 'p'},
+            {"quiet",            no_argument,       0, 'q'},
+            {"repair",           required_argument, 0, 'r'},
+            {"rtscts",           no_argument,       0, 'R'},
+            {"trace",            required_argument, 0, 't'},
+            {"verbose",          no_argument,       0, 'v'},
+            {"vmin",             required_argument, 0, 'V'},
+            {"vtime",            required_argument, 0, 'T'},
+            {"window",           required_argument, 0, 'w'},
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+        c = getopt_long(argc, argv, "aB:b:c:D:df:i:L:M:mp:qr:Rt:T:U:V:vw:", long_options,
+                        &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'a':
+                adaptive = true;
+                break;
+            case 'B':
+                // A file or directory to send in the batch, any number of
+                // them
+                if (batch_add(&batch, optarg) == -1) {
+                    perror("Error adding to batch");
+                    exit(-1);
+                }
+                break;
+            case 'b':
+                serialConfig.baud = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                // lz4, or zstd with an optional level as in zstd:19
+                if (strcmp(optarg, "lz4") == 0) {
+                    cmp.codec = COMPRESS_LZ4;
+                } else if (strncmp(optarg, "zstd", 4) == 0
+                           && (optarg[4] == '\0' || optarg[4] == ':')) {
+                    cmp.codec = COMPRESS_ZSTD;
+                    if (optarg[4] == ':')
+                        cmp.level = strtol(optarg + 5, NULL, 0);
+                } else {
+                    printf("Unknown compression codec %s, expected lz4 or zstd\n", optarg);
+                    exit(-1);
+                }
+
+                if (!compress_supported(cmp.codec)) {
+                    printf("This build can't compress with %s\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'D':
+                // Seconds the whole transfer may take before giving up,
+                // the receiver's journal lets the next attempt resume
+                deadline = strtod(optarg, NULL);
+                break;
+            case 'd':
+                // Only send what changed since the copy the receiver has
+                delta = true;
+                break;
+            case 'f':
+                file = fopen(optarg, "r");
+                if (file == NULL) {
+                    perror("Error opening file");
+                    exit(-1);
+                }
+                break;
+            case 'i':
+                // Seconds between lines of metrics
+                metricsInterval = strtod(optarg, NULL);
+                break;
+            case 'L': {
+                // A file listing what to send in the batch, one path a line
+                FILE *listfp = fopen(optarg, "r");
+                char line[4096];
+
+                if (listfp == NULL) {
+                    perror("Error opening batch list");
+                    exit(-1);
+                }
+
+                while (fgets(line, sizeof(line), listfp) != NULL) {
+                    line[strcspn(line, "\n")] = '\0';
+                    if (line[0] != '\0' && batch_add(&batch, line) == -1) {
+                        printf("Error adding %s to batch: %s\n", line, strerror(errno));
+                        exit(-1);
+                    }
+                }
+
+                fclose(listfp);
+                break;
+            }
+            case 'M':
+                // JSON lines of metrics, - for standard output
+                metricsPath = optarg;
+                break;
+            case 'm':
+                merkle = true;
+                break;
+            case 'p':
+                packetSize = strtoul(optarg, NULL, 0);
+                if (packetSize == 0 || packetSize > MAX_PACKET_SIZE) {
+                    printf("Packet size has to be between 1 and %d bytes\n", MAX_PACKET_SIZE);
+                    exit(-1);
+                }
+                break;
+            case 'q':
+                log_level -= 1;
+                break;
+            case 'r':
+                repairNum = strtoul(optarg, NULL, 0);
+                break;
+            case 'R':
+                serialConfig.rtscts = true;
+                break;
+            case 't':
+                // A binary trace of every frame, see trace.h
+                tracePath = optarg;
+                break;
+            case 'U':
+                // A Unix socket answering every connection with metrics
+                metricsSocket = optarg;
+                break;
+            case 'v':
+                log_level += 1;
+                break;
+            case 'T':
+            case 'V': {
+                // Both are counts the tty keeps in a single byte
+                unsigned long value = strtoul(optarg, NULL, 0);
+                if (value > 255) {
+                    printf("--%s can be at most 255\n", c == 'V' ? "vmin" : "vtime");
+                    exit(-1);
+                }
+                if (c == 'V')
+                    serialConfig.vmin = value;
+                else
+                    serialConfig.vtime = value;
+                break;
+            }
+            case 'w':
+                window = strtoul(optarg, NULL, 0);
+                if (window > MAX_WINDOW_SIZE) {
+                    printf("Window size can be at most %d packets\n", MAX_WINDOW_SIZE);
+                    exit(-1);
+                }
+                break;
+        }
+    }
+
+    if (optind == argc) {
+        printf("%s expects a serial port to communicate across\n", argv[0]);
+        return -1;
+    }
+
+    PacketSource src;
+    size_t packetNum;
+    bool trailer;
+    int serialfd;
+    SerialReader serial;
+
+    // A batch is packed into a temporary file and sent as that
+    if (batch.entryNum > 0) {
+        if (file != stdin) {
+            printf("A batch can't be combined with --file\n");
+            exit(-1);
+        }
+
+        file = tmpfile();
+        if (file == NULL || batch_write(&batch, file) == -1) {
+            perror("Error packing batch");
+            exit(-1);
+        }
+        rewind(file);
+
+        LOG_INFO("Packed %zu files into a batch\n", batch.entryNum);
+    }
+
+    // Anything that can't be seeked has to be streamed, with its length and
+    // hash following the last packet
+    openSource(&src, file, packetSize);
+    trailer = !src.seekable;
+    packetNum = trailer ? SIZE_MAX
+                        : src.fileLen / packetSize + (src.fileLen % packetSize == 0 ? 0 : 1);
+
+    if (adaptive && (window > 1 || repairNum > 0)) {
+        printf("Adaptive frames can't be combined with a window or repair packets\n");
+        exit(-1);
+    }
+
+    // Repair packets are made for groups of window packets, 16 by default
+    if (repairNum > 0 && window <= 1)
+        window = 16;
+
+    if (window + repairNum > FEC_MAX_SYMBOLS) {
+        printf("A group and its repair packets can be at most %d packets\n", FEC_MAX_SYMBOLS);
+        exit(-1);
+    }
+
+    if (delta && (trailer || batch.entryNum > 0)) {
+        printf("A delta can only be made of a single file of known length\n");
+        exit(-1);
+    }
+
+    if (merkle && trailer) {
+        printf("A merkle tree can only be built for a file of known length\n");
+        exit(-1);
+    }
+
+    if (window > 1 && packetNum > UINT32_MAX && !trailer) {
+        printf("File has too many packets to be sequenced for a windowed transfer\n");
+        exit(-1);
+    }
+
+    serialfd = open(argv[optind], O_RDWR);
+    if (serialfd == -1) {
+        perror("Error opening serial port");
+        exit(-1);
+    }
+
+    // Anything that isn't a tty, like a pipe to test with, is used as is
+    if (isatty(serialfd) && serial_configure(serialfd, &serialConfig) == -1) {
+        perror("Error configuring serial port");
+        exit(-1);
+    }
+
+    if (reader_init(&serial, serialfd, READER_SIZE) == -1) {
+        printf("Error allocating the serial buffer\n");
+        exit(-1);
+    }
+    reader_set_deadline(&serial, deadline);
+
+    FILE *metricsfp = startMetrics(metricsPath, metricsInterval, metricsSocket);
+    if (tracePath != NULL && trace_start(tracePath, TRACE_SENDER) == -1) {
+        perror("Error starting trace");
+        exit(-1);
+    }
+
+    // The header describes the delta when there is one, the rebuilt file
+    // is checked against the sha256sum it carries
+    if (delta && makeDelta(&serial, &src, &file))
+        packetNum = src.fileLen / packetSize + (src.fileLen % packetSize == 0 ? 0 : 1);
+    else
+        delta = false;
+
+    // The receiver always expects a header, it carries the negotiated mode
+    uint8_t shaSum[32] = { 0 };
+    uint8_t mode, codec;
+    uint16_t acceptedWindow;
+    uint8_t *have;
+    size_t haveLen;
+    uint8_t merkleRoot[32] = { 0 };
+    uint8_t (*leaves)[32] = NULL;
+    uint8_t flags = 0;
+    RttEstimator headerRtt;
+
+    if (!trailer) {
+        if (calculateFileSHA256(file, shaSum) == -1) {
+            printf("Error reading file\n");
+            exit(-1);
+        }
+        rewind(file);
+    } else {
+        flags |= TRANSFER_FLAG_TRAILER;
+    }
+
+    if (batch.entryNum > 0)
+        flags |= TRANSFER_FLAG_BATCH;
+    if (delta)
+        flags |= TRANSFER_FLAG_DELTA;
+
+    if (merkle) {
+        leaves = malloc(packetNum * 32);
+        if (leaves == NULL && packetNum > 0) {
+            printf("Error allocating the merkle leaves\n");
+            exit(-1);
+        }
+        if (merkle_file_leaves(fileno(file), src.fileLen, packetSize, leaves,
+                               sysconf(_SC_NPROCESSORS_ONLN)) == -1) {
+            printf("Error reading file\n");
+            exit(-1);
+        }
+        merkle_root((const uint8_t (*)[32]) leaves, packetNum, merkleRoot);
+        flags |= TRANSFER_FLAG_MERKLE;
+    }
+
+    // I don't think the sending metadata file is necessary?
+    //writeMetadataFile(shaStr, argv[2]);
+    initRtt(&headerRtt);
+    while (true) {
+        struct timespec sentAt;
+
+        writeHeader(serialfd, shaSum, src.fileLen, trailer ? 0 : packetNum,
+                    adaptive ? TRANSFER_MODE_ADAPTIVE
+                    : repairNum > 0 ? TRANSFER_MODE_FEC
+                    : window > 1 ? TRANSFER_MODE_WINDOW : TRANSFER_MODE_STOP_WAIT,
+                    window, flags, merkleRoot, packetSize, cmp.codec);
+        clock_gettime(CLOCK_MONOTONIC, &sentAt);
+
+        if (!awaitResponse(&serial, 1, &sentAt, headerRtt.rto)) {
+            LOG_WARN("No reply to the transfer header, sending it again\n");
+            backoffRtt(&headerRtt);
+        } else if (readHeaderReply(&serial, trailer ? 0 : packetNum, &mode, &acceptedWindow,
+                                   &codec, &have, &haveLen)) {
+            break;
+        }
+        metrics_count(METRIC_RETRANSMITS, 1);
+    }
+
+    if (codec != cmp.codec)
+        LOG_INFO("Receiver can't decompress packets, sending them uncompressed\n");
+
+    cmp.codec = codec;
+
+    if (merkle) {
+        writeLeaves(&serial, (const uint8_t (*)[32]) leaves, packetNum);
+        free(leaves);
+    }
+
+    LOG_INFO("Header written, sending packets...\n");
+    if (have != NULL)
+        LOG_INFO("Resuming transfer, receiver already has some packets\n");
+
+    if (mode == TRANSFER_MODE_WINDOW && acceptedWindow > 1) {
+        LOG_INFO("Using a window of %u packets\n", acceptedWindow);
+
+        sendWindowed(&serial, &src, &cmp, packetNum, have, haveLen, acceptedWindow);
+    } else if (mode == TRANSFER_MODE_FEC && acceptedWindow > 0) {
+        LOG_INFO("Using groups of %u packets with %lu repair packets\n", acceptedWindow, repairNum);
+
+        sendCorrected(&serial, &src, &cmp, packetNum, have, haveLen, acceptedWindow, repairNum);
+    } else if (mode == TRANSFER_MODE_ADAPTIVE) {
+        LOG_INFO("Using adaptive frame sizes\n");
+
+        sendAdaptive(&serial, &src, &cmp, packetNum, have, haveLen);
+    } else {
+        sendStopAndWait(&serial, &src, &cmp, packetNum, have, haveLen);
+    }
+
+    free(have);
+
+    if (trailer) {
+        RttEstimator rtt;
+
+        sha256_final(&src.shaCtx, (BYTE *) shaSum);
+        initRtt(&rtt);
+
+        // The receiver answers the trailer again if it comes again, with a
+        // sealed TRANSFER_END once it has checked it
+        while (true) {
+            struct timespec sentAt;
+
+            writeTrailer(serialfd, shaSum, src.fileLen, src.packets);
+            clock_gettime(CLOCK_MONOTONIC, &sentAt);
+
+            if (awaitResponse(&serial, 1, &sentAt, rtt.rto)) {
+                if (reader_data(&serial)[0] == TRANSFER_ERROR)
+                    exitIfAborted(&serial, "Receiver rejected the transfer trailer");
+
+                if (isSealed(&serial, TRANSFER_END)) {
+                    reader_consume(&serial, TRANSFER_SEALED_SIZE);
+                    break;
+                }
+
+                LOG_WARN("Received erroneous answer to the trailer, sending it again\n");
+                drainOrDie(&serial);
+            } else {
+                LOG_WARN("No answer to the trailer, sending it again\n");
+                backoffRtt(&rtt);
+            }
+
+            metrics_count(METRIC_RETRANSMITS, 1);
+        }
+
+        LOG_INFO("Trailer written, sent %zu bytes\n", src.fileLen);
+    }
+
+    // Everything is answered, the receiver can stop waiting for queries.
+    // After a trailer this is a sealed TRANSFER_END, without one following.
+    uint8_t command[TRANSFER_SEALED_SIZE] = { TRANSFER_END };
+    uint32_t crcSum = crc32(command, 1);
+    memcpy(command + 1, &crcSum, 4);
+    writeAllOrDie(serialfd, command, trailer ? TRANSFER_SEALED_SIZE : 1);
 
-    free(fileData);
+    stopMetrics(metricsfp);
+    trace_stop();
+    closeSource(&src);
+    fclose(file);
+    batch_free(&batch);
+    reader_destroy(&serial);
+    close(serialfd);
     //deleteMetadataFile();
 }
@@ -1,173 +1,362 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
 #include <sys/stat.h>
+#include <sys/types.h>
 
 #include <linux/limits.h>
 
-#include "sha256.h"
+#include <protocol.h>
+#include <sha256.h>
+#include <sha256_utils.h>
 
-#define PACKET_DIR "received-packets"
 
-int main(int argc, char **argv)
+
+#define RECEIVING_FILE "receiving.meta"
+
+// Upper bound on --jobs, far more than the disk can keep busy
+#define MAX_THREADS 256
+
+// Packets stay in one of these states until the hashing thread releases
+// their slot
+#define PACKET_PENDING 0
+#define PACKET_READY   1
+#define PACKET_MISSING 2
+#define PACKET_SHORT   3
+
+// Worker threads read packet i into slot i % slotNum and write it to its
+// place in the output file, while the main thread hashes the slots in
+// packet order. Workers never run more than slotNum packets ahead of the
+// hash, which keeps memory bounded however large the file is.
+typedef struct {
+    const char *dir;
+    int outfd;
+    size_t fileLen;
+    size_t packetNum;
+    size_t packetSize;
+
+    uint8_t *slots;
+    size_t *slotLen;
+    int *slotState;
+    size_t slotNum;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t next;
+    size_t hashed;
+} Stitcher;
+
+void readMetadataFile(const char *path, uint8_t shaSum[32], size_t *fileLen, size_t *packetNum,
+                      size_t *packetSize)
 {
-    /*
-    // TODO: proper argument parsing
-    if (argc < 3) {
-        printf("%s expects a sha256sum id and a path to store the stitched file as arguments.\n", argv[0]);
-        return 1;
+    // Metadata file format, as written by recv-packets:
+    //  * sha256sum as 64 hex digits
+    //  * file size in bytes
+    //  * number of packets
+    //  * packet size in bytes
+    // each on its own line
+
+    char shaStr[65];
+    FILE *metafp;
+
+    metafp = fopen(path, "r");
+    if (metafp == NULL) {
+        perror("Error opening metadata file");
+        exit(-1);
     }
 
-    if (strlen(argv[1]) != 64) {
-        printf("%s is not a valid sha256sum.\n", argv[1]);
-        return 1;
+    if (fscanf(metafp, "%64s %zu %zu %zu", shaStr, fileLen, packetNum, packetSize) != 4
+        || strlen(shaStr) != 64) {
+        printf("Error parsing metadata file %s\n", path);
+        exit(-1);
     }
+    fclose(metafp);
 
-    uint8_t shaSum[32];
     for (size_t i = 0; i < 32; ++i) {
-        char byteStr[3];
-        byteStr[0] = argv[1][2 * i];
-        byteStr[1] = argv[1][2 * i + 1];
-        byteStr[2] = '\0';
-
-        char *test;
-        shaSum[i] = strtoul(byteStr, &test, 16);
-        if (test != byteStr + 2) {
-            printf("Error parsing sha256sum: %s. Unexpected `%c'\n", argv[1], *test);
-            return 1;
+        char byteStr[3] = { shaStr[2 * i], shaStr[2 * i + 1], '\0' };
+        char *end;
+
+        shaSum[i] = strtoul(byteStr, &end, 16);
+        if (end != byteStr + 2) {
+            printf("Error parsing sha256sum %s, unexpected `%c'\n", shaStr, *end);
+            exit(-1);
         }
     }
 
-    char *shaStr = argv[1];
-
-    char pktdir[PATH_MAX] = STORE_DIR;
-    strcat(pktdir, "/");
-    strcat(pktdir, shaStr);
-
-    // Debug info
-    printf("%s\n", pktdir);
-
-    // Check if the directory exists
-    struct stat st;
-    if (stat(pktdir, &st) == -1) {
-        perror("stat");
-        return 1;
-    } else if (!S_ISDIR(st.st_mode)) {
-        printf("Error: %s exists but is not a directory.\n", shaStr);
-        return 1;
+    if (*packetSize == 0 || *packetSize > MAX_PACKET_SIZE
+        || *packetNum != *fileLen / *packetSize + (*fileLen % *packetSize == 0 ? 0 : 1)) {
+        printf("Metadata file %s describes an impossible transfer\n", path);
+        exit(-1);
     }
+}
 
-    char metapath[PATH_MAX];
-    strcpy(metapath, pktdir);
-    strcat(metapath, ".meta");
+size_t packetLength(size_t fileLen, size_t packetSize, size_t i)
+{
+    size_t offset = i * packetSize;
+    return fileLen - offset > packetSize ? packetSize : fileLen - offset;
+}
 
-    // Open the metadata file
-    FILE *metap = fopen(metapath, "r");
-    if (metap == NULL) {
-        perror("fopen");
-        return 1;
-    }
+int readPacketFile(const Stitcher *st, size_t i, uint8_t *buf, size_t *len)
+{
+    // Returns the packet's state once its file has been read into buf
 
-    // Parse the metadata file
-    size_t fileSize = 0;
-    size_t packetNum = 0;
+    char packetPath[PATH_MAX];
+    size_t expected = packetLength(st->fileLen, st->packetSize, i);
+    ssize_t result;
+    int fd;
 
-    char *line = NULL;
-    size_t lineSize = 0;
-    ssize_t lineLen = getline(&line, &lineSize, metap);
-    if (lineLen == -1) {
-        perror("getline");
-        return 1;
-    }
-    fileSize = strtoul(line, NULL, 10);
+    snprintf(packetPath, sizeof(packetPath), "%s/%zu.pkt", st->dir, i);
 
-    lineLen = getline(&line, &lineSize, metap);
-    if (lineLen == -1) {
-        perror("getline");
-        return 1;
+    fd = open(packetPath, O_RDONLY);
+    if (fd == -1) {
+        if (errno != ENOENT)
+            perror(packetPath);
+        return PACKET_MISSING;
     }
-    packetNum = strtoul(line, NULL, 10);
 
-    free(line);
-    fclose(metap);
-
-    if (fileSize == 0 || packetNum == 0) {
-        printf("Error parsing metadata file: %s.\n", metapath);
-        return 1;
+    // Read one byte past the expected length to catch packets that are
+    // too long as well as too short
+    *len = 0;
+    while (*len <= expected) {
+        result = read(fd, buf + *len, expected + 1 - *len);
+        if (result == -1) {
+            perror(packetPath);
+            close(fd);
+            return PACKET_MISSING;
+        }
+        if (result == 0)
+            break;
+        *len += result;
     }
+    close(fd);
 
-    // Debug info
-    printf("%lu, %lu\n", fileSize, packetNum);
+    return *len == expected ? PACKET_READY : PACKET_SHORT;
+}
 
-    uint8_t *data = malloc(fileSize);
-    size_t offset = 0;
+void pwriteAllOrDie(int fd, const uint8_t *data, size_t dataLen, off_t offset)
+{
+    size_t written = 0;
+    ssize_t result;
+
+    while (written < dataLen) {
+        result = pwrite(fd, data + written, dataLen - written, offset + written);
+        if (result == -1) {
+            perror("Error writing to output file");
+            exit(-1);
+        }
+        written += result;
+    }
+}
 
-    for (size_t i = 0; i < packetNum; ++i) {
-        char pktpath[PATH_MAX];
-        strcpy(pktpath, pktdir);
-        sprintf(pktpath + strlen(pktpath), "/%lu.pkt", i);
+void* stitchWorker(void *arg)
+{
+    Stitcher *st = arg;
 
-        // Debug info
-        printf("%s\n", pktpath);
+    while (true) {
+        size_t i;
 
-        FILE *pktp = fopen(pktpath, "r");
-        if (pktp == NULL) {
-            perror("fopen");
-            return 1;
+        pthread_mutex_lock(&st->lock);
+        while (st->next < st->packetNum && st->next >= st->hashed + st->slotNum)
+            pthread_cond_wait(&st->cond, &st->lock);
+        if (st->next >= st->packetNum) {
+            pthread_mutex_unlock(&st->lock);
+            return NULL;
         }
+        i = st->next++;
+        pthread_mutex_unlock(&st->lock);
+
+        // The slot is ours until the hashing thread has seen this packet
+        size_t slot = i % st->slotNum;
+        uint8_t *buf = st->slots + slot * (st->packetSize + 1);
+        size_t len;
+        int state = readPacketFile(st, i, buf, &len);
+
+        if (state == PACKET_READY)
+            pwriteAllOrDie(st->outfd, buf, len, (off_t) i * st->packetSize);
+
+        pthread_mutex_lock(&st->lock);
+        st->slotLen[slot] = len;
+        st->slotState[slot] = state;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+}
 
-        if(fseek(pktp, 0, SEEK_END) == -1) {
-            perror("fseek");
-            return 1;
+bool hashPackets(Stitcher *st, SHA256_CTX *shaCtx)
+{
+    // Returns whether every packet was present with the right length.
+    // Problems are reported as they are found rather than stopping at the
+    // first one, so a single pass lists everything that needs resending.
+
+    bool complete = true;
+
+    for (size_t i = 0; i < st->packetNum; ++i) {
+        size_t slot = i % st->slotNum;
+        int state;
+
+        pthread_mutex_lock(&st->lock);
+        while (st->slotState[slot] == PACKET_PENDING)
+            pthread_cond_wait(&st->cond, &st->lock);
+        state = st->slotState[slot];
+        pthread_mutex_unlock(&st->lock);
+
+        if (state == PACKET_MISSING) {
+            printf("Packet %zu is missing\n", i);
+            complete = false;
+        } else if (state == PACKET_SHORT) {
+            printf("Packet %zu is %zu bytes, expected %zu\n", i, st->slotLen[slot],
+                   packetLength(st->fileLen, st->packetSize, i));
+            complete = false;
+        } else if (complete) {
+            sha256_update(shaCtx, st->slots + slot * (st->packetSize + 1), st->slotLen[slot]);
         }
 
-        long len = ftell(pktp);
-        rewind(pktp);
+        pthread_mutex_lock(&st->lock);
+        st->slotState[slot] = PACKET_PENDING;
+        st->hashed = i + 1;
+        pthread_cond_broadcast(&st->cond);
+        pthread_mutex_unlock(&st->lock);
+    }
+
+    return complete;
+}
 
-        size_t read = fread(data + offset, 1, len, pktp);
-        if (read != len) {
-            printf("Error reading packet file %s.\n", pktpath);
-            return 1;
+int main(int argc, char **argv)
+{
+    char dir[PATH_MAX] = ".";
+    char metaPath[PATH_MAX] = "";
+    long threadNum = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int c = 0;
+    while (true) {
+        static struct option long_options[] = {
+            {"directory", required_argument, 0, 'd'},
+            {"jobs",      required_argument, 0, 'j'},
+            {"metadata",  required_argument, 0, 'm'},
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+        c = getopt_long(argc, argv, "d:j:m:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'd':
+                snprintf(dir, sizeof(dir), "%s", optarg);
+                break;
+            case 'j':
+                threadNum = strtol(optarg, NULL, 0);
+                if (threadNum < 1 || threadNum > MAX_THREADS) {
+                    printf("--jobs has to be between 1 and %d\n", MAX_THREADS);
+                    exit(-1);
+                }
+                break;
+            case 'm':
+                snprintf(metaPath, sizeof(metaPath), "%s", optarg);
+                break;
         }
-        fclose(pktp);
+    }
 
-        offset += read;
+    if (optind == argc) {
+        printf("%s expects a path to store the stitched file as\n", argv[0]);
+        exit(-1);
     }
 
-    if (offset != fileSize) {
-        printf("Error reading packet files.\n");
-        return 1;
+    // The processor count can't be trusted any more than --jobs
+    if (threadNum < 1)
+        threadNum = 1;
+    else if (threadNum > MAX_THREADS)
+        threadNum = MAX_THREADS;
+
+    Stitcher st;
+    uint8_t shaSum[32], stitchedSum[32];
+
+    // recv-packets leaves the metadata file with the packets
+    if (metaPath[0] == '\0'
+        && (size_t) snprintf(metaPath, sizeof(metaPath), "%s/%s", dir, RECEIVING_FILE)
+           >= sizeof(metaPath)) {
+        printf("Directory path %s is too long\n", dir);
+        exit(-1);
     }
 
-    FILE *outp = fopen(argv[2], "w");
-    if (outp == NULL) {
-        perror("fopen");
-        return 1;
+    readMetadataFile(metaPath, shaSum, &st.fileLen, &st.packetNum, &st.packetSize);
+
+    // Debug info
+    printf("Stitching %zu packets, %zu bytes from %s\n", st.packetNum, st.fileLen, dir);
+
+    st.outfd = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (st.outfd == -1) {
+        perror("Error opening output file");
+        exit(-1);
     }
 
-    size_t written = fwrite(data, 1, fileSize, outp);
-    if (written != fileSize) {
-        printf("Error writing to output file %s.\n", argv[2]);
-        return 1;
+    if (st.fileLen > 0 && fallocate(st.outfd, 0, 0, st.fileLen) == -1 && errno != EOPNOTSUPP) {
+        perror("Error allocating output file");
+        exit(-1);
     }
 
-    // Calculate sha256sum of stitched file
-    SHA256_CTX shaCtx;
-    uint8_t shaSum2[32];
+    // A few slots per thread lets workers keep reading while the hash
+    // catches up with a packet that took a while
+    st.dir = dir;
+    st.slotNum = (size_t) threadNum * 4;
+    st.slots = malloc(st.slotNum * (st.packetSize + 1));
+    st.slotLen = calloc(st.slotNum, sizeof(size_t));
+    st.slotState = calloc(st.slotNum, sizeof(int));
+    st.next = 0;
+    st.hashed = 0;
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.cond, NULL);
+
+    pthread_t threads[threadNum];
+    for (long t = 0; t < threadNum; ++t) {
+        if (pthread_create(&threads[t], NULL, stitchWorker, &st) != 0) {
+            printf("Error starting stitching thread\n");
+            exit(-1);
+        }
+    }
 
+    SHA256_CTX shaCtx;
     sha256_init(&shaCtx);
-    sha256_update(&shaCtx, data, fileSize);
-    sha256_final(&shaCtx, (BYTE *) shaSum2);
+    bool complete = hashPackets(&st, &shaCtx);
+    sha256_final(&shaCtx, (BYTE *) stitchedSum);
 
-    for (size_t i = 0; i < 32; ++i) {
-        if (shaSum[i] != shaSum2[i]) {
-            printf("Sha256 sum of stitched file differs from given sum.\n");
-            return 1;
-        }
+    for (long t = 0; t < threadNum; ++t)
+        pthread_join(threads[t], NULL);
+
+    free(st.slots);
+    free(st.slotLen);
+    free(st.slotState);
+    pthread_mutex_destroy(&st.lock);
+    pthread_cond_destroy(&st.cond);
+
+    if (!complete) {
+        printf("Packets are missing, the stitched file is incomplete\n");
+        exit(-1);
+    }
+
+    if (ftruncate(st.outfd, st.fileLen) == -1 || fsync(st.outfd) == -1) {
+        perror("Error finishing output file");
+        exit(-1);
     }
+    close(st.outfd);
 
-    free(data);
-    */
+    if (memcmp(shaSum, stitchedSum, 32) != 0) {
+        printf("Sha256 sum of stitched file differs from given sum\n");
+        exit(-1);
+    }
+
+    // Debug info
+    printf("Stitched file verified\n");
 }
@@ -0,0 +1,669 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+
+#include <protocol.h>
+#include <trace.h>
+
+// Reads a trace written by send-file or recv-packets with --trace, or one
+// of each from the same transfer, and reports:
+//  * round trip times as the sender saw them, and with the receiver's
+//    trace how they split into the way there and the receiver's turnaround
+//  * idle gaps on the link from the sender to the receiver, and what the
+//    sender was waiting for in each
+//  * clusters of retransmissions, and with the receiver's trace whether
+//    the frame sent again had been lost, damaged or only its answer lost
+//
+// The two traces are lined up by the wall clock time each recorded when it
+// started. If that puts a frame's arrival before it was sent the clocks
+// disagree, and the receiver's trace is moved so the fastest frame took no
+// time at all instead.
+
+#define DEFAULT_GAP_MS     20
+#define DEFAULT_CLUSTER_MS 500
+#define DEFAULT_TOP        10
+
+typedef struct {
+    const char *path;
+    TraceHeader header;
+    TraceEvent *events;
+    size_t num;
+} Trace;
+
+// A frame by sequence number, for finding every copy of one
+typedef struct {
+    uint64_t seq;
+    int64_t ns;
+    uint8_t code;
+} Copy;
+
+typedef struct {
+    double *ms;
+    size_t num, capacity;
+} Samples;
+
+typedef struct {
+    int64_t ns;
+    int64_t lenNs;
+    uint64_t afterSeq;
+    uint8_t afterKind;
+    const char *cause;
+} Gap;
+
+typedef struct {
+    int64_t startNs, endNs;
+    size_t count;
+    uint64_t minSeq, maxSeq;
+    size_t damaged, lost, answerLost;
+} Cluster;
+
+static const char *const kindNames[] = {
+    "?", "frame", "repair packet", "group end", "answer", "query", "timeout", "resync",
+    "overflow"
+};
+
+static void loadOrDie(const char *path, Trace *trace)
+{
+    trace->path = path;
+    if (trace_load(path, &trace->header, &trace->events, &trace->num) == -1) {
+        if (errno == EINVAL)
+            printf("%s isn't a trace\n", path);
+        else
+            perror("Error reading trace");
+        exit(-1);
+    }
+}
+
+static void addSample(Samples *s, double ms)
+{
+    if (s->num == s->capacity) {
+        s->capacity = s->capacity > 0 ? 2 * s->capacity : 256;
+        s->ms = realloc(s->ms, s->capacity * sizeof(double));
+        if (s->ms == NULL) {
+            printf("Error allocating samples\n");
+            exit(-1);
+        }
+    }
+    s->ms[s->num++] = ms;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static int compareCopies(const void *a, const void *b)
+{
+    const Copy *x = a, *y = b;
+
+    if (x->seq != y->seq)
+        return x->seq < y->seq ? -1 : 1;
+    return (x->ns > y->ns) - (x->ns < y->ns);
+}
+
+static int compareGaps(const void *a, const void *b)
+{
+    const Gap *x = a, *y = b;
+    return (x->lenNs < y->lenNs) - (x->lenNs > y->lenNs);
+}
+
+static int compareClusters(const void *a, const void *b)
+{
+    const Cluster *x = a, *y = b;
+
+    // Largest first, then earliest first
+    if (x->count != y->count)
+        return x->count < y->count ? 1 : -1;
+    return (x->startNs > y->startNs) - (x->startNs < y->startNs);
+}
+
+static void printDistribution(const char *name, Samples *s)
+{
+    // Percentiles, then how many samples fall in each power of two of ms
+    if (s->num == 0) {
+        printf("%s: no samples\n", name);
+        return;
+    }
+
+    qsort(s->ms, s->num, sizeof(double), compareDoubles);
+
+    double sum = 0;
+    for (size_t i = 0; i < s->num; ++i)
+        sum += s->ms[i];
+
+    printf("%s (%zu samples): mean %.2f ms, p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n", name,
+           s->num, sum / s->num, s->ms[s->num / 2], s->ms[s->num * 9 / 10],
+           s->ms[s->num * 99 / 100], s->ms[s->num - 1]);
+
+    size_t counts[32] = { 0 }, most = 0;
+    int first = 31, last = 0;
+
+    for (size_t i = 0; i < s->num; ++i) {
+        int b = 0;
+        while (b < 31 && s->ms[i] >= (double) (1u << b) / 8)
+            b += 1;
+        counts[b] += 1;
+        most = counts[b] > most ? counts[b] : most;
+        first = b < first ? b : first;
+        last = b > last ? b : last;
+    }
+
+    for (int b = first; b <= last; ++b) {
+        double low = b > 0 ? (double) (1u << (b - 1)) / 8 : 0;
+        int bar = (int) ((counts[b] * 40 + most - 1) / most);
+
+        printf("  %9.3f - %-9.3f ms %8zu %.*s\n", low, (double) (1u << b) / 8, counts[b], bar,
+               "########################################");
+    }
+}
+
+static bool findSeq(const Copy *copies, size_t num, uint64_t seq, size_t *from, size_t *to)
+{
+    // The range of copies of seq, which are sorted by sequence number
+    size_t lo = 0, hi = num;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (copies[mid].seq < seq)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *from = lo;
+    while (lo < num && copies[lo].seq == seq)
+        lo += 1;
+    *to = lo;
+
+    return *to > *from;
+}
+
+static Copy* collectCopies(const Trace *trace, int64_t shift, size_t *num)
+{
+    Copy *copies = malloc((trace->num + 1) * sizeof(Copy));
+    size_t n = 0;
+
+    if (copies == NULL) {
+        printf("Error allocating frames\n");
+        exit(-1);
+    }
+
+    for (size_t i = 0; i < trace->num; ++i) {
+        const TraceEvent *ev = &trace->events[i];
+        if (ev->kind == TRACE_FRAME)
+            copies[n++] = (Copy) { ev->seq, (int64_t) ev->ns + shift, ev->code };
+    }
+
+    qsort(copies, n, sizeof(Copy), compareCopies);
+    *num = n;
+    return copies;
+}
+
+static int64_t alignClocks(const Trace *send, const Trace *recv, bool *realigned)
+{
+    // What to add to the receiver's clock to get the sender's, from the
+    // wall clock, then moved on if any frame seems to arrive before it was
+    // first sent
+    int64_t shift = (int64_t) (recv->header.realtimeNs - recv->header.monotonicNs)
+                    - (int64_t) (send->header.realtimeNs - send->header.monotonicNs);
+    size_t sentNum, recvNum;
+    Copy *sent = collectCopies(send, 0, &sentNum);
+    Copy *got = collectCopies(recv, shift, &recvNum);
+    int64_t fastest = INT64_MAX;
+
+    for (size_t i = 0; i < recvNum; ++i) {
+        size_t from, to;
+
+        if (!got[i].code || !findSeq(sent, sentNum, got[i].seq, &from, &to))
+            continue;
+        if (got[i].ns - sent[from].ns < fastest)
+            fastest = got[i].ns - sent[from].ns;
+    }
+
+    free(sent);
+    free(got);
+
+    *realigned = fastest < 0;
+    return fastest < 0 ? shift - fastest : shift;
+}
+
+static bool sendsOnLink(uint8_t kind)
+{
+    return kind == TRACE_FRAME || kind == TRACE_REPAIR || kind == TRACE_GROUP_END
+           || kind == TRACE_QUERY;
+}
+
+static double seconds(const Trace *send, int64_t ns)
+{
+    return (ns - (int64_t) send->header.monotonicNs) / 1e9;
+}
+
+static void reportRtt(const Trace *send, const Trace *recv, int64_t shift)
+{
+    // The sender's RTT comes from each answer and what it answers: the
+    // frame with its sequence number, the group end or query with its
+    // number, or for answers without one the last frame sent. Answers to
+    // anything sent more than once are skipped, there's no telling which
+    // copy they answer.
+    Samples rtt = { 0 };
+    size_t sentNum;
+    Copy *sent = collectCopies(send, 0, &sentNum);
+    size_t *copiesSoFar = calloc(sentNum + 1, sizeof(size_t));
+    int64_t lastFrameNs = -1, lastGroupNs = -1, lastQueryNs = -1;
+    uint64_t lastGroup = 0, lastQuery = 0;
+    bool lastFrameOnce = false, lastGroupOnce = false;
+
+    if (copiesSoFar == NULL) {
+        printf("Error allocating frames\n");
+        exit(-1);
+    }
+
+    for (size_t i = 0; i < send->num; ++i) {
+        const TraceEvent *ev = &send->events[i];
+        size_t from, to;
+
+        switch (ev->kind) {
+            case TRACE_FRAME:
+                findSeq(sent, sentNum, ev->seq, &from, &to);
+                copiesSoFar[from] += 1;
+                lastFrameNs = ev->ns;
+                lastFrameOnce = copiesSoFar[from] == 1;
+                break;
+            case TRACE_GROUP_END:
+                lastGroupOnce = lastGroupNs == -1 || ev->seq != lastGroup;
+                lastGroupNs = ev->ns;
+                lastGroup = ev->seq;
+                break;
+            case TRACE_QUERY:
+                lastQueryNs = ev->ns;
+                lastQuery = ev->seq;
+                break;
+            case TRACE_ANSWER:
+                if (ev->code == TRANSFER_QUERY) {
+                    if (lastQueryNs != -1 && ev->seq == lastQuery)
+                        addSample(&rtt, (ev->ns - lastQueryNs) / 1e6);
+                } else if (ev->code == TRANSFER_GROUP_STATUS) {
+                    if (lastGroupNs != -1 && ev->seq == lastGroup && lastGroupOnce)
+                        addSample(&rtt, (ev->ns - lastGroupNs) / 1e6);
+                } else if (ev->seq == TRACE_NO_SEQ) {
+                    // Only the first answer after a frame is for it
+                    if (lastFrameNs != -1 && lastFrameOnce)
+                        addSample(&rtt, (ev->ns - lastFrameNs) / 1e6);
+                    lastFrameNs = -1;
+                } else if (findSeq(sent, sentNum, ev->seq, &from, &to) && to - from == 1) {
+                    addSample(&rtt, (ev->ns - sent[from].ns) / 1e6);
+                }
+                break;
+        }
+    }
+
+    printDistribution("Round trip time", &rtt);
+
+    if (recv != NULL) {
+        // Frames sent once and received intact, and the receiver's answer
+        // when it's the next thing the receiver did
+        Samples there = { 0 }, turnaround = { 0 };
+
+        for (size_t i = 0; i < recv->num; ++i) {
+            const TraceEvent *ev = &recv->events[i];
+            size_t from, to;
+
+            if ((ev->kind != TRACE_FRAME && ev->kind != TRACE_GROUP_END) || !ev->code)
+                continue;
+
+            if (i + 1 < recv->num && recv->events[i + 1].kind == TRACE_ANSWER)
+                addSample(&turnaround, (recv->events[i + 1].ns - ev->ns) / 1e6);
+
+            if (ev->kind == TRACE_FRAME && findSeq(sent, sentNum, ev->seq, &from, &to)
+                && to - from == 1)
+                addSample(&there, ((int64_t) ev->ns + shift - sent[from].ns) / 1e6);
+        }
+
+        printDistribution("Sender to receiver", &there);
+        printDistribution("Receiver turnaround", &turnaround);
+        free(there.ms);
+        free(turnaround.ms);
+    }
+
+    free(rtt.ms);
+    free(copiesSoFar);
+    free(sent);
+}
+
+static void reportGaps(const Trace *send, double baud, double gapMs, size_t top)
+{
+    // The line is taken to be busy from each write until the bytes in it
+    // have gone out at the line rate, or without one only at the moment of
+    // the write. A gap is named after what came between it and the write
+    // ending it: a timeout, answers the sender waited on, or neither, when
+    // it had nothing ready to send.
+    Gap *gaps = NULL;
+    size_t gapNum = 0, gapCapacity = 0;
+    int64_t lineFree = -1, firstNs = -1, lastNs = 0, idleNs = 0;
+    int64_t causeNs[3] = { 0 };
+    const char *causes[3] = { "a timeout", "answers", "nothing to send" };
+    uint64_t prevSeq = 0;
+    uint8_t prevKind = 0;
+    bool timedOut = false, answered = false;
+
+    for (size_t i = 0; i < send->num; ++i) {
+        const TraceEvent *ev = &send->events[i];
+
+        timedOut |= ev->kind == TRACE_TIMEOUT;
+        answered |= ev->kind == TRACE_ANSWER;
+        if (!sendsOnLink(ev->kind))
+            continue;
+
+        int64_t ns = ev->ns;
+        int64_t txNs = baud > 0 ? (int64_t) (ev->len * 10 / baud * 1e9) : 0;
+
+        if (firstNs == -1)
+            firstNs = ns;
+
+        if (lineFree != -1 && ns - lineFree >= gapMs * 1e6) {
+            int cause = timedOut ? 0 : answered ? 1 : 2;
+
+            if (gapNum == gapCapacity) {
+                gapCapacity = gapCapacity > 0 ? 2 * gapCapacity : 64;
+                gaps = realloc(gaps, gapCapacity * sizeof(Gap));
+                if (gaps == NULL) {
+                    printf("Error allocating gaps\n");
+                    exit(-1);
+                }
+            }
+            gaps[gapNum++] = (Gap) { lineFree, ns - lineFree, prevSeq, prevKind, causes[cause] };
+            causeNs[cause] += ns - lineFree;
+            idleNs += ns - lineFree;
+        }
+
+        lineFree = (lineFree > ns ? lineFree : ns) + txNs;
+        lastNs = lineFree;
+        prevSeq = ev->seq;
+        prevKind = ev->kind;
+        timedOut = answered = false;
+    }
+
+    double spanMs = firstNs != -1 ? (lastNs - firstNs) / 1e6 : 0;
+    printf("Idle gaps of %.0f ms or more on the way to the receiver: %zu, %.1f ms in all "
+           "(%.1f%% of %.1f ms)\n", gapMs, gapNum, idleNs / 1e6,
+           spanMs > 0 ? idleNs / 1e4 / spanMs : 0, spanMs);
+    if (baud <= 0)
+        printf("  Without a line rate (-b) these are gaps between writes, sending included\n");
+    for (int c = 0; c < 3; ++c) {
+        if (causeNs[c] > 0)
+            printf("  %.1f ms waiting on %s\n", causeNs[c] / 1e6, causes[c]);
+    }
+
+    qsort(gaps, gapNum, sizeof(Gap), compareGaps);
+    for (size_t g = 0; g < gapNum && g < top; ++g) {
+        printf("  %10.3f s: %8.1f ms after %s %llu, waiting on %s\n", seconds(send, gaps[g].ns),
+               gaps[g].lenNs / 1e6, kindNames[gaps[g].afterKind],
+               (unsigned long long) gaps[g].afterSeq, gaps[g].cause);
+    }
+
+    free(gaps);
+}
+
+static void reportRetransmits(const Trace *send, const Trace *recv, int64_t shift,
+                              double clusterMs, size_t top)
+{
+    // A frame sent with a sequence number that has gone before is sent
+    // again. With the receiver's trace each is put down to what happened to
+    // the copy before it, going by what arrived between when that copy and
+    // the new one could first have: intact means only the answer was lost
+    // or late, damaged means it was damaged, and otherwise it never arrived
+    // recognisably. Frames of different lengths take different times to
+    // arrive, so for adaptive frames this is only a guide.
+    size_t sentNum, recvNum = 0;
+    Copy *sent = collectCopies(send, 0, &sentNum);
+    Copy *got = recv != NULL ? collectCopies(recv, shift, &recvNum) : NULL;
+    int64_t *lastSent = malloc((sentNum + 1) * sizeof(int64_t));
+    Cluster *clusters = NULL;
+    size_t clusterNum = 0, clusterCapacity = 0, total = 0;
+    size_t damaged = 0, lost = 0, answerLost = 0;
+
+    if (lastSent == NULL) {
+        printf("Error allocating frames\n");
+        exit(-1);
+    }
+    for (size_t i = 0; i < sentNum; ++i)
+        lastSent[i] = -1;
+
+    // No copy gets there faster than the fastest did, timed from the last
+    // copy sent before it arrived
+    int64_t fastest = INT64_MAX;
+    for (size_t i = 0; i < recvNum; ++i) {
+        size_t from, to;
+
+        if (!got[i].code || !findSeq(sent, sentNum, got[i].seq, &from, &to))
+            continue;
+        while (to - 1 > from && sent[to - 1].ns > got[i].ns)
+            to -= 1;
+        if (sent[to - 1].ns <= got[i].ns && got[i].ns - sent[to - 1].ns < fastest)
+            fastest = got[i].ns - sent[to - 1].ns;
+    }
+    fastest = fastest == INT64_MAX ? 0 : fastest;
+
+    for (size_t i = 0; i < send->num; ++i) {
+        const TraceEvent *ev = &send->events[i];
+        size_t from, to;
+
+        if (ev->kind != TRACE_FRAME)
+            continue;
+
+        findSeq(sent, sentNum, ev->seq, &from, &to);
+        int64_t previous = lastSent[from];
+        lastSent[from] = ev->ns;
+        if (previous == -1)
+            continue;
+
+        total += 1;
+        if (clusterNum == 0 || ev->ns - clusters[clusterNum - 1].endNs > clusterMs * 1e6) {
+            if (clusterNum == clusterCapacity) {
+                clusterCapacity = clusterCapacity > 0 ? 2 * clusterCapacity : 64;
+                clusters = realloc(clusters, clusterCapacity * sizeof(Cluster));
+                if (clusters == NULL) {
+                    printf("Error allocating clusters\n");
+                    exit(-1);
+                }
+            }
+            clusters[clusterNum++] = (Cluster) { ev->ns, ev->ns, 0, ev->seq, ev->seq, 0, 0, 0 };
+        }
+
+        Cluster *cl = &clusters[clusterNum - 1];
+        cl->endNs = ev->ns;
+        cl->count += 1;
+        cl->minSeq = ev->seq < cl->minSeq ? ev->seq : cl->minSeq;
+        cl->maxSeq = ev->seq > cl->maxSeq ? ev->seq : cl->maxSeq;
+
+        if (got == NULL)
+            continue;
+
+        bool intact = false, broken = false;
+        size_t gotFrom, gotTo;
+        if (findSeq(got, recvNum, ev->seq, &gotFrom, &gotTo)) {
+            for (size_t g = gotFrom; g < gotTo; ++g) {
+                if (got[g].ns < previous + fastest || got[g].ns >= (int64_t) ev->ns + fastest)
+                    continue;
+                intact |= got[g].code;
+                broken |= !got[g].code;
+            }
+        }
+
+        if (intact) {
+            cl->answerLost += 1;
+            answerLost += 1;
+        } else if (broken) {
+            cl->damaged += 1;
+            damaged += 1;
+        } else {
+            cl->lost += 1;
+            lost += 1;
+        }
+    }
+
+    printf("Frames sent again: %zu, in %zu clusters of retransmissions %.0f ms or less apart\n",
+           total, clusterNum, clusterMs);
+    if (got != NULL && total > 0)
+        printf("  %zu after the frame was lost, %zu damaged, %zu only had the answer lost or "
+               "late\n", lost, damaged, answerLost);
+
+    qsort(clusters, clusterNum, sizeof(Cluster), compareClusters);
+    for (size_t c = 0; c < clusterNum && c < top; ++c) {
+        const Cluster *cl = &clusters[c];
+
+        printf("  %10.3f s: %4zu over %8.1f ms, frames %llu to %llu", seconds(send, cl->startNs),
+               cl->count, (cl->endNs - cl->startNs) / 1e6, (unsigned long long) cl->minSeq,
+               (unsigned long long) cl->maxSeq);
+        if (got != NULL)
+            printf(", %zu lost, %zu damaged, %zu answers lost", cl->lost, cl->damaged,
+                   cl->answerLost);
+        printf("\n");
+    }
+
+    free(clusters);
+    free(lastSent);
+    free(got);
+    free(sent);
+}
+
+static void summarise(const Trace *trace)
+{
+    size_t counts[TRACE_OVERFLOW + 1] = { 0 };
+    size_t damaged = 0;
+    uint64_t overflow = 0;
+
+    for (size_t i = 0; i < trace->num; ++i) {
+        const TraceEvent *ev = &trace->events[i];
+
+        if (ev->kind > TRACE_OVERFLOW)
+            continue;
+        counts[ev->kind] += 1;
+        if (ev->kind == TRACE_OVERFLOW)
+            overflow += ev->seq;
+        if (trace->header.side == TRACE_RECEIVER && ev->kind == TRACE_FRAME && !ev->code)
+            damaged += 1;
+    }
+
+    double spanMs = trace->num > 0 ? (trace->events[trace->num - 1].ns
+                                      - trace->events[0].ns) / 1e6 : 0;
+
+    printf("%s trace %s: %.1f ms, %zu frames", trace->header.side == TRACE_SENDER ? "Sender"
+                                                                                   : "Receiver",
+           trace->path, spanMs, counts[TRACE_FRAME]);
+    if (trace->header.side == TRACE_RECEIVER)
+        printf(" (%zu damaged)", damaged);
+    printf(", %zu repair packets, %zu answers, %zu queries", counts[TRACE_REPAIR],
+           counts[TRACE_ANSWER], counts[TRACE_QUERY]);
+    if (trace->header.side == TRACE_SENDER)
+        printf(", %zu timeouts", counts[TRACE_TIMEOUT]);
+    else
+        printf(", %zu resyncs", counts[TRACE_RESYNC]);
+    printf("\n");
+
+    if (overflow > 0)
+        printf("  %llu events didn't fit in the ring and are missing\n",
+               (unsigned long long) overflow);
+}
+
+int main(int argc, char **argv)
+{
+    double baud = 0;
+    double gapMs = DEFAULT_GAP_MS;
+    double clusterMs = DEFAULT_CLUSTER_MS;
+    unsigned long top = DEFAULT_TOP;
+
+    int c = 0;
+    while (true) {
+        static struct option long_options[] = {
+            {"baud",    required_argument, 0, 'b'},
+            {"cluster", required_argument, 0, 'c'},
+            {"gap",     required_argument, 0, 'g'},
+            {"top",     required_argument, 0, 'n'},
+            {0, 0, 0, 0}
+        };
+
+        int option_index = 0;
+        c = getopt_long(argc, argv, "b:c:g:n:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'b':
+                // The line rate, so gaps leave out the time frames take to
+                // go out
+                baud = strtod(optarg, NULL);
+                break;
+            case 'c':
+                // Retransmissions at most this many ms apart are one cluster
+                clusterMs = strtod(optarg, NULL);
+                break;
+            case 'g':
+                // The shortest idle gap reported, in ms
+                gapMs = strtod(optarg, NULL);
+                break;
+            case 'n':
+                // How many of the longest gaps and largest clusters are listed
+                top = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                exit(-1);
+        }
+    }
+
+    if (optind == argc || argc - optind > 2) {
+        printf("Usage: %s [options] trace [trace], a sender's trace and optionally the "
+               "receiver's\n", argv[0]);
+        exit(-1);
+    }
+
+    Trace traces[2];
+    Trace *send = NULL, *recv = NULL;
+
+    for (int i = 0; i < argc - optind; ++i) {
+        loadOrDie(argv[optind + i], &traces[i]);
+        if (traces[i].header.side == TRACE_SENDER && send == NULL)
+            send = &traces[i];
+        else if (traces[i].header.side == TRACE_RECEIVER && recv == NULL)
+            recv = &traces[i];
+        else {
+            printf("Expected a sender's trace and a receiver's, %s is another %s's\n",
+                   traces[i].path, traces[i].header.side == TRACE_SENDER ? "sender" : "receiver");
+            exit(-1);
+        }
+    }
+
+    if (send == NULL) {
+        printf("Everything here needs the sender's trace\n");
+        exit(-1);
+    }
+
+    summarise(send);
+    if (recv != NULL)
+        summarise(recv);
+
+    int64_t shift = 0;
+    if (recv != NULL) {
+        bool realigned;
+        shift = alignClocks(send, recv, &realigned);
+
+        if (realigned)
+            printf("Wall clocks disagree, lined up so the fastest frame took no time\n");
+    }
+    printf("\n");
+
+    reportRtt(send, recv, shift);
+    printf("\n");
+    reportGaps(send, baud, gapMs, top);
+    printf("\n");
+    reportRetransmits(send, recv, shift, clusterMs, top);
+
+    for (int i = 0; i < argc - optind; ++i)
+        free(traces[i].events);
+}